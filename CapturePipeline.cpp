@@ -0,0 +1,471 @@
+//--------------------------------------------------------------------
+//
+// CapturePipeline.cpp
+// Implementation of C++ class that captures the screen and encodes
+// the frames to a video file on separate threads.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "CapturePipeline.h"
+#include "ScreenCapTrace.h"
+#include "PixelOps.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+// Raises 'maxValue' to 'value' if it is larger.
+template <class T> static void UpdateMax(std::atomic<T> &maxValue, T value)
+{
+    T prev = maxValue.load();
+    while (value > prev && !maxValue.compare_exchange_weak(prev, value))
+        ;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Starts capturing and encoding.  Returns true if successful.
+//
+bool CapturePipeline::Start(
+    const wchar_t *filename,
+    uint32_t fps,
+    unsigned queueLength,
+    CapturePipelineDropPolicy dropPolicy,
+    const VideoEncoderConfig &config
+    )
+{
+    if (m_running)
+        Stop();
+
+    const bool prestarted = m_encoder.IsStarted();
+    if ((!filename && !prestarted) || fps < 1 || queueLength < 1)
+        return false;
+
+    m_startQpc = GetQpc();
+    m_filename = filename ? filename : L"";
+    m_fps = fps;
+    m_encoderConfig = config;
+    m_lastTimestamp = 0;
+
+    // Frames are only queued when the screen changes, and each
+    // lasts until the next one.  An encoder that was started
+    // ahead of time must already be set up that way.
+    if (!prestarted)
+        m_encoder.SetVariableFrameRate(true);
+    m_dropPolicy = dropPolicy;
+
+    // The pool has one frame for each queue entry, plus one
+    // for the encoder to work on and one for the capture
+    // thread to fill.  Each queue has room for every frame, so
+    // a frame can always be queued, even when the encoder has
+    // just handed one back and not yet taken the next one.
+    m_frames.assign(queueLength + 2, Frame());
+    m_fullQueue.Reset(m_frames.size());
+    m_freeQueue.Reset(m_frames.size());
+    m_spareFrame = NoFrame;
+    for (uint32_t i = 0; i < m_frames.size(); i++)
+        m_freeQueue.Push(i);
+
+    // Each frame may hold one of the capture's buffers, and the
+    // capture needs one more to capture into.
+    m_capture.SetMaxFrameBuffers(static_cast<unsigned>(m_frames.size()) + 1);
+
+    m_frameQueuedEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    m_frameFreedEvent  = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!m_frameQueuedEvent || !m_frameFreedEvent)
+    {
+        ReleaseResources();
+        return false;
+    }
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_qpcFrequency = freq.QuadPart;
+    m_framesCaptured = m_framesEncoded = m_framesDropped = m_encodeErrors = 0;
+    m_maxQueueDepth = 0;
+    m_captureTicks = m_maxCaptureTicks = 0;
+    m_queueTicks = m_maxQueueTicks = 0;
+    m_encodeTicks = m_maxEncodeTicks = 0;
+    m_firstEncodedQpc = 0;
+
+    m_stopCapture = false;
+    m_captureDone = false;
+    m_prestarted = prestarted;
+    m_encoderStarted = prestarted;
+    m_encoderFailed = false;
+    m_running = true;
+    m_encodeThread  = std::thread(&CapturePipeline::EncodeThread, this);
+    m_captureThread = std::thread(&CapturePipeline::CaptureThread, this);
+    return true;
+}
+
+//
+// Stops capturing and finishes the video file.  Returns true
+// if the video file was written successfully.
+//
+bool CapturePipeline::Stop()
+{
+    if (!m_running)
+        return false;
+
+    // Stop the capture thread first, then let the encoder
+    // thread drain the queue.
+    m_stopCapture = true;
+    SetEvent(m_frameFreedEvent);
+    if (m_captureThread.joinable())
+        m_captureThread.join();
+
+    m_captureDone = true;
+    SetEvent(m_frameQueuedEvent);
+    if (m_encodeThread.joinable())
+        m_encodeThread.join();
+
+    // The last frame stays on screen until capture stopped.
+    m_encoder.RepeatFrame(m_lastTimestamp);
+
+    bool ok = m_encoderStarted && !m_encoderFailed;
+    if (m_encoderStarted && !m_encoder.Stop())
+        ok = false;
+
+    ReleaseResources();
+    m_running = false;
+    return ok;
+}
+
+//
+// Retrieves statistics about the pipeline.
+//
+void CapturePipeline::GetStats(CapturePipelineStats &stats) const
+{
+    auto toMs = [this](int64_t ticks) { return ticks * 1000.0 / m_qpcFrequency; };
+
+    stats.framesCaptured = m_framesCaptured;
+    stats.framesEncoded  = m_framesEncoded;
+    stats.framesDropped  = m_framesDropped;
+    stats.encodeErrors   = m_encodeErrors;
+    stats.queueDepth     = static_cast<unsigned>(m_fullQueue.GetDepth());
+    stats.maxQueueDepth  = m_maxQueueDepth;
+
+    const uint64_t captured = stats.framesCaptured;
+    const uint64_t encoded  = stats.framesEncoded + stats.encodeErrors;
+    stats.avgCaptureMs = captured ? toMs(m_captureTicks) / captured : 0.0;
+    stats.maxCaptureMs = toMs(m_maxCaptureTicks);
+    stats.avgQueueMs   = encoded ? toMs(m_queueTicks) / encoded : 0.0;
+    stats.maxQueueMs   = toMs(m_maxQueueTicks);
+    stats.avgEncodeMs  = encoded ? toMs(m_encodeTicks) / encoded : 0.0;
+    stats.maxEncodeMs  = toMs(m_maxEncodeTicks);
+    const int64_t firstEncodedQpc = m_firstEncodedQpc;
+    stats.firstFrameMs = firstEncodedQpc ? toMs(firstEncodedQpc - m_startQpc) : 0.0;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Body of the capture thread.  Captures frames at up to the
+// requested frame rate and queues them for the encoder.
+// Ticks where the screen didn't change only move the end of
+// the last frame along; nothing is queued for them.
+//
+// The encoder can't change size in the middle of the file, so
+// if the screen changes mode, the rest of the frames are
+// scaled to the size of the first one.
+//
+void CapturePipeline::CaptureThread()
+{
+    CaptureScheduler scheduler(m_capture);
+    if (!scheduler.Start(m_fps))
+        return;
+
+    unsigned videoWidth = 0, videoHeight = 0;
+    while (!m_stopCapture)
+    {
+        uint64_t timestamp = 0;
+        const ScreenCaptureResult result = scheduler.WaitForTick(timestamp);
+        const int64_t startQpc = scheduler.GetTickQpc();
+        if (result != ScreenCaptureResult_Frame && result != ScreenCaptureResult_ModeChanged)
+        {
+            if (scheduler.HasFirstFrame())
+                m_lastTimestamp = timestamp;
+            continue;
+        }
+        m_lastTimestamp = timestamp;
+
+        const unsigned width  = m_capture.GetFrameWidth();
+        const unsigned height = m_capture.GetFrameHeight();
+        if (!videoWidth)
+        {
+            videoWidth  = m_prestarted ? m_encoder.GetWidth()  : width;
+            videoHeight = m_prestarted ? m_encoder.GetHeight() : height;
+        }
+        const bool resize = (width != videoWidth || height != videoHeight);
+        if (resize && m_capture.GetFrameFormat() != ScreenCaptureFormat_BGRA32)
+        {
+            // Only 32-bit frames can be scaled here.
+            m_framesDropped++;
+            continue;
+        }
+
+        uint32_t index = 0;
+        if (!GetFreeFrame(index))
+        {
+            SCREENCAP_TRACE("PipelineFrameDropped",
+                TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                TraceLoggingBool(false, "Queued"));
+            m_framesDropped++;
+            continue;
+        }
+
+        // Hold on to the capture's own buffer if it hands one
+        // out, or else copy the captured image into the pooled
+        // frame buffer.  The encoder handles padded scanlines, so
+        // it can be copied in one piece.
+        Frame &frame = m_frames[index];
+        frame.bottomUp = m_capture.IsFrameBottomUp();
+        frame.timestamp = timestamp;
+        frame.handle.Reset();
+        if (!resize)
+        {
+            frame.width  = width;
+            frame.height = height;
+            frame.stride = m_capture.GetFrameStride();
+            frame.handle = m_capture.GetFrameHandle();
+            if (!frame.handle)
+            {
+                frame.pixels.resize(m_capture.GetFrameBufferSize());
+                memcpy(frame.pixels.data(), m_capture.GetFrameBuffer(), frame.pixels.size());
+            }
+        }
+        else
+        {
+            frame.width  = videoWidth;
+            frame.height = videoHeight;
+            frame.stride = videoWidth * 4;
+            frame.pixels.resize(static_cast<size_t>(frame.stride) * videoHeight);
+            PixelOps::ScaleImage(frame.pixels.data(), frame.stride, videoWidth, videoHeight,
+                m_capture.GetFrameBuffer(), m_capture.GetFrameStride(), width, height, m_scaleBuffers);
+
+            // Have the capture scale the frames that follow,
+            // which is cheaper if it can do it on the GPU.
+            if (result == ScreenCaptureResult_ModeChanged)
+                m_capture.SetOutputSize(videoWidth, videoHeight);
+        }
+
+        frame.queuedQpc = GetQpc();
+        if (!m_fullQueue.Push(index))
+        {
+            // Only the encoder thread may hand frames back
+            // through the free queue, so keep this one for the
+            // next capture instead of losing it.
+            frame.handle.Reset();
+            m_spareFrame = index;
+            SCREENCAP_TRACE("PipelineFrameDropped",
+                TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                TraceLoggingBool(false, "Queued"));
+            m_framesDropped++;
+            continue;
+        }
+        SetEvent(m_frameQueuedEvent);
+
+        const int64_t ticks = frame.queuedQpc - startQpc;
+        m_captureTicks += ticks;
+        UpdateMax(m_maxCaptureTicks, ticks);
+        UpdateMax(m_maxQueueDepth, static_cast<unsigned>(m_fullQueue.GetDepth()));
+        SCREENCAP_TRACE("PipelineFrameQueued",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingUInt32(static_cast<unsigned>(m_fullQueue.GetDepth()), "QueueDepth"),
+            TraceLoggingInt64(ticks, "CaptureTicks"));
+        m_framesCaptured++;
+    }
+}
+
+//
+// Gets a frame buffer for the capture thread to fill, applying
+// the drop policy if all of them are in use.  Returns false if
+// the frame just captured should be dropped.
+//
+bool CapturePipeline::GetFreeFrame(uint32_t &index)
+{
+    if (m_spareFrame != NoFrame)
+    {
+        index = m_spareFrame;
+        m_spareFrame = NoFrame;
+        return true;
+    }
+
+    for (;;)
+    {
+        if (m_freeQueue.Pop(index))
+            return true;
+
+        switch (m_dropPolicy)
+        {
+        case CapturePipelineDrop_Oldest:
+            // Take back the oldest frame the encoder hasn't
+            // gotten to yet.
+            if (m_fullQueue.Pop(index))
+            {
+                SCREENCAP_TRACE("PipelineFrameDropped",
+                    TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                    TraceLoggingBool(true, "Queued"));
+                m_framesDropped++;
+                return true;
+            }
+            break;
+
+        case CapturePipelineDrop_Newest:
+            return false;
+
+        case CapturePipelineDrop_Block:
+        default:
+            if (m_stopCapture)
+                return false;
+            WaitForSingleObject(m_frameFreedEvent, 100);
+            break;
+        }
+    }
+}
+
+//
+// Body of the encoder thread.  Encodes queued frames until
+// the capture thread is done and the queue is empty.
+//
+void CapturePipeline::EncodeThread()
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    for (;;)
+    {
+        uint32_t index = 0;
+        if (!m_fullQueue.Pop(index))
+        {
+            if (m_captureDone)
+                break;
+            WaitForSingleObject(m_frameQueuedEvent, 100);
+            continue;
+        }
+
+        Frame &frame = m_frames[index];
+        const int64_t startQpc = GetQpc();
+        const int64_t queueTicks = startQpc - frame.queuedQpc;
+
+        const bool encoded = EncodeFrame(frame);
+        const int64_t endQpc = GetQpc();
+        if (encoded)
+        {
+            if (!m_framesEncoded)
+                m_firstEncodedQpc = endQpc;
+            m_framesEncoded++;
+        }
+        else
+        {
+            m_encodeErrors++;
+        }
+
+        const int64_t encodeTicks = endQpc - startQpc;
+        SCREENCAP_TRACE("PipelineFrameEncoded",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+            TraceLoggingUInt32(static_cast<unsigned>(m_fullQueue.GetDepth()), "QueueDepth"),
+            TraceLoggingInt64(queueTicks, "QueueTicks"),
+            TraceLoggingInt64(encodeTicks, "EncodeTicks"));
+        m_queueTicks += queueTicks;
+        UpdateMax(m_maxQueueTicks, queueTicks);
+        m_encodeTicks += encodeTicks;
+        UpdateMax(m_maxEncodeTicks, encodeTicks);
+
+        // Give the capture its buffer back.
+        frame.handle.Reset();
+        m_freeQueue.Push(index);
+        SetEvent(m_frameFreedEvent);
+    }
+
+    CoUninitialize();
+}
+
+//
+// Sends one frame to the encoder, starting the encoder first
+// if this is the first frame.  Returns true if successful.
+//
+bool CapturePipeline::EncodeFrame(Frame &frame)
+{
+    if (m_encoderFailed)
+        return false;
+
+    if (!m_encoderStarted)
+    {
+        if (!m_encoder.Start(m_filename.c_str(), frame.width, frame.height, m_fps, m_encoderConfig))
+        {
+            m_encoderFailed = true;
+            return false;
+        }
+        m_encoderStarted = true;
+    }
+
+    // The encoder can't change size in the middle of a file.
+    if (frame.width != m_encoder.GetWidth() || frame.height != m_encoder.GetHeight())
+        return false;
+
+    const uint8_t *pixels = frame.handle ? frame.handle.GetData() : frame.pixels.data();
+    return m_encoder.AddFrame(pixels, frame.stride, frame.bottomUp, frame.timestamp);
+}
+
+//
+// Releases the frame buffers and events.
+//
+void CapturePipeline::ReleaseResources()
+{
+    if (m_frameQueuedEvent)
+        CloseHandle(m_frameQueuedEvent);
+    if (m_frameFreedEvent)
+        CloseHandle(m_frameFreedEvent);
+    m_frameQueuedEvent = m_frameFreedEvent = nullptr;
+
+    m_frames.clear();
+    m_fullQueue.Reset(0);
+    m_freeQueue.Reset(0);
+}
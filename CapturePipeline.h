@@ -0,0 +1,210 @@
+//--------------------------------------------------------------------
+//
+// CapturePipeline.h
+// Header file of C++ class that captures the screen and encodes
+// the frames to a video file on separate threads, so a slow
+// encoder doesn't cost captured frames and waiting for the screen
+// doesn't stall the encoder.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "ScreenCap.h"
+#include "VideoFileEncoder.h"
+#include "CaptureScheduler.h"
+#include "FrameQueue.h"
+#include "PixelOps.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// What the capture thread does when every frame buffer is
+// waiting to be encoded.
+//
+enum CapturePipelineDropPolicy
+{
+    CapturePipelineDrop_Oldest = 0,  // Throw away the oldest queued frame.
+    CapturePipelineDrop_Newest = 1,  // Throw away the frame just captured.
+    CapturePipelineDrop_Block  = 2   // Wait for the encoder to catch up.
+};
+
+//
+// Statistics of a running (or stopped) capture pipeline.
+// Latencies are in milliseconds.
+//
+struct CapturePipelineStats
+{
+    uint64_t framesCaptured = 0;    // Frames captured and queued.
+    uint64_t framesEncoded  = 0;    // Frames sent to the encoder.
+    uint64_t framesDropped  = 0;    // Frames thrown away by the drop policy.
+    uint64_t encodeErrors   = 0;    // Frames the encoder rejected.
+    unsigned queueDepth     = 0;    // Frames currently waiting to be encoded.
+    unsigned maxQueueDepth  = 0;    // Most frames ever waiting to be encoded.
+    double   avgCaptureMs   = 0.0;  // Time to capture and queue a frame.
+    double   maxCaptureMs   = 0.0;
+    double   avgQueueMs     = 0.0;  // Time a frame waited in the queue.
+    double   maxQueueMs     = 0.0;
+    double   avgEncodeMs    = 0.0;  // Time to encode a frame.
+    double   maxEncodeMs    = 0.0;
+    double   firstFrameMs   = 0.0;  // Time from Start() until the first frame was encoded.
+};
+
+//
+// This class runs a capture thread and an encoder thread
+// connected by a bounded queue of pooled frame buffers.
+// The ScreenCapture object must already be started, and
+// the VideoFileEncoder must have its encoding format set;
+// the pipeline starts the encoder itself once it knows the
+// size of the captured frames.  Neither object should be
+// used by anybody else while the pipeline is running.
+//
+// Frames are captured on the ticks of a CaptureScheduler and
+// stamped with the time they were presented.  The encoder is
+// put in variable frame rate mode, so when the screen doesn't
+// change nothing is queued or encoded; the previous frame just
+// lasts longer.  If the screen changes mode while the pipeline
+// runs, the frames are scaled to the size of the first one.
+//
+// The encoder may also be started ahead of time, in variable
+// frame rate mode, to save the time that starting it takes
+// out of the time to the first frame; see InstantRecorder.
+// The frames are then scaled to the encoder's size.
+//
+class CapturePipeline
+{
+public:
+    CapturePipeline(ScreenCapture &capture, VideoFileEncoder &encoder) :
+        m_capture(capture), m_encoder(encoder) { }
+    CapturePipeline() = delete;
+    ~CapturePipeline() { Stop(); }
+
+    //
+    // Starts capturing at up to 'fps' frames per second and
+    // encoding to the specified file.  'queueLength' is the
+    // number of captured frames that may wait for the encoder.
+    // 'config' is passed on to VideoFileEncoder::Start().  If
+    // the encoder was already started, it is used as it is,
+    // and 'filename' and 'config' are ignored.  Returns true if
+    // successful.
+    //
+    bool Start(
+            const wchar_t *filename,
+            uint32_t fps,
+            unsigned queueLength = 4,
+            CapturePipelineDropPolicy dropPolicy = CapturePipelineDrop_Oldest,
+            const VideoEncoderConfig &config = VideoEncoderConfig());
+
+    //
+    // Stops capturing, encodes whatever is still queued, and
+    // finishes the video file.  Returns true if the video file
+    // was written successfully.
+    //
+    bool Stop();
+
+    bool IsRunning() const { return m_running; }
+
+    //
+    // Retrieves statistics about the pipeline.  May be called
+    // while the pipeline is running.
+    //
+    void GetStats(CapturePipelineStats &stats) const;
+
+private:
+    // A pooled frame buffer.  When the capture hands out its
+    // own buffer, the frame holds on to that instead of copying
+    // it into 'pixels'.
+    struct Frame
+    {
+        std::vector<uint8_t> pixels;
+        FrameHandle          handle;
+        unsigned             width = 0;
+        unsigned             height = 0;
+        unsigned             stride = 0;     // Bytes between scanlines.
+        bool                 bottomUp = false;
+        uint64_t             timestamp = 0;  // In 100ns units.
+        int64_t              queuedQpc = 0;  // When the frame was queued.
+    };
+
+    ScreenCapture    &m_capture;
+    VideoFileEncoder &m_encoder;
+    std::wstring      m_filename;
+    uint32_t          m_fps = 0;
+    VideoEncoderConfig m_encoderConfig;
+    CapturePipelineDropPolicy m_dropPolicy = CapturePipelineDrop_Oldest;
+
+    std::vector<Frame> m_frames;    // The frame buffer pool.
+    FrameQueue         m_freeQueue; // Frames the capture thread may fill.
+    FrameQueue         m_fullQueue; // Frames waiting to be encoded.
+    static const uint32_t NoFrame = UINT32_MAX;
+    uint32_t           m_spareFrame = NoFrame; // A free frame held by the capture thread.
+    PixelOpsScaleBuffers m_scaleBuffers;       // For the capture thread's scaling.
+    HANDLE             m_frameQueuedEvent = nullptr;
+    HANDLE             m_frameFreedEvent = nullptr;
+
+    std::thread        m_captureThread;
+    std::thread        m_encodeThread;
+    std::atomic<bool>  m_stopCapture { false };
+    std::atomic<bool>  m_captureDone { false };
+    std::atomic<uint64_t> m_lastTimestamp { 0 };  // Last tick the screen was seen at.
+    bool               m_running = false;
+    bool               m_encoderStarted = false;
+    bool               m_prestarted = false;     // Was the encoder started before Start()?
+    bool               m_encoderFailed = false;
+
+    // Statistics; times are in QPC ticks.
+    int64_t                m_qpcFrequency = 1;
+    std::atomic<uint64_t>  m_framesCaptured { 0 };
+    std::atomic<uint64_t>  m_framesEncoded { 0 };
+    std::atomic<uint64_t>  m_framesDropped { 0 };
+    std::atomic<uint64_t>  m_encodeErrors { 0 };
+    std::atomic<unsigned>  m_maxQueueDepth { 0 };
+    std::atomic<int64_t>   m_captureTicks { 0 };
+    std::atomic<int64_t>   m_maxCaptureTicks { 0 };
+    std::atomic<int64_t>   m_queueTicks { 0 };
+    std::atomic<int64_t>   m_maxQueueTicks { 0 };
+    std::atomic<int64_t>   m_encodeTicks { 0 };
+    std::atomic<int64_t>   m_maxEncodeTicks { 0 };
+    int64_t                m_startQpc = 0;
+    std::atomic<int64_t>   m_firstEncodedQpc { 0 };
+
+    void CaptureThread();
+    void EncodeThread();
+    bool GetFreeFrame(uint32_t &index);
+    bool EncodeFrame(Frame &frame);
+    void ReleaseResources();
+};
@@ -0,0 +1,202 @@
+//--------------------------------------------------------------------
+//
+// CaptureScheduler.cpp
+// Implementation of C++ class that paces screen capture at a
+// fixed frame rate.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "CaptureScheduler.h"
+
+// Older SDKs don't define this.  Windows versions before 10
+// (1803) reject it, and we fall back to a normal timer.
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Starts ticking at the given frame rate.  Returns true if
+// successful.
+//
+bool CaptureScheduler::Start(uint32_t fps)
+{
+    Stop();
+
+    if (fps < 1)
+        return false;
+
+    m_timer = CreateWaitableTimerExW(nullptr, nullptr,
+                CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!m_timer)
+        m_timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+    if (!m_timer)
+        return false;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_qpcFrequency = freq.QuadPart;
+    m_fps = fps;
+    m_periodTicks = m_qpcFrequency / fps;
+    m_startQpc = GetQpc();
+    m_nextTickQpc = m_startQpc;
+    m_firstFrameQpc = 0;
+    m_lastTimestamp = 0;
+    return true;
+}
+
+//
+// Stops ticking and releases the timer.
+//
+void CaptureScheduler::Stop()
+{
+    if (m_timer)
+        CloseHandle(m_timer);
+    m_timer = nullptr;
+    m_fps = 0;
+}
+
+//
+// Sleeps until the next tick, then captures the latest frame
+// if the screen changed.
+//
+ScreenCaptureResult CaptureScheduler::WaitForTick(uint64_t &timestamp)
+{
+    timestamp = m_lastTimestamp;
+    if (!m_timer)
+        return ScreenCaptureResult_Error; // Not started yet!
+
+    // Sleep until the tick is due.  A negative due time is
+    // relative, in 100ns units.
+    int64_t now = GetQpc();
+    if (now < m_nextTickQpc)
+    {
+        LARGE_INTEGER due;
+        due.QuadPart = -((m_nextTickQpc - now) * 10000000 / m_qpcFrequency);
+        if (due.QuadPart < 0 && SetWaitableTimer(m_timer, &due, 0, nullptr, nullptr, FALSE))
+            WaitForSingleObject(m_timer, INFINITE);
+        now = GetQpc();
+    }
+    const int64_t tickQpc = now;
+    m_tickQpc = tickQpc;
+
+    // Schedule the next tick, skipping any we were too late for.
+    m_nextTickQpc += m_periodTicks;
+    if (m_nextTickQpc <= now)
+        m_nextTickQpc = now + m_periodTicks;
+
+    // Take whatever was presented since the last tick, without
+    // waiting for more.
+    ScreenCaptureResult result = m_capture.WaitForFrame(0);
+    bool frame = (result == ScreenCaptureResult_Frame ||
+                  result == ScreenCaptureResult_ModeChanged);
+    if (frame && m_capture.GetFrameWidth() < 1)
+    {
+        result = ScreenCaptureResult_NoChange;
+        frame = false;
+    }
+
+    if (frame)
+    {
+        // If the capture doesn't know when the frame was
+        // presented, use the time of the tick instead.
+        int64_t frameQpc = m_capture.GetFrameTime();
+        if (frameQpc == 0)
+            frameQpc = tickQpc;
+        if (!m_firstFrameQpc)
+        {
+            // A frame that was already on the screen before we
+            // started (see ScreenCapture::PrimeFirstFrame())
+            // starts the video when we did.
+            if (frameQpc < m_startQpc)
+                frameQpc = m_startQpc;
+            m_firstFrameQpc = frameQpc;
+            timestamp = 0;
+        }
+        else
+        {
+            // A frame presented just before the last tick may
+            // only show up now; keep the timestamps in order.
+            timestamp = ToTimestamp(frameQpc);
+            if (timestamp <= m_lastTimestamp)
+                timestamp = m_lastTimestamp + 1;
+        }
+    }
+    else if (result == ScreenCaptureResult_NoChange && m_firstFrameQpc)
+    {
+        timestamp = ToTimestamp(tickQpc);
+        if (timestamp < m_lastTimestamp)
+            timestamp = m_lastTimestamp;
+    }
+
+    m_lastTimestamp = timestamp;
+    return result;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Converts a performance counter value to a timestamp in 100ns
+// units since the first frame.  Whole seconds are converted
+// separately, so long captures can't overflow.
+//
+uint64_t CaptureScheduler::ToTimestamp(int64_t qpc) const
+{
+    if (qpc <= m_firstFrameQpc)
+        return 0;
+
+    const int64_t ticks = qpc - m_firstFrameQpc;
+    const int64_t seconds = ticks / m_qpcFrequency;
+    const int64_t rest = ticks % m_qpcFrequency;
+    return static_cast<uint64_t>(seconds * 10000000 + rest * 10000000 / m_qpcFrequency);
+}
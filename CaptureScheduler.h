@@ -0,0 +1,117 @@
+//--------------------------------------------------------------------
+//
+// CaptureScheduler.h
+// Header file of C++ class that paces screen capture at a fixed
+// frame rate and stamps each frame with the time it was shown.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "ScreenCap.h"
+#include <cstdint>
+
+//
+// This class captures from a ScreenCapture object at a fixed
+// frame rate.  It sleeps on a high resolution waitable timer
+// between ticks rather than in Sleep(), so ticks don't drift
+// by the scheduler granularity.  At each tick it picks up the
+// latest frame, if the screen changed.
+//
+// Timestamps are in 100ns units, counting from the first
+// frame, and are taken from when each frame was presented to
+// the screen (see ScreenCapture::GetFrameTime()) rather than
+// from when it was captured, so they reflect the real, uneven
+// intervals between frames.  A first frame presented before
+// Start() counts as presented at Start().
+//
+// Ticks where nothing changed are reported as such, without
+// copying anything, so the previous frame can simply be made
+// to last longer; see VideoFileEncoder::SetVariableFrameRate()
+// and VideoFileEncoder::RepeatFrame().
+//
+class CaptureScheduler
+{
+public:
+    CaptureScheduler(ScreenCapture &capture) : m_capture(capture) { }
+    CaptureScheduler() = delete;
+    ~CaptureScheduler() { Stop(); }
+
+    //
+    // Starts ticking at 'fps' frames per second.  The
+    // ScreenCapture object must already be started.  Returns
+    // true if successful.
+    //
+    bool Start(uint32_t fps);
+
+    //
+    // Stops ticking and releases the timer.
+    //
+    void Stop();
+
+    //
+    // Sleeps until the next tick, then captures the latest
+    // frame if the screen changed since the last tick.  On
+    // ScreenCaptureResult_Frame (or _ModeChanged), the frame is
+    // in the ScreenCapture object's frame buffer and 'timestamp'
+    // is when it was presented.  On ScreenCaptureResult_NoChange,
+    // 'timestamp' is the time of the tick, which the previous
+    // frame is still on the screen at.  Ticks that were missed
+    // because the caller took too long are skipped, not
+    // bunched up.
+    //
+    ScreenCaptureResult WaitForTick(uint64_t &timestamp);
+
+    uint32_t GetFps()        const { return m_fps; }
+    bool     HasFirstFrame() const { return m_firstFrameQpc != 0; }
+
+    // Returns when the last tick woke up, in QPC ticks, to
+    // time the capture that followed it.
+    int64_t  GetTickQpc()    const { return m_tickQpc; }
+
+private:
+    ScreenCapture &m_capture;
+    HANDLE   m_timer = nullptr;
+    uint32_t m_fps = 0;
+    int64_t  m_qpcFrequency = 1;
+    int64_t  m_periodTicks = 0;     // QPC ticks between ticks.
+    int64_t  m_nextTickQpc = 0;     // When the next tick is due.
+    int64_t  m_tickQpc = 0;         // When the last tick woke up.
+    int64_t  m_startQpc = 0;        // When Start() was called.
+    int64_t  m_firstFrameQpc = 0;   // Present time of the first frame.
+    uint64_t m_lastTimestamp = 0;   // Timestamp of the last tick.
+
+    uint64_t ToTimestamp(int64_t qpc) const;
+};
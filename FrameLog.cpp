@@ -0,0 +1,580 @@
+//--------------------------------------------------------------------
+//
+// FrameLog.cpp
+// C++ implementation of classes that record captured frames losslessly
+// into a compressed, memory-mapped frame log file and read them back.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "FrameLog.h"
+#include "PixelOps.h"
+
+#pragma comment(lib, "Cabinet.lib")
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Identifies the header of a frame log file, and the record in
+// front of each frame.
+static const uint32_t FileMagic   = 0x4C464353;  // "SCFL"
+static const uint32_t RecordMagic = 0x4D415246;  // "FRAM"
+static const uint32_t FileVersion = 1;
+
+// The file grows in steps of at least this many bytes.
+static const uint64_t GrowBytes = 64ull << 20;
+
+//
+// The header at the start of a frame log file.  'frameCount' is
+// kept up to date as frames are added; 'indexOffset' is zero
+// until the index has been written by FrameLogWriter::Close().
+//
+struct FileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;        // ScreenCaptureFormat.
+    uint32_t frameBytes;    // Size of a decoded frame.
+    uint32_t keyInterval;
+    uint32_t frameCount;
+    uint64_t indexOffset;
+};
+
+//
+// The record in front of each frame's data.
+//
+struct FrameRecord
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t timestamp;
+    uint32_t storedBytes;
+    uint32_t reserved;
+};
+
+// Returns the bytes per scanline and the number of scanlines of
+// a frame of the given size and format, without padding.
+static void GetFrameLayout(unsigned width, unsigned height, ScreenCaptureFormat format,
+    unsigned &rowBytes, unsigned &rows)
+{
+    if (format == ScreenCaptureFormat_NV12)
+    {
+        rowBytes = width;
+        rows = height + height / 2;
+    }
+    else
+    {
+        rowBytes = width * 4;
+        rows = height;
+    }
+}
+
+//--------------------------------------------------------------------
+// FrameLogWriter public members
+//--------------------------------------------------------------------
+
+//
+// Creates a frame log file for frames of the given size and
+// format.  Returns true if successful.
+//
+bool FrameLogWriter::Create(const wchar_t *filename, unsigned width, unsigned height,
+    ScreenCaptureFormat format, unsigned keyInterval)
+{
+    Close();
+
+    if (!filename || width < 1 || height < 1 || keyInterval < 1)
+        return false;
+    if (format == ScreenCaptureFormat_NV12 && ((width | height) & 1))
+        return false;
+
+    m_width = width;
+    m_height = height;
+    m_format = format;
+    m_keyInterval = keyInterval;
+    GetFrameLayout(width, height, format, m_rowBytes, m_rows);
+    m_frameBytes = m_rowBytes * m_rows;
+    m_previous.assign(m_frameBytes, 0);
+    m_delta.resize(m_frameBytes);
+    m_index.clear();
+    m_used = 0;
+    m_mapSize = 0;
+
+    // XPRESS is the fastest of the Windows codecs.  Raw mode
+    // leaves out the block headers, since we know the sizes.
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, nullptr, &m_compressor))
+    {
+        m_compressor = nullptr;
+        return false;
+    }
+
+    m_file = CreateFileW(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        Close();
+        return false;
+    }
+
+    FileHeader header = {};
+    if (!Append(&header, sizeof(header)))
+    {
+        Close();
+        return false;
+    }
+    UpdateHeader(0);
+    return true;
+}
+
+//
+// Stores a frame, as the difference from the previous one
+// unless it is a key frame.  Returns true if successful.
+//
+bool FrameLogWriter::AddFrame(const uint8_t *pixels, unsigned stride, uint64_t timestamp,
+    const std::vector<ScreenCaptureRect> *dirtyRects)
+{
+    if (!IsOpen() || !pixels || stride < m_rowBytes)
+        return false;
+
+    const bool key = (m_index.size() % m_keyInterval) == 0;
+    if (key)
+    {
+        // Stored as is.  It also becomes the previous frame.
+        PixelOps::CopyImage(m_previous.data(), m_rowBytes, pixels, stride, m_rowBytes, m_rows);
+        memcpy(m_delta.data(), m_previous.data(), m_frameBytes);
+    }
+    else if (dirtyRects && m_format == ScreenCaptureFormat_BGRA32)
+    {
+        // Only the dirty rectangles can be different from zero.
+        memset(m_delta.data(), 0, m_frameBytes);
+        for (const auto &r : *dirtyRects)
+        {
+            const unsigned left   = static_cast<unsigned>(max(r.left, 0));
+            const unsigned top    = static_cast<unsigned>(max(r.top, 0));
+            const unsigned right  = min(static_cast<unsigned>(max(r.right, 0)), m_width);
+            const unsigned bottom = min(static_cast<unsigned>(max(r.bottom, 0)), m_height);
+            if (left >= right || top >= bottom)
+                continue;
+
+            // Rectangles may overlap.  XORing with the previous
+            // frame and then with the new pixels, and updating the
+            // previous frame right away, leaves any part that was
+            // already done as it is.
+            const size_t offset = static_cast<size_t>(top) * m_rowBytes + left * 4;
+            const size_t bytes  = static_cast<size_t>(right - left) * 4;
+            const uint8_t *src = pixels + static_cast<size_t>(top) * stride + left * 4;
+            PixelOps::XorImage(m_delta.data() + offset, m_rowBytes,
+                m_delta.data() + offset, m_rowBytes,
+                m_previous.data() + offset, m_rowBytes, bytes, bottom - top);
+            PixelOps::XorImage(m_delta.data() + offset, m_rowBytes,
+                m_delta.data() + offset, m_rowBytes,
+                src, stride, bytes, bottom - top);
+            PixelOps::CopyImage(m_previous.data() + offset, m_rowBytes, src, stride, bytes, bottom - top);
+        }
+    }
+    else
+    {
+        PixelOps::XorImage(m_delta.data(), m_rowBytes, pixels, stride,
+            m_previous.data(), m_rowBytes, m_rowBytes, m_rows);
+        PixelOps::CopyImage(m_previous.data(), m_rowBytes, pixels, stride, m_rowBytes, m_rows);
+    }
+
+    // Compress straight into the file.  A frame that doesn't
+    // get smaller is stored as is.
+    if (!Reserve(sizeof(FrameRecord) + static_cast<uint64_t>(m_frameBytes)))
+        return false;
+
+    FrameRecord record = {};
+    record.magic = RecordMagic;
+    record.flags = key ? FrameLogFlag_Key : 0;
+    record.timestamp = timestamp;
+
+    uint8_t *data = m_view + m_used + sizeof(record);
+    SIZE_T compressedBytes = 0;
+    if (Compress(m_compressor, m_delta.data(), m_frameBytes, data, m_frameBytes, &compressedBytes) &&
+        compressedBytes < m_frameBytes)
+    {
+        record.flags |= FrameLogFlag_Compressed;
+        record.storedBytes = static_cast<uint32_t>(compressedBytes);
+    }
+    else
+    {
+        memcpy(data, m_delta.data(), m_frameBytes);
+        record.storedBytes = m_frameBytes;
+    }
+
+    FrameLogEntry entry = {};
+    entry.offset = m_used;
+    entry.timestamp = timestamp;
+    entry.flags = record.flags;
+    entry.storedBytes = record.storedBytes;
+
+    memcpy(m_view + m_used, &record, sizeof(record));
+    m_used += sizeof(record) + record.storedBytes;
+    m_index.push_back(entry);
+    UpdateHeader(0);
+    return true;
+}
+
+//
+// Writes the index at the end of the log and closes the file,
+// trimming off the space that was reserved but not used.
+// Returns true if successful.
+//
+bool FrameLogWriter::Close()
+{
+    if (m_compressor)
+    {
+        CloseCompressor(m_compressor);
+        m_compressor = nullptr;
+    }
+    if (!IsOpen())
+        return false;
+
+    bool ok = false;
+    if (m_view)
+    {
+        const uint64_t indexOffset = m_used;
+        if (Append(m_index.data(), m_index.size() * sizeof(FrameLogEntry)))
+        {
+            UpdateHeader(indexOffset);
+            ok = true;
+        }
+        FlushViewOfFile(m_view, 0);
+        UnmapViewOfFile(m_view);
+        m_view = nullptr;
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    LARGE_INTEGER size;
+    size.QuadPart = static_cast<LONGLONG>(m_used);
+    if (!SetFilePointerEx(m_file, size, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+        ok = false;
+    CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+
+    m_previous.clear();
+    m_delta.clear();
+    return ok;
+}
+
+//--------------------------------------------------------------------
+// FrameLogWriter private members
+//--------------------------------------------------------------------
+
+//
+// Makes sure the mapping has room for 'bytes' more bytes,
+// growing the file if needed.  Returns true if successful.
+//
+bool FrameLogWriter::Reserve(uint64_t bytes)
+{
+    if (m_view && m_used + bytes <= m_mapSize)
+        return true;
+
+    // Grow by at least half again, so the file is only
+    // remapped a few times over a long recording.
+    const uint64_t newSize = max(m_used + bytes + GrowBytes, m_mapSize + m_mapSize / 2);
+    if (m_view)
+    {
+        UnmapViewOfFile(m_view);
+        m_view = nullptr;
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    // Mapping more than the file holds extends the file.
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READWRITE,
+                    static_cast<DWORD>(newSize >> 32), static_cast<DWORD>(newSize), nullptr);
+    if (!m_mapping)
+        return false;
+    m_view = static_cast<uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0));
+    if (!m_view)
+    {
+        CloseHandle(m_mapping);
+        m_mapping = nullptr;
+        return false;
+    }
+
+    m_mapSize = newSize;
+    return true;
+}
+
+//
+// Appends 'bytes' bytes to the file.  Returns true if successful.
+//
+bool FrameLogWriter::Append(const void *data, size_t bytes)
+{
+    if (!Reserve(bytes))
+        return false;
+
+    memcpy(m_view + m_used, data, bytes);
+    m_used += bytes;
+    return true;
+}
+
+//
+// Writes the file header with the current frame count.
+//
+void FrameLogWriter::UpdateHeader(uint64_t indexOffset)
+{
+    FileHeader header = {};
+    header.magic       = FileMagic;
+    header.version     = FileVersion;
+    header.width       = m_width;
+    header.height      = m_height;
+    header.format      = static_cast<uint32_t>(m_format);
+    header.frameBytes  = m_frameBytes;
+    header.keyInterval = m_keyInterval;
+    header.frameCount  = static_cast<uint32_t>(m_index.size());
+    header.indexOffset = indexOffset;
+    memcpy(m_view, &header, sizeof(header));
+}
+
+//--------------------------------------------------------------------
+// FrameLogReader public members
+//--------------------------------------------------------------------
+
+//
+// Opens a frame log and loads its index.  Returns true if
+// successful.
+//
+bool FrameLogReader::Open(const wchar_t *filename)
+{
+    Close();
+
+    m_file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart < static_cast<LONGLONG>(sizeof(FileHeader)))
+    {
+        Close();
+        return false;
+    }
+    m_fileSize = static_cast<uint64_t>(size.QuadPart);
+
+    m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_view = static_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_view || !CreateDecompressor(COMPRESS_ALGORITHM_XPRESS | COMPRESS_RAW, nullptr, &m_decompressor))
+    {
+        m_decompressor = nullptr;
+        Close();
+        return false;
+    }
+
+    FileHeader header;
+    memcpy(&header, m_view, sizeof(header));
+    if (header.magic != FileMagic || header.version != FileVersion ||
+        header.width < 1 || header.height < 1 ||
+        (header.format != ScreenCaptureFormat_BGRA32 && header.format != ScreenCaptureFormat_NV12))
+    {
+        Close();
+        return false;
+    }
+
+    m_width  = header.width;
+    m_height = header.height;
+    m_format = static_cast<ScreenCaptureFormat>(header.format);
+    unsigned rows = 0;
+    GetFrameLayout(m_width, m_height, m_format, m_rowBytes, rows);
+    m_frameBytes = m_rowBytes * rows;
+    if (header.frameBytes != m_frameBytes || !LoadIndex(header.frameCount, header.indexOffset))
+    {
+        Close();
+        return false;
+    }
+
+    m_frame.assign(m_frameBytes, 0);
+    m_delta.resize(m_frameBytes);
+    m_frameIndex = -1;
+    return true;
+}
+
+//
+// Closes the frame log.
+//
+void FrameLogReader::Close()
+{
+    if (m_view)
+        UnmapViewOfFile(m_view);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    if (m_decompressor)
+        CloseDecompressor(m_decompressor);
+
+    m_view = nullptr;
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+    m_decompressor = nullptr;
+    m_index.clear();
+    m_frame.clear();
+    m_delta.clear();
+    m_frameIndex = -1;
+}
+
+//
+// Decodes frame 'index' into 'pixels'.  Returns true if
+// successful.
+//
+bool FrameLogReader::ReadFrame(unsigned index, std::vector<uint8_t> &pixels, uint64_t &timestamp)
+{
+    if (index >= m_index.size())
+        return false;
+
+    // Start from the key frame before it, unless the frame we
+    // decoded last is on the way.
+    unsigned first = index;
+    while (first > 0 && !(m_index[first].flags & FrameLogFlag_Key))
+        first--;
+    if (m_frameIndex >= first && m_frameIndex <= index)
+        first = static_cast<unsigned>(m_frameIndex) + 1;
+
+    for (unsigned i = first; i <= index; i++)
+    {
+        if (!DecodeFrame(i))
+        {
+            m_frameIndex = -1;
+            return false;
+        }
+        m_frameIndex = i;
+    }
+
+    pixels = m_frame;
+    timestamp = m_index[index].timestamp;
+    return true;
+}
+
+//--------------------------------------------------------------------
+// FrameLogReader private members
+//--------------------------------------------------------------------
+
+//
+// Loads the index written when the log was closed.  If there is
+// none, because the writer never got to close it, the index is
+// rebuilt by walking through the frame records.  Returns true if
+// successful.
+//
+bool FrameLogReader::LoadIndex(uint32_t frameCount, uint64_t indexOffset)
+{
+    m_index.clear();
+    if (indexOffset)
+    {
+        const uint64_t bytes = static_cast<uint64_t>(frameCount) * sizeof(FrameLogEntry);
+        if (indexOffset < sizeof(FileHeader) || indexOffset + bytes > m_fileSize)
+            return false;
+        m_index.resize(frameCount);
+        memcpy(m_index.data(), m_view + indexOffset, static_cast<size_t>(bytes));
+    }
+    else
+    {
+        // The unused end of the file is all zeros, so the walk
+        // stops at the first record that isn't there.
+        uint64_t offset = sizeof(FileHeader);
+        while (offset + sizeof(FrameRecord) <= m_fileSize)
+        {
+            FrameRecord record;
+            memcpy(&record, m_view + offset, sizeof(record));
+            if (record.magic != RecordMagic ||
+                offset + sizeof(record) + record.storedBytes > m_fileSize)
+                break;
+
+            FrameLogEntry entry = {};
+            entry.offset = offset;
+            entry.timestamp = record.timestamp;
+            entry.flags = record.flags;
+            entry.storedBytes = record.storedBytes;
+            m_index.push_back(entry);
+            offset += sizeof(record) + record.storedBytes;
+        }
+    }
+
+    // Every frame has to be inside the file, and the first one
+    // has to be a key frame.
+    for (const auto &entry : m_index)
+    {
+        if (entry.offset + sizeof(FrameRecord) + entry.storedBytes > m_fileSize ||
+            entry.storedBytes > m_frameBytes)
+            return false;
+    }
+    return m_index.empty() || (m_index[0].flags & FrameLogFlag_Key);
+}
+
+//
+// Decodes frame 'index' on top of m_frame, which must hold the
+// frame before it unless this is a key frame.  Returns true if
+// successful.
+//
+bool FrameLogReader::DecodeFrame(unsigned index)
+{
+    const FrameLogEntry &entry = m_index[index];
+    const bool key = (entry.flags & FrameLogFlag_Key) != 0;
+    const uint8_t *data = m_view + entry.offset + sizeof(FrameRecord);
+
+    // Key frames go straight into m_frame.  Differences are
+    // unpacked first, then XORed with the previous frame.
+    uint8_t *out = key ? m_frame.data() : m_delta.data();
+    if (entry.flags & FrameLogFlag_Compressed)
+    {
+        SIZE_T bytes = 0;
+        if (!Decompress(m_decompressor, data, entry.storedBytes, out, m_frameBytes, &bytes) ||
+            bytes != m_frameBytes)
+            return false;
+    }
+    else
+    {
+        if (entry.storedBytes != m_frameBytes)
+            return false;
+        memcpy(out, data, m_frameBytes);
+    }
+
+    if (!key)
+        PixelOps::XorImage(m_frame.data(), m_frameBytes, m_frame.data(), m_frameBytes,
+            m_delta.data(), m_frameBytes, m_frameBytes, 1);
+    return true;
+}
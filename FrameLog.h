@@ -0,0 +1,213 @@
+//--------------------------------------------------------------------
+//
+// FrameLog.h
+// Header file of C++ classes that record captured frames losslessly
+// into a compressed, memory-mapped frame log file and read them back.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <compressapi.h>
+#include <cstdint>
+#include <vector>
+#include "ScreenCapTypes.h"
+
+//
+// A frame log holds a series of captured frames, pixel for
+// pixel, in one file.  Each frame is stored as the exclusive or
+// of itself and the frame before it, which leaves the
+// unchanged parts of the screen as runs of zeros, and then
+// compressed with the XPRESS codec that comes with Windows.
+// Every so often a key frame is stored in full, so a frame can
+// be read back without decoding the whole log.  An index of
+// all frames is written at the end when the log is closed.  If
+// it never gets closed, the frames are found by walking
+// through them instead.
+//
+
+//
+// How a frame is stored in a frame log.
+//
+enum FrameLogFlags
+{
+    FrameLogFlag_Key        = 1,  // Stored in full, not as a difference.
+    FrameLogFlag_Compressed = 2   // Compressed; otherwise stored as is.
+};
+
+//
+// One entry of a frame log's index, as stored in the file.
+//
+struct FrameLogEntry
+{
+    uint64_t offset;        // Offset of the frame's record in the file.
+    uint64_t timestamp;
+    uint32_t flags;         // FrameLogFlag_xxx values.
+    uint32_t storedBytes;   // Size of the frame's data after the record.
+};
+
+//
+// This class writes a frame log.  The file is memory-mapped
+// and grown in large steps as frames are appended, so writing
+// a frame is just a copy into the mapping, and the operating
+// system writes it to disk in the background.
+//
+class FrameLogWriter
+{
+public:
+    FrameLogWriter() { }
+    ~FrameLogWriter() { Close(); }
+
+    //
+    // Creates a frame log for frames of the given size and
+    // format, replacing any existing file.  Every
+    // 'keyInterval'th frame is stored as a key frame.  Returns
+    // true if successful.
+    //
+    bool Create(const wchar_t *filename, unsigned width, unsigned height,
+        ScreenCaptureFormat format, unsigned keyInterval = 30);
+
+    //
+    // Appends a frame, whose scanlines are 'stride' bytes apart.
+    // For NV12 frames the UV plane starts stride * height bytes
+    // after 'pixels'.  If 'dirtyRects' is given, only those
+    // parts of a BGRA32 frame are compared with the previous
+    // frame; the caller promises that nothing else changed.
+    // Timestamps are stored as given.  Returns true if
+    // successful.
+    //
+    bool AddFrame(const uint8_t *pixels, unsigned stride, uint64_t timestamp,
+        const std::vector<ScreenCaptureRect> *dirtyRects = nullptr);
+
+    //
+    // Writes the index, trims the file to the size that was
+    // used, and closes it.  Returns true if successful.
+    //
+    bool Close();
+
+    bool     IsOpen() const { return m_file != INVALID_HANDLE_VALUE; }
+    unsigned GetFrameCount() const { return static_cast<unsigned>(m_index.size()); }
+
+    // Returns the bytes stored so far, and the bytes the same
+    // frames take up uncompressed.
+    uint64_t GetStoredBytes() const { return m_used; }
+    uint64_t GetRawBytes() const { return static_cast<uint64_t>(m_frameBytes) * m_index.size(); }
+
+private:
+    HANDLE   m_file = INVALID_HANDLE_VALUE;
+    HANDLE   m_mapping = nullptr;
+    uint8_t *m_view = nullptr;
+    uint64_t m_mapSize = 0;     // Size of the file and the mapping.
+    uint64_t m_used = 0;        // Bytes of the file used so far.
+
+    COMPRESSOR_HANDLE m_compressor = nullptr;
+
+    unsigned m_width = 0;
+    unsigned m_height = 0;
+    ScreenCaptureFormat m_format = ScreenCaptureFormat_BGRA32;
+    unsigned m_rowBytes = 0;    // Bytes per scanline, without padding.
+    unsigned m_rows = 0;        // Scanlines per frame, counting the UV plane.
+    unsigned m_frameBytes = 0;
+    unsigned m_keyInterval = 0;
+
+    std::vector<uint8_t>    m_previous;  // The last frame added.
+    std::vector<uint8_t>    m_delta;     // The frame as stored, before compression.
+    std::vector<FrameLogEntry> m_index;
+
+    bool Reserve(uint64_t bytes);
+    bool Append(const void *data, size_t bytes);
+    void UpdateHeader(uint64_t indexOffset);
+};
+
+//
+// This class reads frames back out of a frame log.
+//
+class FrameLogReader
+{
+public:
+    FrameLogReader() { }
+    ~FrameLogReader() { Close(); }
+
+    //
+    // Opens a frame log for reading.  Returns true if successful.
+    //
+    bool Open(const wchar_t *filename);
+    void Close();
+
+    unsigned GetFrameCount() const { return static_cast<unsigned>(m_index.size()); }
+    unsigned GetWidth() const  { return m_width; }
+    unsigned GetHeight() const { return m_height; }
+    ScreenCaptureFormat GetFormat() const { return m_format; }
+
+    //
+    // Returns the size of a decoded frame, and the bytes
+    // between its scanlines.  Decoded frames have no padding.
+    //
+    size_t   GetFrameBytes() const { return m_frameBytes; }
+    unsigned GetStride() const { return m_rowBytes; }
+
+    //
+    // Decodes frame 'index' into 'pixels' and returns its
+    // timestamp.  Reading the frames in order only decodes
+    // each frame once; jumping around decodes from the nearest
+    // key frame before the one asked for.  Returns true if
+    // successful.
+    //
+    bool ReadFrame(unsigned index, std::vector<uint8_t> &pixels, uint64_t &timestamp);
+
+private:
+    HANDLE        m_file = INVALID_HANDLE_VALUE;
+    HANDLE        m_mapping = nullptr;
+    const uint8_t *m_view = nullptr;
+    uint64_t      m_fileSize = 0;
+
+    DECOMPRESSOR_HANDLE m_decompressor = nullptr;
+
+    unsigned m_width = 0;
+    unsigned m_height = 0;
+    ScreenCaptureFormat m_format = ScreenCaptureFormat_BGRA32;
+    unsigned m_rowBytes = 0;
+    unsigned m_frameBytes = 0;
+
+    std::vector<FrameLogEntry> m_index;
+    std::vector<uint8_t>    m_frame;          // The last frame decoded.
+    std::vector<uint8_t>    m_delta;          // Scratch for decoding.
+    int64_t                 m_frameIndex = -1; // Index of m_frame, or -1.
+
+    bool LoadIndex(uint32_t frameCount, uint64_t indexOffset);
+    bool DecodeFrame(unsigned index);
+};
@@ -0,0 +1,382 @@
+//--------------------------------------------------------------------
+//
+// FramePool.cpp
+// C++ code for a pool of aligned frame buffers that are shared
+// between threads through reference-counted handles.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "FramePool.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#pragma comment(lib, "Advapi32.lib")
+
+// Older SDKs don't define this.
+#ifndef FILE_MAP_LARGE_PAGES
+#define FILE_MAP_LARGE_PAGES 0x20000000
+#endif
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+//
+// One buffer and the handles' count of references to it.
+//
+struct FramePoolBuffer
+{
+    std::atomic<long>               refs { 1 };
+    uint8_t                        *data = nullptr;     // View of the section.
+    size_t                          size = 0;           // Bytes that were asked for.
+    HANDLE                          section = nullptr;
+    FrameInfo                       info;
+    std::shared_ptr<FramePoolState> pool;
+};
+
+//
+// What a pool shares with its buffers.
+//
+struct FramePoolState
+{
+    std::mutex                     lock;
+    std::vector<FramePoolBuffer *> free;
+    size_t                         bufferSize = 0;   // Size of the buffers handed out now.
+    unsigned                       count = 0;        // Buffers in existence.
+    unsigned                       maxBuffers = FramePool::DefaultMaxBuffers;
+    bool                           largePages = false;
+    bool                           closed = false;   // The pool has been destroyed.
+};
+
+// Unmaps a buffer's memory, closes its section, and deletes it.
+static void FreeBuffer(FramePoolBuffer *buffer)
+{
+    if (buffer->data)
+        UnmapViewOfFile(buffer->data);
+    if (buffer->section)
+        CloseHandle(buffer->section);
+    delete buffer;
+}
+
+// Frees a list of buffers.
+static void FreeBuffers(std::vector<FramePoolBuffer *> &buffers)
+{
+    for (auto *buffer : buffers)
+        FreeBuffer(buffer);
+    buffers.clear();
+}
+
+// Creates a buffer of the given size in a page-file section,
+// with large pages if asked for and possible.  Returns nullptr
+// if there isn't enough memory.
+static FramePoolBuffer *CreateBuffer(size_t bytes, bool largePages)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    for (int attempt = largePages ? 0 : 1; attempt < 2; attempt++)
+    {
+        // Large page sections must be a whole number of large
+        // pages.
+        const bool large = (attempt == 0);
+        const uint64_t granularity = large ? GetLargePageMinimum() : si.dwPageSize;
+        if (granularity == 0)
+            continue;
+        const uint64_t capacity = (bytes + granularity - 1) / granularity * granularity;
+
+        HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr,
+                            PAGE_READWRITE | SEC_COMMIT | (large ? SEC_LARGE_PAGES : 0),
+                            static_cast<DWORD>(capacity >> 32), static_cast<DWORD>(capacity),
+                            nullptr);
+        if (!section)
+            continue;
+
+        void *view = MapViewOfFile(section,
+                        FILE_MAP_ALL_ACCESS | (large ? FILE_MAP_LARGE_PAGES : 0),
+                        0, 0, static_cast<SIZE_T>(capacity));
+        if (!view)
+        {
+            CloseHandle(section);
+            continue;
+        }
+
+        auto *buffer = new FramePoolBuffer;
+        buffer->data = static_cast<uint8_t *>(view);
+        buffer->size = bytes;
+        buffer->section = section;
+        return buffer;
+    }
+
+    return nullptr;
+}
+
+// Enables a privilege in the process token.  Returns false if
+// the process doesn't have it.
+static bool EnablePrivilege(const wchar_t *name)
+{
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return false;
+
+    TOKEN_PRIVILEGES tp = {};
+    tp.PrivilegeCount = 1;
+    tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // AdjustTokenPrivileges() succeeds even when the privilege
+    // isn't held, but says so through GetLastError().
+    const bool ok = LookupPrivilegeValueW(nullptr, name, &tp.Privileges[0].Luid) &&
+                    AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr) &&
+                    GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return ok;
+}
+
+//--------------------------------------------------------------------
+// FrameHandle public members
+//--------------------------------------------------------------------
+
+FrameHandle::FrameHandle(const FrameHandle &other) : m_buffer(other.m_buffer)
+{
+    if (m_buffer)
+        m_buffer->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+FrameHandle &FrameHandle::operator=(const FrameHandle &other)
+{
+    // Take the new reference first, in case both handles
+    // refer to the same buffer.
+    if (other.m_buffer)
+        other.m_buffer->refs.fetch_add(1, std::memory_order_relaxed);
+    Reset();
+    m_buffer = other.m_buffer;
+    return *this;
+}
+
+FrameHandle &FrameHandle::operator=(FrameHandle &&other) noexcept
+{
+    if (this != &other)
+    {
+        Reset();
+        m_buffer = other.m_buffer;
+        other.m_buffer = nullptr;
+    }
+    return *this;
+}
+
+//
+// Lets go of the buffer.  The last handle to let go gives the
+// buffer back to its pool, or frees it if the pool is gone or
+// has moved on to another size.
+//
+void FrameHandle::Reset()
+{
+    FramePoolBuffer *buffer = m_buffer;
+    m_buffer = nullptr;
+    if (!buffer || buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    std::shared_ptr<FramePoolState> pool = buffer->pool;
+    {
+        std::lock_guard<std::mutex> lock(pool->lock);
+        if (!pool->closed && buffer->size == pool->bufferSize)
+        {
+            pool->free.push_back(buffer);
+            return;
+        }
+        pool->count--;
+    }
+    FreeBuffer(buffer);
+}
+
+uint8_t *FrameHandle::GetData() const
+{
+    return m_buffer ? m_buffer->data : nullptr;
+}
+
+size_t FrameHandle::GetSize() const
+{
+    return m_buffer ? m_buffer->size : 0;
+}
+
+void *FrameHandle::GetSection() const
+{
+    return m_buffer ? m_buffer->section : nullptr;
+}
+
+bool FrameHandle::IsShared() const
+{
+    return m_buffer && m_buffer->refs.load(std::memory_order_acquire) > 1;
+}
+
+const FrameInfo &FrameHandle::GetInfo() const
+{
+    static const FrameInfo none;
+    return m_buffer ? m_buffer->info : none;
+}
+
+void FrameHandle::SetInfo(const FrameInfo &info)
+{
+    if (m_buffer)
+        m_buffer->info = info;
+}
+
+//--------------------------------------------------------------------
+// FramePool public members
+//--------------------------------------------------------------------
+
+FramePool::FramePool() : m_state(std::make_shared<FramePoolState>())
+{
+}
+
+//
+// Frees the free buffers.  Buffers that are still held free
+// themselves when they are released.
+//
+FramePool::~FramePool()
+{
+    std::vector<FramePoolBuffer *> free;
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        m_state->closed = true;
+        free.swap(m_state->free);
+        m_state->count -= static_cast<unsigned>(free.size());
+    }
+    FreeBuffers(free);
+}
+
+//
+// Limits the number of buffers.
+//
+void FramePool::SetMaxBuffers(unsigned count)
+{
+    std::lock_guard<std::mutex> lock(m_state->lock);
+    m_state->maxBuffers = count;
+}
+
+//
+// Backs the buffers allocated from now on with large pages,
+// if the process may use them.
+//
+bool FramePool::SetLargePages(bool enable)
+{
+    if (enable && (GetLargePageMinimum() == 0 || !EnablePrivilege(L"SeLockMemoryPrivilege")))
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_state->lock);
+    m_state->largePages = enable;
+    return true;
+}
+
+//
+// Hands out a buffer of the given size.
+//
+FrameHandle FramePool::Allocate(size_t bytes)
+{
+    if (bytes == 0)
+        return FrameHandle();
+
+    std::vector<FramePoolBuffer *> stale;
+    bool largePages = false;
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        if (bytes != m_state->bufferSize)
+        {
+            // The free buffers are the wrong size now.
+            stale.swap(m_state->free);
+            m_state->count -= static_cast<unsigned>(stale.size());
+            m_state->bufferSize = bytes;
+        }
+        else if (!m_state->free.empty())
+        {
+            FramePoolBuffer *buffer = m_state->free.back();
+            m_state->free.pop_back();
+            buffer->refs.store(1, std::memory_order_relaxed);
+            buffer->info = FrameInfo();
+            return FrameHandle(buffer);
+        }
+
+        // Count the new buffer now, so other threads can't go
+        // over the limit while it is being created.
+        full = (m_state->count >= m_state->maxBuffers);
+        if (!full)
+            m_state->count++;
+        largePages = m_state->largePages;
+    }
+    FreeBuffers(stale);
+    if (full)
+        return FrameHandle();
+
+    FramePoolBuffer *buffer = CreateBuffer(bytes, largePages);
+    if (!buffer)
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        m_state->count--;
+        return FrameHandle();
+    }
+
+    buffer->pool = m_state;
+    return FrameHandle(buffer);
+}
+
+//
+// Frees the buffers that nobody holds.
+//
+void FramePool::Trim()
+{
+    std::vector<FramePoolBuffer *> free;
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        free.swap(m_state->free);
+        m_state->count -= static_cast<unsigned>(free.size());
+    }
+    FreeBuffers(free);
+}
+
+unsigned FramePool::GetBufferCount() const
+{
+    std::lock_guard<std::mutex> lock(m_state->lock);
+    return m_state->count;
+}
+
+unsigned FramePool::GetFreeCount() const
+{
+    std::lock_guard<std::mutex> lock(m_state->lock);
+    return static_cast<unsigned>(m_state->free.size());
+}
@@ -0,0 +1,193 @@
+//--------------------------------------------------------------------
+//
+// FramePool.h
+// C++ declarations for a pool of aligned frame buffers that are
+// shared between threads through reference-counted handles.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include "ScreenCapTypes.h"
+
+struct FramePoolBuffer;
+struct FramePoolState;
+
+//
+// Describes the image held in a frame buffer.
+//
+struct FrameInfo
+{
+    unsigned            width = 0;
+    unsigned            height = 0;
+    unsigned            stride = 0;      // Bytes between scanlines.
+    unsigned            depth = 0;       // Bits per pixel; 12 for NV12.
+    ScreenCaptureFormat format = ScreenCaptureFormat_BGRA32;
+    bool                bottomUp = false;
+    int64_t             time = 0;        // When it was presented, in QPC ticks.
+};
+
+//
+// A reference to a buffer from a FramePool.  Copying a handle
+// shares the buffer rather than copying the pixels, so a
+// captured frame can be handed to an encoder, a snapshot
+// writer and anything else at once.  When the last handle to a
+// buffer goes away, the buffer goes back to its pool, or is
+// freed if the pool is gone.
+//
+// Copies of a handle may be used by different threads, but
+// one handle object must not.  Whoever fills a buffer should
+// only write to it while IsShared() is false, since the other
+// holders expect the pixels to stay put.
+//
+class FrameHandle
+{
+public:
+    FrameHandle() { }
+    FrameHandle(const FrameHandle &other);
+    FrameHandle(FrameHandle &&other) noexcept : m_buffer(other.m_buffer) { other.m_buffer = nullptr; }
+    ~FrameHandle() { Reset(); }
+
+    FrameHandle &operator=(const FrameHandle &other);
+    FrameHandle &operator=(FrameHandle &&other) noexcept;
+
+    //
+    // Lets go of the buffer.
+    //
+    void Reset();
+
+    explicit operator bool() const { return m_buffer != nullptr; }
+
+    //
+    // Returns the buffer's memory, which starts on a page
+    // boundary, and the number of bytes that were asked for.
+    //
+    uint8_t *GetData() const;
+    size_t   GetSize() const;
+
+    //
+    // Returns the page-file section that backs the buffer, as
+    // a HANDLE, so GDI can draw into it with CreateDIBSection().
+    //
+    void *GetSection() const;
+
+    //
+    // Returns true if other handles refer to the same buffer.
+    //
+    bool IsShared() const;
+
+    //
+    // The description of the image in the buffer, which the
+    // writer sets along with the pixels.
+    //
+    const FrameInfo &GetInfo() const;
+    void SetInfo(const FrameInfo &info);
+
+private:
+    friend class FramePool;
+
+    FramePoolBuffer *m_buffer = nullptr;
+
+    explicit FrameHandle(FramePoolBuffer *buffer) : m_buffer(buffer) { }
+};
+
+//
+// This class hands out frame buffers and takes them back when
+// their last handle is released, so that capturing at a steady
+// frame size doesn't allocate any memory.  Each buffer is a
+// page-file section mapped into the process, which puts it on
+// at least a 64KB boundary and lets GDI draw into it directly.
+// All of the buffers are the size given to the latest
+// Allocate(); changing the size frees the buffers of the old
+// size as they come back.
+//
+// The pool may be used by several threads at once.
+//
+class FramePool
+{
+public:
+    FramePool();
+    ~FramePool();
+
+    FramePool(const FramePool &) = delete;
+    FramePool &operator=(const FramePool &) = delete;
+
+    // How many buffers a pool allows by default.
+    static const unsigned DefaultMaxBuffers = 16;
+
+    //
+    // Limits the number of buffers, including those still held,
+    // so that a consumer that never lets go can't use up all
+    // the memory.
+    //
+    void SetMaxBuffers(unsigned count);
+
+    //
+    // Backs the buffers allocated from now on with large pages,
+    // which cuts TLB misses when whole frames are streamed
+    // through the CPU.  This needs the "Lock pages in memory"
+    // privilege.  Returns false if large pages can't be used,
+    // in which case normal pages are used.
+    //
+    bool SetLargePages(bool enable);
+
+    //
+    // Hands out a buffer of 'bytes' bytes, reusing a free one if
+    // there is one.  The contents of a reused buffer are left
+    // from its last use.  Returns an empty handle if the pool
+    // is at its limit or out of memory.
+    //
+    FrameHandle Allocate(size_t bytes);
+
+    //
+    // Frees the buffers that nobody holds.
+    //
+    void Trim();
+
+    //
+    // Returns the number of buffers in existence, and how many
+    // of those are free.
+    //
+    unsigned GetBufferCount() const;
+    unsigned GetFreeCount() const;
+
+private:
+    // Shared with the buffers, which outlive the pool if they
+    // are still held when it is destroyed.
+    std::shared_ptr<FramePoolState> m_state;
+};
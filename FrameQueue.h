@@ -0,0 +1,131 @@
+//--------------------------------------------------------------------
+//
+// FrameQueue.h
+// A small lock-free bounded queue of frame indices, used to hand
+// pooled frame buffers from one thread to another.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <cstdint>
+
+//
+// Bounded single-producer, single-consumer queue of frame
+// indices.  Push() may only be called from the producer
+// thread.  Pop() is normally called from the consumer thread,
+// but it is also safe for the producer to call it, which lets
+// the producer throw away the oldest entry when the queue is
+// full.
+//
+class FrameQueue
+{
+public:
+    explicit FrameQueue(size_t capacity = 0) { Reset(capacity); }
+
+    //
+    // Empties the queue and sets its capacity.  Must not be
+    // called while other threads are using the queue.
+    //
+    void Reset(size_t capacity)
+    {
+        m_capacity = capacity;
+        m_items = std::vector<std::atomic<uint32_t>>(capacity);
+        m_head.store(0);
+        m_tail.store(0);
+    }
+
+    //
+    // Adds an entry to the back of the queue.  Returns false
+    // if the queue is full.
+    //
+    bool Push(uint32_t value)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        if (tail - head >= m_capacity)
+            return false; // Full!
+
+        m_items[tail % m_capacity].store(value, std::memory_order_relaxed);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    //
+    // Removes the entry at the front of the queue, placing it
+    // in 'value'.  Returns false if the queue is empty.
+    //
+    bool Pop(uint32_t &value)
+    {
+        size_t head = m_head.load(std::memory_order_acquire);
+        for (;;)
+        {
+            const size_t tail = m_tail.load(std::memory_order_acquire);
+            if (head == tail)
+                return false; // Empty!
+
+            // The entry can't be overwritten until 'head' moves
+            // past it, so only keep it if we are the ones who
+            // moved 'head'.
+            value = m_items[head % m_capacity].load(std::memory_order_relaxed);
+            if (m_head.compare_exchange_weak(head, head + 1,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+    }
+
+    //
+    // Returns the number of entries in the queue.  The result
+    // may be stale by the time the caller looks at it.
+    //
+    size_t GetDepth() const
+    {
+        const size_t head = m_head.load(std::memory_order_acquire);
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    size_t GetCapacity() const { return m_capacity; }
+
+private:
+    std::vector<std::atomic<uint32_t>> m_items;
+    size_t m_capacity = 0;
+    std::atomic<size_t> m_head { 0 };   // Next entry to pop.
+    std::atomic<size_t> m_tail { 0 };   // Next entry to push.
+};
@@ -0,0 +1,310 @@
+//--------------------------------------------------------------------
+//
+// InstantRecorder.cpp
+// C++ class that keeps a capture session and an encoder ready,
+// so a recording can start without delay.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "InstantRecorder.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Starts Media Foundation, the capture and the first encoder.
+// Returns true if successful.
+//
+bool InstantRecorder::Prepare(
+    ScreenCaptureMode mode,
+    uint32_t fps,
+    const VideoEncoderConfig &config,
+    uint32_t maxWidth,
+    uint32_t maxHeight
+    )
+{
+    Shutdown();
+    if (fps < 1)
+        return false;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_qpcFrequency = freq.QuadPart;
+    const int64_t startQpc = GetQpc();
+
+    // Media Foundation stays started for as long as we are, so
+    // the encoders don't each start it.
+    if (FAILED(MFStartup(MF_VERSION)))
+        return false;
+    m_mfStarted = true;
+
+    if (!m_capture.Startup(mode))
+    {
+        Shutdown();
+        return false;
+    }
+
+    // The video size comes from the first frame.  Frames that
+    // are too large or odd-sized are scaled by the capture,
+    // on the GPU where it can.
+    const ScreenCaptureResult first = m_capture.WaitForFrame(1000);
+    if ((first != ScreenCaptureResult_Frame && first != ScreenCaptureResult_ModeChanged) ||
+        m_capture.GetFrameWidth() < 1 || m_capture.GetFrameFormat() != ScreenCaptureFormat_BGRA32)
+    {
+        Shutdown();
+        return false;
+    }
+    VideoFileEncoder::FitFrameSize(m_capture.GetFrameWidth(), m_capture.GetFrameHeight(),
+        maxWidth, maxHeight, m_width, m_height);
+    if (m_width != m_capture.GetFrameWidth() || m_height != m_capture.GetFrameHeight())
+        m_capture.SetOutputSize(m_width, m_height);
+
+    m_fps = fps;
+    m_config = config;
+    StartWarming();
+    WaitForWarming();
+    if (!m_encoder)
+    {
+        Shutdown();
+        return false;
+    }
+
+    m_prepared = true;
+    m_prepareMs = (GetQpc() - startQpc) * 1000.0 / m_qpcFrequency;
+    return true;
+}
+
+//
+// Stops any recording and releases everything.
+//
+void InstantRecorder::Shutdown()
+{
+    // Don't start another encoder on the way out.
+    m_prepared = false;
+    if (m_pipeline)
+        StopRecording();
+
+    WaitForWarming();
+    DiscardEncoder();
+    m_capture.Shutdown();
+    if (m_mfStarted)
+        MFShutdown();
+    m_mfStarted = false;
+    m_width = m_height = 0;
+}
+
+//
+// Starts recording with the encoder that was started ahead of
+// time.  Returns true if successful.
+//
+bool InstantRecorder::StartRecording(const wchar_t *filename)
+{
+    if (!m_prepared || m_pipeline || !filename)
+        return false;
+
+    const int64_t startQpc = GetQpc();
+
+    // Normally the encoder is long since ready.  If starting it
+    // failed before, try once more.
+    WaitForWarming();
+    if (!m_encoder)
+    {
+        StartWarming();
+        WaitForWarming();
+        if (!m_encoder)
+            return false;
+    }
+
+    // The screen may not change for a while, so start with the
+    // frame that is on it now.  If the capture has no frame to
+    // give, such as after losing the duplication, wait for one;
+    // a recording without a first frame couldn't be finished.
+    if (!m_capture.PrimeFirstFrame())
+    {
+        const ScreenCaptureResult result = m_capture.WaitForFrame(1000);
+        if ((result != ScreenCaptureResult_Frame && result != ScreenCaptureResult_ModeChanged) ||
+            !m_capture.PrimeFirstFrame())
+        {
+            return false;
+        }
+    }
+
+    m_pipeline.reset(new CapturePipeline(m_capture, *m_encoder));
+    m_primeTicks = GetQpc() - startQpc;
+    if (!m_pipeline->Start(nullptr, m_fps))
+    {
+        m_pipeline.reset();
+        return false;
+    }
+
+    m_filename = filename;
+    return true;
+}
+
+//
+// Stops recording, moves the file into place and starts the
+// next encoder.  Returns true if the file was written
+// successfully.
+//
+bool InstantRecorder::StopRecording()
+{
+    if (!m_pipeline)
+        return false;
+
+    bool ok = m_pipeline->Stop();
+    m_pipeline->GetStats(m_lastStats);
+    m_pipeline.reset();
+    m_encoder.reset();
+
+    if (ok)
+    {
+        ok = MoveFileExW(m_encoderFilename.c_str(), m_filename.c_str(),
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED) != FALSE;
+    }
+    if (!ok)
+        DeleteFileW(m_encoderFilename.c_str());
+    m_encoderFilename.clear();
+
+    if (m_prepared)
+        StartWarming();
+    return ok;
+}
+
+//
+// Retrieves the statistics of the current or last recording.
+//
+void InstantRecorder::GetStats(CapturePipelineStats &stats) const
+{
+    if (m_pipeline)
+        m_pipeline->GetStats(stats);
+    else
+        stats = m_lastStats;
+}
+
+//
+// Returns the time from StartRecording() to the first encoded
+// frame.
+//
+double InstantRecorder::GetTimeToFirstFrameMs() const
+{
+    CapturePipelineStats stats;
+    GetStats(stats);
+    if (stats.firstFrameMs <= 0.0)
+        return 0.0;
+    return stats.firstFrameMs + m_primeTicks * 1000.0 / m_qpcFrequency;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Starts the next encoder on the worker thread.
+//
+void InstantRecorder::StartWarming()
+{
+    WaitForWarming();
+    m_warmThread = std::thread(&InstantRecorder::WarmThread, this);
+}
+
+//
+// Waits for the worker thread to finish starting an encoder.
+//
+void InstantRecorder::WaitForWarming()
+{
+    if (m_warmThread.joinable())
+        m_warmThread.join();
+}
+
+//
+// Body of the worker thread.  Creates and starts an encoder
+// writing to a file of its own in the temporary directory,
+// which is the slow part of starting a recording.
+//
+void InstantRecorder::WarmThread()
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    wchar_t tempDir[MAX_PATH];
+    if (!GetTempPathW(MAX_PATH, tempDir))
+        tempDir[0] = 0;
+    wchar_t name[MAX_PATH + 64];
+    swprintf_s(name, L"%sInstantRecorder_%lu_%u.mp4", tempDir, GetCurrentProcessId(), m_nextNumber++);
+
+    // Media Foundation was started by Prepare(), and COM here.
+    std::unique_ptr<VideoFileEncoder> encoder(new VideoFileEncoder(false, false));
+    if (encoder->SetEncodingFormat(MFVideoFormat_H264) &&
+        encoder->SetVariableFrameRate(true) &&
+        encoder->Start(name, m_width, m_height, m_fps, m_config))
+    {
+        m_encoder = std::move(encoder);
+        m_encoderFilename = name;
+    }
+    else
+    {
+        encoder.reset();
+        DeleteFileW(name);
+    }
+
+    CoUninitialize();
+}
+
+//
+// Throws away an encoder that was started ahead of time but
+// never used, along with its file.
+//
+void InstantRecorder::DiscardEncoder()
+{
+    if (m_encoder)
+    {
+        m_encoder.reset();
+        DeleteFileW(m_encoderFilename.c_str());
+    }
+    m_encoderFilename.clear();
+}
@@ -0,0 +1,164 @@
+//--------------------------------------------------------------------
+//
+// InstantRecorder.h
+// Header file of C++ class that keeps a capture session and an
+// encoder ready, so a recording can start without delay.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "ScreenCap.h"
+#include "VideoFileEncoder.h"
+#include "CapturePipeline.h"
+#include <memory>
+#include <string>
+#include <thread>
+
+//
+// This class keeps everything a recording needs warmed up, for
+// recordings that start on demand, such as from a hotkey.  It
+// is meant to live as long as the application.
+//
+// Prepare() starts Media Foundation, starts the capture (which
+// creates the Direct3D device and the output duplication in
+// the DX11 modes), captures a first frame to learn the frame
+// size, and starts an encoder ahead of time, which loads the
+// encoder MFT and sets up its sink writer.  The encoder writes
+// to a file of its own in the temporary directory until it is
+// needed.  StartRecording() then only has to start the threads
+// of a CapturePipeline, and StopRecording() finishes the file
+// and moves it to where it was asked for, and starts the next
+// encoder ahead of time on a worker thread, the same way as
+// VideoSegmenter.
+//
+// COM must be initialized on the thread that calls Prepare().
+//
+class InstantRecorder
+{
+public:
+    InstantRecorder() { }
+    ~InstantRecorder() { Shutdown(); }
+
+    //
+    // Starts the capture in the given mode and an encoder for
+    // H.264 video at up to 'fps' frames per second.  Frames
+    // larger than 'maxWidth' x 'maxHeight' are scaled down to
+    // fit (see VideoFileEncoder::FitFrameSize()).  Returns true
+    // if successful.
+    //
+    bool Prepare(
+            ScreenCaptureMode mode,
+            uint32_t fps,
+            const VideoEncoderConfig &config = VideoEncoderConfig(),
+            uint32_t maxWidth = 1920,
+            uint32_t maxHeight = 1080);
+
+    //
+    // Stops any recording and releases everything that
+    // Prepare() started.
+    //
+    void Shutdown();
+
+    bool IsPrepared()  const { return m_prepared; }
+    bool IsRecording() const { return m_pipeline != nullptr; }
+
+    //
+    // Starts recording to the given file, which is created when
+    // the recording stops.  Waits for the next encoder if it
+    // isn't ready yet.  Returns true if successful.
+    //
+    bool StartRecording(const wchar_t *filename);
+
+    //
+    // Stops recording and moves the finished file into place.
+    // Returns true if the file was written successfully.
+    //
+    bool StopRecording();
+
+    //
+    // Retrieves the statistics of the current or last
+    // recording.
+    //
+    void GetStats(CapturePipelineStats &stats) const;
+
+    //
+    // Returns how long it took from the StartRecording() call
+    // until the first frame was encoded, in milliseconds, or
+    // zero if no frame was encoded yet.
+    //
+    double GetTimeToFirstFrameMs() const;
+
+    //
+    // Returns how long Prepare() took, in milliseconds.
+    //
+    double GetPrepareMs() const { return m_prepareMs; }
+
+    //
+    // The capture session, for changing its settings between
+    // recordings.
+    //
+    ScreenCapture &GetCapture() { return m_capture; }
+
+private:
+    ScreenCapture      m_capture;
+    uint32_t           m_fps = 0;
+    uint32_t           m_width = 0;         // Size of the video frames.
+    uint32_t           m_height = 0;
+    VideoEncoderConfig m_config;
+    bool               m_prepared = false;
+    bool               m_mfStarted = false;
+    unsigned           m_nextNumber = 0;    // For naming the files of the encoders.
+    double             m_prepareMs = 0.0;
+
+    // The encoder being started ahead of time, or that was, by
+    // m_warmThread, and the file it writes to.  Only touched
+    // by other threads while m_warmThread runs.
+    std::unique_ptr<VideoFileEncoder> m_encoder;
+    std::wstring       m_encoderFilename;
+    std::thread        m_warmThread;
+
+    // The recording in progress, if any.
+    std::unique_ptr<CapturePipeline> m_pipeline;
+    std::wstring       m_filename;          // Where the recording goes.
+    CapturePipelineStats m_lastStats;       // Of the last recording, once stopped.
+    int64_t            m_qpcFrequency = 1;
+    int64_t            m_primeTicks = 0;    // Time StartRecording() took before the pipeline started.
+
+    void StartWarming();
+    void WaitForWarming();
+    void WarmThread();
+    void DiscardEncoder();
+};
@@ -0,0 +1,891 @@
+//--------------------------------------------------------------------
+//
+// PixelOps.cpp
+// Pixel processing kernels shared by the capture and encoding
+// code, with SSSE3 and AVX2 versions picked at run time.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "PixelOps.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#define PIXELOPS_X86
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+// Fixed point BT.709 studio range coefficients, scaled by 128.
+// The SIMD kernels multiply bytes by signed bytes, so these
+// must fit in 8 bits, and the scalar kernels use the same
+// values so that all levels produce identical output.
+static const int YB = 8,  YG = 79,  YR = 23;
+static const int UB = 56, UG = -43, UR = -13;
+static const int VB = -5, VG = -51, VR = 56;
+static const int YRound = 64;
+static const int UVBias = 128 * 128 + 64;
+
+// The scaler blends pixels with 7-bit weights, first two
+// scanlines into 16-bit sums, then two of those sums into
+// 32-bit ones, which are rounded back down to bytes.
+static const int ScaleOne = 128;
+static const int ScaleRound = 1 << 13;
+static const int ScaleShift = 14;
+
+// The tile hash keeps eight 32-bit lanes per tile, one for
+// every eighth pixel of each scanline, so that AVX2 can work
+// on eight pixels at a time and SSSE3 on two sets of four, and
+// folds them into 64 bits at the end.  Each step is
+// (lane ^ pixel) * an odd constant, which can't map two lane
+// values to the same one, so a change to a single pixel always
+// changes the hash.
+static const uint32_t HashSeed = 0x811C9DC5;
+static const uint32_t HashMultiplier = 0x9E3779B1;
+static const uint64_t HashFoldMultiplier = 0x9E3779B97F4A7C15ull;
+static const unsigned HashLanes = 8;
+
+//----------------------------------------------------------
+// Scalar kernels
+//----------------------------------------------------------
+
+static void SwapRowScalar(uint8_t *a, uint8_t *b, size_t bytes)
+{
+    std::swap_ranges(a, a + bytes, b);
+}
+
+static void XorRowScalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t bytes)
+{
+    for (size_t x = 0; x < bytes; x++)
+        dst[x] = a[x] ^ b[x];
+}
+
+static void HashRowScalar(uint32_t *lanes, const uint8_t *src, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++)
+    {
+        uint32_t px;
+        memcpy(&px, src + x * 4, 4);
+        uint32_t &lane = lanes[x % HashLanes];
+        lane = (lane ^ px) * HashMultiplier;
+    }
+}
+
+static uint64_t FoldHashLanes(const uint32_t *lanes)
+{
+    uint64_t hash = 0;
+    for (unsigned i = 0; i < HashLanes; i++)
+        hash = (hash ^ lanes[i]) * HashFoldMultiplier;
+    return hash ^ (hash >> 32);
+}
+
+static void BGRAToRGB24RowScalar(uint8_t *dst, const uint8_t *src, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst += 3;
+        src += 4;
+    }
+}
+
+static void SetAlphaRowScalar(uint8_t *pixels, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++)
+        pixels[x * 4 + 3] = 255;
+}
+
+static inline uint8_t Average(uint8_t a, uint8_t b)
+{
+    return static_cast<uint8_t>((a + b + 1) >> 1);
+}
+
+static inline uint8_t Luma(const uint8_t *p)
+{
+    return static_cast<uint8_t>(((YB * p[0] + YG * p[1] + YR * p[2] + YRound) >> 7) + 16);
+}
+
+//
+// Converts two scanlines of BGRA pixels, starting at pixel 'x',
+// to two scanlines of Y and one scanline of UV.
+//
+static void BGRAToNV12RowsScalar(
+    uint8_t *dstY0, uint8_t *dstY1, uint8_t *dstUV,
+    const uint8_t *src0, const uint8_t *src1,
+    unsigned x, unsigned width
+    )
+{
+    for (; x < width; x += 2)
+    {
+        const uint8_t *p0 = src0 + x * 4;
+        const uint8_t *p1 = src1 + x * 4;
+        dstY0[x]     = Luma(p0);
+        dstY0[x + 1] = Luma(p0 + 4);
+        dstY1[x]     = Luma(p1);
+        dstY1[x + 1] = Luma(p1 + 4);
+
+        // Average vertically first, then horizontally, the
+        // same as the SIMD kernels do.
+        const int b = Average(Average(p0[0], p1[0]), Average(p0[4], p1[4]));
+        const int g = Average(Average(p0[1], p1[1]), Average(p0[5], p1[5]));
+        const int r = Average(Average(p0[2], p1[2]), Average(p0[6], p1[6]));
+        dstUV[x]     = static_cast<uint8_t>((UB * b + UG * g + UR * r + UVBias) >> 7);
+        dstUV[x + 1] = static_cast<uint8_t>((VB * b + VG * g + VR * r + UVBias) >> 7);
+    }
+}
+
+//
+// Blends two scanlines of 'count' bytes into 16-bit sums,
+// giving 'b' the weight 'wb' out of ScaleOne.
+//
+static void BlendRowsScalar(int16_t *dst, const uint8_t *a, const uint8_t *b, int wb, size_t count)
+{
+    const int wa = ScaleOne - wb;
+    for (size_t i = 0; i < count; i++)
+        dst[i] = static_cast<int16_t>(a[i] * wa + b[i] * wb);
+}
+
+//
+// Produces output pixels from 'x' on from the blended sums of
+// a scanline.  Output pixel x blends sum pixels xofs[x] and
+// xofs[x] + 1; the low 16 bits of xweight[x] are the weight of
+// the first and the high 16 bits the weight of the second.
+//
+static void ScaleRowScalar(uint8_t *dst, const int16_t *sums,
+    const uint32_t *xofs, const uint32_t *xweight, unsigned x, unsigned width)
+{
+    for (; x < width; x++)
+    {
+        const int16_t *p = sums + xofs[x] * 4;
+        const int w0 = xweight[x] & 0xFFFF;
+        const int w1 = xweight[x] >> 16;
+        for (int c = 0; c < 4; c++)
+            dst[x * 4 + c] = static_cast<uint8_t>((p[c] * w0 + p[c + 4] * w1 + ScaleRound) >> ScaleShift);
+    }
+}
+
+#ifdef PIXELOPS_X86
+
+//----------------------------------------------------------
+// SSSE3 kernels
+//----------------------------------------------------------
+
+static void SwapRowSSSE3(uint8_t *a, uint8_t *b, size_t bytes)
+{
+    size_t x = 0;
+    for (; x + 16 <= bytes; x += 16)
+    {
+        __m128i *pa = reinterpret_cast<__m128i *>(a + x);
+        __m128i *pb = reinterpret_cast<__m128i *>(b + x);
+        const __m128i va = _mm_loadu_si128(pa);
+        const __m128i vb = _mm_loadu_si128(pb);
+        _mm_storeu_si128(pa, vb);
+        _mm_storeu_si128(pb, va);
+    }
+    SwapRowScalar(a + x, b + x, bytes - x);
+}
+
+static void XorRowSSSE3(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t bytes)
+{
+    size_t x = 0;
+    for (; x + 16 <= bytes; x += 16)
+    {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_xor_si128(va, vb));
+    }
+    XorRowScalar(dst + x, a + x, b + x, bytes - x);
+}
+
+// SSE4.1 added a 32-bit multiply; before that it takes two
+// 64-bit multiplies of the even and odd lanes.
+static inline __m128i MulLo32SSSE3(__m128i a, __m128i b)
+{
+    const __m128i even = _mm_mul_epu32(a, b);
+    const __m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void HashRowSSSE3(uint32_t *lanes, const uint8_t *src, unsigned width)
+{
+    const __m128i mul = _mm_set1_epi32(static_cast<int>(HashMultiplier));
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lanes + 4));
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4 + 16));
+        lo = MulLo32SSSE3(_mm_xor_si128(lo, a), mul);
+        hi = MulLo32SSSE3(_mm_xor_si128(hi, b), mul);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), lo);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes + 4), hi);
+    HashRowScalar(lanes, src + x * 4, width - x);
+}
+
+static void BGRAToRGB24RowSSSE3(uint8_t *dst, const uint8_t *src, unsigned width)
+{
+    // Moves the first three bytes of each pixel to the low 12
+    // bytes of the register.
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m128i *s = reinterpret_cast<const __m128i *>(src + x * 4);
+        __m128i *d = reinterpret_cast<__m128i *>(dst + x * 3);
+        const __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128(s + 0), pack);
+        const __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128(s + 1), pack);
+        const __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128(s + 2), pack);
+        const __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128(s + 3), pack);
+        _mm_storeu_si128(d + 0, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128(d + 1, _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128(d + 2, _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+    BGRAToRGB24RowScalar(dst + x * 3, src + x * 4, width - x);
+}
+
+static void SetAlphaRowSSSE3(uint8_t *pixels, unsigned width)
+{
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+
+    unsigned x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i *p = reinterpret_cast<__m128i *>(pixels + x * 4);
+        _mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), alpha));
+    }
+    SetAlphaRowScalar(pixels + x * 4, width - x);
+}
+
+//
+// Returns the Y values of the eight pixels in 'a' and 'b' in
+// the low eight bytes.
+//
+static inline __m128i LumaSSSE3(__m128i a, __m128i b)
+{
+    const __m128i coef = _mm_setr_epi8(YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0);
+    __m128i y = _mm_hadd_epi16(_mm_maddubs_epi16(a, coef), _mm_maddubs_epi16(b, coef));
+    y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(YRound)), 7);
+    y = _mm_add_epi16(y, _mm_set1_epi16(16));
+    return _mm_packus_epi16(y, y);
+}
+
+static void BGRAToNV12RowsSSSE3(
+    uint8_t *dstY0, uint8_t *dstY1, uint8_t *dstUV,
+    const uint8_t *src0, const uint8_t *src1,
+    unsigned width
+    )
+{
+    const __m128i ucoef = _mm_setr_epi8(UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0);
+    const __m128i vcoef = _mm_setr_epi8(VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0);
+    const __m128i bias = _mm_set1_epi16(UVBias);
+    const __m128i interleave = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + x * 4));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src0 + x * 4 + 16));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + x * 4));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src1 + x * 4 + 16));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dstY0 + x), LumaSSSE3(a0, b0));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dstY1 + x), LumaSSSE3(a1, b1));
+
+        // Average each 2x2 block: the two scanlines first, then
+        // the even and odd pixels.
+        const __m128 a = _mm_castsi128_ps(_mm_avg_epu8(a0, a1));
+        const __m128 b = _mm_castsi128_ps(_mm_avg_epu8(b0, b1));
+        const __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i odd  = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        const __m128i q = _mm_avg_epu8(even, odd);
+
+        // Four U values followed by four V values, then
+        // interleaved into UV pairs.
+        __m128i uv = _mm_hadd_epi16(_mm_maddubs_epi16(q, ucoef), _mm_maddubs_epi16(q, vcoef));
+        uv = _mm_srli_epi16(_mm_add_epi16(uv, bias), 7);
+        uv = _mm_shuffle_epi8(_mm_packus_epi16(uv, uv), interleave);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dstUV + x), uv);
+    }
+    BGRAToNV12RowsScalar(dstY0, dstY1, dstUV, src0, src1, x, width);
+}
+
+static void BlendRowsSSSE3(int16_t *dst, const uint8_t *a, const uint8_t *b, int wb, size_t count)
+{
+    const __m128i va16 = _mm_set1_epi16(static_cast<short>(ScaleOne - wb));
+    const __m128i vb16 = _mm_set1_epi16(static_cast<short>(wb));
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m128i pa = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        const __m128i pb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), va16),
+                                         _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), vb16));
+        const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), va16),
+                                         _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), vb16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 8), hi);
+    }
+    BlendRowsScalar(dst + i, a + i, b + i, wb, count - i);
+}
+
+static void ScaleRowSSSE3(uint8_t *dst, const int16_t *sums,
+    const uint32_t *xofs, const uint32_t *xweight, unsigned width)
+{
+    // Pairs up the same channel of the two pixels, so one
+    // multiply-add blends all four channels.
+    const __m128i pairs = _mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+    const __m128i round = _mm_set1_epi32(ScaleRound);
+
+    unsigned x = 0;
+    for (; x + 2 <= width; x += 2)
+    {
+        const __m128i p0 = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + xofs[x] * 4)), pairs);
+        const __m128i p1 = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + xofs[x + 1] * 4)), pairs);
+        __m128i r0 = _mm_madd_epi16(p0, _mm_set1_epi32(static_cast<int>(xweight[x])));
+        __m128i r1 = _mm_madd_epi16(p1, _mm_set1_epi32(static_cast<int>(xweight[x + 1])));
+        r0 = _mm_srai_epi32(_mm_add_epi32(r0, round), ScaleShift);
+        r1 = _mm_srai_epi32(_mm_add_epi32(r1, round), ScaleShift);
+        const __m128i r = _mm_packs_epi32(r0, r1);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + x * 4), _mm_packus_epi16(r, r));
+    }
+    ScaleRowScalar(dst, sums, xofs, xweight, x, width);
+}
+
+//----------------------------------------------------------
+// AVX2 kernels
+//----------------------------------------------------------
+
+static void SwapRowAVX2(uint8_t *a, uint8_t *b, size_t bytes)
+{
+    size_t x = 0;
+    for (; x + 32 <= bytes; x += 32)
+    {
+        __m256i *pa = reinterpret_cast<__m256i *>(a + x);
+        __m256i *pb = reinterpret_cast<__m256i *>(b + x);
+        const __m256i va = _mm256_loadu_si256(pa);
+        const __m256i vb = _mm256_loadu_si256(pb);
+        _mm256_storeu_si256(pa, vb);
+        _mm256_storeu_si256(pb, va);
+    }
+    SwapRowScalar(a + x, b + x, bytes - x);
+}
+
+static void XorRowAVX2(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t bytes)
+{
+    size_t x = 0;
+    for (; x + 32 <= bytes; x += 32)
+    {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + x));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), _mm256_xor_si256(va, vb));
+    }
+    XorRowScalar(dst + x, a + x, b + x, bytes - x);
+}
+
+static void HashRowAVX2(uint32_t *lanes, const uint8_t *src, unsigned width)
+{
+    const __m256i mul = _mm256_set1_epi32(static_cast<int>(HashMultiplier));
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lanes));
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+        acc = _mm256_mullo_epi32(_mm256_xor_si256(acc, v), mul);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    HashRowScalar(lanes, src + x * 4, width - x);
+}
+
+static void BGRAToRGB24RowAVX2(uint8_t *dst, const uint8_t *src, unsigned width)
+{
+    // Packs each 128-bit lane to 12 bytes, then moves the two
+    // lanes together to make 24 bytes.
+    const __m256i pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    // Each step stores 32 bytes but only advances 24, so stop
+    // while the extra bytes still land inside the scanline.
+    unsigned x = 0;
+    for (; x + 11 <= width; x += 8)
+    {
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+        p = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p, pack), join);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 3), p);
+    }
+    _mm256_zeroupper();
+    BGRAToRGB24RowScalar(dst + x * 3, src + x * 4, width - x);
+}
+
+static void SetAlphaRowAVX2(uint8_t *pixels, unsigned width)
+{
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+
+    unsigned x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i *p = reinterpret_cast<__m256i *>(pixels + x * 4);
+        _mm256_storeu_si256(p, _mm256_or_si256(_mm256_loadu_si256(p), alpha));
+    }
+    _mm256_zeroupper();
+    SetAlphaRowScalar(pixels + x * 4, width - x);
+}
+
+//
+// The AVX2 shuffles work within each 128-bit lane, so the
+// results come out with groups of four pixels out of order.
+// This permutation puts the low 16 bytes back in order.
+//
+static inline __m256i ReorderAVX2(__m256i v)
+{
+    return _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+//
+// Returns the Y values of the 16 pixels in 'a' and 'b' in the
+// low 16 bytes.
+//
+static inline __m256i LumaAVX2(__m256i a, __m256i b)
+{
+    const __m256i coef = _mm256_setr_epi8(
+        YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0,
+        YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0, YB, YG, YR, 0);
+    __m256i y = _mm256_hadd_epi16(_mm256_maddubs_epi16(a, coef), _mm256_maddubs_epi16(b, coef));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(YRound)), 7);
+    y = _mm256_add_epi16(y, _mm256_set1_epi16(16));
+    return ReorderAVX2(_mm256_packus_epi16(y, y));
+}
+
+static void BGRAToNV12RowsAVX2(
+    uint8_t *dstY0, uint8_t *dstY1, uint8_t *dstUV,
+    const uint8_t *src0, const uint8_t *src1,
+    unsigned width
+    )
+{
+    const __m256i ucoef = _mm256_setr_epi8(
+        UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0,
+        UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0, UB, UG, UR, 0);
+    const __m256i vcoef = _mm256_setr_epi8(
+        VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0,
+        VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0, VB, VG, VR, 0);
+    const __m256i bias = _mm256_set1_epi16(UVBias);
+    const __m256i interleave = _mm256_setr_epi8(
+        0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 1, 5, 2, 6, 3, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        const __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src0 + x * 4));
+        const __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src0 + x * 4 + 32));
+        const __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src1 + x * 4));
+        const __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src1 + x * 4 + 32));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstY0 + x), _mm256_castsi256_si128(LumaAVX2(a0, b0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstY1 + x), _mm256_castsi256_si128(LumaAVX2(a1, b1)));
+
+        // Same as the SSSE3 version, eight UV pairs at a time.
+        const __m256 a = _mm256_castsi256_ps(_mm256_avg_epu8(a0, a1));
+        const __m256 b = _mm256_castsi256_ps(_mm256_avg_epu8(b0, b1));
+        const __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m256i odd  = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        const __m256i q = _mm256_avg_epu8(even, odd);
+
+        __m256i uv = _mm256_hadd_epi16(_mm256_maddubs_epi16(q, ucoef), _mm256_maddubs_epi16(q, vcoef));
+        uv = _mm256_srli_epi16(_mm256_add_epi16(uv, bias), 7);
+        uv = _mm256_shuffle_epi8(_mm256_packus_epi16(uv, uv), interleave);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dstUV + x), _mm256_castsi256_si128(ReorderAVX2(uv)));
+    }
+    _mm256_zeroupper();
+    BGRAToNV12RowsSSSE3(dstY0 + x, dstY1 + x, dstUV + x, src0 + x * 4, src1 + x * 4, width - x);
+}
+
+static void BlendRowsAVX2(int16_t *dst, const uint8_t *a, const uint8_t *b, int wb, size_t count)
+{
+    const __m256i va16 = _mm256_set1_epi16(static_cast<short>(ScaleOne - wb));
+    const __m256i vb16 = _mm256_set1_epi16(static_cast<short>(wb));
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        const __m256i pa = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+        const __m256i pb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+        const __m256i s = _mm256_add_epi16(_mm256_mullo_epi16(pa, va16), _mm256_mullo_epi16(pb, vb16));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), s);
+    }
+    _mm256_zeroupper();
+    BlendRowsScalar(dst + i, a + i, b + i, wb, count - i);
+}
+
+//
+// Checks which instruction sets the CPU and OS support.
+//
+static PixelOpsLevel DetectLevel()
+{
+    int info[4] = {};
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool ssse3   = (info[2] & (1 << 9)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx     = (info[2] & (1 << 28)) != 0;
+    if (!ssse3)
+        return PixelOpsLevel_Scalar;
+
+    // AVX2 also needs the OS to save the YMM registers.
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return PixelOpsLevel_AVX2;
+    }
+
+    return PixelOpsLevel_SSSE3;
+}
+
+#else
+
+static PixelOpsLevel DetectLevel()
+{
+    return PixelOpsLevel_Scalar;
+}
+
+#endif // PIXELOPS_X86
+
+static const PixelOpsLevel s_supportedLevel = DetectLevel();
+static PixelOpsLevel s_level = s_supportedLevel;
+
+//----------------------------------------------------------
+// Public members
+//----------------------------------------------------------
+
+PixelOpsLevel PixelOps::GetSupportedLevel()
+{
+    return s_supportedLevel;
+}
+
+PixelOpsLevel PixelOps::GetLevel()
+{
+    return s_level;
+}
+
+void PixelOps::SetLevel(PixelOpsLevel level)
+{
+    s_level = (level > s_supportedLevel) ? s_supportedLevel : level;
+}
+
+const char *PixelOps::GetLevelName(PixelOpsLevel level)
+{
+    switch (level)
+    {
+        case PixelOpsLevel_Scalar:  return "Scalar";
+        case PixelOpsLevel_SSSE3:   return "SSSE3";
+        case PixelOpsLevel_AVX2:    return "AVX2";
+    }
+    return "Unknown";
+}
+
+void PixelOps::CopyImage(
+    uint8_t *dst, ptrdiff_t dstStride,
+    const uint8_t *src, ptrdiff_t srcStride,
+    size_t rowBytes, unsigned rows
+    )
+{
+    // The runtime library's memcpy already uses the widest
+    // loads and stores the CPU has, and measured faster than
+    // our own SSSE3 and AVX2 loops, so all levels use it.
+    for (unsigned y = 0; y < rows; y++)
+    {
+        memcpy(dst, src, rowBytes);
+        dst += dstStride;
+        src += srcStride;
+    }
+}
+
+void PixelOps::ReverseRows(
+    uint8_t *pixels, ptrdiff_t stride,
+    size_t rowBytes, unsigned rows
+    )
+{
+    if (rows < 2)
+        return;
+
+    uint8_t *top = pixels;
+    uint8_t *bottom = pixels + stride * static_cast<ptrdiff_t>(rows - 1);
+    for (unsigned y = 0; y < rows / 2; y++)
+    {
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            SwapRowAVX2(top, bottom, rowBytes);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            SwapRowSSSE3(top, bottom, rowBytes);
+        else
+#endif
+            SwapRowScalar(top, bottom, rowBytes);
+        top += stride;
+        bottom -= stride;
+    }
+#ifdef PIXELOPS_X86
+    if (s_level >= PixelOpsLevel_AVX2)
+        _mm256_zeroupper();
+#endif
+}
+
+void PixelOps::XorImage(
+    uint8_t *dst, ptrdiff_t dstStride,
+    const uint8_t *a, ptrdiff_t aStride,
+    const uint8_t *b, ptrdiff_t bStride,
+    size_t rowBytes, unsigned rows
+    )
+{
+    for (unsigned y = 0; y < rows; y++)
+    {
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            XorRowAVX2(dst, a, b, rowBytes);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            XorRowSSSE3(dst, a, b, rowBytes);
+        else
+#endif
+            XorRowScalar(dst, a, b, rowBytes);
+        dst += dstStride;
+        a += aStride;
+        b += bStride;
+    }
+#ifdef PIXELOPS_X86
+    if (s_level >= PixelOpsLevel_AVX2)
+        _mm256_zeroupper();
+#endif
+}
+
+void PixelOps::HashTiles(
+    const uint8_t *pixels, ptrdiff_t stride,
+    unsigned width, unsigned height,
+    unsigned tileSize, uint64_t *hashes,
+    std::vector<uint32_t> &lanes
+    )
+{
+    if (!width || !height || !tileSize)
+        return;
+
+    // The lanes of a whole row of tiles are kept, so each
+    // scanline is read once, from left to right.
+    const unsigned across = (width + tileSize - 1) / tileSize;
+    lanes.resize(static_cast<size_t>(across) * HashLanes);
+    for (unsigned top = 0; top < height; top += tileSize)
+    {
+        const unsigned rows = std::min(tileSize, height - top);
+        std::fill(lanes.begin(), lanes.end(), HashSeed);
+        for (unsigned y = 0; y < rows; y++)
+        {
+            const uint8_t *row = pixels + stride * static_cast<ptrdiff_t>(top + y);
+            for (unsigned t = 0; t < across; t++)
+            {
+                const unsigned left = t * tileSize;
+                const unsigned count = std::min(tileSize, width - left);
+                uint32_t *tileLanes = &lanes[static_cast<size_t>(t) * HashLanes];
+#ifdef PIXELOPS_X86
+                if (s_level >= PixelOpsLevel_AVX2)
+                    HashRowAVX2(tileLanes, row + left * 4, count);
+                else if (s_level >= PixelOpsLevel_SSSE3)
+                    HashRowSSSE3(tileLanes, row + left * 4, count);
+                else
+#endif
+                    HashRowScalar(tileLanes, row + left * 4, count);
+            }
+        }
+        for (unsigned t = 0; t < across; t++)
+            hashes[t] = FoldHashLanes(&lanes[static_cast<size_t>(t) * HashLanes]);
+        hashes += across;
+    }
+#ifdef PIXELOPS_X86
+    if (s_level >= PixelOpsLevel_AVX2)
+        _mm256_zeroupper();
+#endif
+}
+
+void PixelOps::BGRAToRGB24(
+    uint8_t *dst, ptrdiff_t dstStride,
+    const uint8_t *src, ptrdiff_t srcStride,
+    unsigned width, unsigned rows
+    )
+{
+    for (unsigned y = 0; y < rows; y++)
+    {
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            BGRAToRGB24RowAVX2(dst, src, width);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            BGRAToRGB24RowSSSE3(dst, src, width);
+        else
+#endif
+            BGRAToRGB24RowScalar(dst, src, width);
+        dst += dstStride;
+        src += srcStride;
+    }
+}
+
+void PixelOps::SetAlpha(
+    uint8_t *pixels, ptrdiff_t stride,
+    unsigned width, unsigned rows
+    )
+{
+    for (unsigned y = 0; y < rows; y++)
+    {
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            SetAlphaRowAVX2(pixels, width);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            SetAlphaRowSSSE3(pixels, width);
+        else
+#endif
+            SetAlphaRowScalar(pixels, width);
+        pixels += stride;
+    }
+}
+
+void PixelOps::BGRAToNV12(
+    uint8_t *dstY, ptrdiff_t strideY,
+    uint8_t *dstUV, ptrdiff_t strideUV,
+    const uint8_t *src, ptrdiff_t srcStride,
+    unsigned width, unsigned height
+    )
+{
+    for (unsigned y = 0; y + 1 < height; y += 2)
+    {
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            BGRAToNV12RowsAVX2(dstY, dstY + strideY, dstUV, src, src + srcStride, width);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            BGRAToNV12RowsSSSE3(dstY, dstY + strideY, dstUV, src, src + srcStride, width);
+        else
+#endif
+            BGRAToNV12RowsScalar(dstY, dstY + strideY, dstUV, src, src + srcStride, 0, width);
+        dstY += strideY * 2;
+        dstUV += strideUV;
+        src += srcStride * 2;
+    }
+}
+
+void PixelOps::ScaleImage(
+    uint8_t *dst, ptrdiff_t dstStride,
+    unsigned dstWidth, unsigned dstHeight,
+    const uint8_t *src, ptrdiff_t srcStride,
+    unsigned srcWidth, unsigned srcHeight,
+    PixelOpsScaleBuffers &buffers
+    )
+{
+    if (!dstWidth || !dstHeight || !srcWidth || !srcHeight)
+        return;
+
+    // Works out where output coordinate 'i' samples the source,
+    // in 16.16 fixed point, with pixel centers lined up.
+    auto sample = [](unsigned i, unsigned srcSize, unsigned dstSize,
+                     unsigned &index, int &weight)
+    {
+        const int64_t step = (static_cast<int64_t>(srcSize) << 16) / dstSize;
+        int64_t pos = step * i + step / 2 - 0x8000;
+        if (pos < 0)
+            pos = 0;
+        index = static_cast<unsigned>(pos >> 16);
+        weight = static_cast<int>((pos & 0xFFFF) * ScaleOne >> 16);
+        if (index >= srcSize - 1)
+        {
+            index = srcSize - 1;
+            weight = 0;
+        }
+    };
+
+    std::vector<uint32_t> &xofs = buffers.xofs;
+    std::vector<uint32_t> &xweight = buffers.xweight;
+    if (buffers.srcWidth != srcWidth || buffers.dstWidth != dstWidth)
+    {
+        xofs.resize(dstWidth);
+        xweight.resize(dstWidth);
+        for (unsigned x = 0; x < dstWidth; x++)
+        {
+            int w = 0;
+            sample(x, srcWidth, dstWidth, xofs[x], w);
+            xweight[x] = static_cast<uint32_t>(ScaleOne - w) | (static_cast<uint32_t>(w) << 16);
+        }
+        buffers.srcWidth = srcWidth;
+        buffers.dstWidth = dstWidth;
+    }
+
+    // The blended scanline has one spare pixel at the end, so
+    // the last pixel can be blended with it like any other.
+    std::vector<int16_t> &sums = buffers.sums;
+    sums.resize((static_cast<size_t>(srcWidth) + 1) * 4);
+    const size_t rowBytes = static_cast<size_t>(srcWidth) * 4;
+
+    for (unsigned y = 0; y < dstHeight; y++)
+    {
+        unsigned sy = 0;
+        int wy = 0;
+        sample(y, srcHeight, dstHeight, sy, wy);
+        const uint8_t *a = src + srcStride * static_cast<ptrdiff_t>(sy);
+        const uint8_t *b = (sy + 1 < srcHeight) ? a + srcStride : a;
+
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_AVX2)
+            BlendRowsAVX2(sums.data(), a, b, wy, rowBytes);
+        else if (s_level >= PixelOpsLevel_SSSE3)
+            BlendRowsSSSE3(sums.data(), a, b, wy, rowBytes);
+        else
+#endif
+            BlendRowsScalar(sums.data(), a, b, wy, rowBytes);
+        memcpy(&sums[rowBytes], &sums[rowBytes - 4], 4 * sizeof(int16_t));
+
+#ifdef PIXELOPS_X86
+        if (s_level >= PixelOpsLevel_SSSE3)
+            ScaleRowSSSE3(dst, sums.data(), xofs.data(), xweight.data(), dstWidth);
+        else
+#endif
+            ScaleRowScalar(dst, sums.data(), xofs.data(), xweight.data(), 0, dstWidth);
+        dst += dstStride;
+    }
+}
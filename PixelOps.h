@@ -0,0 +1,199 @@
+//--------------------------------------------------------------------
+//
+// PixelOps.h
+// Pixel processing kernels shared by the capture and encoding
+// code, with SSSE3 and AVX2 versions picked at run time.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//
+// Instruction set levels that the kernels can run at.  Each
+// level includes the ones before it.
+//
+enum PixelOpsLevel
+{
+    PixelOpsLevel_Scalar = 0,   // Plain C++.
+    PixelOpsLevel_SSSE3  = 1,   // 128-bit SSE2 plus the SSSE3 byte shuffle.
+    PixelOpsLevel_AVX2   = 2    // 256-bit.
+};
+
+//
+// Scratch space for PixelOps::ScaleImage(), which the caller
+// keeps from one frame to the next so it isn't allocated for
+// every frame.  The column tables are only worked out again
+// when the widths change.
+//
+struct PixelOpsScaleBuffers
+{
+    std::vector<uint32_t> xofs;       // Source pixel of each column.
+    std::vector<uint32_t> xweight;    // Weights of it and the next one.
+    std::vector<int16_t>  sums;       // The vertically blended scanline.
+    unsigned srcWidth = 0;            // Widths the tables are for.
+    unsigned dstWidth = 0;
+};
+
+//
+// Pixel processing kernels.  All kernels take the address of
+// the first scanline and the offset in bytes from one scanline
+// to the next.  Strides may be negative, so that an image can
+// be flipped vertically while it is copied by passing the
+// address of its last scanline with a negative stride.
+//
+// Pixels in 32-bit formats are in BGRA byte order (or BGRX,
+// where the fourth byte is unused).
+//
+class PixelOps
+{
+public:
+    //
+    // Returns the highest level supported by this CPU.
+    //
+    static PixelOpsLevel GetSupportedLevel();
+
+    //
+    // Returns or sets the level that the kernels run at.  It
+    // starts out at the highest supported level.  Setting is
+    // mainly useful for testing and benchmarking; levels above
+    // GetSupportedLevel() are lowered to it.
+    //
+    static PixelOpsLevel GetLevel();
+    static void SetLevel(PixelOpsLevel level);
+    static const char *GetLevelName(PixelOpsLevel level);
+
+    //
+    // Copies 'rows' scanlines of 'rowBytes' bytes each, like
+    // MFCopyImage(), for code that doesn't use Media Foundation.
+    //
+    static void CopyImage(
+            uint8_t *dst, ptrdiff_t dstStride,
+            const uint8_t *src, ptrdiff_t srcStride,
+            size_t rowBytes, unsigned rows);
+
+    //
+    // Flips an image vertically in place by swapping its
+    // scanlines end for end.
+    //
+    static void ReverseRows(
+            uint8_t *pixels, ptrdiff_t stride,
+            size_t rowBytes, unsigned rows);
+
+    //
+    // Sets each byte of 'dst' to the exclusive or of the bytes
+    // of 'a' and 'b' at the same place, so that XORing the
+    // result with either image gives back the other.  Used for
+    // storing frames as differences from the frame before,
+    // where unchanged pixels become zero.  'dst' may be the
+    // same image as 'a' or 'b'.
+    //
+    static void XorImage(
+            uint8_t *dst, ptrdiff_t dstStride,
+            const uint8_t *a, ptrdiff_t aStride,
+            const uint8_t *b, ptrdiff_t bStride,
+            size_t rowBytes, unsigned rows);
+
+    //
+    // Splits an image of 32-bit pixels into square tiles of
+    // 'tileSize' pixels, and stores a 64-bit hash of each one
+    // in 'hashes', in rows from left to right, top to bottom.
+    // Tiles along the right and bottom edges are cut short.
+    // 'hashes' must have room for one per tile.  Comparing the
+    // hashes of two frames tells which tiles changed, at the
+    // cost of reading the frame once; a change to a single
+    // pixel always changes the hash of its tile.  'lanes' is
+    // scratch space, resized as needed, which the caller keeps
+    // from one frame to the next so it is only allocated when
+    // the width changes.
+    //
+    static void HashTiles(
+            const uint8_t *pixels, ptrdiff_t stride,
+            unsigned width, unsigned height,
+            unsigned tileSize, uint64_t *hashes,
+            std::vector<uint32_t> &lanes);
+
+    //
+    // Packs 32-bit BGRA pixels into 24-bit pixels in BGR byte
+    // order, as used by 24-bit BMP files, dropping the fourth
+    // byte.
+    //
+    static void BGRAToRGB24(
+            uint8_t *dst, ptrdiff_t dstStride,
+            const uint8_t *src, ptrdiff_t srcStride,
+            unsigned width, unsigned rows);
+
+    //
+    // Sets the fourth byte of each 32-bit pixel to 255, so
+    // BGRX images can be used where BGRA is expected.  GDI and
+    // DXGI leave the X byte undefined.
+    //
+    static void SetAlpha(
+            uint8_t *pixels, ptrdiff_t stride,
+            unsigned width, unsigned rows);
+
+    //
+    // Converts 32-bit BGRA pixels to NV12, using the BT.709
+    // matrix with studio (16-235) range, the same as the
+    // Direct3D video processor produces.  Each UV sample is
+    // the average of a 2x2 block of pixels, so 'width' and
+    // 'height' must be even.  The Y plane and the interleaved
+    // UV plane may have different strides.
+    //
+    static void BGRAToNV12(
+            uint8_t *dstY, ptrdiff_t strideY,
+            uint8_t *dstUV, ptrdiff_t strideUV,
+            const uint8_t *src, ptrdiff_t srcStride,
+            unsigned width, unsigned height);
+
+    //
+    // Resizes an image of 32-bit pixels with a bilinear filter
+    // that samples at the pixel centers.  At exactly half size
+    // each output pixel is the average of a 2x2 block; below
+    // half size some source pixels are skipped, so this is
+    // meant for moderate downscaling, such as 1440p to 1080p.
+    // The images must not overlap.  'buffers' is scratch space
+    // that may only be used by one call at a time.
+    //
+    static void ScaleImage(
+            uint8_t *dst, ptrdiff_t dstStride,
+            unsigned dstWidth, unsigned dstHeight,
+            const uint8_t *src, ptrdiff_t srcStride,
+            unsigned srcWidth, unsigned srcHeight,
+            PixelOpsScaleBuffers &buffers);
+};
@@ -0,0 +1,582 @@
+//--------------------------------------------------------------------
+//
+// ReplayBuffer.cpp
+// Implementation of a C++ class that keeps the last stretch of an
+// encoded video in memory and saves it to an .mp4 file on demand.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ReplayBuffer.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+//
+// Makes the type code of an MP4 box from its four letter name.
+//
+static constexpr uint32_t BoxType(const char *name)
+{
+    return (static_cast<uint32_t>(static_cast<uint8_t>(name[0])) << 24) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(name[1])) << 16) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(name[2])) << 8) |
+            static_cast<uint32_t>(static_cast<uint8_t>(name[3]));
+}
+
+// Larger boxes are taken to mean the stream isn't what we think.
+static const uint64_t MaxBoxBytes = 1ull << 30;
+
+// Flags of the 'tfhd' and 'trun' boxes that say which fields
+// are present.
+static const uint32_t TfhdBaseDataOffset        = 0x000001;
+static const uint32_t TfhdSampleDescription     = 0x000002;
+static const uint32_t TfhdDefaultSampleDuration = 0x000008;
+static const uint32_t TrunDataOffset            = 0x000001;
+static const uint32_t TrunFirstSampleFlags      = 0x000004;
+static const uint32_t TrunSampleDuration        = 0x000100;
+static const uint32_t TrunSampleSize            = 0x000200;
+static const uint32_t TrunSampleFlags           = 0x000400;
+static const uint32_t TrunSampleTimeOffset      = 0x000800;
+
+// MP4 files store numbers big-endian.
+static uint32_t ReadBE32(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static uint64_t ReadBE64(const uint8_t *p)
+{
+    return (static_cast<uint64_t>(ReadBE32(p)) << 32) | ReadBE32(p + 4);
+}
+
+static void WriteBE32(uint8_t *p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+static void WriteBE64(uint8_t *p, uint64_t value)
+{
+    WriteBE32(p, static_cast<uint32_t>(value >> 32));
+    WriteBE32(p + 4, static_cast<uint32_t>(value));
+}
+
+//
+// Looks for a box of the given type among the boxes from
+// 'begin' to 'end' of 'data'.  If found, returns true with the
+// offsets of its contents and of its end.
+//
+static bool FindBox(const uint8_t *data, size_t begin, size_t end, uint32_t type,
+    size_t &contentBegin, size_t &boxEnd)
+{
+    size_t pos = begin;
+    while (pos <= end && end - pos >= 8)
+    {
+        uint64_t size = ReadBE32(data + pos);
+        size_t header = 8;
+        if (size == 1)
+        {
+            if (end - pos < 16)
+                return false;
+            size = ReadBE64(data + pos + 8);
+            header = 16;
+        }
+        else if (size == 0)
+        {
+            // The box runs to the end of its parent.
+            size = end - pos;
+        }
+        if (size < header || size > end - pos)
+            return false;
+
+        if (ReadBE32(data + pos + 4) == type)
+        {
+            contentBegin = pos + header;
+            boxEnd = pos + static_cast<size_t>(size);
+            return true;
+        }
+        pos += static_cast<size_t>(size);
+    }
+    return false;
+}
+
+//
+// Converts a time in track units to 100ns units.
+//
+static uint64_t ToHns(uint64_t time, uint32_t timescale)
+{
+    return (time / timescale) * 10000000 + (time % timescale) * 10000000 / timescale;
+}
+
+//
+// Writes all of 'data' to a file.  Returns true if successful.
+//
+static bool WriteAll(HANDLE file, const std::vector<uint8_t> &data)
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        const size_t left = data.size() - done;
+        const DWORD chunk = static_cast<DWORD>((left < (1u << 30)) ? left : (1u << 30));
+        DWORD written = 0;
+        if (!WriteFile(file, data.data() + done, chunk, &written, nullptr) || written != chunk)
+            return false;
+        done += written;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+void ReplayBuffer::SetLimits(uint64_t maxDuration, size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_maxDuration = maxDuration;
+    m_maxBytes = maxBytes;
+    Trim();
+}
+
+void ReplayBuffer::Reset()
+{
+    m_box.clear();
+    m_boxSize = 0;
+    m_streamOffset = 0;
+    m_timescale = 0;
+    m_defaultSampleDuration = 0;
+    m_nextDecodeTime = 0;
+    m_headerDone = false;
+    m_failed = false;
+    m_pending.reset();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_header.clear();
+    m_fragments.clear();
+    m_duration = 0;
+    m_bytes = 0;
+}
+
+//
+// Writes the header and a snapshot of the buffered fragments to
+// a file.  The fragments are numbered again from one, their
+// decode times moved so the first one starts at zero, and any
+// base data offsets, which count from the start of the stream,
+// moved to where the fragments are in the file; nothing else
+// needs changing for them to play as a file of their own.
+//
+bool ReplayBuffer::SaveToFile(const wchar_t *filename) const
+{
+    // Take a snapshot, so the encoder can carry on while the
+    // file is written.
+    std::vector<uint8_t> header;
+    std::vector<std::shared_ptr<const Fragment>> fragments;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_header.empty() || m_fragments.empty())
+            return false;
+        header = m_header;
+        fragments.assign(m_fragments.begin(), m_fragments.end());
+    }
+
+    HANDLE file = CreateFileW(filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    bool ok = WriteAll(file, header);
+    const uint64_t firstDecodeTime = fragments[0]->decodeTime;
+    uint64_t fileOffset = header.size();
+    std::vector<uint8_t> moof;
+    for (size_t i = 0; ok && i < fragments.size(); i++)
+    {
+        const Fragment &fragment = *fragments[i];
+        moof = fragment.moof;
+        if (fragment.baseOffset)
+        {
+            const uint64_t base = ReadBE64(moof.data() + fragment.baseOffset);
+            WriteBE64(moof.data() + fragment.baseOffset, base - fragment.streamOffset + fileOffset);
+        }
+        if (fragment.mfhdOffset)
+            WriteBE32(moof.data() + fragment.mfhdOffset, static_cast<uint32_t>(i + 1));
+        if (fragment.tfdtOffset)
+        {
+            const uint64_t decodeTime = fragment.decodeTime - firstDecodeTime;
+            if (fragment.tfdt64)
+                WriteBE64(moof.data() + fragment.tfdtOffset, decodeTime);
+            else
+                WriteBE32(moof.data() + fragment.tfdtOffset, static_cast<uint32_t>(decodeTime));
+        }
+        ok = WriteAll(file, moof) && WriteAll(file, fragment.mdat);
+        fileOffset += moof.size() + fragment.mdat.size();
+    }
+
+    CloseHandle(file);
+    if (!ok)
+        DeleteFileW(filename);
+    return ok;
+}
+
+uint64_t ReplayBuffer::GetBufferedDuration() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_duration;
+}
+
+size_t ReplayBuffer::GetBufferedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bytes;
+}
+
+size_t ReplayBuffer::GetFragmentCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fragments.size();
+}
+
+//
+// Takes the encoded stream as it is written, and puts its top
+// level boxes back together, however they were split up
+// between writes.
+//
+bool ReplayBuffer::Write(const uint8_t *data, size_t size)
+{
+    if (m_failed)
+        return false;
+
+    while (size > 0)
+    {
+        // Take the rest of the box, or as much of its header as
+        // is needed to find out its size.
+        size_t want = 0;
+        if (m_boxSize)
+            want = static_cast<size_t>(m_boxSize - m_box.size());
+        else
+            want = ((m_box.size() < 8) ? 8 : 16) - m_box.size();
+        const size_t count = (want < size) ? want : size;
+        m_box.insert(m_box.end(), data, data + count);
+        data += count;
+        size -= count;
+
+        if (!m_boxSize)
+        {
+            if (m_box.size() < 8)
+                break;
+            const uint32_t size32 = ReadBE32(m_box.data());
+            if (size32 == 1)
+            {
+                if (m_box.size() < 16)
+                    continue;
+                m_boxSize = ReadBE64(m_box.data() + 8);
+                if (m_boxSize < 16)
+                    m_boxSize = 0;
+            }
+            else if (size32 >= 8)
+            {
+                m_boxSize = size32;
+            }
+
+            // Boxes that run to the end of the stream (size 0)
+            // can't be taken apart as they come in.
+            if (!m_boxSize || m_boxSize > MaxBoxBytes)
+            {
+                m_failed = true;
+                return false;
+            }
+            m_box.reserve(static_cast<size_t>(m_boxSize));
+        }
+
+        if (m_box.size() == m_boxSize)
+        {
+            if (!HandleBox())
+            {
+                m_failed = true;
+                return false;
+            }
+            m_streamOffset += m_boxSize;
+            m_box.clear();
+            m_boxSize = 0;
+        }
+    }
+
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Deals with the top level box in m_box.  Returns false if the
+// stream can't be used.
+//
+bool ReplayBuffer::HandleBox()
+{
+    const uint32_t type = ReadBE32(m_box.data() + 4);
+    if (type == BoxType("moof"))
+    {
+        m_headerDone = true;
+        m_pending = std::make_unique<Fragment>();
+        m_pending->moof.swap(m_box);
+        m_pending->streamOffset = m_streamOffset;
+        return ParseFragment(*m_pending);
+    }
+    if (type == BoxType("mdat"))
+    {
+        // Samples with no 'moof' in front can't be played, so
+        // they are left out.
+        if (m_pending)
+        {
+            // The samples must be in this 'mdat', right after
+            // the 'moof', or they would be lost when the
+            // fragments around them are dropped.
+            const size_t moofBytes = m_pending->moof.size();
+            const size_t header = (ReadBE32(m_box.data()) == 1) ? 16 : 8;
+            if (m_pending->firstSample < static_cast<int64_t>(moofBytes + header) ||
+                m_pending->lastSample >= static_cast<int64_t>(moofBytes + m_box.size()))
+            {
+                return false;
+            }
+            m_pending->mdat.swap(m_box);
+            AddFragment(std::move(m_pending));
+        }
+        return true;
+    }
+    if (!m_headerDone)
+        return ParseHeaderBox();
+
+    // Anything after the fragments, such as the 'mfra' index
+    // written at the end, refers to fragments that may have
+    // been dropped, and isn't needed to play the rest.
+    return true;
+}
+
+//
+// Keeps a box that comes before the first fragment, such as
+// 'ftyp' or 'moov', as part of the header, and takes what is
+// needed to time the fragments from 'moov'.
+//
+bool ReplayBuffer::ParseHeaderBox()
+{
+    const uint8_t *data = m_box.data();
+    const size_t   size = m_box.size();
+    size_t moovBegin = 0, moovEnd = 0;
+    if (FindBox(data, 0, size, BoxType("moov"), moovBegin, moovEnd))
+    {
+        size_t trakBegin, trakEnd, mdiaBegin, mdiaEnd, mdhdBegin, mdhdEnd;
+        if (!FindBox(data, moovBegin, moovEnd, BoxType("trak"), trakBegin, trakEnd) ||
+            !FindBox(data, trakBegin, trakEnd, BoxType("mdia"), mdiaBegin, mdiaEnd) ||
+            !FindBox(data, mdiaBegin, mdiaEnd, BoxType("mdhd"), mdhdBegin, mdhdEnd))
+        {
+            return false;
+        }
+
+        // The timescale follows the creation and modification
+        // times, which are 64 bits in version 1.
+        const size_t timescaleOffset = mdhdBegin + ((data[mdhdBegin] == 1) ? 20 : 12);
+        if (timescaleOffset + 4 > mdhdEnd)
+            return false;
+        m_timescale = ReadBE32(data + timescaleOffset);
+        if (!m_timescale)
+            return false;
+
+        size_t mvexBegin, mvexEnd, trexBegin, trexEnd;
+        if (FindBox(data, moovBegin, moovEnd, BoxType("mvex"), mvexBegin, mvexEnd) &&
+            FindBox(data, mvexBegin, mvexEnd, BoxType("trex"), trexBegin, trexEnd) &&
+            trexBegin + 16 <= trexEnd)
+        {
+            m_defaultSampleDuration = ReadBE32(data + trexBegin + 12);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_header.insert(m_header.end(), m_box.begin(), m_box.end());
+    return true;
+}
+
+//
+// Finds where a fragment's sequence number and decode time are
+// kept, and adds up how long its samples last.  The stream has
+// only the one video track, so only the first 'traf' is looked
+// at.  Returns false if the fragment can't be used.
+//
+bool ReplayBuffer::ParseFragment(Fragment &fragment)
+{
+    if (!m_timescale)
+        return false;
+
+    const uint8_t *data = fragment.moof.data();
+    const size_t   size = fragment.moof.size();
+    size_t moofBegin, moofEnd, trafBegin, trafEnd, begin, end;
+    if (!FindBox(data, 0, size, BoxType("moof"), moofBegin, moofEnd) ||
+        !FindBox(data, moofBegin, moofEnd, BoxType("traf"), trafBegin, trafEnd))
+    {
+        return false;
+    }
+
+    if (FindBox(data, moofBegin, moofEnd, BoxType("mfhd"), begin, end) && begin + 8 <= end)
+        fragment.mfhdOffset = begin + 4;
+
+    // A fragment without a decode time follows straight on from
+    // the one before.
+    fragment.decodeTime = m_nextDecodeTime;
+    if (FindBox(data, trafBegin, trafEnd, BoxType("tfdt"), begin, end))
+    {
+        fragment.tfdt64 = (data[begin] == 1);
+        if (begin + (fragment.tfdt64 ? 12 : 8) > end)
+            return false;
+        fragment.tfdtOffset = begin + 4;
+        fragment.decodeTime = fragment.tfdt64 ?
+            ReadBE64(data + begin + 4) : ReadBE32(data + begin + 4);
+    }
+
+    // Sample data offsets count from the base data offset if
+    // there is one, which counts from the start of the stream,
+    // or else from the start of the 'moof'.
+    uint32_t defaultDuration = m_defaultSampleDuration;
+    int64_t base = 0;
+    if (FindBox(data, trafBegin, trafEnd, BoxType("tfhd"), begin, end) && begin + 8 <= end)
+    {
+        const uint32_t flags = ReadBE32(data + begin) & 0xFFFFFF;
+        size_t pos = begin + 8;
+        if (flags & TfhdBaseDataOffset)
+        {
+            if (pos + 8 > end)
+                return false;
+            fragment.baseOffset = pos;
+            base = static_cast<int64_t>(ReadBE64(data + pos) - fragment.streamOffset);
+            pos += 8;
+        }
+        if (flags & TfhdSampleDescription)
+            pos += 4;
+        if (flags & TfhdDefaultSampleDuration)
+        {
+            if (pos + 4 > end)
+                return false;
+            defaultDuration = ReadBE32(data + pos);
+        }
+    }
+
+    // Each 'trun' box lists a run of samples, with their
+    // durations if they aren't all the default.  Where each
+    // run starts is noted, so HandleBox() can check that the
+    // samples are in the 'mdat' that follows.
+    uint64_t duration = 0;
+    size_t pos = trafBegin;
+    bool firstRun = true;
+    fragment.firstSample = fragment.lastSample = base;
+    while (FindBox(data, pos, trafEnd, BoxType("trun"), begin, end))
+    {
+        if (begin + 8 > end)
+            return false;
+        const uint32_t flags = ReadBE32(data + begin) & 0xFFFFFF;
+        const uint32_t sampleCount = ReadBE32(data + begin + 4);
+        size_t sample = begin + 8;
+        if (flags & TrunDataOffset)
+        {
+            if (sample + 4 > end)
+                return false;
+            const int64_t run = base + static_cast<int32_t>(ReadBE32(data + sample));
+            fragment.firstSample = firstRun ? run : min(fragment.firstSample, run);
+            fragment.lastSample  = firstRun ? run : max(fragment.lastSample, run);
+            sample += 4;
+        }
+        firstRun = false;
+        if (flags & TrunFirstSampleFlags)
+            sample += 4;
+        const size_t sampleBytes =
+            ((flags & TrunSampleDuration)   ? 4 : 0) +
+            ((flags & TrunSampleSize)       ? 4 : 0) +
+            ((flags & TrunSampleFlags)      ? 4 : 0) +
+            ((flags & TrunSampleTimeOffset) ? 4 : 0);
+        if (sample + static_cast<uint64_t>(sampleCount) * sampleBytes > end)
+            return false;
+
+        if (flags & TrunSampleDuration)
+        {
+            for (uint32_t i = 0; i < sampleCount; i++, sample += sampleBytes)
+                duration += ReadBE32(data + sample);
+        }
+        else
+        {
+            duration += static_cast<uint64_t>(sampleCount) * defaultDuration;
+        }
+        pos = end;
+    }
+
+    m_nextDecodeTime = fragment.decodeTime + duration;
+    fragment.duration = ToHns(duration, m_timescale);
+    return true;
+}
+
+//
+// Adds a finished fragment to the buffer, and drops the oldest
+// ones if it's now over its limits.
+//
+void ReplayBuffer::AddFragment(std::unique_ptr<Fragment> fragment)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_duration += fragment->duration;
+    m_bytes += fragment->moof.size() + fragment->mdat.size();
+    m_fragments.push_back(std::shared_ptr<const Fragment>(std::move(fragment)));
+    Trim();
+}
+
+//
+// Drops the oldest fragments while the buffer is over its
+// limits, always keeping the newest one.  Called with m_mutex
+// held.
+//
+void ReplayBuffer::Trim()
+{
+    while (m_fragments.size() > 1)
+    {
+        const Fragment &oldest = *m_fragments.front();
+        const size_t oldestBytes = oldest.moof.size() + oldest.mdat.size();
+        const bool overDuration = m_maxDuration && m_duration - oldest.duration >= m_maxDuration;
+        const bool overBytes = m_maxBytes && m_bytes > m_maxBytes;
+        if (!overDuration && !overBytes)
+            break;
+
+        m_duration -= oldest.duration;
+        m_bytes -= oldestBytes;
+        m_fragments.pop_front();
+    }
+}
@@ -0,0 +1,159 @@
+//--------------------------------------------------------------------
+//
+// ReplayBuffer.h
+// Header file of a C++ class that keeps the last stretch of an
+// encoded video in memory and saves it to an .mp4 file on demand.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "VideoFileEncoder.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//
+// This class keeps the last part of a recording in memory, so
+// it can be saved to a file after the fact ("save the last 60
+// seconds") without writing anything to disk until then.  Pass
+// it to VideoFileEncoder::Start() as the output of a fragmented
+// MP4 encoding.  The fragmented MP4 sink starts a new fragment
+// at each key frame, so each fragment can be played on its own
+// from the header at the start of the stream, and the oldest
+// fragments are simply thrown away once the buffer goes over
+// its limits.  Setting config.gopSize sets how finely the
+// buffer is trimmed.  Nothing is re-encoded when the buffer is
+// saved: the header and the fragments are written out as they
+// are, with their timestamps moved to start from zero.
+//
+// The encoder writes to the buffer from its own thread, and the
+// buffer may be saved while the encoding goes on.
+//
+class ReplayBuffer : public VideoEncoderOutput
+{
+public:
+    ReplayBuffer() { }
+    ~ReplayBuffer() { }
+
+    //
+    // Sets how much of the recording is kept.  The oldest
+    // fragments are dropped while the rest still hold
+    // 'maxDuration' (in 100ns units) of video, and while the
+    // buffer holds more than 'maxBytes'.  Zero means no limit.
+    // The newest fragment is always kept.
+    //
+    void SetLimits(uint64_t maxDuration, size_t maxBytes);
+
+    //
+    // Throws away everything buffered, so a new encoding can be
+    // started with the buffer as its output.  It must not be
+    // called while an encoder is writing to it.
+    //
+    void Reset();
+
+    //
+    // Writes what's in the buffer to an .mp4 file, replacing
+    // any existing file.  Returns false if there is nothing to
+    // save yet or the file can't be written.
+    //
+    bool SaveToFile(const wchar_t *filename) const;
+
+    //
+    // Returns how much video is buffered, in 100ns units, how
+    // many bytes it takes up, and how many fragments it is
+    // split into.
+    //
+    uint64_t GetBufferedDuration() const;
+    size_t   GetBufferedBytes() const;
+    size_t   GetFragmentCount() const;
+
+    // Returns true if the stream written to the buffer couldn't
+    // be understood, after which all writes fail.
+    bool IsFailed() const { return m_failed; }
+
+    // VideoEncoderOutput
+    bool Write(const uint8_t *data, size_t size) override;
+
+private:
+    //
+    // One fragment of the stream: a 'moof' box describing the
+    // samples and the 'mdat' box holding them.
+    //
+    struct Fragment
+    {
+        std::vector<uint8_t> moof;
+        std::vector<uint8_t> mdat;
+        size_t   mfhdOffset = 0;    // Offset of the sequence number in 'moof', or 0.
+        size_t   tfdtOffset = 0;    // Offset of the decode time in 'moof', or 0.
+        size_t   baseOffset = 0;    // Offset of the base data offset in 'moof', or 0.
+        uint64_t streamOffset = 0;  // Where 'moof' started in the stream.
+        int64_t  firstSample = 0;   // Offsets of the first and last runs of samples
+        int64_t  lastSample = 0;    // from the start of 'moof'.
+        bool     tfdt64 = false;    // The decode time is 64 bits.
+        uint64_t decodeTime = 0;    // In track units.
+        uint64_t duration = 0;      // In 100ns units.
+    };
+
+    // The box being put together from the written data.
+    std::vector<uint8_t> m_box;
+    uint64_t m_boxSize = 0;     // Size of m_box once its header is in, or 0.
+    uint64_t m_streamOffset = 0;// Where m_box started in the stream.
+
+    // What was learned from the header and the fragments so far.
+    uint32_t m_timescale = 0;   // Track units per second.
+    uint32_t m_defaultSampleDuration = 0;   // From 'trex', in track units.
+    uint64_t m_nextDecodeTime = 0;          // In track units.
+    bool     m_headerDone = false;
+    std::atomic<bool> m_failed { false };
+    std::unique_ptr<Fragment> m_pending;    // A 'moof' waiting for its 'mdat'.
+
+    // Guards everything below, which SaveToFile() reads.
+    mutable std::mutex m_mutex;
+    std::vector<uint8_t> m_header;  // Everything before the first 'moof'.
+    std::deque<std::shared_ptr<const Fragment>> m_fragments;
+    uint64_t m_maxDuration = 0;
+    size_t   m_maxBytes = 0;
+    uint64_t m_duration = 0;        // Of all buffered fragments, in 100ns units.
+    size_t   m_bytes = 0;           // Of all buffered fragments.
+
+    bool HandleBox();
+    bool ParseHeaderBox();
+    bool ParseFragment(Fragment &fragment);
+    void AddFragment(std::unique_ptr<Fragment> fragment);
+    void Trim();
+};
@@ -3,11 +3,7 @@
 // ScreenCap.h
 // Header file of C++ class to capture screen images on a Windows
 // computer.  This ScreenCapture class is a thin wrapper around the
-// ScreenCaptureGDI and ScreenCaptureDX11 classes.
-//
-// ToDo:
-//  * Refactor this so ScreenCaptureGDI and ScreenCaptureDX11 are
-//    child classes of ScreenCapture.
+// capture engines, which all implement ScreenCaptureBackend.
 //
 //--------------------------------------------------------------------
 // (C) Copyright 2019,2024 by Ammon R. Campbell.
@@ -45,15 +41,11 @@
 //--------------------------------------------------------------------
 
 #pragma once
-#include "ScreenCapGDI.h"
+#include "ScreenCapBackend.h"
 #include "ScreenCapDX11.h"
+#include <dwmapi.h>
 
-enum ScreenCaptureMode
-{
-    ScreenCaptureMode_Invalid = 0,
-    ScreenCaptureMode_GDI     = 1,  // GDI capture is slow but very reliable.
-    ScreenCaptureMode_DX11    = 2   // DX11 capture is fast but depends on DirectX drivers.
-};
+#pragma comment(lib, "dwmapi.lib")
 
 //
 // This class manages a screen capture session.
@@ -65,28 +57,20 @@ public:
     ~ScreenCapture() { Shutdown(); }
 
     //
-    // Begins a screen capture session.  Returns true if
-    // successful.
+    // Begins a screen capture session.  In ScreenCaptureMode_Auto
+    // the first of WGC, DX11 and GDI that starts and captures
+    // its first frame fast enough for 'minFps' frames per second
+    // is used, and GetCaptureMode() tells which one it was.
+    // Returns true if successful.
     //
-    bool Startup(ScreenCaptureMode mode)
+    bool Startup(ScreenCaptureMode mode, unsigned minFps = 10)
     {
         // Shut down the previous capture session first.
-        if (m_mode != ScreenCaptureMode_Invalid)
+        if (m_backend)
             Shutdown();
 
-        m_mode = mode;
-        if (mode == ScreenCaptureMode_GDI)
-        {
-            m_capgdi = new ScreenCaptureGDI;
-            return m_capgdi->Startup();
-        }
-        else if (mode == ScreenCaptureMode_DX11)
-        {
-            m_capdx11 = new ScreenCaptureDX11;
-            return m_capdx11->Startup();
-        }
-
-        return false;
+        m_backend = StartScreenCaptureBackend(mode, minFps, m_firstFrame);
+        return m_backend != nullptr;
     }
 
     //
@@ -95,15 +79,9 @@ public:
     //
     void Shutdown()
     {
-        if (m_capgdi)
-            delete m_capgdi;
-
-        if (m_capdx11)
-            delete m_capdx11;
-
-        m_capgdi = nullptr;
-        m_capdx11 = nullptr;
-        m_mode = ScreenCaptureMode_Invalid;
+        m_backend.reset();
+        m_window = nullptr;
+        m_firstFrame = false;
     }
 
     //
@@ -119,54 +97,286 @@ public:
     //
     bool CaptureFrame()
     {
-        if (m_capgdi)
-            return m_capgdi->CaptureFrame();
-        if (m_capdx11)
-            return m_capdx11->CaptureFrame();
+        if (!m_backend)
+            return false;
+
+        // Follow the window being captured, if any.
+        if (m_window && !UpdateWindowRegion())
+            return false;
+
+        if (TakeFirstFrame())
+            return true;
+        return m_backend->CaptureFrame();
+    }
+
+    //
+    // Waits up to 'timeoutMs' milliseconds (or INFINITE) for
+    // the screen to change, then captures the new frame the
+    // same way as CaptureFrame().  In the DX11 and WGC modes the
+    // thread sleeps until a frame is presented, without polling.
+    // GDI can't tell when the screen changes, so in GDI mode
+    // this captures a frame right away, and with incremental
+    // capture enabled compares it with the frame before to tell
+    // whether it changed.  Returns
+    // ScreenCaptureResult_NoChange if nothing changed before the
+    // timeout, so callers can tell that apart from an error.
+    // In the DX11 modes a lost duplication is recreated without
+    // restarting, and the first frame after the screen changed
+    // size or orientation is returned as
+    // ScreenCaptureResult_ModeChanged instead of _Frame.  With
+    // pipelined readback the GPU copy of a frame that just
+    // arrived isn't waited for, so the call may return
+    // ScreenCaptureResult_NoChange before the timeout even
+    // though the screen changed; that frame is returned by the
+    // next call.
+    //
+    ScreenCaptureResult WaitForFrame(unsigned timeoutMs)
+    {
+        if (!m_backend)
+            return ScreenCaptureResult_Error;
 
+        if (m_window && !UpdateWindowRegion())
+            return ScreenCaptureResult_Error;
+
+        if (TakeFirstFrame())
+            return ScreenCaptureResult_Frame;
+        return m_backend->WaitForFrame(timeoutMs);
+    }
+
+    //
+    // Brings the frame buffer up to date with the screen, and
+    // makes the next CaptureFrame() or WaitForFrame() hand it
+    // out even if the screen doesn't change, the same as the
+    // frame captured by Startup() in ScreenCaptureMode_Auto.
+    // For starting to record from a session that was started
+    // ahead of time:  the engine only delivers changes, so on
+    // a static screen the recording would otherwise have no
+    // first frame.  Returns false if there is no frame yet.
+    //
+    bool PrimeFirstFrame()
+    {
+        if (!m_backend)
+            return false;
+        if (m_firstFrame)
+            return true;
+
+        // If nothing changed, the engine still has the frame it
+        // last captured, which is what is on the screen.
+        const ScreenCaptureResult result = WaitForFrame(0);
+        if (result == ScreenCaptureResult_Error)
+            return false;
+        if (result == ScreenCaptureResult_Frame || result == ScreenCaptureResult_ModeChanged)
+            m_firstFrame = (GetFrameWidth() > 0 && GetFrameBuffer() != nullptr);
+        else
+            m_firstFrame = m_backend->RestoreLastFrame();
+        return m_firstFrame;
+    }
+
+    //
+    // Attempts to capture the next frame from the screen into
+    // a GPU texture, without copying it to system memory.  See
+    // ScreenCaptureDX11::CaptureFrameTexture().  Only supported
+    // in DX11 mode; returns false in other modes.
+    //
+    bool CaptureFrameTexture(CComPtr<ID3D11Texture2D> &texture)
+    {
+        if (m_backend && m_backend->GetMode() == ScreenCaptureMode_DX11)
+            return static_cast<ScreenCaptureDX11 *>(m_backend.get())->CaptureFrameTexture(texture);
         return false;
     }
 
     //
-    // Returns the current screen capture mode (GDI or DX11).
+    // Returns the Direct3D device that owns the textures returned
+    // by CaptureFrameTexture(), or nullptr if not in DX11 mode.
     //
-    ScreenCaptureMode GetCaptureMode() const { return m_mode; }
+    ID3D11Device *GetD3DDevice() const
+    {
+        if (m_backend && m_backend->GetMode() == ScreenCaptureMode_DX11)
+            return m_backend->GetD3DDevice();
+        return nullptr;
+    }
 
     //
-    // Return size and format of the frame buffer that
-    // contains the captured image.
+    // Enables or disables pipelined readback, which trades one
+    // frame of latency for not having to wait on the GPU in
+    // every CaptureFrame() call.  Only supported in the DX11
+    // modes; returns false in other modes.
+    //
+    bool SetPipelinedReadback(bool enable)
+    {
+        return m_backend && m_backend->SetPipelinedReadback(enable);
+    }
+
+    //
+    // Enables or disables incremental capture, where only the
+    // regions of the screen that changed are copied into the
+    // frame buffer.  In GDI mode the whole screen is still
+    // copied, but each frame is compared with the one before in
+    // tiles, so the dirty rectangles cover only what changed
+    // and WaitForFrame() returns ScreenCaptureResult_NoChange
+    // for a frame that didn't change at all.  Supported in the
+    // DX11 and GDI modes; returns false in other modes.
+    //
+    bool SetIncrementalCapture(bool enable)
+    {
+        return m_backend && m_backend->SetIncrementalCapture(enable);
+    }
+
+    //
+    // Includes or leaves out the mouse pointer.  In the DX11
+    // modes the pointer is drawn into the frame buffer, and
+    // only the areas it left and moved to are reported as
+    // dirty, so a moving pointer doesn't cost a full frame;
+    // pointer movement alone then counts as a change to the
+    // screen.  WGC leaves drawing the pointer to Windows.  Left
+    // out by default; returns false if the pointer can't be
+    // included in this mode.
+    //
+    bool SetCursorCapture(bool enable)
+    {
+        return m_backend && m_backend->SetCursorCapture(enable);
+    }
+
+    //
+    // Restricts capture to a region of the screen, given in
+    // desktop coordinates (the same as window rectangles).  The
+    // frame buffer takes on the size of the region, clipped to
+    // the screen, and only that region is copied.  Only
+    // supported in GDI, DX11 and WGC modes; returns false in
+    // other modes or if the region is empty.
+    //
+    bool SetCaptureRegion(const ScreenCaptureRect &region)
+    {
+        m_window = nullptr;
+        m_firstFrame = false;
+        return m_backend && m_backend->SetCaptureRegion(region);
+    }
+
+    //
+    // Goes back to capturing the whole screen, undoing
+    // SetCaptureRegion() or SetCaptureWindow().
+    //
+    void ClearCaptureRegion()
+    {
+        m_window = nullptr;
+        m_firstFrame = false;
+        if (m_backend)
+            m_backend->ClearCaptureRegion();
+    }
+
+    //
+    // Restricts capture to a window.  In WGC mode the window's
+    // own contents are captured, even where other windows cover
+    // it.  In GDI and DX11 modes, the area of the screen the
+    // window covers is captured instead, windows on top of it
+    // included; the window's position is looked up again in
+    // each CaptureFrame() call, so the capture follows the
+    // window as it moves or resizes.  Either way CaptureFrame()
+    // fails once the window is destroyed.  Not supported in
+    // DX11All mode.
+    //
+    bool SetCaptureWindow(HWND hwnd)
+    {
+        m_window = nullptr;
+        m_firstFrame = false;
+        if (!m_backend || !IsWindow(hwnd))
+            return false;
+        if (m_backend->SetCaptureWindow(hwnd))
+            return true;
+
+        m_window = hwnd;
+        if (!UpdateWindowRegion())
+        {
+            m_window = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    //
+    // Selects the pixel format of the frame buffer.  BGRA32 is
+    // supported in all modes.  NV12 is only supported in DX11
+    // mode, where the conversion is done on the GPU if the
+    // graphics driver has a video processor.
+    // Must be called after Startup().  Returns false if the
+    // format isn't supported.
+    //
+    bool SetOutputFormat(ScreenCaptureFormat format)
+    {
+        m_firstFrame = false;
+        return m_backend && m_backend->SetOutputFormat(format);
+    }
+
     //
-    unsigned GetFrameWidth()  const
+    // Scales every frame to the given size, rounded down to
+    // even numbers, so frames from any screen or capture region
+    // fit a video encoder.  DX11 mode scales on the GPU where it
+    // can.  Pass zero for both to go back to the captured size.
+    // Only supported in GDI and DX11 modes.
+    //
+    bool SetOutputSize(unsigned width, unsigned height)
     {
-        if (m_capgdi)
-            return m_capgdi->GetFrameWidth();
-        if (m_capdx11)
-            return m_capdx11->GetFrameWidth();
-        return 0;
+        m_firstFrame = false;
+        return m_backend && m_backend->SetOutputSize(width, height);
     }
-    unsigned GetFrameHeight() const
+
+    //
+    // Returns the pixel format of the frame buffer.
+    //
+    ScreenCaptureFormat GetFrameFormat() const
     {
-        if (m_capgdi)
-            return m_capgdi->GetFrameHeight();
-        if (m_capdx11)
-            return m_capdx11->GetFrameHeight();
-        return 0;
+        return m_backend ? m_backend->GetFrameFormat() : ScreenCaptureFormat_BGRA32;
     }
-    unsigned GetFrameDepth()  const
+
+    //
+    // Returns the current screen capture mode.  After starting
+    // in ScreenCaptureMode_Auto, this is the mode that was
+    // chosen.
+    //
+    ScreenCaptureMode GetCaptureMode() const
     {
-        if (m_capgdi)
-            return m_capgdi->GetFrameDepth();
-        if (m_capdx11)
-            return m_capdx11->GetFrameDepth();
-        return 0;
+        return m_backend ? m_backend->GetMode() : ScreenCaptureMode_Invalid;
     }
-    unsigned GetFrameStride() const
+
+    //
+    // Return size and format of the frame buffer that
+    // contains the captured image.
+    //
+    unsigned GetFrameWidth()  const { return m_backend ? m_backend->GetFrameWidth()  : 0; }
+    unsigned GetFrameHeight() const { return m_backend ? m_backend->GetFrameHeight() : 0; }
+    unsigned GetFrameDepth()  const { return m_backend ? m_backend->GetFrameDepth()  : 0; }
+    unsigned GetFrameStride() const { return m_backend ? m_backend->GetFrameStride() : 0; }
+
+    //
+    // Returns when the captured frame was shown on the screen,
+    // in QueryPerformanceCounter() ticks.  In the DX11 modes
+    // this is the present time reported by DXGI, and in WGC
+    // mode the time the compositor produced the frame; GDI can
+    // only report when the frame was captured.
+    //
+    int64_t GetFrameTime() const
     {
-        if (m_capgdi)
-            return m_capgdi->GetFrameStride();
-        if (m_capdx11)
-            return m_capdx11->GetFrameStride();
-        return 0;
+        return m_backend ? m_backend->GetFrameTime() : 0;
+    }
+
+    //
+    // Returns true if the scanlines of the frame buffer are in
+    // bottom-to-top order rather than top-to-bottom order.  Pass
+    // this as the flipY parameter of VideoFileEncoder::AddFrame().
+    //
+    bool IsFrameBottomUp() const
+    {
+        return m_backend && m_backend->IsFrameBottomUp();
+    }
+
+    //
+    // Returns the size of the frame buffer in bytes.  For NV12
+    // frames this includes the UV plane, which follows the Y
+    // plane at GetFrameStride() * GetFrameHeight() bytes in.
+    //
+    size_t GetFrameBufferSize() const
+    {
+        return m_backend ? m_backend->GetFrameBufferSize() : 0;
     }
 
     //
@@ -175,11 +385,7 @@ public:
     //
     const uint8_t *GetFrameBuffer() const
     {
-        if (m_capgdi)
-            return m_capgdi->GetFrameBuffer();
-        if (m_capdx11)
-            return m_capdx11->GetFrameBuffer();
-        return nullptr;
+        return m_backend ? m_backend->GetFrameBuffer() : nullptr;
     }
     const uint8_t *GetFrameBufferScanlinePtr(unsigned y) const
     {
@@ -190,9 +396,107 @@ public:
         return GetFrameBuffer() + (GetFrameStride() * y) + (x * GetFrameDepth() / 8);
     }
 
+    //
+    // Returns a handle to the frame buffer of the frame just
+    // captured, for keeping the frame without copying it.  The
+    // handle's FrameInfo describes the image.  While anybody
+    // holds the handle, the capture engine leaves that buffer
+    // alone and captures into another one from its FramePool,
+    // so holding more frames at once than SetMaxFrameBuffers()
+    // allows makes capture fail.  Supported in the GDI and DX11
+    // modes; returns an empty handle in other modes, in which
+    // case the frame has to be copied out of GetFrameBuffer().
+    //
+    FrameHandle GetFrameHandle() const
+    {
+        return m_backend ? m_backend->GetFrameHandle() : FrameHandle();
+    }
+
+    //
+    // Returns how long each stage of the last capture took, for
+    // profiling.  Supported in the GDI and DX11 modes; the
+    // timings are all zero in other modes.
+    //
+    ScreenCaptureTimings GetFrameTimings() const
+    {
+        return m_backend ? m_backend->GetFrameTimings() : ScreenCaptureTimings();
+    }
+
+    //
+    // Sets how many frame buffers the capture engine may have at
+    // once, including the ones whose handles are held elsewhere.
+    // The default is FramePool::DefaultMaxBuffers.
+    //
+    void SetMaxFrameBuffers(unsigned count)
+    {
+        if (m_backend)
+            m_backend->SetMaxFrameBuffers(count);
+    }
+
+    //
+    // Returns the list of rectangles of the frame buffer that
+    // changed in the most recently captured frame.  Consumers
+    // can use this to process only what changed.
+    //
+    const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const
+    {
+        static const std::vector<ScreenCaptureRect> none;
+        return m_backend ? m_backend->GetFrameDirtyRects() : none;
+    }
+
+    //
+    // Returns the number of screens covered by the frame buffer,
+    // and the area of the frame buffer that each one covers.
+    // Except in DX11All mode there is a single screen covering
+    // the whole frame buffer.
+    //
+    unsigned GetOutputCount() const
+    {
+        return m_backend ? m_backend->GetOutputCount() : 0;
+    }
+    ScreenCaptureRect GetOutputRect(unsigned index) const
+    {
+        return m_backend ? m_backend->GetOutputRect(index) : ScreenCaptureRect();
+    }
+
 private:
-    ScreenCaptureMode m_mode = ScreenCaptureMode_Invalid;
-    class ScreenCaptureGDI  *m_capgdi  = nullptr;
-    class ScreenCaptureDX11 *m_capdx11 = nullptr;
-};
+    //
+    // Returns true once if the frame captured while choosing the
+    // engine in ScreenCaptureMode_Auto hasn't been handed out
+    // yet.  The engine already counted it as delivered, so on a
+    // static screen there wouldn't be another one.
+    //
+    bool TakeFirstFrame()
+    {
+        const bool first = m_firstFrame;
+        m_firstFrame = false;
+        return first;
+    }
 
+    //
+    // Points the capture region at the current position of
+    // m_window.  The extended frame bounds leave out the
+    // invisible resize borders that GetWindowRect() includes.
+    //
+    bool UpdateWindowRegion()
+    {
+        if (!IsWindow(m_window))
+            return false;
+
+        RECT rc;
+        if (FAILED(DwmGetWindowAttribute(m_window, DWMWA_EXTENDED_FRAME_BOUNDS, &rc, sizeof(rc))) &&
+            !GetWindowRect(m_window, &rc))
+            return false;
+
+        ScreenCaptureRect region;
+        region.left   = rc.left;
+        region.top    = rc.top;
+        region.right  = rc.right;
+        region.bottom = rc.bottom;
+        return m_backend->SetCaptureRegion(region);
+    }
+
+    std::unique_ptr<ScreenCaptureBackend> m_backend;
+    HWND m_window = nullptr;        // Window followed with SetCaptureRegion(), if any.
+    bool m_firstFrame = false;      // See TakeFirstFrame().
+};
@@ -0,0 +1,160 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapBackend.cpp
+// Creates the screen capture engines, and picks one automatically.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ScreenCapGDI.h"
+#include "ScreenCapDX11.h"
+#include "ScreenCapMultiDX11.h"
+#include "ScreenCapWGC.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// How long the automatic choice waits for each engine's first
+// frame, in milliseconds.
+static const unsigned ProbeTimeoutMs = 500;
+
+//
+// Captures the first frame from a newly started engine and
+// measures how many frames per second it could deliver at that
+// speed.  Returns false if no frame arrived in time.
+//
+static bool ProbeBackend(ScreenCaptureBackend &backend, double &fps)
+{
+    LARGE_INTEGER freq, start, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    const ScreenCaptureResult result = backend.WaitForFrame(ProbeTimeoutMs);
+    QueryPerformanceCounter(&end);
+
+    if ((result != ScreenCaptureResult_Frame && result != ScreenCaptureResult_ModeChanged) ||
+        backend.GetFrameWidth() < 1)
+    {
+        return false;
+    }
+
+    const LONGLONG ticks = max(end.QuadPart - start.QuadPart, 1LL);
+    fps = static_cast<double>(freq.QuadPart) / static_cast<double>(ticks);
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Public functions
+//--------------------------------------------------------------------
+
+//
+// Returns the name of a capture mode.
+//
+const char *GetScreenCaptureModeName(ScreenCaptureMode mode)
+{
+    switch (mode)
+    {
+        case ScreenCaptureMode_GDI:     return "GDI";
+        case ScreenCaptureMode_DX11:    return "DX11";
+        case ScreenCaptureMode_DX11All: return "DX11ALL";
+        case ScreenCaptureMode_WGC:     return "WGC";
+        case ScreenCaptureMode_Auto:    return "AUTO";
+        default:                        return "Invalid";
+    }
+}
+
+//
+// Creates the capture engine for a mode, without starting it.
+//
+std::unique_ptr<ScreenCaptureBackend> CreateScreenCaptureBackend(ScreenCaptureMode mode)
+{
+    switch (mode)
+    {
+        case ScreenCaptureMode_GDI:
+            return std::make_unique<ScreenCaptureGDI>();
+        case ScreenCaptureMode_DX11:
+            return std::make_unique<ScreenCaptureDX11>();
+        case ScreenCaptureMode_DX11All:
+            return std::make_unique<ScreenCaptureMultiDX11>();
+        case ScreenCaptureMode_WGC:
+            return std::make_unique<ScreenCaptureWGC>();
+        default:
+            return nullptr;
+    }
+}
+
+//
+// Creates and starts the capture engine for a mode, choosing
+// one for ScreenCaptureMode_Auto.  Returns nullptr if no engine
+// could be started.
+//
+std::unique_ptr<ScreenCaptureBackend> StartScreenCaptureBackend(
+    ScreenCaptureMode mode, unsigned minFps, bool &firstFrame)
+{
+    firstFrame = false;
+    if (mode != ScreenCaptureMode_Auto)
+    {
+        auto backend = CreateScreenCaptureBackend(mode);
+        if (!backend || !backend->Startup())
+            return nullptr;
+        return backend;
+    }
+
+    // In order of preference.  GDI is kept as the last resort
+    // even if it is slow.
+    static const ScreenCaptureMode choices[] =
+    {
+        ScreenCaptureMode_WGC,
+        ScreenCaptureMode_DX11,
+        ScreenCaptureMode_GDI
+    };
+    const size_t numChoices = sizeof(choices) / sizeof(choices[0]);
+
+    for (size_t i = 0; i < numChoices; i++)
+    {
+        auto backend = CreateScreenCaptureBackend(choices[i]);
+        if (!backend->Startup())
+            continue;
+
+        double fps = 0.0;
+        const bool gotFrame = ProbeBackend(*backend, fps);
+        if ((gotFrame && fps >= minFps) || i + 1 == numChoices)
+        {
+            firstFrame = gotFrame;
+            return backend;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,169 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapBackend.h
+// Interface implemented by each of the screen capture engines
+// (GDI, DX11, DX11 multi-screen and Windows.Graphics.Capture), and
+// the factory that creates them.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "ScreenCapTypes.h"
+#include "FramePool.h"
+
+struct ID3D11Device;
+
+enum ScreenCaptureMode
+{
+    ScreenCaptureMode_Invalid = 0,
+    ScreenCaptureMode_GDI     = 1,  // GDI capture is slow but very reliable.
+    ScreenCaptureMode_DX11    = 2,  // DX11 capture is fast but depends on DirectX drivers.
+    ScreenCaptureMode_DX11All = 3,  // DX11 capture of all screens, as one virtual desktop.
+    ScreenCaptureMode_WGC     = 4,  // Windows.Graphics.Capture, on Windows 10 1903 or later.
+    ScreenCaptureMode_Auto    = 5   // The first of WGC, DX11 and GDI that works well enough.
+};
+
+//
+// The interface of a screen capture engine.  Each engine
+// captures frames into a frame buffer in system memory; the
+// optional features have default implementations here that
+// report them as unsupported.  See ScreenCapture for what each
+// member does.
+//
+class ScreenCaptureBackend
+{
+public:
+    virtual ~ScreenCaptureBackend() { }
+
+    virtual ScreenCaptureMode GetMode() const = 0;
+
+    virtual bool Startup() = 0;
+    virtual void Shutdown() = 0;
+    virtual bool CaptureFrame() = 0;
+
+    // Engines that can't wait for the screen to change just
+    // capture a frame right away.
+    virtual ScreenCaptureResult WaitForFrame(unsigned /*timeoutMs*/)
+    {
+        return CaptureFrame() ? ScreenCaptureResult_Frame : ScreenCaptureResult_Error;
+    }
+
+    //
+    // Makes the frame in the frame buffer the captured frame
+    // again, with all of it reported as changed, so it can be
+    // handed out although the screen didn't change.  Returns
+    // false if the frame buffer holds no complete frame.
+    // Engines that keep the last frame's size when nothing
+    // changed only have to check that there is one.
+    //
+    virtual bool RestoreLastFrame() { return GetFrameWidth() > 0 && GetFrameBuffer() != nullptr; }
+
+    virtual bool SetPipelinedReadback(bool /*enable*/) { return false; }
+    virtual bool SetIncrementalCapture(bool /*enable*/) { return false; }
+    virtual bool SetCursorCapture(bool enable) { return !enable; }
+    virtual bool SetCaptureRegion(const ScreenCaptureRect & /*region*/) { return false; }
+    virtual void ClearCaptureRegion() { }
+
+    //
+    // Captures the contents of a window itself, rather than the
+    // area of the screen it covers, for engines that can.  The
+    // handle is a void pointer so that this header doesn't need
+    // windows.h.  Returns false if not supported, in which case
+    // ScreenCapture follows the window with SetCaptureRegion().
+    //
+    virtual bool SetCaptureWindow(void * /*hwnd*/) { return false; }
+
+    virtual bool SetOutputFormat(ScreenCaptureFormat format) { return format == ScreenCaptureFormat_BGRA32; }
+    virtual ScreenCaptureFormat GetFrameFormat() const { return ScreenCaptureFormat_BGRA32; }
+    virtual bool SetOutputSize(unsigned /*width*/, unsigned /*height*/) { return false; }
+
+    virtual ID3D11Device *GetD3DDevice() const { return nullptr; }
+
+    virtual unsigned GetFrameWidth()  const = 0;
+    virtual unsigned GetFrameHeight() const = 0;
+    virtual unsigned GetFrameDepth()  const = 0;
+    virtual unsigned GetFrameStride() const = 0;
+    virtual int64_t  GetFrameTime()   const = 0;
+    virtual bool     IsFrameBottomUp() const { return false; }
+
+    virtual size_t GetFrameBufferSize() const
+    {
+        return static_cast<size_t>(GetFrameStride()) * GetFrameHeight();
+    }
+    virtual const uint8_t *GetFrameBuffer() const = 0;
+    virtual FrameHandle GetFrameHandle() const { return FrameHandle(); }
+    virtual void SetMaxFrameBuffers(unsigned) { }
+    virtual ScreenCaptureTimings GetFrameTimings() const { return ScreenCaptureTimings(); }
+    virtual const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const = 0;
+
+    // Engines that capture one screen cover the whole frame
+    // buffer with it.
+    virtual unsigned GetOutputCount() const { return 1; }
+    virtual ScreenCaptureRect GetOutputRect(unsigned /*index*/) const
+    {
+        ScreenCaptureRect r;
+        r.right  = static_cast<int>(GetFrameWidth());
+        r.bottom = static_cast<int>(GetFrameHeight());
+        return r;
+    }
+};
+
+//
+// Returns the name of a capture mode, such as "DX11".
+//
+const char *GetScreenCaptureModeName(ScreenCaptureMode mode);
+
+//
+// Creates the capture engine for a mode, without starting it.
+// Returns nullptr for ScreenCaptureMode_Invalid and
+// ScreenCaptureMode_Auto; see StartScreenCaptureBackend().
+//
+std::unique_ptr<ScreenCaptureBackend> CreateScreenCaptureBackend(ScreenCaptureMode mode);
+
+//
+// Creates and starts the capture engine for a mode.  For
+// ScreenCaptureMode_Auto, tries WGC, then DX11, then GDI, and
+// keeps the first one that starts and whose first frame is
+// captured quickly enough for 'minFps' frames per second.  That
+// first frame is left in the engine's frame buffer, and
+// 'firstFrame' tells whether there is one.  Returns nullptr if
+// no engine could be started.
+//
+std::unique_ptr<ScreenCaptureBackend> StartScreenCaptureBackend(
+    ScreenCaptureMode mode, unsigned minFps, bool &firstFrame);
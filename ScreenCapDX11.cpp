@@ -44,8 +44,12 @@
 //--------------------------------------------------------------------
 
 #include "ScreenCapDX11.h"
+#include "ScreenCapTrace.h"
+#include "PixelOps.h"
+#include <d3d10.h>
 
 #pragma comment(lib, "D3D11.lib")
+#pragma comment(lib, "DXGI.lib")
 
 //--------------------------------------------------------------------
 // Local helpers
@@ -65,230 +69,1697 @@ static bool IsFormat32bit(int fmt)
     return true;
 }
 
+// Converts a Windows RECT to a ScreenCaptureRect.
+static ScreenCaptureRect ToCaptureRect(const RECT &r)
+{
+    ScreenCaptureRect cr;
+    cr.left   = r.left;
+    cr.top    = r.top;
+    cr.right  = r.right;
+    cr.bottom = r.bottom;
+    return cr;
+}
+
+// Converts a rectangle of an image of one size to the matching
+// rectangle of the image scaled to another size.  It is grown
+// by a pixel on each side, because the scaling filter blends
+// neighboring pixels, and clipped to the scaled image.
+static RECT ScaleRect(const RECT &r, UINT srcWidth, UINT srcHeight, UINT dstWidth, UINT dstHeight)
+{
+    const LONG left   = static_cast<LONG>(static_cast<int64_t>(r.left) * dstWidth / srcWidth) - 1;
+    const LONG top    = static_cast<LONG>(static_cast<int64_t>(r.top) * dstHeight / srcHeight) - 1;
+    const LONG right  = static_cast<LONG>((static_cast<int64_t>(r.right) * dstWidth + srcWidth - 1) / srcWidth) + 1;
+    const LONG bottom = static_cast<LONG>((static_cast<int64_t>(r.bottom) * dstHeight + srcHeight - 1) / srcHeight) + 1;
+    const RECT scaled =
+    {
+        max(left, 0L), max(top, 0L),
+        min(right, static_cast<LONG>(dstWidth)), min(bottom, static_cast<LONG>(dstHeight))
+    };
+    return scaled;
+}
+
+// Blends a pixel of a color pointer shape, which has straight
+// alpha, over a screen pixel.  The screen pixel keeps its own
+// alpha byte.
+static uint32_t BlendPointerPixel(uint32_t src, uint32_t dst)
+{
+    const uint32_t a = src >> 24;
+    if (a == 0xff)
+        return (dst & 0xff000000) | (src & 0x00ffffff);
+    if (a == 0)
+        return dst;
+
+    uint32_t out = dst & 0xff000000;
+    for (int shift = 0; shift < 24; shift += 8)
+    {
+        const uint32_t s = (src >> shift) & 0xff;
+        const uint32_t d = (dst >> shift) & 0xff;
+        out |= ((s * a + d * (255 - a) + 127) / 255) << shift;
+    }
+    return out;
+}
+
+// Returns true if nobody but the caller holds a reference to
+// the given COM object.
+static bool IsUnreferenced(IUnknown *p)
+{
+    p->AddRef();
+    return p->Release() == 1;
+}
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
 //--------------------------------------------------------------------
 // Public members
 //--------------------------------------------------------------------
 
 //
-// Begins a screen capture session.  Returns true if successful.
+// Begins a screen capture session on the given output of the
+// given adapter.  Returns true if successful.
+//
+bool ScreenCaptureDX11::Startup(unsigned adapterIndex, unsigned outputIndex)
+{
+    m_frameBuffer.Reset();
+    m_frameBufferValid = false;
+    m_frameDirtyRects.clear();
+    m_dirtyRectsUnreported = false;
+    m_frameWidth = m_frameHeight = m_frameDepth = m_frameStride = 0;
+    m_outputDesc = {};
+    m_outputIndex = outputIndex;
+    m_modeChanged = false;
+    m_cursorShapeInfo = {};
+    m_cursorVisible = m_cursorDrawn = false;
+    m_bufferWidth = m_bufferHeight = m_bufferDepth = m_bufferStride = 0;
+
+    // The default adapter is the first one, but it is created
+    // without naming it so that WARP and the reference driver
+    // can be tried if there is no hardware driver.
+    CComPtr<IDXGIAdapter1> adapter;
+    if (adapterIndex != 0)
+    {
+        CComPtr<IDXGIFactory1> factory;
+        if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), reinterpret_cast<void**>(&factory))) ||
+            FAILED(factory->EnumAdapters1(adapterIndex, &adapter)))
+        {
+            return false;
+        }
+    }
+
+    if (!InitializeDevice(adapter))
+        return false;
+
+    if (!StartOutputDuplication(m_device, outputIndex, m_outputDuplication))
+        return false;
+
+    return true;
+}
+
+//
+// Lists the outputs of all adapters that are attached to the
+// desktop.  Returns true if at least one was found.
+//
+bool ScreenCaptureDX11::EnumerateOutputs(std::vector<ScreenCaptureOutputInfo> &outputs)
+{
+    outputs.clear();
+
+    CComPtr<IDXGIFactory1> factory;
+    if (FAILED(CreateDXGIFactory1(__uuidof(IDXGIFactory1), reinterpret_cast<void**>(&factory))))
+        return false;
+
+    CComPtr<IDXGIAdapter1> adapter;
+    for (UINT iadapter = 0; factory->EnumAdapters1(iadapter, &adapter) != DXGI_ERROR_NOT_FOUND; iadapter++)
+    {
+        CComPtr<IDXGIOutput> output;
+        for (UINT ioutput = 0; adapter->EnumOutputs(ioutput, &output) != DXGI_ERROR_NOT_FOUND; ioutput++)
+        {
+            DXGI_OUTPUT_DESC desc;
+            if (SUCCEEDED(output->GetDesc(&desc)) && desc.AttachedToDesktop)
+            {
+                ScreenCaptureOutputInfo info;
+                info.adapterIndex = iadapter;
+                info.outputIndex  = ioutput;
+                info.desktopRect  = ToCaptureRect(desc.DesktopCoordinates);
+                wcsncpy_s(info.deviceName, desc.DeviceName, _TRUNCATE);
+                outputs.push_back(info);
+            }
+            output.Release();
+        }
+        adapter.Release();
+    }
+
+    return !outputs.empty();
+}
+
+//
+// Stops the screen capture session and releases any
+// allocated resources.
+//
+void ScreenCaptureDX11::Shutdown()
+{
+    ReleaseHeldFrame();
+    ReleaseStagingTextures();
+    ReleaseVideoProcessor();
+    m_videoContext.Release();
+    m_videoDevice.Release();
+    m_gpuTextures.clear();
+
+    if (m_outputDuplication)
+        m_outputDuplication.Release();
+
+    if (m_device)
+        m_device.Release();
+
+    if (m_deviceContext)
+        m_deviceContext.Release();
+
+    m_frameBuffer.Reset();
+    m_scaleBuffer.clear();
+    m_frameBufferValid = false;
+    m_frameDirtyRects.clear();
+    m_dirtyRectsUnreported = false;
+}
+
+//
+// Attempts to capture the next frame from the screen.
+// The captured image is placed in an internal frame
+// buffer that can be accessed via GetCapturedFrame().
+// Returns true if successful.
+//
+// May return false because of an error or, more
+// typically, because no pixels have changed on
+// the screen since the last frame was captured,
+// so no new frame is available yet.
+//
+bool ScreenCaptureDX11::CaptureFrame()
+{
+    const ScreenCaptureResult result = WaitForFrame(DefaultFrameTimeout);
+    return result == ScreenCaptureResult_Frame || result == ScreenCaptureResult_ModeChanged;
+}
+
+//
+// Waits up to 'timeoutMs' milliseconds for the screen to
+// change, then captures the new frame into the internal
+// frame buffer.  If the output duplication was lost, it is
+// recreated on the same device and the wait is retried once.
+//
+ScreenCaptureResult ScreenCaptureDX11::WaitForFrame(unsigned timeoutMs)
+{
+    // Assume we won't capture an image.
+    m_frameWidth = m_frameHeight = m_frameStride = m_frameDepth = 0;
+
+    if (!m_device || !m_deviceContext)
+        return ScreenCaptureResult_Error; // Not initialized yet!
+
+    // The duplication was lost by an earlier call and couldn't
+    // be recreated yet.
+    if (!m_outputDuplication && !RestartOutputDuplication(timeoutMs))
+        return ScreenCaptureResult_NoChange;
+
+    HRESULT hr = S_OK;
+    ScreenCaptureResult result = CaptureNextFrame(timeoutMs, hr);
+    if (hr == DXGI_ERROR_ACCESS_LOST)
+    {
+        SCREENCAP_TRACE("DuplicationLost",
+            TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+            TraceLoggingUInt32(m_outputIndex, "Output"));
+        LoseOutputDuplication();
+        if (!RestartOutputDuplication(timeoutMs))
+            return ScreenCaptureResult_NoChange;
+
+        result = CaptureNextFrame(timeoutMs, hr);
+        if (hr == DXGI_ERROR_ACCESS_LOST)
+        {
+            LoseOutputDuplication();
+            return ScreenCaptureResult_NoChange;
+        }
+    }
+
+    if (result == ScreenCaptureResult_Frame && m_modeChanged)
+    {
+        m_modeChanged = false;
+        result = ScreenCaptureResult_ModeChanged;
+    }
+
+    // The caller gets this frame's changed regions now, so the
+    // next frame starts a new list.
+    if (result == ScreenCaptureResult_Frame || result == ScreenCaptureResult_ModeChanged)
+        m_dirtyRectsUnreported = false;
+    return result;
+}
+
+//
+// Makes the frame buffer the captured frame again.  WaitForFrame()
+// forgets the frame size when nothing changed, but the buffer
+// still holds the last frame in full, as RedrawCursor() relies
+// on too.
+//
+bool ScreenCaptureDX11::RestoreLastFrame()
+{
+    if (!m_frameBufferValid)
+        return false;
+
+    m_frameWidth  = m_bufferWidth;
+    m_frameHeight = m_bufferHeight;
+    m_frameDepth  = m_bufferDepth;
+    m_frameStride = m_bufferStride;
+
+    ScreenCaptureRect whole;
+    whole.right  = static_cast<int>(m_frameWidth);
+    whole.bottom = static_cast<int>(m_frameHeight);
+    m_frameDirtyRects.assign(1, whole);
+    m_dirtyRectsUnreported = false;
+    UpdateFrameInfo();
+    return true;
+}
+
+//
+// Does the work of WaitForFrame() with the current output
+// duplication.  If ScreenCaptureResult_Error is returned
+// because DXGI failed, 'hr' receives its error code.
+//
+// In pipelined mode, the frame returned is the one that
+// was acquired by the previous call, if any.  While such a
+// frame is waiting, we don't block for a new one.
+//
+ScreenCaptureResult ScreenCaptureDX11::CaptureNextFrame(unsigned timeoutMs, HRESULT &hr)
+{
+    hr = S_OK;
+
+    // In pipelined mode the previous frame is held until now,
+    // so the GPU copy we queued from it had time to complete.
+    ReleaseHeldFrame();
+
+    if (m_stagingPending)
+        timeoutMs = 0;
+
+    // Wait for a new screen image.
+    m_timings = ScreenCaptureTimings();
+    CComPtr<ID3D11Texture2D> cacquiredDesktopImage;
+    DXGI_OUTDUPL_FRAME_INFO finfo = {};
+    const int64_t acquireStart = GetQpc();
+    hr = AcquireNextFrame(m_outputDuplication, timeoutMs, m_cursorEnabled,
+                    cacquiredDesktopImage, finfo);
+    m_timings.acquire = GetQpc() - acquireStart;
+    if (hr == S_FALSE)
+    {
+        // Only the mouse pointer changed.  A frame queued by an
+        // earlier call gets the pointer when it is read back;
+        // otherwise the pointer is moved in the frame buffer.
+        hr = S_OK;
+        if (ReadbackPendingFrame(true) || RedrawCursor(finfo.LastMouseUpdateTime.QuadPart))
+            return ScreenCaptureResult_Frame;
+        return ScreenCaptureResult_NoChange;
+    }
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+    {
+        // No new frame, but a frame queued by an earlier call may
+        // still be waiting to be read back.
+        return ReadbackPendingFrame(true) ?
+            ScreenCaptureResult_Frame : ScreenCaptureResult_NoChange;
+    }
+    if (FAILED(hr))
+        return ScreenCaptureResult_Error;
+
+    m_frameHeld = true;
+
+    // Make sure the captured image is 32-bit.
+    DXGI_OUTDUPL_DESC desc;
+    m_outputDuplication->GetDesc(&desc);
+    if (!IsFormat32bit(desc.ModeDesc.Format))
+    {
+        // Incompatible image format!
+        SCREENCAP_TRACE("CaptureFailed",
+            TraceLoggingLevel(WINEVENT_LEVEL_ERROR),
+            TraceLoggingString("Unsupported format", "Reason"),
+            TraceLoggingUInt32(static_cast<UINT>(desc.ModeDesc.Format), "Format"));
+        ReleaseHeldFrame();
+        return ScreenCaptureResult_Error;
+    }
+
+    // Work out the size and format of the frames we read back.
+    // NV12 frames must have even dimensions.  If the video
+    // processor can't do the conversion or scaling, the frames
+    // are read back as they are and converted or scaled after
+    // the readback.  Only the capture region is copied out of
+    // the acquired image.
+    D3D11_TEXTURE2D_DESC acquiredDesc;
+    cacquiredDesktopImage->GetDesc(&acquiredDesc);
+    const D3D11_BOX box = GetCaptureBox(acquiredDesc.Width, acquiredDesc.Height);
+    const bool cropped = box.left != 0 || box.top != 0 ||
+        box.right != acquiredDesc.Width || box.bottom != acquiredDesc.Height;
+    const UINT sourceWidth  = box.right - box.left;
+    const UINT sourceHeight = box.bottom - box.top;
+    UINT outputWidth  = sourceWidth;
+    UINT outputHeight = sourceHeight;
+    DXGI_FORMAT outputFormat = acquiredDesc.Format;
+    const bool nv12 = (m_outputFormat == ScreenCaptureFormat_NV12);
+    const UINT minSize = nv12 ? 2 : 1;
+    if (outputWidth < minSize || outputHeight < minSize)
+    {
+        // The capture region is off this output.
+        ReleaseHeldFrame();
+        return ScreenCaptureResult_NoChange;
+    }
+
+    const bool scale = IsScaled(sourceWidth, sourceHeight);
+    bool convert = (nv12 || scale) && m_videoDevice;
+    if (convert)
+    {
+        UINT vpWidth  = scale ? m_scaledWidth  : outputWidth;
+        UINT vpHeight = scale ? m_scaledHeight : outputHeight;
+        const DXGI_FORMAT vpFormat = nv12 ? DXGI_FORMAT_NV12 : acquiredDesc.Format;
+        if (nv12)
+        {
+            vpWidth  &= ~1u;
+            vpHeight &= ~1u;
+        }
+        if (UpdateVideoProcessor(acquiredDesc, vpWidth, vpHeight, vpFormat))
+        {
+            outputWidth  = vpWidth;
+            outputHeight = vpHeight;
+            outputFormat = vpFormat;
+        }
+        else
+        {
+            // Don't try the video processor again.
+            m_videoContext.Release();
+            m_videoDevice.Release();
+            convert = false;
+        }
+    }
+
+    // Make sure the staging textures match the current
+    // display mode.
+    if (!UpdateStagingTextures(outputWidth, outputHeight, outputFormat))
+    {
+        SCREENCAP_TRACE("CaptureFailed",
+            TraceLoggingLevel(WINEVENT_LEVEL_ERROR),
+            TraceLoggingString("Staging textures", "Reason"));
+        ReleaseHeldFrame();
+        return ScreenCaptureResult_Error;
+    }
+
+    // If every slot is still waiting to be read back, make
+    // room by reading back the oldest one.  Its pixels are
+    // superseded by the frame we just acquired.
+    if (m_stagingPending == NumStagingTextures)
+        ReadbackPendingFrame(true);
+
+    // Queue a copy of the captured texture to the next
+    // staging texture in the ring.
+    const int64_t copyStart = GetQpc();
+    StagingSlot &slot = m_staging[m_stagingWrite];
+    if (convert)
+    {
+        if (!RunVideoProcessor(cacquiredDesktopImage, box, scale))
+        {
+            SCREENCAP_TRACE("CaptureFailed",
+                TraceLoggingLevel(WINEVENT_LEVEL_ERROR),
+                TraceLoggingString("Video processor", "Reason"));
+            ReleaseHeldFrame();
+            return ScreenCaptureResult_Error;
+        }
+        m_deviceContext->CopyResource(slot.texture, m_vpOutput);
+    }
+    else if (cropped)
+    {
+        m_deviceContext->CopySubresourceRegion(slot.texture, 0, 0, 0, 0,
+            cacquiredDesktopImage, 0, &box);
+    }
+    else
+    {
+        m_deviceContext->CopyResource(slot.texture, cacquiredDesktopImage);
+    }
+    m_timings.gpuCopy = GetQpc() - copyStart;
+    m_stagingWrite = (m_stagingWrite + 1) % NumStagingTextures;
+    slot.fullFrame = !GetFrameMetadata(finfo, cropped ? &box : nullptr, slot);
+    slot.presentTime = finfo.LastPresentTime.QuadPart;
+    slot.sourceWidth = sourceWidth;
+    slot.sourceHeight = sourceHeight;
+    slot.pending = true;
+    m_stagingPending++;
+
+    if (!m_pipelined)
+    {
+        // Read the frame back right away, waiting for the
+        // GPU copy to finish.
+        bool ok = ReadbackPendingFrame(true);
+        ReleaseHeldFrame();
+        return ok ? ScreenCaptureResult_Frame : ScreenCaptureResult_Error;
+    }
+
+    // Read back the oldest pending frame.  Only wait for
+    // the GPU if that frame was queued by an earlier call;
+    // the copy we just queued is left for the next call.
+    // A frame that isn't ready yet will be returned by the next
+    // call.
+    return ReadbackPendingFrame(m_stagingPending > 1) ?
+        ScreenCaptureResult_Frame : ScreenCaptureResult_NoChange;
+}
+
+//
+// Attempts to capture the next frame from the screen into a
+// GPU texture, without reading it back to system memory.
+// Returns true if successful.
+//
+bool ScreenCaptureDX11::CaptureFrameTexture(CComPtr<ID3D11Texture2D> &texture)
+{
+    if (texture)
+        texture.Release();
+
+    if (!m_device || !m_deviceContext)
+        return false; // Not initialized yet!
+
+    // Don't wait for a lost duplication to come back; the
+    // next call tries again.
+    if (!m_outputDuplication && !RestartOutputDuplication(0))
+        return false;
+
+    ReleaseHeldFrame();
+
+    // Attempt to capture a new screen image.
+    m_timings = ScreenCaptureTimings();
+    CComPtr<ID3D11Texture2D> cacquiredDesktopImage;
+    DXGI_OUTDUPL_FRAME_INFO finfo = {};
+    const int64_t acquireStart = GetQpc();
+    const HRESULT hr = AcquireNextFrame(m_outputDuplication, DefaultFrameTimeout, false,
+                    cacquiredDesktopImage, finfo);
+    m_timings.acquire = GetQpc() - acquireStart;
+    if (hr == DXGI_ERROR_ACCESS_LOST)
+    {
+        LoseOutputDuplication();
+        RestartOutputDuplication(0);
+        return false;
+    }
+    if (FAILED(hr))
+        return false;
+
+    // This frame's changes never reach the frame buffer.
+    m_frameBufferValid = false;
+
+    D3D11_TEXTURE2D_DESC desc;
+    cacquiredDesktopImage->GetDesc(&desc);
+    const D3D11_BOX box = GetCaptureBox(desc.Width, desc.Height);
+    const bool scale = IsScaled(box.right - box.left, box.bottom - box.top);
+    ID3D11Texture2D *gpuTexture = nullptr;
+    if (IsFormat32bit(desc.Format) && box.right > box.left && box.bottom > box.top)
+    {
+        if (!scale)
+            gpuTexture = GetFreeGpuTexture(box.right - box.left, box.bottom - box.top, desc.Format);
+        else if (UpdateVideoProcessor(desc, m_scaledWidth, m_scaledHeight, desc.Format))
+            gpuTexture = GetFreeGpuTexture(m_scaledWidth, m_scaledHeight, desc.Format);
+    }
+
+    // The acquired image belongs to the output duplication and
+    // must be released, so hand out a copy of the capture region.
+    const int64_t copyStart = GetQpc();
+    if (gpuTexture && scale)
+    {
+        if (RunVideoProcessor(cacquiredDesktopImage, box, true))
+        {
+            m_deviceContext->CopyResource(gpuTexture, m_vpOutput);
+            texture = gpuTexture;
+        }
+    }
+    else if (gpuTexture)
+    {
+        m_deviceContext->CopySubresourceRegion(gpuTexture, 0, 0, 0, 0,
+            cacquiredDesktopImage, 0, &box);
+        texture = gpuTexture;
+    }
+    m_timings.gpuCopy = GetQpc() - copyStart;
+    if (texture)
+        m_frameTime = finfo.LastPresentTime.QuadPart;
+
+    m_outputDuplication->ReleaseFrame();
+    return texture != nullptr;
+}
+
+//
+// Enables or disables pipelined readback.
+//
+bool ScreenCaptureDX11::SetPipelinedReadback(bool enable)
+{
+    if (m_pipelined && !enable)
+    {
+        // Drop anything still queued, so the next call returns
+        // the frame it acquires rather than a stale one.
+        ReleaseHeldFrame();
+        DropPendingFrames();
+    }
+
+    m_pipelined = enable;
+    return true;
+}
+
+//
+// Selects the pixel format of the frame buffer.  Returns false
+// if the format isn't supported.
+//
+bool ScreenCaptureDX11::SetOutputFormat(ScreenCaptureFormat format)
+{
+    if (format != ScreenCaptureFormat_BGRA32 && format != ScreenCaptureFormat_NV12)
+        return false;
+
+    if (format != m_outputFormat)
+    {
+        // Frames already queued are in the old format.
+        ReleaseHeldFrame();
+        ReleaseStagingTextures();
+        m_outputFormat = format;
+    }
+
+    return true;
+}
+
+//
+// Sets the size that frames are scaled to, or goes back to
+// the captured size if both are zero.  Returns false if the
+// size is too small.
+//
+bool ScreenCaptureDX11::SetOutputSize(unsigned width, unsigned height)
+{
+    if (width || height)
+    {
+        if (width < 2 || height < 2)
+            return false;
+        width  &= ~1u;
+        height &= ~1u;
+    }
+
+    if (width != m_scaledWidth || height != m_scaledHeight)
+    {
+        // Frames already queued are the old size.
+        ReleaseHeldFrame();
+        ReleaseStagingTextures();
+        m_scaledWidth  = width;
+        m_scaledHeight = height;
+    }
+
+    return true;
+}
+
+//
+// Sets the part of the screen to capture, in desktop
+// coordinates.  Returns false if the region is empty.
+//
+bool ScreenCaptureDX11::SetCaptureRegion(const ScreenCaptureRect &region)
+{
+    if (region.right <= region.left || region.bottom <= region.top)
+        return false;
+
+    m_region = region;
+    m_regionSet = true;
+    return true;
+}
+
+//
+// Goes back to capturing the whole output.
+//
+void ScreenCaptureDX11::ClearCaptureRegion()
+{
+    m_regionSet = false;
+}
+
+//
+// Enables or disables incremental capture.
+//
+bool ScreenCaptureDX11::SetIncrementalCapture(bool enable)
+{
+    m_incremental = enable;
+    m_frameBufferValid = false;
+    return true;
+}
+
+//
+// Enables or disables drawing the mouse pointer into the
+// frame buffer.
+//
+bool ScreenCaptureDX11::SetCursorCapture(bool enable)
+{
+    if (enable != m_cursorEnabled)
+    {
+        // The frame buffer may hold a pointer that would never
+        // be taken out again, so start over with a full frame.
+        m_cursorEnabled = enable;
+        m_cursorDrawn = false;
+        m_frameBufferValid = false;
+    }
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Initializes a DirectX 11 device so we can use it, on the
+// given adapter or on the default adapter if it is nullptr.
+// Populates m_device and m_deviceContext, and returns
+// true if successful.
+//
+bool ScreenCaptureDX11::InitializeDevice(IDXGIAdapter *adapter)
+{
+    // We will try the driver types in this order.  A device on
+    // a specific adapter has to use the unknown driver type.
+    static const D3D_DRIVER_TYPE defaultDrivers[] =
+    {
+        D3D_DRIVER_TYPE_HARDWARE,
+        D3D_DRIVER_TYPE_WARP,
+        D3D_DRIVER_TYPE_REFERENCE
+    };
+    static const D3D_DRIVER_TYPE adapterDrivers[] =
+    {
+        D3D_DRIVER_TYPE_UNKNOWN
+    };
+    const D3D_DRIVER_TYPE *drivers = adapter ? adapterDrivers : defaultDrivers;
+    const size_t numDrivers = adapter ? _countof(adapterDrivers) : _countof(defaultDrivers);
+
+    // We will try the feature support levels in this order.
+    static const D3D_FEATURE_LEVEL featureLevels[] =
+    {
+        D3D_FEATURE_LEVEL_11_0,
+        D3D_FEATURE_LEVEL_10_1,
+        D3D_FEATURE_LEVEL_10_0,
+        D3D_FEATURE_LEVEL_9_1
+    };
+
+    // Video support lets the device be shared with the Media
+    // Foundation encoders, but not every driver type has it, so
+    // we fall back to creating a device without it.
+    static const UINT creationFlags[] =
+    {
+        D3D11_CREATE_DEVICE_BGRA_SUPPORT | D3D11_CREATE_DEVICE_VIDEO_SUPPORT,
+        0
+    };
+
+    D3D_FEATURE_LEVEL featureLevel;
+    HRESULT hr = E_FAIL;
+
+    for (size_t idriver = 0; idriver < numDrivers; idriver++)
+    {
+        for (const auto &flags : creationFlags)
+        {
+            hr = D3D11CreateDevice(adapter, drivers[idriver], nullptr, flags,
+                    featureLevels, static_cast<UINT>(_countof(featureLevels)),
+                    D3D11_SDK_VERSION, &m_device, &featureLevel,
+                    &m_deviceContext);
+            if (SUCCEEDED(hr) && m_device && m_deviceContext)
+            {
+                // Success.  The device may be used from an encoder
+                // thread too, so turn on multithread protection.
+                CComQIPtr<ID3D10Multithread> multithread(m_device);
+                if (multithread)
+                    multithread->SetMultithreadProtected(TRUE);
+
+                // The video interfaces are only there if the driver
+                // supports video; without them we can't convert to NV12.
+                m_device->QueryInterface(__uuidof(ID3D11VideoDevice),
+                    reinterpret_cast<void **>(&m_videoDevice));
+                m_deviceContext->QueryInterface(__uuidof(ID3D11VideoContext),
+                    reinterpret_cast<void **>(&m_videoContext));
+                return true;
+            }
+
+            if (m_device)
+                m_device.Release();
+            if (m_deviceContext)
+                m_deviceContext.Release();
+        }
+    }
+
+    // Failed on all drivers!
+    return false;
+}
+
+//
+// Copies the image from a staging texture to our internal
+// frame buffer pixel array.  Populates the m_frameXXX members
+// and returns S_OK if successful.  If 'mapFlags' contains
+// D3D11_MAP_FLAG_DO_NOT_WAIT and the GPU has not finished
+// copying to the texture yet, returns DXGI_ERROR_WAS_STILL_DRAWING.
+//
+// In incremental mode, only the regions of the frame buffer
+// that the slot's move and dirty rectangles say have changed
+// are updated.
+//
+HRESULT ScreenCaptureDX11::CopyStagingTextureToMemory(
+    ID3D11DeviceContext *pDeviceContext,
+    const StagingSlot &slot,
+    UINT mapFlags
+    )
+{
+    if (!pDeviceContext || !slot.texture)
+        return E_POINTER;
+
+    D3D11_TEXTURE2D_DESC desc;
+    slot.texture->GetDesc(&desc);
+
+    // Lock the staging texture so we can access its pixel data.
+    const int64_t mapStart = GetQpc();
+    D3D11_MAPPED_SUBRESOURCE res;
+    const auto hr = pDeviceContext->Map(
+        slot.texture,
+        D3D11CalcSubresource(0, 0, 0),
+        D3D11_MAP_READ,
+        mapFlags,
+        &res
+    );
+    if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+    {
+        SCREENCAP_TRACE("MapNotReady",
+            TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE));
+        return hr;
+    }
+    if (FAILED(hr))
+    {
+        SCREENCAP_TRACE("MapFailed",
+            TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+            TraceLoggingHResult(hr, "HResult"));
+        return hr;
+    }
+    const int64_t copyStart = GetQpc();
+    m_timings.map += copyStart - mapStart;
+
+    // NV12 textures have the UV plane right after the Y plane,
+    // and are always copied in full.  NV12 frames that the GPU
+    // didn't convert are converted here instead, and the same
+    // goes for frames that the GPU didn't scale.
+    const bool nv12 = (m_outputFormat == ScreenCaptureFormat_NV12);
+    const bool cpuConvert = nv12 && (desc.Format != DXGI_FORMAT_NV12);
+    const bool scaled = IsScaled(slot.sourceWidth, slot.sourceHeight);
+    const bool cpuScale = scaled &&
+        (desc.Width != m_scaledWidth || desc.Height != m_scaledHeight);
+    const UINT sourceWidth  = desc.Width;
+    const UINT sourceHeight = desc.Height;
+    if (cpuScale)
+    {
+        desc.Width  = m_scaledWidth;
+        desc.Height = m_scaledHeight;
+    }
+    else if (cpuConvert)
+    {
+        desc.Width  &= ~1u;
+        desc.Height &= ~1u;
+    }
+    const UINT frameStride = cpuConvert ? desc.Width :
+        cpuScale ? desc.Width * 4 : res.RowPitch;
+    const size_t frameBytes = nv12 ?
+        static_cast<size_t>(frameStride) * desc.Height * 3 / 2 :
+        static_cast<size_t>(frameStride) * desc.Height;
+
+    // We can only update the frame buffer in place if it holds
+    // the previous frame in exactly the same layout, and the
+    // rectangles match its pixels one for one.
+    const bool incremental = m_incremental && m_frameBufferValid &&
+        !slot.fullFrame && !nv12 && !scaled && m_frameBuffer.GetSize() == frameBytes;
+
+    // Somebody may still hold the last frame, in which case this
+    // one goes into another buffer.
+    if (!PrepareFrameBuffer(frameBytes, incremental))
+    {
+        SCREENCAP_TRACE("FrameBufferUnavailable",
+            TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+            TraceLoggingUInt64(frameBytes, "Bytes"));
+        pDeviceContext->Unmap(slot.texture, 0);
+        return E_OUTOFMEMORY;
+    }
+
+    // Take the pointer out of the frame buffer before the
+    // changes are applied, since moves would carry it along.
+    // The caller's copy of the last frame has it too, so its
+    // area is dirty.
+    const bool cursorWasDrawn = m_cursorDrawn;
+    const ScreenCaptureRect oldCursorRect = m_cursorRect;
+    RestoreCursorArea(incremental);
+
+    m_frameWidth     = static_cast<int>(desc.Width);
+    m_frameHeight    = static_cast<int>(desc.Height);
+    m_frameStride    = frameStride;
+    m_frameDepth     = nv12 ? 12 : 32;
+    m_frameTime      = slot.presentTime;
+
+    if (!m_dirtyRectsUnreported)
+        m_frameDirtyRects.clear();
+    m_dirtyRectsUnreported = true;
+    if (cursorWasDrawn && !slot.fullFrame)
+        m_frameDirtyRects.push_back(oldCursorRect);
+    size_t copiedBytes = incremental ? 0 : frameBytes;
+    if (incremental)
+    {
+        // Moves must be applied before the dirty rectangles.
+        ApplyMoveRects(slot.moveRects);
+
+        // Copy only the rectangles that changed.
+        auto copyRect = [&](const RECT &r)
+        {
+            const LONG left   = max(r.left, 0L);
+            const LONG top    = max(r.top, 0L);
+            const LONG right  = min(r.right, static_cast<LONG>(m_frameWidth));
+            const LONG bottom = min(r.bottom, static_cast<LONG>(m_frameHeight));
+            if (left >= right || top >= bottom)
+                return;
+
+            const size_t offset = top * m_frameStride + left * sizeof(uint32_t);
+            const size_t bytes  = (right - left) * sizeof(uint32_t);
+            copiedBytes += bytes * (bottom - top);
+            const uint8_t *src = static_cast<const uint8_t *>(res.pData) + offset;
+            uint8_t *dst = m_frameBuffer.GetData() + offset;
+            for (LONG y = top; y < bottom; y++)
+            {
+                memcpy(dst, src, bytes);
+                src += m_frameStride;
+                dst += m_frameStride;
+            }
+
+            const RECT clipped = { left, top, right, bottom };
+            m_frameDirtyRects.push_back(ToCaptureRect(clipped));
+        };
+
+        for (const auto &move : slot.moveRects)
+            m_frameDirtyRects.push_back(ToCaptureRect(move.DestinationRect));
+        for (const auto &r : slot.dirtyRects)
+            copyRect(r);
+    }
+    else
+    {
+        // Copy the texture's pixel data into our image buffer.
+        const uint8_t *pixels = static_cast<const uint8_t *>(res.pData);
+        if (cpuScale && cpuConvert)
+        {
+            const UINT scaleStride = desc.Width * 4;
+            m_scaleBuffer.resize(static_cast<size_t>(scaleStride) * desc.Height);
+            PixelOps::ScaleImage(m_scaleBuffer.data(), scaleStride, desc.Width, desc.Height,
+                pixels, res.RowPitch, sourceWidth, sourceHeight, m_scaleBuffers);
+
+            uint8_t *pY = m_frameBuffer.GetData();
+            PixelOps::BGRAToNV12(pY, frameStride,
+                pY + static_cast<size_t>(frameStride) * desc.Height, frameStride,
+                m_scaleBuffer.data(), scaleStride, desc.Width, desc.Height);
+        }
+        else if (cpuScale)
+        {
+            PixelOps::ScaleImage(m_frameBuffer.GetData(), frameStride, desc.Width, desc.Height,
+                pixels, res.RowPitch, sourceWidth, sourceHeight, m_scaleBuffers);
+        }
+        else if (cpuConvert)
+        {
+            uint8_t *pY = m_frameBuffer.GetData();
+            PixelOps::BGRAToNV12(pY, frameStride,
+                pY + static_cast<size_t>(frameStride) * desc.Height, frameStride,
+                static_cast<const uint8_t *>(res.pData), res.RowPitch,
+                desc.Width, desc.Height);
+        }
+        else
+        {
+            memcpy(m_frameBuffer.GetData(), res.pData, frameBytes);
+        }
+
+        if (slot.fullFrame)
+        {
+            ScreenCaptureRect cr;
+            cr.right  = m_frameWidth;
+            cr.bottom = m_frameHeight;
+            m_frameDirtyRects.push_back(cr);
+        }
+        else
+        {
+            // Still report what changed, for the caller's benefit,
+            // in the coordinates of the scaled frame if need be.
+            auto report = [&](const RECT &r)
+            {
+                m_frameDirtyRects.push_back(ToCaptureRect(scaled ?
+                    ScaleRect(r, slot.sourceWidth, slot.sourceHeight, m_frameWidth, m_frameHeight) : r));
+            };
+            for (const auto &move : slot.moveRects)
+                report(move.DestinationRect);
+            for (const auto &r : slot.dirtyRects)
+                report(r);
+        }
+    }
+    m_frameBufferValid = true;
+    m_bufferWidth  = m_frameWidth;
+    m_bufferHeight = m_frameHeight;
+    m_bufferDepth  = m_frameDepth;
+    m_bufferStride = m_frameStride;
+
+    if (m_cursorEnabled)
+        DrawCursor();
+    UpdateFrameInfo();
+
+    pDeviceContext->Unmap(slot.texture, 0);
+    m_timings.copy += GetQpc() - copyStart;
+
+    SCREENCAP_TRACE("FrameReadBack",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingUInt64(copiedBytes, "BytesCopied"),
+        TraceLoggingUInt32(static_cast<UINT>(m_frameDirtyRects.size()), "DirtyRects"),
+        TraceLoggingBool(incremental, "Incremental"),
+        TraceLoggingInt64(m_timings.map, "MapTicks"),
+        TraceLoggingInt64(m_timings.copy, "CopyTicks"));
+
+    return S_OK;
+}
+
+//
+// Makes sure m_frameBuffer is a buffer of the given size that
+// nobody else holds, so it can be written.  If a consumer
+// still holds the current one, it is left to them and another
+// is taken from the pool, with the current pixels copied over
+// if 'keepContents' is true.  Returns false if the pool has no
+// buffer to spare.
+//
+bool ScreenCaptureDX11::PrepareFrameBuffer(size_t bytes, bool keepContents)
+{
+    if (m_frameBuffer && m_frameBuffer.GetSize() == bytes && !m_frameBuffer.IsShared())
+        return true;
+
+    FrameHandle buffer = m_framePool.Allocate(bytes);
+    if (!buffer)
+        return false;
+    if (keepContents && m_frameBuffer.GetSize() == bytes)
+        memcpy(buffer.GetData(), m_frameBuffer.GetData(), bytes);
+    m_frameBuffer = std::move(buffer);
+    return true;
+}
+
+//
+// Describes the captured frame in its buffer, for whoever gets
+// the buffer from GetFrameHandle().
+//
+void ScreenCaptureDX11::UpdateFrameInfo()
+{
+    FrameInfo info;
+    info.width  = m_frameWidth;
+    info.height = m_frameHeight;
+    info.stride = m_frameStride;
+    info.depth  = m_frameDepth;
+    info.format = m_outputFormat;
+    info.time   = m_frameTime;
+    m_frameBuffer.SetInfo(info);
+}
+
+//
+// Moves regions of the frame buffer as described by DXGI move
+// rectangles.  Each destination rectangle receives the pixels
+// found at its source point in the previous frame.
+//
+void ScreenCaptureDX11::ApplyMoveRects(
+    const std::vector<DXGI_OUTDUPL_MOVE_RECT> &moveRects
+    )
+{
+    for (const auto &move : moveRects)
+    {
+        const RECT &d = move.DestinationRect;
+        const LONG width  = d.right - d.left;
+        const LONG height = d.bottom - d.top;
+        if (width <= 0 || height <= 0 ||
+            d.left < 0 || d.top < 0 ||
+            move.SourcePoint.x < 0 || move.SourcePoint.y < 0 ||
+            d.right  > static_cast<LONG>(m_frameWidth) ||
+            d.bottom > static_cast<LONG>(m_frameHeight) ||
+            move.SourcePoint.x + width  > static_cast<LONG>(m_frameWidth) ||
+            move.SourcePoint.y + height > static_cast<LONG>(m_frameHeight))
+        {
+            // Bogus move; the next full frame will fix things up.
+            m_frameBufferValid = false;
+            continue;
+        }
+
+        // Walk the scanlines in the direction that doesn't overwrite
+        // source pixels before they are moved.  memmove() takes care
+        // of overlap within a scanline.
+        const size_t bytes = width * sizeof(uint32_t);
+        const bool bottomUp = d.top > move.SourcePoint.y;
+        for (LONG i = 0; i < height; i++)
+        {
+            const LONG row = bottomUp ? height - 1 - i : i;
+            uint8_t *dst = m_frameBuffer.GetData() +
+                (d.top + row) * m_frameStride + d.left * sizeof(uint32_t);
+            const uint8_t *src = m_frameBuffer.GetData() +
+                (move.SourcePoint.y + row) * m_frameStride +
+                move.SourcePoint.x * sizeof(uint32_t);
+            memmove(dst, src, bytes);
+        }
+    }
+}
+
+//
+// Records the pointer position and shape reported with a frame
+// that is still held.  The shape is only fetched when DXGI
+// says it changed.  Returns true if the drawn pointer may have
+// changed, which is the case if it moved or changed shape
+// while visible, or was just shown or hidden.
+//
+bool ScreenCaptureDX11::UpdateCursor(const DXGI_OUTDUPL_FRAME_INFO &finfo)
+{
+    bool changed = false;
+    if (finfo.PointerShapeBufferSize != 0)
+    {
+        if (m_cursorShape.size() < finfo.PointerShapeBufferSize)
+            m_cursorShape.resize(finfo.PointerShapeBufferSize);
+
+        UINT required = 0;
+        if (FAILED(m_outputDuplication->GetFramePointerShape(
+                static_cast<UINT>(m_cursorShape.size()), m_cursorShape.data(),
+                &required, &m_cursorShapeInfo)))
+        {
+            // Leave the pointer out until we get a good shape.
+            m_cursorShapeInfo = {};
+        }
+        changed = m_cursorVisible;
+    }
+
+    // The position is only valid if the mouse was updated.
+    if (finfo.LastMouseUpdateTime.QuadPart != 0)
+    {
+        const bool visible = finfo.PointerPosition.Visible != FALSE;
+        if (visible || m_cursorVisible)
+            changed = true;
+        m_cursorVisible  = visible;
+        m_cursorPosition = finfo.PointerPosition.Position;
+    }
+
+    return changed;
+}
+
+//
+// Draws the mouse pointer into the frame buffer, first saving
+// the pixels it covers so RestoreCursorArea() can put them
+// back.  The area it covers is added to the dirty rectangles.
+// Nothing is drawn if the pointer is hidden, off the frame, or
+// the frame isn't 32-bit.
+//
+void ScreenCaptureDX11::DrawCursor()
+{
+    m_cursorDrawn = false;
+    const DXGI_OUTDUPL_POINTER_SHAPE_INFO &info = m_cursorShapeInfo;
+    if (!m_cursorVisible || info.Width == 0 || m_bufferDepth != 32)
+        return;
+
+    // Monochrome shapes are an AND mask followed by an XOR mask
+    // of the same size.
+    const bool mono = (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_MONOCHROME);
+    const LONG width  = static_cast<LONG>(info.Width);
+    const LONG height = static_cast<LONG>(mono ? info.Height / 2 : info.Height);
+    if (static_cast<size_t>(info.Pitch) * (mono ? height * 2 : height) > m_cursorShape.size())
+        return;
+
+    // Work out where the shape goes in the frame, which may be
+    // a region of the output and may be scaled.
+    const RECT &output = m_outputDesc.DesktopCoordinates;
+    const D3D11_BOX box = GetCaptureBox(static_cast<UINT>(output.right - output.left),
+                                        static_cast<UINT>(output.bottom - output.top));
+    const LONG sourceWidth  = static_cast<LONG>(box.right - box.left);
+    const LONG sourceHeight = static_cast<LONG>(box.bottom - box.top);
+    if (sourceWidth < 1 || sourceHeight < 1)
+        return;
+    LONG x = m_cursorPosition.x - static_cast<LONG>(box.left);
+    LONG y = m_cursorPosition.y - static_cast<LONG>(box.top);
+    if (IsScaled(static_cast<UINT>(sourceWidth), static_cast<UINT>(sourceHeight)))
+    {
+        x = static_cast<LONG>(static_cast<int64_t>(x) * static_cast<LONG>(m_bufferWidth) / sourceWidth);
+        y = static_cast<LONG>(static_cast<int64_t>(y) * static_cast<LONG>(m_bufferHeight) / sourceHeight);
+    }
+
+    const LONG left   = max(x, 0L);
+    const LONG top    = max(y, 0L);
+    const LONG right  = min(x + width, static_cast<LONG>(m_bufferWidth));
+    const LONG bottom = min(y + height, static_cast<LONG>(m_bufferHeight));
+    if (left >= right || top >= bottom)
+        return;
+
+    // Save what's underneath.
+    const size_t rowBytes = static_cast<size_t>(right - left) * 4;
+    uint8_t *origin = m_frameBuffer.GetData() + top * m_bufferStride + left * 4;
+    m_cursorSaved.resize(rowBytes * (bottom - top));
+    PixelOps::CopyImage(m_cursorSaved.data(), rowBytes, origin, m_bufferStride,
+        rowBytes, bottom - top);
+
+    const uint8_t *shape = m_cursorShape.data();
+    for (LONG py = top; py < bottom; py++)
+    {
+        uint32_t *dst = reinterpret_cast<uint32_t *>(m_frameBuffer.GetData() + py * m_bufferStride);
+        const LONG sy = py - y;
+        for (LONG px = left; px < right; px++)
+        {
+            const LONG sx = px - x;
+            uint32_t &d = dst[px];
+            if (mono)
+            {
+                // The pixel is (screen AND mask) XOR mask.
+                const uint8_t bit = static_cast<uint8_t>(0x80 >> (sx & 7));
+                const uint32_t andMask = (shape[sy * info.Pitch + sx / 8] & bit) ? 0xffffffff : 0;
+                const uint32_t xorMask = (shape[(sy + height) * info.Pitch + sx / 8] & bit) ? 0xffffffff : 0;
+                d = (d & 0xff000000) | (((d & andMask) ^ xorMask) & 0x00ffffff);
+            }
+            else
+            {
+                const uint32_t s = *reinterpret_cast<const uint32_t *>(shape + sy * info.Pitch + sx * 4);
+                if (info.Type == DXGI_OUTDUPL_POINTER_SHAPE_TYPE_COLOR)
+                    d = BlendPointerPixel(s, d);
+                else if (s >> 24)
+                    d ^= s & 0x00ffffff;  // Masked color: XOR with the screen.
+                else
+                    d = (d & 0xff000000) | (s & 0x00ffffff);
+            }
+        }
+    }
+
+    m_cursorRect.left   = left;
+    m_cursorRect.top    = top;
+    m_cursorRect.right  = right;
+    m_cursorRect.bottom = bottom;
+    m_cursorDrawn = true;
+    m_frameDirtyRects.push_back(m_cursorRect);
+}
+
+//
+// Forgets the pointer drawn by DrawCursor(), first putting back
+// the pixels it covered if 'copyBack' is true.  Pass false when
+// the frame buffer is about to be overwritten anyway.
 //
-bool ScreenCaptureDX11::Startup()
+void ScreenCaptureDX11::RestoreCursorArea(bool copyBack)
 {
-    m_frameBuffer.clear();
-    m_frameWidth = m_frameHeight = m_frameDepth = m_frameStride = 0;
+    if (m_cursorDrawn && copyBack)
+    {
+        const ScreenCaptureRect &r = m_cursorRect;
+        const size_t rowBytes = static_cast<size_t>(r.right - r.left) * 4;
+        PixelOps::CopyImage(m_frameBuffer.GetData() + r.top * m_bufferStride + r.left * 4,
+            m_bufferStride, m_cursorSaved.data(), rowBytes, rowBytes, r.bottom - r.top);
+    }
+    m_cursorDrawn = false;
+}
 
-    if (!InitializeDevice())
+//
+// Moves the pointer in the frame buffer after an update that
+// only changed the pointer, and makes the result the captured
+// frame.  Returns false if the frame buffer doesn't hold a
+// complete frame, or nothing changed.
+//
+bool ScreenCaptureDX11::RedrawCursor(int64_t mouseTime)
+{
+    if (!m_frameBufferValid || m_bufferDepth != 32 ||
+        !PrepareFrameBuffer(m_frameBuffer.GetSize(), true))
+    {
         return false;
+    }
 
-    if (!StartOutputDuplication(m_device, m_outputDuplication))
+    if (!m_dirtyRectsUnreported)
+        m_frameDirtyRects.clear();
+    if (m_cursorDrawn)
+        m_frameDirtyRects.push_back(m_cursorRect);
+    RestoreCursorArea(true);
+    DrawCursor();
+    if (m_frameDirtyRects.empty())
         return false;
+    m_dirtyRectsUnreported = true;
 
+    m_frameWidth  = m_bufferWidth;
+    m_frameHeight = m_bufferHeight;
+    m_frameDepth  = m_bufferDepth;
+    m_frameStride = m_bufferStride;
+    m_frameTime   = mouseTime;
+    UpdateFrameInfo();
     return true;
 }
 
 //
-// Stops the screen capture session and releases any
-// allocated resources.
+// Retrieves the move and dirty rectangles of the frame that was
+// just acquired and stores them in 'slot'.  Returns false if
+// DXGI did not provide them, so the whole frame must be treated
+// as changed.
 //
-void ScreenCaptureDX11::Shutdown()
+bool ScreenCaptureDX11::GetFrameMetadata(
+    const DXGI_OUTDUPL_FRAME_INFO &finfo,
+    const D3D11_BOX *box,
+    StagingSlot &slot
+    )
 {
-    if (m_stagingTexture)
-        m_stagingTexture.Release();
+    slot.moveRects.clear();
+    slot.dirtyRects.clear();
 
-    if (m_outputDuplication)
-        m_outputDuplication.Release();
+    if (finfo.TotalMetadataBufferSize == 0)
+        return false;
 
-    if (m_device)
-        m_device.Release();
+    if (m_metadata.size() < finfo.TotalMetadataBufferSize)
+        m_metadata.resize(finfo.TotalMetadataBufferSize);
 
-    if (m_deviceContext)
-        m_deviceContext.Release();
+    // Move rectangles come first.
+    UINT bytes = 0;
+    HRESULT hr = m_outputDuplication->GetFrameMoveRects(
+        static_cast<UINT>(m_metadata.size()),
+        reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT *>(m_metadata.data()),
+        &bytes);
+    if (FAILED(hr))
+        return false;
+    const auto *moves = reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT *>(m_metadata.data());
+    slot.moveRects.assign(moves, moves + bytes / sizeof(DXGI_OUTDUPL_MOVE_RECT));
+
+    bytes = 0;
+    hr = m_outputDuplication->GetFrameDirtyRects(
+        static_cast<UINT>(m_metadata.size()),
+        reinterpret_cast<RECT *>(m_metadata.data()),
+        &bytes);
+    if (FAILED(hr))
+        return false;
+    const auto *rects = reinterpret_cast<const RECT *>(m_metadata.data());
+    slot.dirtyRects.assign(rects, rects + bytes / sizeof(RECT));
+
+    if (box)
+    {
+        // A move may come from outside the capture region, so
+        // treat the moved areas as dirty instead.  Then make
+        // the rectangles relative to the region.
+        for (const auto &move : slot.moveRects)
+            slot.dirtyRects.push_back(move.DestinationRect);
+        slot.moveRects.clear();
+
+        const RECT bounds =
+        {
+            static_cast<LONG>(box->left), static_cast<LONG>(box->top),
+            static_cast<LONG>(box->right), static_cast<LONG>(box->bottom)
+        };
+        size_t count = 0;
+        for (const auto &r : slot.dirtyRects)
+        {
+            RECT clipped;
+            if (IntersectRect(&clipped, &r, &bounds))
+            {
+                OffsetRect(&clipped, -bounds.left, -bounds.top);
+                slot.dirtyRects[count++] = clipped;
+            }
+        }
+        slot.dirtyRects.resize(count);
+    }
 
-    m_frameBuffer.clear();
+    return true;
 }
 
 //
-// Attempts to capture the next frame from the screen.
-// The captured image is placed in an internal frame
-// buffer that can be accessed via GetCapturedFrame().
-// Returns true if successful.
-//
-// May return false because of an error or, more
-// typically, because no pixels have changed on
-// the screen since the last frame was captured,
-// so no new frame is available yet.
+// Returns the part of an acquired image of the given size that
+// is to be captured, which is the capture region in the
+// output's own coordinates, or the whole image if there is no
+// capture region.  The box is empty if the region is entirely
+// off this output.
 //
-bool ScreenCaptureDX11::CaptureFrame()
+D3D11_BOX ScreenCaptureDX11::GetCaptureBox(UINT width, UINT height) const
 {
-    // Assume we won't capture an image.
-    m_frameWidth = m_frameHeight = m_frameStride = m_frameDepth = 0;
+    D3D11_BOX box = { 0, 0, 0, width, height, 1 };
+    if (!m_regionSet)
+        return box;
 
-    if (!m_device || !m_deviceContext || !m_outputDuplication)
-        return false; // Not initialized yet!
+    const RECT &output = m_outputDesc.DesktopCoordinates;
+    const LONG left   = max(m_region.left   - output.left, 0L);
+    const LONG top    = max(m_region.top    - output.top,  0L);
+    const LONG right  = min(m_region.right  - output.left, static_cast<LONG>(width));
+    const LONG bottom = min(m_region.bottom - output.top,  static_cast<LONG>(height));
+    if (left >= right || top >= bottom)
+        return D3D11_BOX { 0, 0, 0, 0, 0, 1 };
 
-    // Attempt to capture a new screen image.
-    CComPtr<ID3D11Texture2D> cacquiredDesktopImage;
-    if (!AcquireNextFrame(m_outputDuplication, cacquiredDesktopImage) ||
-        !cacquiredDesktopImage)
-    {
+    box.left   = static_cast<UINT>(left);
+    box.top    = static_cast<UINT>(top);
+    box.right  = static_cast<UINT>(right);
+    box.bottom = static_cast<UINT>(bottom);
+    return box;
+}
+
+//
+// Reads back the oldest pending staging texture into our
+// internal frame buffer.  If 'allowWait' is false and the
+// GPU has not finished copying to that texture yet, the
+// texture is left pending and false is returned.  Returns
+// true if a frame was read back.
+//
+bool ScreenCaptureDX11::ReadbackPendingFrame(bool allowWait)
+{
+    if (!m_stagingPending)
         return false;
-    }
 
-    // Make sure the captured image is 32-bit.
-    DXGI_OUTDUPL_DESC desc;
-    m_outputDuplication->GetDesc(&desc);
-    if (!IsFormat32bit(desc.ModeDesc.Format))
-    {
-        // Incompatible image format!
+    StagingSlot &slot = m_staging[m_stagingRead];
+    HRESULT hr = CopyStagingTextureToMemory(m_deviceContext, slot,
+                    allowWait ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT);
+    if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
         return false;
-    }
 
-    // Copy image from the captured texture to a staging texture,
-    // and then from the staging texture to our image buffer.
-    if (!CreateStagingTexture(m_device, desc, m_stagingTexture))
+    // The slot is free again, whether or not the readback worked.
+    slot.pending = false;
+    m_stagingRead = (m_stagingRead + 1) % NumStagingTextures;
+    m_stagingPending--;
+
+    if (FAILED(hr))
     {
-        m_outputDuplication->ReleaseFrame();
+        // The frame buffer missed this frame's changes.
+        m_frameBufferValid = false;
         return false;
     }
-    m_deviceContext->CopyResource(m_stagingTexture, cacquiredDesktopImage);
-    bool ok = CopyStagingTextureToMemory(m_deviceContext, m_stagingTexture);
-    m_stagingTexture.Release();
 
-    m_outputDuplication->ReleaseFrame();
-    return ok;
+    return true;
 }
 
-//--------------------------------------------------------------------
-// Private members
-//--------------------------------------------------------------------
+//
+// Discards any frames that were copied to staging textures
+// but not read back yet.
+//
+void ScreenCaptureDX11::DropPendingFrames()
+{
+    for (auto &slot : m_staging)
+        slot.pending = false;
+    m_stagingWrite = m_stagingRead = m_stagingPending = 0;
+
+    // Their changes are lost, so the next frame must be copied in full.
+    m_frameBufferValid = false;
+}
 
 //
-// Initializes a DirectX 11 device so we can use it.
-// Populates m_device and m_deviceContext, and returns
-// true if successful.
+// Releases the frame of the output duplication that we are
+// holding, if any.
 //
-bool ScreenCaptureDX11::InitializeDevice()
+void ScreenCaptureDX11::ReleaseHeldFrame()
 {
-    // We will try the driver types in this order.
-    static const D3D_DRIVER_TYPE drivers[] =
-    {
-        D3D_DRIVER_TYPE_HARDWARE,
-        D3D_DRIVER_TYPE_WARP,
-        D3D_DRIVER_TYPE_REFERENCE
-    };
+    if (m_frameHeld && m_outputDuplication)
+        m_outputDuplication->ReleaseFrame();
 
-    // We will try the feature support levels in this order.
-    static const D3D_FEATURE_LEVEL featureLevels[] =
-    {
-        D3D_FEATURE_LEVEL_11_0,
-        D3D_FEATURE_LEVEL_10_1,
-        D3D_FEATURE_LEVEL_10_0,
-        D3D_FEATURE_LEVEL_9_1
-    };
+    m_frameHeld = false;
+}
 
-    D3D_FEATURE_LEVEL featureLevel;
-    HRESULT hr = E_FAIL;
+//
+// Creates a staging texture of the given size and format.
+// Populates 'stagingTexture' and returns true if successful.
+//
+bool ScreenCaptureDX11::CreateStagingTexture(
+    ID3D11Device *pdevice,
+    UINT width,
+    UINT height,
+    DXGI_FORMAT format,
+    CComPtr<ID3D11Texture2D> &stagingTexture
+    )
+{
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width              = width;
+    desc.Height             = height;
+    desc.Format             = format;
+    desc.ArraySize          = 1;
+    desc.BindFlags          = 0;
+    desc.MiscFlags          = 0;
+    desc.SampleDesc.Count   = 1;
+    desc.SampleDesc.Quality = 0;
+    desc.MipLevels          = 1;
+    desc.CPUAccessFlags     = D3D11_CPU_ACCESS_READ;
+    desc.Usage              = D3D11_USAGE_STAGING;
 
-    for (const auto &driver : drivers)
+    const auto hr = pdevice->CreateTexture2D(&desc, nullptr, &stagingTexture);
+    if (FAILED(hr) || !stagingTexture)
+        return false;
+
+    return true;
+}
+
+//
+// Makes sure the ring of staging textures exists and has the
+// given size and pixel format.  The textures are only recreated
+// when these change, such as when the display mode changes.
+// Returns true if successful.
+//
+bool ScreenCaptureDX11::UpdateStagingTextures(UINT width, UINT height, DXGI_FORMAT format)
+{
+    if (m_staging[0].texture &&
+        m_stagingDesc.Width  == width  &&
+        m_stagingDesc.Height == height &&
+        m_stagingDesc.Format == format)
+    {
+        // Still valid.
+        return true;
+    }
+
+    ReleaseStagingTextures();
+    for (auto &slot : m_staging)
     {
-        hr = D3D11CreateDevice(nullptr, driver, nullptr, 0,
-                featureLevels, static_cast<UINT>(_countof(featureLevels)),
-                D3D11_SDK_VERSION, &m_device, &featureLevel,
-                &m_deviceContext);
-        if (SUCCEEDED(hr) && m_device && m_deviceContext)
+        if (!CreateStagingTexture(m_device, width, height, format, slot.texture))
         {
-            // Success.
-            return true;
+            ReleaseStagingTextures();
+            return false;
         }
-
-        if (m_device)
-            m_device.Release();
-        if (m_deviceContext)
-            m_deviceContext.Release();
     }
 
-    // Failed on all drivers!
-    return false;
+    m_staging[0].texture->GetDesc(&m_stagingDesc);
+    return true;
 }
 
 //
-// Copies the image from a staging texture to our internal
-// frame buffer pixel array.  Populates the m_frameXXX members
-// and returns true if successful.
+// Makes sure the video processor exists and converts images
+// described by 'inputDesc' to the given output size and format.
+// It is only recreated when these change.  Returns true if
+// successful.
 //
-bool ScreenCaptureDX11::CopyStagingTextureToMemory(
-    ID3D11DeviceContext *pDeviceContext,
-    CComPtr<ID3D11Texture2D> &stagingTexture
+bool ScreenCaptureDX11::UpdateVideoProcessor(
+    const D3D11_TEXTURE2D_DESC &inputDesc,
+    UINT outputWidth,
+    UINT outputHeight,
+    DXGI_FORMAT outputFormat
     )
 {
-    if (!pDeviceContext)
+    if (!m_videoDevice || !m_videoContext)
         return false;
 
-    D3D11_TEXTURE2D_DESC desc;
-    stagingTexture->GetDesc(&desc);
+    if (m_vp && m_vpInput && m_vpOutput)
+    {
+        D3D11_TEXTURE2D_DESC inDesc, outDesc;
+        m_vpInput->GetDesc(&inDesc);
+        m_vpOutput->GetDesc(&outDesc);
+        if (inDesc.Width   == inputDesc.Width  &&
+            inDesc.Height  == inputDesc.Height &&
+            inDesc.Format  == inputDesc.Format &&
+            outDesc.Width  == outputWidth      &&
+            outDesc.Height == outputHeight     &&
+            outDesc.Format == outputFormat)
+        {
+            // Still valid.
+            return true;
+        }
+    }
 
-    // Lock the staging texture so we can access its pixel data.
-    D3D11_MAPPED_SUBRESOURCE res;
-    const auto hr = pDeviceContext->Map(
-        stagingTexture,
-        D3D11CalcSubresource(0, 0, 0),
-        D3D11_MAP_READ,
-        0,
-        &res
-    );
+    ReleaseVideoProcessor();
+
+    D3D11_VIDEO_PROCESSOR_CONTENT_DESC content = {};
+    content.InputFrameFormat            = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+    content.InputFrameRate.Numerator    = 60;
+    content.InputFrameRate.Denominator  = 1;
+    content.InputWidth                  = inputDesc.Width;
+    content.InputHeight                 = inputDesc.Height;
+    content.OutputFrameRate.Numerator   = 60;
+    content.OutputFrameRate.Denominator = 1;
+    content.OutputWidth                 = outputWidth;
+    content.OutputHeight                = outputHeight;
+    content.Usage                       = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+
+    HRESULT hr = m_videoDevice->CreateVideoProcessorEnumerator(&content, &m_vpEnum);
     if (FAILED(hr))
         return false;
 
-    // Copy the texture's pixel data into our image buffer.
-    m_frameWidth     = static_cast<int>(desc.Width);
-    m_frameHeight    = static_cast<int>(desc.Height);
-    m_frameStride    = res.RowPitch;
-    m_frameDepth     = 32;
-    m_frameBuffer.resize(m_frameStride * m_frameHeight);
-    memcpy(m_frameBuffer.data(), res.pData, m_frameBuffer.size());
+    // Make sure the conversion is supported before going further.
+    UINT flags = 0;
+    if (FAILED(m_vpEnum->CheckVideoProcessorFormat(outputFormat, &flags)) ||
+        !(flags & D3D11_VIDEO_PROCESSOR_FORMAT_SUPPORT_OUTPUT))
+    {
+        ReleaseVideoProcessor();
+        return false;
+    }
+
+    hr = m_videoDevice->CreateVideoProcessor(m_vpEnum, 0, &m_vp);
+
+    // The captured image is copied to an input texture of our
+    // own, so the input view only has to be created once.
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width              = inputDesc.Width;
+    desc.Height             = inputDesc.Height;
+    desc.Format             = inputDesc.Format;
+    desc.ArraySize          = 1;
+    desc.BindFlags          = D3D11_BIND_RENDER_TARGET;
+    desc.SampleDesc.Count   = 1;
+    desc.MipLevels          = 1;
+    desc.Usage              = D3D11_USAGE_DEFAULT;
+    if (SUCCEEDED(hr))
+        hr = m_device->CreateTexture2D(&desc, nullptr, &m_vpInput);
+
+    desc.Width  = outputWidth;
+    desc.Height = outputHeight;
+    desc.Format = outputFormat;
+    if (SUCCEEDED(hr))
+        hr = m_device->CreateTexture2D(&desc, nullptr, &m_vpOutput);
+
+    D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC inViewDesc = {};
+    inViewDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+    if (SUCCEEDED(hr))
+        hr = m_videoDevice->CreateVideoProcessorInputView(m_vpInput, m_vpEnum,
+                &inViewDesc, &m_vpInputView);
+
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC outViewDesc = {};
+    outViewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+    if (SUCCEEDED(hr))
+        hr = m_videoDevice->CreateVideoProcessorOutputView(m_vpOutput, m_vpEnum,
+                &outViewDesc, &m_vpOutputView);
+
+    if (FAILED(hr))
+    {
+        ReleaseVideoProcessor();
+        return false;
+    }
 
-    pDeviceContext->Unmap(stagingTexture, 0);
+    // The desktop is full range RGB.  Video encoders expect
+    // studio range BT.709 YUV.
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE inColor = {};
+    inColor.RGB_Range = 0;  // 0-255
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE outColor = {};
+    outColor.YCbCr_Matrix  = 1;  // BT.709
+    outColor.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235;
+    m_videoContext->VideoProcessorSetStreamColorSpace(m_vp, 0, &inColor);
+    m_videoContext->VideoProcessorSetOutputColorSpace(m_vp, &outColor);
+    m_videoContext->VideoProcessorSetStreamFrameFormat(m_vp, 0,
+        D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE);
+    m_videoContext->VideoProcessorSetStreamAutoProcessingMode(m_vp, 0, FALSE);
 
     return true;
 }
 
 //
-// Creates a staging texture compatible with the given
-// texture format description.  Populates 'stagingTexture'
-// and returns true if successful.
+// Converts the part of 'source' inside 'box' into m_vpOutput
+// with the video processor, scaling it to the size of
+// m_vpOutput if 'scale' is true.  Returns true if successful.
 //
-bool ScreenCaptureDX11::CreateStagingTexture(
-    ID3D11Device *pdevice,
-    const DXGI_OUTDUPL_DESC &ddesc,
-    CComPtr<ID3D11Texture2D> &stagingTexture
-    )
+bool ScreenCaptureDX11::RunVideoProcessor(ID3D11Texture2D *source, const D3D11_BOX &box, bool scale)
+{
+    if (!m_vp || !m_vpInput || !m_vpOutput || !m_vpInputView || !m_vpOutputView)
+        return false;
+
+    m_deviceContext->CopyResource(m_vpInput, source);
+
+    // Unless we are scaling, the output may be one pixel
+    // smaller than the box, to make it even, so the source
+    // rectangle is made to match it exactly and nothing gets
+    // scaled.
+    D3D11_TEXTURE2D_DESC outDesc;
+    m_vpOutput->GetDesc(&outDesc);
+    const UINT width  = scale ? box.right - box.left : outDesc.Width;
+    const UINT height = scale ? box.bottom - box.top : outDesc.Height;
+    const RECT sourceRect =
+    {
+        static_cast<LONG>(box.left), static_cast<LONG>(box.top),
+        static_cast<LONG>(box.left + width), static_cast<LONG>(box.top + height)
+    };
+    m_videoContext->VideoProcessorSetStreamSourceRect(m_vp, 0, TRUE, &sourceRect);
+
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable        = TRUE;
+    stream.pInputSurface = m_vpInputView;
+    HRESULT hr = m_videoContext->VideoProcessorBlt(m_vp, m_vpOutputView, 0, 1, &stream);
+    return SUCCEEDED(hr);
+}
+
+//
+// Returns true if frames captured from an area of the given
+// size have to be scaled to the size set by SetOutputSize().
+//
+bool ScreenCaptureDX11::IsScaled(UINT width, UINT height) const
+{
+    return m_scaledWidth && (width != m_scaledWidth || height != m_scaledHeight);
+}
+
+//
+// Releases the video processor and its textures.
+//
+void ScreenCaptureDX11::ReleaseVideoProcessor()
+{
+    m_vpInputView.Release();
+    m_vpOutputView.Release();
+    m_vpInput.Release();
+    m_vpOutput.Release();
+    m_vp.Release();
+    m_vpEnum.Release();
+}
+
+//
+// Returns a texture from the pool of GPU textures that is not
+// in use by anyone else, creating one if needed.  Textures that
+// don't match the given size and format are discarded.  Returns
+// nullptr if the pool is exhausted or creation fails.
+//
+ID3D11Texture2D *ScreenCaptureDX11::GetFreeGpuTexture(UINT width, UINT height, DXGI_FORMAT format)
 {
+    for (size_t i = 0; i < m_gpuTextures.size(); )
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        m_gpuTextures[i]->GetDesc(&desc);
+        if (desc.Width  != width  ||
+            desc.Height != height ||
+            desc.Format != format)
+        {
+            // Left over from a previous display mode or capture
+            // region.  Anyone still
+            // using it keeps their own reference.
+            m_gpuTextures.erase(m_gpuTextures.begin() + i);
+            continue;
+        }
+
+        if (IsUnreferenced(m_gpuTextures[i]))
+            return m_gpuTextures[i];
+        i++;
+    }
+
+    if (m_gpuTextures.size() >= MaxGpuTextures)
+        return nullptr; // Everything is still in use!
+
     D3D11_TEXTURE2D_DESC desc = {};
-    desc.Width              = ddesc.ModeDesc.Width;
-    desc.Height             = ddesc.ModeDesc.Height;
-    desc.Format             = ddesc.ModeDesc.Format;
+    desc.Width              = width;
+    desc.Height             = height;
+    desc.Format             = format;
     desc.ArraySize          = 1;
-    desc.BindFlags          = 0;
+    desc.BindFlags          = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
     desc.MiscFlags          = 0;
     desc.SampleDesc.Count   = 1;
     desc.SampleDesc.Quality = 0;
     desc.MipLevels          = 1;
-    desc.CPUAccessFlags     = D3D11_CPU_ACCESS_READ;
-    desc.Usage              = D3D11_USAGE_STAGING;
+    desc.CPUAccessFlags     = 0;
+    desc.Usage              = D3D11_USAGE_DEFAULT;
 
-    const auto hr = pdevice->CreateTexture2D(&desc, nullptr, &stagingTexture);
-    if (FAILED(hr) || !stagingTexture)
-        return false;
+    CComPtr<ID3D11Texture2D> texture;
+    const auto hr = m_device->CreateTexture2D(&desc, nullptr, &texture);
+    if (FAILED(hr) || !texture)
+        return nullptr;
 
-    return true;
+    m_gpuTextures.push_back(texture);
+    return texture;
 }
 
 //
-// Starts output duplication on the given device.
-// Populates 'cOutputDuplication' and returns true if successful.
+// Releases the ring of staging textures.
+//
+void ScreenCaptureDX11::ReleaseStagingTextures()
+{
+    DropPendingFrames();
+    for (auto &slot : m_staging)
+    {
+        if (slot.texture)
+            slot.texture.Release();
+    }
+
+    m_stagingDesc = {};
+}
+
+//
+// Starts duplication of the given output of the adapter that
+// the given device was created on.  Populates
+// 'cOutputDuplication' and returns true if successful.
 //
 bool ScreenCaptureDX11::StartOutputDuplication(
         ID3D11Device *pdevice,
+        unsigned outputIndex,
         CComPtr<IDXGIOutputDuplication> &cOutputDuplication
         )
 {
@@ -303,10 +1774,13 @@ bool ScreenCaptureDX11::StartOutputDuplication(
         return false;
 
     CComPtr<IDXGIOutput> dxgiOutput;
-    hr = dxgiAdapter->EnumOutputs(0, &dxgiOutput);
+    hr = dxgiAdapter->EnumOutputs(outputIndex, &dxgiOutput);
     if (FAILED(hr))
         return false;
 
+    DXGI_OUTPUT_DESC outputDesc;
+    dxgiOutput->GetDesc(&outputDesc);
+
     CComPtr<IDXGIOutput1> dxgiOutput1;
     hr = dxgiOutput->QueryInterface(
         __uuidof(IDXGIOutput1),
@@ -322,67 +1796,186 @@ bool ScreenCaptureDX11::StartOutputDuplication(
     if (!cOutputDuplication)
         return false;
 
+    m_outputDesc = outputDesc;
+    return true;
+}
+
+//
+// Forgets an output duplication that DXGI reported as lost.
+// Its frame can no longer be released, and the frames already
+// copied to the staging textures are still read back.
+//
+void ScreenCaptureDX11::LoseOutputDuplication()
+{
+    m_frameHeld = false;
+    if (m_outputDuplication)
+        m_outputDuplication.Release();
+}
+
+//
+// Recreates the duplication of the output we were capturing,
+// on the device we already have, trying again every
+// RestartRetryInterval milliseconds for up to 'timeoutMs'
+// milliseconds while the output can't be duplicated (such as
+// during a mode change or while the secure desktop is up).
+// Sets m_modeChanged if the output changed size or
+// orientation.  Returns true if successful.
+//
+bool ScreenCaptureDX11::RestartOutputDuplication(unsigned timeoutMs)
+{
+    LARGE_INTEGER freq, now, deadline;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    deadline.QuadPart = now.QuadPart + freq.QuadPart * timeoutMs / 1000;
+
+    const DXGI_OUTPUT_DESC oldDesc = m_outputDesc;
+    while (!StartOutputDuplication(m_device, m_outputIndex, m_outputDuplication))
+    {
+        if (m_outputDuplication)
+            m_outputDuplication.Release();
+
+        DWORD sleepMs = RestartRetryInterval;
+        if (timeoutMs != INFINITE)
+        {
+            QueryPerformanceCounter(&now);
+            if (now.QuadPart >= deadline.QuadPart)
+            {
+                SCREENCAP_TRACE("DuplicationRestartFailed",
+                    TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                    TraceLoggingUInt32(m_outputIndex, "Output"),
+                    TraceLoggingUInt32(timeoutMs, "TimeoutMs"));
+                return false;
+            }
+            const DWORD leftMs = static_cast<DWORD>(((deadline.QuadPart - now.QuadPart) * 1000 +
+                                    freq.QuadPart - 1) / freq.QuadPart);
+            sleepMs = min(sleepMs, leftMs);
+        }
+        Sleep(sleepMs);
+    }
+
+    const RECT &a = oldDesc.DesktopCoordinates;
+    const RECT &b = m_outputDesc.DesktopCoordinates;
+    if (a.right - a.left != b.right - b.left || a.bottom - a.top != b.bottom - b.top ||
+        oldDesc.Rotation != m_outputDesc.Rotation)
+    {
+        // Frames of the old size that are still queued would
+        // be returned as the first frame of the new mode.
+        DropPendingFrames();
+        m_modeChanged = true;
+    }
+
+    // The first frame of the new duplication covers the
+    // whole output.
+    m_frameBufferValid = false;
+    SCREENCAP_TRACE("DuplicationRestarted",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingUInt32(m_outputIndex, "Output"),
+        TraceLoggingBool(m_modeChanged, "ModeChanged"));
     return true;
 }
 
 //
-// Attempts to capture a screen image, placing it into
-// 'acquiredDesktopImage'.  Returns true if successful.
+// Waits up to 'timeoutMs' milliseconds for the screen image to
+// change, placing the new image into 'acquiredDesktopImage' and
+// its frame information into 'finfo'.  Returns S_OK if an image
+// was acquired, DXGI_ERROR_WAIT_TIMEOUT if nothing changed in
+// time, or another error code if the duplication failed.
 //
-bool ScreenCaptureDX11::AcquireNextFrame(
+// DXGI wakes us as soon as a frame is presented, so there is no
+// polling here.  Updates that only move the mouse pointer carry
+// no new image; those are released and the wait resumes for
+// whatever is left of the timeout, measured against a
+// QueryPerformanceCounter() deadline.  If 'pointerUpdates' is
+// true and such an update changed the drawn pointer, S_FALSE is
+// returned instead, with no image.  The pointer is tracked
+// either way.
+//
+HRESULT ScreenCaptureDX11::AcquireNextFrame(
     IDXGIOutputDuplication *cOutputDuplication,
-    CComPtr<ID3D11Texture2D> &acquiredDesktopImage
+    UINT timeoutMs,
+    bool pointerUpdates,
+    CComPtr<ID3D11Texture2D> &acquiredDesktopImage,
+    DXGI_OUTDUPL_FRAME_INFO &finfo
     )
 {
+    LARGE_INTEGER freq, now, deadline;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    deadline.QuadPart = now.QuadPart + freq.QuadPart * timeoutMs / 1000;
+
     // This will be filled with the resource interface of the
     // surface that contains the desktop image.
     CComPtr<IDXGIResource> desktopResource;
 
-    // It may take several tries to get the frame.
-    HRESULT hr = E_FAIL;
-    for (int attempt = 0; attempt < 4; attempt++)
+    for (;;)
     {
-        DXGI_OUTDUPL_FRAME_INFO finfo = {};
-        hr = cOutputDuplication->AcquireNextFrame(50 /*timeout ms*/,
-                &finfo, &desktopResource);
-        if (SUCCEEDED(hr) && finfo.LastPresentTime.QuadPart == 0)
+        finfo = {};
+        HRESULT hr = cOutputDuplication->AcquireNextFrame(timeoutMs,
+                        &finfo, &desktopResource);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
         {
-            // When QuadPart is zero, the frame is still in the process
-            // of being captured, but we do still need to release the
-            // resource and frame.
-            desktopResource.Release();
-            cOutputDuplication->ReleaseFrame();
-            Sleep(1);
+            SCREENCAP_TRACE("AcquireTimeout",
+                TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                TraceLoggingUInt32(timeoutMs, "TimeoutMs"));
+            return hr;
         }
-        else if (SUCCEEDED(hr) && !desktopResource)
+        if (FAILED(hr))
         {
-            // The call succeeded but desktopResource was not populated.
-            cOutputDuplication->ReleaseFrame();
-            Sleep(1);
+            SCREENCAP_TRACE("AcquireFailed",
+                TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+                TraceLoggingHResult(hr, "HResult"));
+            return hr;
         }
-        else
-        {
+        const bool cursorChanged = UpdateCursor(finfo);
+        if (finfo.LastPresentTime.QuadPart != 0 && desktopResource)
             break;
-        }
-    }
 
-    //
-    // Debugging Note:
-    //   If we timed out getting the next frame, 'hr' will
-    //   contain DXGI_ERROR_WAIT_TIMEOUT (aka 0x887A0027)
-    //   when we reach here.
-    //
+        // When LastPresentTime is zero, only the mouse pointer
+        // changed, but we do still need to release the resource
+        // and frame.
+        desktopResource.Release();
+        cOutputDuplication->ReleaseFrame();
+        if (pointerUpdates && cursorChanged)
+            return S_FALSE;
 
-    if (FAILED(hr) || !desktopResource)
-        return false;
+        if (timeoutMs != INFINITE)
+        {
+            QueryPerformanceCounter(&now);
+            if (now.QuadPart >= deadline.QuadPart)
+            {
+                SCREENCAP_TRACE("AcquireTimeout",
+                    TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                    TraceLoggingUInt32(0, "TimeoutMs"));
+                return DXGI_ERROR_WAIT_TIMEOUT;
+            }
+
+            // Round up, so we never wake early and spin.
+            timeoutMs = static_cast<UINT>(((deadline.QuadPart - now.QuadPart) * 1000 +
+                            freq.QuadPart - 1) / freq.QuadPart);
+        }
+    }
 
     // Get the texture for the screen image that was just captured.
-    hr = desktopResource->QueryInterface(__uuidof(ID3D11Texture2D),
+    HRESULT hr = desktopResource->QueryInterface(__uuidof(ID3D11Texture2D),
                     reinterpret_cast<void **>(&acquiredDesktopImage));
     desktopResource.Release();
     if (FAILED(hr))
-        return false;
+    {
+        SCREENCAP_TRACE("AcquireFailed",
+            TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+            TraceLoggingHResult(hr, "HResult"));
+        cOutputDuplication->ReleaseFrame();
+        return hr;
+    }
 
-    return true;
+    // AccumulatedFrames above one means the screen was updated
+    // more often than we captured it.
+    SCREENCAP_TRACE("FrameAcquired",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingUInt32(finfo.AccumulatedFrames, "AccumulatedFrames"),
+        TraceLoggingInt64(finfo.LastPresentTime.QuadPart, "PresentTime"),
+        TraceLoggingUInt32(finfo.TotalMetadataBufferSize, "MetadataBytes"),
+        TraceLoggingBool(finfo.ProtectedContentMaskedOut != FALSE, "ProtectedContentMaskedOut"));
+    return S_OK;
 }
 
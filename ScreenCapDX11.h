@@ -47,28 +47,66 @@
 #include <d3d11.h>
 #include <vector>
 #include <cstdint>
+#include "ScreenCapBackend.h"
+#include "PixelOps.h"
+
+//
+// Describes one display output that can be captured.
+//
+struct ScreenCaptureOutputInfo
+{
+    unsigned          adapterIndex = 0;
+    unsigned          outputIndex = 0;
+    ScreenCaptureRect desktopRect;          // Position on the virtual desktop.
+    wchar_t           deviceName[32] = {};  // Such as "\\.\DISPLAY1".
+};
 
 //
 // This class manages a screen capture session, using
 // the output duplication features in DirectX 11.
 // 
-class ScreenCaptureDX11
+class ScreenCaptureDX11 : public ScreenCaptureBackend
 {
 public:
     ScreenCaptureDX11()  { }
     ~ScreenCaptureDX11() { Shutdown(); }
 
+    ScreenCaptureMode GetMode() const override { return ScreenCaptureMode_DX11; }
+
     //
-    // Begins a screen capture session.  Returns true if
-    // successful.
+    // Begins a screen capture session.  By default the first
+    // output of the first adapter is captured, which is
+    // normally the primary screen.  EnumerateOutputs() lists
+    // the other possible choices.  Returns true if successful.
     //
-    bool Startup();
+    bool Startup(unsigned adapterIndex, unsigned outputIndex);
+    bool Startup() override { return Startup(0, 0); }
+
+    //
+    // Lists the outputs of all adapters that are attached to
+    // the desktop.  Returns true if any were found.
+    //
+    static bool EnumerateOutputs(std::vector<ScreenCaptureOutputInfo> &outputs);
+
+    //
+    // Returns the position of the captured output on the
+    // virtual desktop.
+    //
+    ScreenCaptureRect GetOutputRect() const
+    {
+        ScreenCaptureRect r;
+        r.left   = m_outputDesc.DesktopCoordinates.left;
+        r.top    = m_outputDesc.DesktopCoordinates.top;
+        r.right  = m_outputDesc.DesktopCoordinates.right;
+        r.bottom = m_outputDesc.DesktopCoordinates.bottom;
+        return r;
+    }
 
     //
     // Stops the screen capture session and releases any
     // allocated resources.
     //
-    void Shutdown();
+    void Shutdown() override;
 
     //
     // Attempts to capture the next frame from the screen.
@@ -81,53 +119,400 @@ public:
     // the screen since the last frame was captured,
     // so no new frame is available yet.
     //
-    bool CaptureFrame();
+    bool CaptureFrame() override;
+
+    //
+    // Waits up to 'timeoutMs' milliseconds (or INFINITE) for
+    // the screen to change, then captures the new frame the
+    // same way as CaptureFrame().  The thread sleeps in DXGI
+    // until a frame is presented, so a capture thread can call
+    // this in a loop without using any CPU while the screen is
+    // static.  Mouse pointer updates don't count as changes.
+    // Returns ScreenCaptureResult_NoChange if the timeout
+    // expired, or ScreenCaptureResult_Error if capture failed.
+    //
+    // When the duplication is lost (DXGI_ERROR_ACCESS_LOST,
+    // which Windows reports for mode changes, desktop switches
+    // and full-screen applications), only the duplication is
+    // recreated; the device, staging textures and frame buffer
+    // are kept, and the staging textures are only rebuilt if
+    // the size changed.  While the output can't be duplicated
+    // yet (such as on the secure desktop), NoChange is
+    // returned.  The first frame after the output changed size
+    // or orientation is returned as
+    // ScreenCaptureResult_ModeChanged, so the caller can
+    // reconfigure whatever consumes the frames.
+    //
+    ScreenCaptureResult WaitForFrame(unsigned timeoutMs) override;
+
+    //
+    // Hands out the frame in the frame buffer again, after a
+    // WaitForFrame() that found no change.  Returns false if
+    // the frame buffer doesn't hold a complete frame.
+    //
+    bool RestoreLastFrame() override;
+
+    // How long CaptureFrame() waits for the screen to change, in milliseconds.
+    static const unsigned DefaultFrameTimeout = 50;
+
+    // How often a lost duplication is retried, in milliseconds.
+    static const unsigned RestartRetryInterval = 50;
+
+    //
+    // Enables or disables pipelined readback.  When enabled,
+    // CaptureFrame() queues the GPU copy of the newly acquired
+    // frame and returns the frame that was queued by the
+    // previous call, instead of waiting for the GPU copy to
+    // finish.  This removes the per-frame CPU/GPU sync point
+    // at the cost of one frame of latency.  Disabled by default.
+    //
+    bool SetPipelinedReadback(bool enable) override;
+    bool GetPipelinedReadback() const { return m_pipelined; }
+
+    //
+    // Restricts capture to a region of the screen, given in
+    // desktop coordinates (the same as window rectangles), so
+    // only that region is copied from the acquired image and
+    // read back.  The region is clipped to this output; the
+    // frames are the size of the clipped region, and no frames
+    // are captured while it is entirely off this output.
+    // Dirty rectangles are relative to the region.  Returns
+    // false if the region is empty.
+    //
+    bool SetCaptureRegion(const ScreenCaptureRect &region) override;
+    void ClearCaptureRegion() override;
+
+    //
+    // Enables or disables incremental capture.  When enabled,
+    // the move and dirty rectangles reported by DXGI are used
+    // to update the internal frame buffer in place, so only the
+    // parts of the screen that changed are copied from the GPU.
+    // Disabled by default.
+    //
+    bool SetIncrementalCapture(bool enable) override;
+    bool GetIncrementalCapture() const { return m_incremental; }
+
+    //
+    // Enables or disables drawing the mouse pointer into the
+    // frame buffer.  Output duplication leaves the pointer out
+    // of the screen image and reports its shape and position
+    // separately; the shape is only fetched again when DXGI
+    // says it changed.  The pixels under the pointer are saved
+    // before it is drawn and put back before the next frame is
+    // applied, so the frame buffer can still be updated in
+    // place, and the dirty rectangles only gain the areas the
+    // pointer left and moved to.  When the pointer moves over
+    // an otherwise unchanged screen, WaitForFrame() returns a
+    // frame that only differs there, without any GPU copy.
+    // Scaled frames get the pointer at its own size.  It isn't
+    // drawn into NV12 frames or the textures returned by
+    // CaptureFrameTexture().  Disabled by default.
+    //
+    bool SetCursorCapture(bool enable) override;
+    bool GetCursorCapture() const { return m_cursorEnabled; }
+
+    //
+    // Selects the pixel format of the frame buffer.  In NV12
+    // mode the frames are converted on the GPU with the Direct3D
+    // video processor before they are read back, which also
+    // reads back much less data.  If the driver has no video
+    // processor, they are converted on the CPU after the
+    // readback instead.  NV12 frames always have even
+    // dimensions; an odd last column or row is dropped.
+    // Incremental capture is not supported for NV12 frames.
+    // Returns false if the format isn't supported.
+    //
+    bool SetOutputFormat(ScreenCaptureFormat format) override;
+    ScreenCaptureFormat GetFrameFormat() const override { return m_outputFormat; }
+
+    //
+    // Scales every frame to the given size, whatever the size
+    // of the screen or capture region, so the frames can go to
+    // a video encoder with size limits.  The size is rounded
+    // down to even numbers.  Frames are scaled on the GPU with
+    // the Direct3D video processor before they are read back,
+    // or with a bilinear filter on the CPU after the readback
+    // if the driver has no video processor.  Pass zero for both
+    // to go back to the captured size.  Incremental capture is
+    // not supported while frames are scaled, but the dirty
+    // rectangles are still scaled to match the frames.
+    // Returns false if the size is too small.
+    //
+    bool SetOutputSize(unsigned width, unsigned height) override;
+
+    //
+    // Attempts to capture the next frame from the screen
+    // without copying it to system memory.  On success,
+    // 'texture' receives a GPU texture (usage DEFAULT, same
+    // format as the desktop) that holds the captured image,
+    // and true is returned.  If SetOutputSize() is in effect,
+    // the image is scaled with the video processor, and this
+    // fails if there is none.  The texture comes from a small
+    // pool and is reused once the caller and anything it was
+    // handed to (such as a video encoder) have released it.
+    // The internal frame buffer is not updated.
+    //
+    bool CaptureFrameTexture(CComPtr<ID3D11Texture2D> &texture);
+
+    //
+    // Returns the Direct3D device used for capturing, so other
+    // components (such as a video encoder) can share it with
+    // the textures returned by CaptureFrameTexture().
+    //
+    ID3D11Device *GetD3DDevice() const override { return m_device; }
 
     //
     // Return size and format of the frame buffer that
     // contains the captured image.
     //
-    unsigned GetFrameWidth()  const { return m_frameWidth;  }
-    unsigned GetFrameHeight() const { return m_frameHeight; }
-    unsigned GetFrameDepth()  const { return m_frameDepth;  }
-    unsigned GetFrameStride() const { return m_frameStride; }
+    unsigned GetFrameWidth()  const override { return m_frameWidth;  }
+    unsigned GetFrameHeight() const override { return m_frameHeight; }
+    unsigned GetFrameDepth()  const override { return m_frameDepth;  }
+    unsigned GetFrameStride() const override { return m_frameStride; }
+
+    //
+    // Returns the time the captured frame was presented to the
+    // screen, as reported by DXGI, in QueryPerformanceCounter()
+    // ticks.  This also covers the last frame returned by
+    // CaptureFrameTexture().
+    //
+    int64_t GetFrameTime() const override { return m_frameTime; }
+
+    //
+    // Returns true if the scanlines of the frame buffer are in
+    // bottom-to-top order.  Textures are always top-down.
+    //
+    bool IsFrameBottomUp() const override { return false; }
 
     //
     // Returns a pointer to the frame buffer pixels of
-    // the captured image.
+    // the captured image.  For NV12 frames, the scanline
+    // and pixel pointers refer to the Y plane, and the UV
+    // plane starts GetFrameStride() * GetFrameHeight() bytes
+    // into the frame buffer.
     //
-    const uint8_t *GetFrameBuffer() const { return m_frameBuffer.data(); }
-    const uint8_t *GetFrameBufferScanlinePtr(unsigned y) const { return m_frameBuffer.data() + (m_frameStride * y); }
-    const uint8_t *GetFrameBufferPixelPtr(unsigned y, unsigned x) const { return m_frameBuffer.data() + (m_frameStride * y) + (x * m_frameDepth / 8); }
+    size_t GetFrameBufferSize() const override { return m_frameBuffer.GetSize(); }
+    const uint8_t *GetFrameBuffer() const override { return m_frameBuffer.GetData(); }
+    const uint8_t *GetFrameBufferScanlinePtr(unsigned y) const { return m_frameBuffer.GetData() + (m_frameStride * y); }
+    const uint8_t *GetFrameBufferPixelPtr(unsigned y, unsigned x) const { return m_frameBuffer.GetData() + (m_frameStride * y) + (x * m_frameDepth / 8); }
+
+    //
+    // Returns a handle to the frame buffer, or an empty handle
+    // if the last call captured nothing.  The frame buffer is
+    // updated in place while nobody else holds it; otherwise
+    // the next frame goes into another buffer from the pool,
+    // and in incremental mode the previous frame is copied
+    // over first.  Capture fails while none is free.
+    //
+    FrameHandle GetFrameHandle() const override { return m_frameWidth ? m_frameBuffer : FrameHandle(); }
+    void SetMaxFrameBuffers(unsigned count) override { m_framePool.SetMaxBuffers(count); }
+
+    //
+    // Returns how long each stage of the last capture took.  In
+    // pipelined mode the readback stages are those of the frame
+    // returned, which was acquired by an earlier call.
+    //
+    ScreenCaptureTimings GetFrameTimings() const override { return m_timings; }
+
+    //
+    // Returns the list of rectangles of the frame buffer that
+    // changed in the most recently captured frame, including the
+    // destinations of moved regions.  When DXGI provides no
+    // change information, the list holds the whole frame.
+    //
+    const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const override { return m_frameDirtyRects; }
 
 private:
+    // Number of staging textures kept in the readback ring.
+    static const unsigned NumStagingTextures = 3;
+
     CComPtr<ID3D11Device>           m_device;
     CComPtr<ID3D11DeviceContext>    m_deviceContext;
-    CComPtr<ID3D11Texture2D>        m_stagingTexture;
     CComPtr<IDXGIOutputDuplication> m_outputDuplication;
+    DXGI_OUTPUT_DESC                m_outputDesc = {};
+    unsigned                        m_outputIndex = 0;
+
+    // True if the duplication was recreated for an output of a
+    // different size or orientation, and no frame has been
+    // returned since.
+    bool                            m_modeChanged = false;
+
+    // Region of the desktop to capture, if m_regionSet.
+    ScreenCaptureRect               m_region;
+    bool                            m_regionSet = false;
 
-    // The pixels of the captured image.
-    std::vector<uint8_t> m_frameBuffer;
+    // One entry in the ring of staging textures.  'pending' is
+    // true while a GPU copy has been queued into the texture but
+    // its pixels have not been read back yet.
+    //
+    // The move and dirty rectangles of the frame that was copied
+    // to the slot are kept with it, because the frame is released
+    // before the slot is read back in pipelined mode.  'fullFrame'
+    // is true if DXGI did not provide them.
+    struct StagingSlot
+    {
+        CComPtr<ID3D11Texture2D>            texture;
+        bool                                pending = false;
+        bool                                fullFrame = true;
+        int64_t                             presentTime = 0;
+        UINT                                sourceWidth = 0;   // Size of the captured
+        UINT                                sourceHeight = 0;  // area, before scaling.
+        std::vector<DXGI_OUTDUPL_MOVE_RECT> moveRects;
+        std::vector<RECT>                   dirtyRects;
+    };
+
+    // Ring of staging textures that live for the whole capture
+    // session.  They are only rebuilt when the duplicated output
+    // reports a different size or pixel format.
+    StagingSlot                     m_staging[NumStagingTextures];
+    unsigned                        m_stagingWrite = 0;    // Next slot to copy into.
+    unsigned                        m_stagingRead = 0;     // Oldest pending slot.
+    unsigned                        m_stagingPending = 0;  // Number of pending slots.
+    D3D11_TEXTURE2D_DESC            m_stagingDesc = {};
+
+    // Pixel format of the frame buffer.
+    ScreenCaptureFormat m_outputFormat = ScreenCaptureFormat_BGRA32;
+
+    // Size frames are scaled to, or zero to leave them alone.
+    UINT m_scaledWidth  = 0;
+    UINT m_scaledHeight = 0;
+
+    // Scratch image of the scaled frame, when NV12 frames are
+    // scaled and converted on the CPU.
+    std::vector<uint8_t> m_scaleBuffer;
+    PixelOpsScaleBuffers m_scaleBuffers;    // For scaling on the CPU.
+
+    // Video processor used to convert and scale frames on the
+    // GPU.  The captured image is copied to m_vpInput, which is
+    // converted into m_vpOutput.
+    CComPtr<ID3D11VideoDevice>               m_videoDevice;
+    CComPtr<ID3D11VideoContext>              m_videoContext;
+    CComPtr<ID3D11VideoProcessorEnumerator>  m_vpEnum;
+    CComPtr<ID3D11VideoProcessor>            m_vp;
+    CComPtr<ID3D11Texture2D>                 m_vpInput;
+    CComPtr<ID3D11Texture2D>                 m_vpOutput;
+    CComPtr<ID3D11VideoProcessorInputView>   m_vpInputView;
+    CComPtr<ID3D11VideoProcessorOutputView>  m_vpOutputView;
+
+    // Maximum number of GPU textures handed out by CaptureFrameTexture().
+    static const unsigned MaxGpuTextures = 8;
+
+    // Pool of GPU textures handed out by CaptureFrameTexture().
+    std::vector<CComPtr<ID3D11Texture2D>> m_gpuTextures;
+
+    // True if pipelined readback is enabled.
+    bool m_pipelined = false;
+
+    // True if we are still holding the most recently acquired
+    // frame of the output duplication (pipelined mode only).
+    bool m_frameHeld = false;
+
+    // The pixels of the captured image, in a buffer from
+    // m_framePool.
+    FramePool   m_framePool;
+    FrameHandle m_frameBuffer;
+
+    // True if incremental capture is enabled.
+    bool m_incremental = false;
+
+    // True if m_frameBuffer holds a complete copy of the most
+    // recently read back frame, so it can be updated in place.
+    bool m_frameBufferValid = false;
+
+    // Regions that changed in the most recently captured frame.
+    // When a frame is read back but not handed to the caller,
+    // such as to make room in the staging ring, its regions
+    // are kept and the next frame's are added to them.
+    std::vector<ScreenCaptureRect> m_frameDirtyRects;
+    bool m_dirtyRectsUnreported = false;
+
+    // How long the stages of the last capture took.
+    ScreenCaptureTimings m_timings;
+
+    // Scratch buffer for the frame metadata returned by DXGI.
+    std::vector<uint8_t> m_metadata;
+
+    // True if the mouse pointer is drawn into the frame buffer.
+    bool m_cursorEnabled = false;
+
+    // The pointer as DXGI last reported it.  Its shape is kept
+    // even when it isn't drawn, since DXGI only sends the shape
+    // when it changes.  The position is the top left corner of
+    // the shape, in the output's coordinates.
+    std::vector<uint8_t>            m_cursorShape;
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO m_cursorShapeInfo = {};
+    POINT                           m_cursorPosition = {};
+    bool                            m_cursorVisible = false;
+
+    // Where the pointer was drawn into the frame buffer, and
+    // the pixels it covered, while m_cursorDrawn.
+    ScreenCaptureRect               m_cursorRect;
+    std::vector<uint8_t>            m_cursorSaved;
+    bool                            m_cursorDrawn = false;
 
     // Size and format of the captured frame buffer image.
     unsigned m_frameWidth  = 0;
     unsigned m_frameHeight = 0;
     unsigned m_frameDepth  = 0; // Pixel depth in bits-per-pixel.
     unsigned m_frameStride = 0; // Number of bytes between scanlines.
+    int64_t  m_frameTime   = 0; // LastPresentTime of the frame, in QPC ticks.
 
-    bool InitializeDevice();
+    // Size of the image in the frame buffer, which stays put
+    // when a call captures nothing.
+    unsigned m_bufferWidth  = 0;
+    unsigned m_bufferHeight = 0;
+    unsigned m_bufferDepth  = 0;
+    unsigned m_bufferStride = 0;
+
+    bool InitializeDevice(IDXGIAdapter *adapter);
     bool StartOutputDuplication(
             ID3D11Device *pdevice,
+            unsigned outputIndex,
             CComPtr<IDXGIOutputDuplication> &cOutputDuplication);
+    void LoseOutputDuplication();
+    bool RestartOutputDuplication(unsigned timeoutMs);
+    ScreenCaptureResult CaptureNextFrame(unsigned timeoutMs, HRESULT &hr);
     bool CreateStagingTexture(
             ID3D11Device* pdevice,
-            const DXGI_OUTDUPL_DESC &duplDesc,
+            UINT width,
+            UINT height,
+            DXGI_FORMAT format,
             CComPtr<ID3D11Texture2D> &stagingTexture);
-    bool CopyStagingTextureToMemory(
+    bool UpdateStagingTextures(UINT width, UINT height, DXGI_FORMAT format);
+    bool UpdateVideoProcessor(
+            const D3D11_TEXTURE2D_DESC &inputDesc,
+            UINT outputWidth,
+            UINT outputHeight,
+            DXGI_FORMAT outputFormat);
+    bool RunVideoProcessor(ID3D11Texture2D *source, const D3D11_BOX &box, bool scale);
+    bool IsScaled(UINT width, UINT height) const;
+    void ReleaseVideoProcessor();
+    ID3D11Texture2D *GetFreeGpuTexture(UINT width, UINT height, DXGI_FORMAT format);
+    D3D11_BOX GetCaptureBox(UINT width, UINT height) const;
+    void ReleaseStagingTextures();
+    HRESULT CopyStagingTextureToMemory(
             ID3D11DeviceContext *pDeviceContext,
-            CComPtr<ID3D11Texture2D> &stagingTexture);
-    bool AcquireNextFrame(
+            const StagingSlot &slot,
+            UINT mapFlags);
+    bool GetFrameMetadata(
+            const DXGI_OUTDUPL_FRAME_INFO &finfo,
+            const D3D11_BOX *box,
+            StagingSlot &slot);
+    bool PrepareFrameBuffer(size_t bytes, bool keepContents);
+    void UpdateFrameInfo();
+    void ApplyMoveRects(const std::vector<DXGI_OUTDUPL_MOVE_RECT> &moveRects);
+    bool UpdateCursor(const DXGI_OUTDUPL_FRAME_INFO &finfo);
+    void DrawCursor();
+    void RestoreCursorArea(bool copyBack);
+    bool RedrawCursor(int64_t mouseTime);
+    void DropPendingFrames();
+    bool ReadbackPendingFrame(bool allowWait);
+    void ReleaseHeldFrame();
+    HRESULT AcquireNextFrame(
             IDXGIOutputDuplication* cOutputDuplication,
-            CComPtr<ID3D11Texture2D> &acquiredDesktopImage);
+            UINT timeoutMs,
+            bool pointerUpdates,
+            CComPtr<ID3D11Texture2D> &acquiredDesktopImage,
+            DXGI_OUTDUPL_FRAME_INFO &frameInfo);
 };
 
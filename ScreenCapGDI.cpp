@@ -44,10 +44,10 @@
 //--------------------------------------------------------------------
 
 #include "ScreenCapGDI.h"
+#include "PixelOps.h"
 #define STRICT
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
-#include <vector>
 
 //
 // Begins a screen capture session.  Returns true if
@@ -56,17 +56,19 @@
 bool ScreenCaptureGDI::Startup()
 {
     // Tell Windows our app is "DPI aware" so it doesn't give us
-    // artificially scaled screen size values below. 
-    ::SetProcessDPIAware();
+    // artificially scaled screen size values below.  This holds
+    // for the rest of the process, so it is only done once.
+    static const BOOL dpiAware = ::SetProcessDPIAware();
+    (void)dpiAware;
 
-    // Determine the dimensions of the frame buffer.
-    m_width  = GetSystemMetrics(SM_CXSCREEN);
-    m_height = GetSystemMetrics(SM_CYSCREEN);
-    if (GetSystemMetrics(SM_CMONITORS) > 1)
-    {
-       m_width  = GetSystemMetrics(SM_CXVIRTUALSCREEN);
-       m_height = GetSystemMetrics(SM_CYVIRTUALSCREEN);
-    }
+    // Determine the area of the desktop we capture:  the
+    // whole virtual screen, whose origin is negative when a
+    // monitor sits above or left of the primary one.
+    m_screen.left   = GetSystemMetrics(SM_XVIRTUALSCREEN);
+    m_screen.top    = GetSystemMetrics(SM_YVIRTUALSCREEN);
+    m_screen.right  = m_screen.left + GetSystemMetrics(SM_CXVIRTUALSCREEN);
+    m_screen.bottom = m_screen.top  + GetSystemMetrics(SM_CYVIRTUALSCREEN);
+    m_source = m_screen;
 
     // Create a memory display context that's compatible with the screen.
     HDC hdcScreen = GetDC(GetDesktopWindow());
@@ -75,35 +77,235 @@ bool ScreenCaptureGDI::Startup()
     if (m_hdcMem == nullptr)
        return false;
 
-    // Create a DIB section the same size as the screen.
-    // This will be our in-memory frame buffer.
-    BITMAPINFOHEADER hdr = {0};
-    hdr.biSize = sizeof(hdr);
-    hdr.biWidth = m_width;
-    hdr.biHeight = m_height;
-    hdr.biBitCount = 32;
-    hdr.biPlanes = 1;
-    m_dibSection = CreateDIBSection(reinterpret_cast<HDC>(m_hdcMem),
-                         reinterpret_cast<BITMAPINFO *>(&hdr), DIB_RGB_COLORS,
-                         reinterpret_cast<void **>(&m_dibBits), nullptr, 0);
-    if (m_dibSection == nullptr || m_dibBits == nullptr)
+    if (!CreateFrameBuffer(m_source.right - m_source.left, m_source.bottom - m_source.top))
     {
        DeleteDC(reinterpret_cast<HDC>(m_hdcMem));
        m_hdcMem = nullptr;
        return false;
     }
 
-    m_depth = hdr.biBitCount;
-    m_stride = m_width * hdr.biBitCount / 8;
-    while (m_stride % 4)
-       ++m_stride;
+    return true;
+}
+
+//
+// Creates a DIB section of the given size, selects it into
+// the memory display context in place of any previous ones,
+// and resets the dirty rectangle to the whole frame, which also
+// restarts change detection.  Returns
+// true if successful.
+//
+bool ScreenCaptureGDI::CreateFrameBuffer(unsigned width, unsigned height)
+{
+    FrameSlot slot;
+    if (!CreateFrameSlot(width, height, slot))
+       return false;
 
     // Select the DIB section we just created into the memory display context.
     // This will allow Windows to draw on the DIB *and* allows us direct access
     // to the pixels of the DIB.
-    m_dibOld = static_cast<HBITMAP>(SelectObject(reinterpret_cast<HDC>(m_hdcMem), m_dibSection));
+    GdiFlush();
+    HGDIOBJ prev = SelectObject(reinterpret_cast<HDC>(m_hdcMem), slot.dib);
+    if (m_slots.empty())
+       m_dibOld = prev;
+    ReleaseFrameSlots();
+    m_slots.push_back(std::move(slot));
+    m_slot = 0;
+    m_dibBits = m_slots[0].bits;
+    m_frameTime = 0;
+
+    m_width = width;
+    m_height = height;
+    m_depth = 32;
+    m_stride = m_width * m_depth / 8;
+
+    // The first frame of a new size has nothing to compare
+    // with, so report the whole frame as changed.
+    SetFullDirtyRect();
+    m_tileHashes.clear();
+
+    GdiFlush();
+    return true;
+}
+
+//
+// Reports the whole frame as changed.
+//
+void ScreenCaptureGDI::SetFullDirtyRect()
+{
+    ScreenCaptureRect full;
+    full.right  = m_width;
+    full.bottom = m_height;
+    m_dirtyRects.assign(1, full);
+    m_frameChanged = true;
+}
+
+//
+// Creates a DIB section of the given size in a buffer from the
+// frame pool, or in memory of its own if the pool has nothing
+// to give.  Returns true if successful.
+//
+bool ScreenCaptureGDI::CreateFrameSlot(unsigned width, unsigned height, FrameSlot &slot)
+{
+    // A negative height makes it a top-down DIB, so the
+    // scanlines are already in top-to-bottom order and never
+    // need flipping.  At 32 bits per pixel the scanlines are
+    // always DWORD aligned, as GDI requires.
+    BITMAPINFOHEADER hdr = {0};
+    hdr.biSize = sizeof(hdr);
+    hdr.biWidth = width;
+    hdr.biHeight = -static_cast<LONG>(height);
+    hdr.biBitCount = 32;
+    hdr.biPlanes = 1;
 
+    // GDI maps its own view of the pool buffer's section, so
+    // the pixels it draws show up at the buffer's address too.
+    slot.frame = m_framePool.Allocate(static_cast<size_t>(width) * 4 * height);
+    HANDLE section = slot.frame ? reinterpret_cast<HANDLE>(slot.frame.GetSection()) : nullptr;
+    uint8_t *bits = nullptr;
+    HBITMAP dib = CreateDIBSection(reinterpret_cast<HDC>(m_hdcMem),
+                         reinterpret_cast<BITMAPINFO *>(&hdr), DIB_RGB_COLORS,
+                         reinterpret_cast<void **>(&bits), section, 0);
+    if (dib == nullptr || bits == nullptr)
+    {
+       if (dib)
+          DeleteObject(dib);
+       slot.frame.Reset();
+       return false;
+    }
+
+    slot.dib = dib;
+    slot.bits = bits;
+    return true;
+}
+
+//
+// Selects the given DIB section into the memory display
+// context, so the next frame is drawn into it.
+//
+void ScreenCaptureGDI::SelectFrameSlot(size_t index)
+{
     GdiFlush();
+    SelectObject(reinterpret_cast<HDC>(m_hdcMem), m_slots[index].dib);
+    m_slot = index;
+    m_dibBits = m_slots[index].bits;
+}
+
+//
+// Makes sure the DIB section selected into the memory display
+// context is one that nobody else holds the buffer of, so the
+// next frame can be drawn into it.  Another DIB section is
+// created if they are all held.  Returns false if the pool
+// has reached its limit.
+//
+bool ScreenCaptureGDI::SelectFreeSlot()
+{
+    if (!m_slots[m_slot].frame.IsShared())
+        return true;
+
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        if (m_slots[i].frame && !m_slots[i].frame.IsShared())
+        {
+            SelectFrameSlot(i);
+            return true;
+        }
+    }
+
+    FrameSlot slot;
+    if (!CreateFrameSlot(m_width, m_height, slot) || !slot.frame)
+    {
+        if (slot.dib)
+            DeleteObject(slot.dib);
+        return false;
+    }
+    m_slots.push_back(std::move(slot));
+    SelectFrameSlot(m_slots.size() - 1);
+    return true;
+}
+
+//
+// Deletes the DIB sections, none of which may be selected into
+// the memory display context.  Handles to their buffers that
+// were given out stay valid.
+//
+void ScreenCaptureGDI::ReleaseFrameSlots()
+{
+    for (auto &slot : m_slots)
+        DeleteObject(slot.dib);
+    m_slots.clear();
+    m_dibBits = nullptr;
+}
+
+//
+// Restricts capture to a region of the desktop, clipped to
+// the virtual screen.  The frame buffer is reallocated if the
+// size of the region changes.  Returns false if the region
+// doesn't overlap the screen.
+//
+bool ScreenCaptureGDI::SetCaptureRegion(const ScreenCaptureRect &region)
+{
+    if (m_hdcMem == nullptr)
+        return false; // Not initialized yet!
+
+    RECT screen = { m_screen.left, m_screen.top, m_screen.right, m_screen.bottom };
+    RECT wanted = { region.left, region.top, region.right, region.bottom };
+    RECT clipped;
+    if (!IntersectRect(&clipped, &screen, &wanted))
+        return false;
+
+    unsigned width  = m_scaledWidth  ? m_scaledWidth  : clipped.right - clipped.left;
+    unsigned height = m_scaledHeight ? m_scaledHeight : clipped.bottom - clipped.top;
+    if (width != m_width || height != m_height)
+    {
+        if (!CreateFrameBuffer(width, height))
+            return false;
+    }
+
+    m_source.left   = clipped.left;
+    m_source.top    = clipped.top;
+    m_source.right  = clipped.right;
+    m_source.bottom = clipped.bottom;
+    return true;
+}
+
+//
+// Goes back to capturing the whole virtual screen.
+//
+void ScreenCaptureGDI::ClearCaptureRegion()
+{
+    if (m_hdcMem != nullptr)
+        SetCaptureRegion(m_screen);
+}
+
+//
+// Sets the size that frames are scaled to, or goes back to the
+// size of the captured area if both are zero.  The frame buffer
+// is reallocated if its size changes.  Returns false if the
+// size is too small.
+//
+bool ScreenCaptureGDI::SetOutputSize(unsigned width, unsigned height)
+{
+    if (m_hdcMem == nullptr)
+        return false; // Not initialized yet!
+
+    if (width || height)
+    {
+        if (width < 2 || height < 2)
+            return false;
+        width  &= ~1u;
+        height &= ~1u;
+    }
+    m_scaledWidth  = width;
+    m_scaledHeight = height;
+
+    if (!width)
+    {
+        width  = m_source.right - m_source.left;
+        height = m_source.bottom - m_source.top;
+    }
+    if (width != m_width || height != m_height)
+        return CreateFrameBuffer(width, height);
+
     return true;
 }
 
@@ -118,13 +320,53 @@ void ScreenCaptureGDI::Shutdown()
       SelectObject(reinterpret_cast<HDC>(m_hdcMem), m_dibOld);
    if (m_hdcMem)
       DeleteDC(reinterpret_cast<HDC>(m_hdcMem));
-   if (m_dibSection)
-      DeleteObject(m_dibSection);
+   ReleaseFrameSlots();
+   m_framePool.Trim();
 
     m_dibOld = nullptr;
     m_hdcMem = nullptr;
-    m_dibSection = nullptr;
+    m_slot = 0;
+    m_frameTime = 0;
+    m_dirtyRects.clear();
+    m_screen = m_source = ScreenCaptureRect();
     m_width = m_height = m_depth = m_stride = 0;
+    m_scaledWidth = m_scaledHeight = 0;
+    m_tileHashes.clear();
+    m_frameChanged = true;
+}
+
+//
+// Enables or disables change detection.
+//
+bool ScreenCaptureGDI::SetIncrementalCapture(bool enable)
+{
+    m_detectChanges = enable;
+    m_tileHashes.clear();
+    SetFullDirtyRect();
+    return true;
+}
+
+//
+// Makes the last frame captured the current one again, all of it
+// changed.
+//
+bool ScreenCaptureGDI::RestoreLastFrame()
+{
+    if (!m_width || !GetFrameBuffer())
+        return false;
+    SetFullDirtyRect();
+    return true;
+}
+
+//
+// Captures a frame, and tells whether it changed if change
+// detection is enabled.
+//
+ScreenCaptureResult ScreenCaptureGDI::WaitForFrame(unsigned /*timeoutMs*/)
+{
+    if (!CaptureFrame())
+        return ScreenCaptureResult_Error;
+    return m_frameChanged ? ScreenCaptureResult_Frame : ScreenCaptureResult_NoChange;
 }
 
 //
@@ -138,29 +380,113 @@ bool ScreenCaptureGDI::CaptureFrame()
     if (m_hdcMem == nullptr || m_width == 0)
         return false; // Not initialized yet!
 
+    // Don't draw over a frame that somebody is still using.
+    if (!SelectFreeSlot())
+        return false;
+
     // Copy pixels from the screen's display context to our
-    // frame buffer.
+    // frame buffer, scaling them if the sizes differ.  HALFTONE
+    // averages the pixels that are dropped when shrinking.
+    LARGE_INTEGER copyStart;
+    QueryPerformanceCounter(&copyStart);
     GdiFlush();
     HDC hdcScreen = GetDC(GetDesktopWindow());
-    BitBlt(reinterpret_cast<HDC>(m_hdcMem), 0, 0, m_width, m_height,
-       hdcScreen, 0, 0, SRCCOPY | CAPTUREBLT);
+    HDC hdcMem = reinterpret_cast<HDC>(m_hdcMem);
+    const int sourceWidth  = m_source.right - m_source.left;
+    const int sourceHeight = m_source.bottom - m_source.top;
+    if (sourceWidth == static_cast<int>(m_width) && sourceHeight == static_cast<int>(m_height))
+    {
+        BitBlt(hdcMem, 0, 0, m_width, m_height,
+           hdcScreen, m_source.left, m_source.top, SRCCOPY | CAPTUREBLT);
+    }
+    else
+    {
+        SetStretchBltMode(hdcMem, HALFTONE);
+        SetBrushOrgEx(hdcMem, 0, 0, nullptr);
+        StretchBlt(hdcMem, 0, 0, m_width, m_height,
+           hdcScreen, m_source.left, m_source.top, sourceWidth, sourceHeight,
+           SRCCOPY | CAPTUREBLT);
+    }
     ReleaseDC(GetDesktopWindow(), hdcScreen);
 
-    // GDI captures the scanlines in bottom-to-top order, so
-    // we need to reorder the scanlines in top-to-bottom order.
-    std::vector<uint8_t> scanline(m_stride);
-    uint8_t *scanline1 = m_dibBits;
-    uint8_t *scanline2 = m_dibBits + (m_height - 1) * m_stride;
-    for (unsigned y = 0; y < m_height / 2; y++)
-    {
-        memcpy(scanline.data(), scanline1, m_stride);
-        memcpy(scanline1, scanline2, m_stride);
-        memcpy(scanline2, scanline.data(), m_stride);
+    // Make sure GDI is done drawing before the caller looks
+    // at the pixels.
+    GdiFlush();
+
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    m_frameTime = qpc.QuadPart;
 
-        scanline1 += m_stride;
-        scanline2 -= m_stride;
+    if (m_detectChanges)
+    {
+        DetectChanges();
+        LARGE_INTEGER detectEnd;
+        QueryPerformanceCounter(&detectEnd);
+        m_timings.copy = detectEnd.QuadPart - copyStart.QuadPart;
+    }
+    else
+    {
+        m_timings.copy = qpc.QuadPart - copyStart.QuadPart;
     }
 
+    FrameInfo info;
+    info.width  = m_width;
+    info.height = m_height;
+    info.stride = m_stride;
+    info.depth  = m_depth;
+    info.time   = m_frameTime;
+    m_slots[m_slot].frame.SetInfo(info);
     return true;
 }
 
+
+//
+// Hashes the tiles of the frame just captured and compares
+// them with the ones of the frame before, setting the dirty
+// rectangles to the runs of tiles that changed.  Each frame
+// is drawn in full, whichever DIB section it went into, so the
+// comparison is always with the previous frame.
+//
+void ScreenCaptureGDI::DetectChanges()
+{
+    const unsigned across = (m_width + ChangeTileSize - 1) / ChangeTileSize;
+    const unsigned down   = (m_height + ChangeTileSize - 1) / ChangeTileSize;
+    m_newTileHashes.resize(static_cast<size_t>(across) * down);
+    PixelOps::HashTiles(m_dibBits, m_stride, m_width, m_height,
+        ChangeTileSize, m_newTileHashes.data(), m_hashLanes);
+
+    if (m_tileHashes.size() != m_newTileHashes.size())
+    {
+        // Nothing to compare with yet.
+        SetFullDirtyRect();
+    }
+    else
+    {
+        m_dirtyRects.clear();
+        for (unsigned ty = 0; ty < down; ty++)
+        {
+            const size_t row = static_cast<size_t>(ty) * across;
+            for (unsigned tx = 0; tx < across; tx++)
+            {
+                if (m_newTileHashes[row + tx] == m_tileHashes[row + tx])
+                    continue;
+
+                // Take in the rest of the run of changed tiles.
+                unsigned end = tx + 1;
+                while (end < across && m_newTileHashes[row + end] != m_tileHashes[row + end])
+                    end++;
+
+                ScreenCaptureRect r;
+                r.left   = static_cast<int>(tx * ChangeTileSize);
+                r.top    = static_cast<int>(ty * ChangeTileSize);
+                r.right  = static_cast<int>(min(end * ChangeTileSize, m_width));
+                r.bottom = static_cast<int>(min((ty + 1) * ChangeTileSize, m_height));
+                m_dirtyRects.push_back(r);
+                tx = end;
+            }
+        }
+        m_frameChanged = !m_dirtyRects.empty();
+    }
+
+    m_tileHashes.swap(m_newTileHashes);
+}
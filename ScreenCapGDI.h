@@ -41,27 +41,31 @@
 
 #pragma once
 #include <cstdint>
+#include <vector>
+#include "ScreenCapBackend.h"
 
 //---------------------------------------------------------------
 // A class to grab screenshots using Windows GDI.
 //---------------------------------------------------------------
-class ScreenCaptureGDI
+class ScreenCaptureGDI : public ScreenCaptureBackend
 {
 public:
     ScreenCaptureGDI()  { }
     ~ScreenCaptureGDI() { Shutdown(); }
 
+    ScreenCaptureMode GetMode() const override { return ScreenCaptureMode_GDI; }
+
     //
     // Begins a screen capture session.  Returns true if
     // successful.
     //
-    bool Startup();
+    bool Startup() override;
 
     //
     // Stops the screen capture session and releases any
     // allocated resources.
     //
-    void Shutdown();
+    void Shutdown() override;
 
     //
     // Attempts to capture the next frame from the screen.
@@ -69,32 +73,150 @@ public:
     // buffer that can be accessed via GetCapturedFrame()
     // (see below).  Returns true if successful.
     //
-    bool CaptureFrame();
+    bool CaptureFrame() override;
+
+    //
+    // Captures a frame the same way as CaptureFrame().  GDI
+    // can't wait for the screen to change, so this returns
+    // right away, without waiting for 'timeoutMs'.  With change
+    // detection enabled (see SetIncrementalCapture()), returns
+    // ScreenCaptureResult_NoChange if the frame came out the
+    // same as the one before, so the caller can skip it.
+    //
+    ScreenCaptureResult WaitForFrame(unsigned timeoutMs) override;
+
+    // Hands out the last frame again.  See ScreenCaptureBackend.
+    bool RestoreLastFrame() override;
+
+    //
+    // Enables or disables change detection.  GDI has no way to
+    // tell what changed on the screen, so when enabled, each
+    // captured frame is hashed in tiles of ChangeTileSize
+    // pixels and compared with the frame before.  The dirty
+    // rectangles then cover only the tiles that changed, one
+    // rectangle for each run of changed tiles across a row,
+    // and are empty if nothing changed.  The whole frame is
+    // still copied from the screen, so the frame buffer always
+    // holds the complete frame.  Disabled by default, in which
+    // case the whole frame is reported as changed.
+    //
+    bool SetIncrementalCapture(bool enable) override;
+    bool GetIncrementalCapture() const { return m_detectChanges; }
+
+    // Size of the tiles compared by change detection, in pixels.
+    static const unsigned ChangeTileSize = 32;
+
+    //
+    // Restricts capture to a region of the screen, given in
+    // desktop coordinates (the same as window rectangles), so
+    // only that region is copied into the frame buffer.  The
+    // region is clipped to the screen and the frame buffer
+    // takes on its size.  Returns false if the region doesn't
+    // overlap the screen.
+    //
+    bool SetCaptureRegion(const ScreenCaptureRect &region) override;
+    void ClearCaptureRegion() override;
+
+    //
+    // Scales every frame to the given size, rounded down to
+    // even numbers, instead of the size of the captured area.
+    // GDI does the scaling while it copies from the screen.
+    // Pass zero for both to go back to the captured size.
+    // Returns false if the size is too small.
+    //
+    bool SetOutputSize(unsigned width, unsigned height) override;
 
     // Retrieve the dimensions and format of the captured
     // frame image.
-    unsigned GetFrameWidth()  const { return m_width;  }
-    unsigned GetFrameHeight() const { return m_height; }
-    unsigned GetFrameDepth()  const { return m_depth;  }
-    unsigned GetFrameStride() const { return m_stride; }
+    unsigned GetFrameWidth()  const override { return m_width;  }
+    unsigned GetFrameHeight() const override { return m_height; }
+    unsigned GetFrameDepth()  const override { return m_depth;  }
+    unsigned GetFrameStride() const override { return m_stride; }
+
+    // Returns the time the frame was captured, in
+    // QueryPerformanceCounter() ticks.  GDI doesn't know when
+    // the screen was last drawn.
+    int64_t GetFrameTime() const override { return m_frameTime; }
+
+    // Returns true if the scanlines of the frame buffer are in
+    // bottom-to-top order.  The DIB section is top-down, so
+    // this is always false.
+    bool IsFrameBottomUp() const override { return false; }
 
     //
     // Returns a pointer to the frame buffer pixels of
     // the captured image.
     //
-    const uint8_t *GetFrameBuffer() const { return m_dibBits; }
+    const uint8_t *GetFrameBuffer() const override { return m_dibBits; }
     const uint8_t *GetFrameBufferScanlinePtr(unsigned y) const { if (!m_dibBits) return nullptr; return m_dibBits + (m_stride * y); }
     const uint8_t *GetFrameBufferPixelPtr(unsigned y, unsigned x) const { if (!m_dibBits) return nullptr; return m_dibBits + (m_stride * y) + (x * m_depth / 8); }
 
+    //
+    // Returns the list of rectangles of the frame buffer that
+    // changed in the most recently captured frame.  This is
+    // the whole frame unless change detection is enabled.
+    //
+    const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const override { return m_dirtyRects; }
+
+    //
+    // Returns a handle to the buffer that holds the captured
+    // frame.  GDI draws straight into buffers from the pool, so
+    // this costs no copy.  While the handle is held, frames are
+    // captured into other buffers.
+    //
+    FrameHandle GetFrameHandle() const override { return m_frameTime && !m_slots.empty() ? m_slots[m_slot].frame : FrameHandle(); }
+    void SetMaxFrameBuffers(unsigned count) override { m_framePool.SetMaxBuffers(count); }
+
+    //
+    // Returns how long the last capture took.  GDI copies the
+    // screen in one step, timed as the copy stage along with
+    // any change detection.
+    //
+    ScreenCaptureTimings GetFrameTimings() const override { return m_timings; }
+
 private:
+    //
+    // A DIB section that GDI draws frames into, and the pool
+    // buffer it is made from.  The handle is empty if the pool
+    // couldn't supply a buffer and the DIB has its own memory.
+    //
+    struct FrameSlot
+    {
+        FrameHandle frame;
+        void *      dib = nullptr;
+        uint8_t *   bits = nullptr;
+    };
+
     unsigned       m_width = 0;               // Width of frame in pixels.
     unsigned       m_height = 0;              // Height of frame in pixels.
     unsigned       m_depth = 0;               // Color depth of frame in bits per pixel.
     int            m_stride = 0;              // Offset between first byte of each scanline in DIB section.
+    int64_t        m_frameTime = 0;           // When the last frame was captured, in QPC ticks.
     // Note these are void pointer so we can avoid having to include windows.h in here.
     void *         m_hdcMem = nullptr;        // Handle to memory display context that we created.
-    void *         m_dibSection = nullptr;    // DIB section selected into memory display context.
     void *         m_dibOld = nullptr;        // Original DIB section from display context so we can restore it later.
-    uint8_t *      m_dibBits = nullptr;       // Pointer to the raw pixel array of m_dibSection.
+    uint8_t *      m_dibBits = nullptr;       // Pointer to the raw pixel array of the selected DIB section.
+    FramePool      m_framePool;               // Buffers the DIB sections are made from.
+    std::vector<FrameSlot> m_slots;           // DIB sections of the current frame size.
+    size_t         m_slot = 0;                // Which of m_slots is selected into m_hdcMem.
+    std::vector<ScreenCaptureRect> m_dirtyRects; // Changed regions of the last captured frame.
+    ScreenCaptureTimings m_timings;           // How long the last capture took.
+    ScreenCaptureRect m_screen;               // Virtual screen in desktop coordinates.
+    ScreenCaptureRect m_source;               // Area of the desktop being captured.
+    unsigned       m_scaledWidth = 0;         // Size frames are scaled to, or zero
+    unsigned       m_scaledHeight = 0;        // for the size of m_source.
+    bool           m_detectChanges = false;   // Compare each frame with the one before?
+    bool           m_frameChanged = true;     // Did the last frame differ from the one before?
+    std::vector<uint64_t> m_tileHashes;       // Tile hashes of the last frame, or empty for none.
+    std::vector<uint64_t> m_newTileHashes;    // Tile hashes of the frame being compared.
+    std::vector<uint32_t> m_hashLanes;        // Scratch space for hashing the tiles.
+
+    bool CreateFrameBuffer(unsigned width, unsigned height);
+    bool CreateFrameSlot(unsigned width, unsigned height, FrameSlot &slot);
+    bool SelectFreeSlot();
+    void SelectFrameSlot(size_t index);
+    void ReleaseFrameSlots();
+    void DetectChanges();
+    void SetFullDirtyRect();
 };
 
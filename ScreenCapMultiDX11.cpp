@@ -0,0 +1,516 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapMultiDX11.cpp
+// Implementation of C++ class to capture all of the screens of a
+// PC at once, using DirectX 11 output duplication on each one.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ScreenCapMultiDX11.h"
+#include "PixelOps.h"
+#include <climits>
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Marks a wait with no deadline.
+static const int64_t NoDeadline = INT64_MAX;
+
+// Longest time an output thread waits at once, so it notices
+// Shutdown() while its screen stays unchanged.
+static const unsigned StopCheckMs = 500;
+
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+//
+// Returns the QueryPerformanceCounter() time 'timeoutMs'
+// milliseconds from now, or NoDeadline for INFINITE.
+//
+static int64_t GetDeadline(unsigned timeoutMs)
+{
+    if (timeoutMs == INFINITE)
+        return NoDeadline;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return GetQpc() + freq.QuadPart * timeoutMs / 1000;
+}
+
+//
+// Returns the milliseconds left until 'deadline', rounded up,
+// or INFINITE if there is no deadline.
+//
+static DWORD GetRemainingMs(int64_t deadline)
+{
+    if (deadline == NoDeadline)
+        return INFINITE;
+    const int64_t now = GetQpc();
+    if (now >= deadline)
+        return 0;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return static_cast<DWORD>(((deadline - now) * 1000 + freq.QuadPart - 1) / freq.QuadPart);
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Begins a screen capture session on every output attached to
+// the desktop.  Returns true if at least one output was started.
+//
+bool ScreenCaptureMultiDX11::Startup()
+{
+    Shutdown();
+
+    std::vector<ScreenCaptureOutputInfo> infos;
+    if (!ScreenCaptureDX11::EnumerateOutputs(infos))
+        return false;
+
+    for (const auto &info : infos)
+    {
+        // We wait on one event per output.
+        if (m_outputs.size() >= MAXIMUM_WAIT_OBJECTS)
+            break;
+
+        auto output = std::make_unique<Output>();
+        if (!output->capture.Startup(info.adapterIndex, info.outputIndex))
+            continue; // Skip outputs we can't duplicate.
+
+        output->desktopRect = output->capture.GetOutputRect();
+        m_outputs.push_back(std::move(output));
+    }
+    if (m_outputs.empty())
+        return false;
+
+    UpdateLayout();
+
+    for (auto &output : m_outputs)
+    {
+        output->startEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        output->doneEvent  = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (!output->startEvent || !output->doneEvent)
+        {
+            Shutdown();
+            return false;
+        }
+        output->thread = std::thread(&ScreenCaptureMultiDX11::OutputThread, this, output.get());
+    }
+
+    return true;
+}
+
+//
+// Stops the screen capture session and releases any
+// allocated resources.
+//
+void ScreenCaptureMultiDX11::Shutdown()
+{
+    m_stopping = true;
+    for (auto &output : m_outputs)
+    {
+        if (output->thread.joinable())
+        {
+            SetEvent(output->startEvent);
+            output->thread.join();
+        }
+        if (output->startEvent)
+            CloseHandle(output->startEvent);
+        if (output->doneEvent)
+            CloseHandle(output->doneEvent);
+        output->capture.Shutdown();
+    }
+    m_stopping = false;
+
+    m_outputs.clear();
+    m_frameBuffer.clear();
+    m_frameDirtyRects.clear();
+    m_width = m_height = m_frameWidth = m_frameHeight = 0;
+    m_desktopLeft = m_desktopTop = 0;
+    m_frameTime = 0;
+}
+
+//
+// Captures the next frame from all of the outputs in parallel.
+// Returns true if any of them changed.
+//
+bool ScreenCaptureMultiDX11::CaptureFrame()
+{
+    const ScreenCaptureResult result = WaitForFrame(ScreenCaptureDX11::DefaultFrameTimeout);
+    return result == ScreenCaptureResult_Frame || result == ScreenCaptureResult_ModeChanged;
+}
+
+//
+// Waits for the next frame from all of the outputs in
+// parallel.  Each output thread blocks in its own output's
+// duplication until the deadline, and we block on their done
+// events, so nothing runs until a screen changes.  Once one
+// output has a frame, the others that also have one are
+// collected without waiting, and those still waiting are left
+// to their threads; what they capture is delivered by a later
+// call.
+//
+ScreenCaptureResult ScreenCaptureMultiDX11::WaitForFrame(unsigned timeoutMs)
+{
+    // Assume we won't capture an image.
+    m_frameWidth = m_frameHeight = 0;
+    m_frameDirtyRects.clear();
+
+    if (m_outputs.empty())
+        return ScreenCaptureResult_Error; // Not initialized yet!
+
+    const int64_t deadline = GetDeadline(timeoutMs);
+    for (auto &output : m_outputs)
+        output->finished = false;
+
+    bool captured = false;
+    std::vector<HANDLE> events;
+    std::vector<Output *> waiting;
+    for (;;)
+    {
+        // Set the idle outputs waiting for their screens, until
+        // one of the outputs has something.  Setting the start
+        // event publishes the deadline to the thread.
+        if (!captured)
+        {
+            for (auto &output : m_outputs)
+            {
+                if (!output->busy && !output->finished)
+                {
+                    output->deadline = deadline;
+                    output->busy = true;
+                    SetEvent(output->startEvent);
+                }
+            }
+        }
+
+        events.clear();
+        waiting.clear();
+        for (auto &output : m_outputs)
+        {
+            if (output->busy)
+            {
+                events.push_back(output->doneEvent);
+                waiting.push_back(output.get());
+            }
+        }
+        if (events.empty())
+            break;
+
+        const DWORD wait = WaitForMultipleObjects(static_cast<DWORD>(events.size()),
+            events.data(), FALSE, captured ? 0 : GetRemainingMs(deadline));
+        if (wait >= WAIT_OBJECT_0 + events.size())
+            break; // Timed out.
+
+        // The output's thread is idle again, so its capture
+        // object is ours until we start it again.
+        Output &output = *waiting[wait - WAIT_OBJECT_0];
+        output.busy = false;
+        output.desktopRect = output.capture.GetOutputRect();
+        if (output.captured)
+        {
+            captured = true;
+            output.finished = true;
+            if (!output.modeChanged)
+                CompositeOutput(output);
+        }
+        else if (output.failed || GetRemainingMs(deadline) == 0)
+        {
+            // Failed outputs aren't retried until the next call.
+            output.finished = true;
+        }
+    }
+
+    // Outputs that changed mode weren't composited, because
+    // the layout of the virtual desktop may have changed too.
+    bool modeChanged = false;
+    for (const auto &output : m_outputs)
+    {
+        if (output->finished && output->captured && output->modeChanged)
+            modeChanged = true;
+    }
+    if (modeChanged)
+    {
+        UpdateLayout();
+        for (auto &output : m_outputs)
+        {
+            if (output->finished && output->captured && output->modeChanged)
+            {
+                output->composited = false;
+                CompositeOutput(*output);
+            }
+        }
+    }
+
+    bool failed = true;
+    for (const auto &output : m_outputs)
+    {
+        if (!output->finished || !output->failed)
+            failed = false;
+        if (output->finished && output->captured)
+        {
+            m_frameTime = max(m_frameTime, output->capture.GetFrameTime());
+            m_frameDirtyRects.insert(m_frameDirtyRects.end(),
+                output->dirtyRects.begin(), output->dirtyRects.end());
+        }
+    }
+    if (!captured)
+        return failed ? ScreenCaptureResult_Error : ScreenCaptureResult_NoChange;
+
+    m_frameWidth  = m_width;
+    m_frameHeight = m_height;
+    if (!modeChanged)
+        return ScreenCaptureResult_Frame;
+
+    // Everything may have moved.
+    ScreenCaptureRect whole;
+    whole.right  = static_cast<int>(m_width);
+    whole.bottom = static_cast<int>(m_height);
+    m_frameDirtyRects.assign(1, whole);
+    return ScreenCaptureResult_ModeChanged;
+}
+
+//
+// Makes the virtual desktop frame buffer the captured frame
+// again, all of it changed.
+//
+bool ScreenCaptureMultiDX11::RestoreLastFrame()
+{
+    if (!m_width || !m_height || m_frameBuffer.empty())
+        return false;
+
+    m_frameWidth  = m_width;
+    m_frameHeight = m_height;
+    ScreenCaptureRect whole;
+    whole.right  = static_cast<int>(m_width);
+    whole.bottom = static_cast<int>(m_height);
+    m_frameDirtyRects.assign(1, whole);
+    return true;
+}
+
+//
+// Enables or disables pipelined readback on all outputs.
+//
+bool ScreenCaptureMultiDX11::SetPipelinedReadback(bool enable)
+{
+    for (auto &output : m_outputs)
+        output->capture.SetPipelinedReadback(enable);
+    return true;
+}
+
+//
+// Enables or disables incremental capture on all outputs.
+//
+bool ScreenCaptureMultiDX11::SetIncrementalCapture(bool enable)
+{
+    for (auto &output : m_outputs)
+        output->capture.SetIncrementalCapture(enable);
+    return true;
+}
+
+//
+// Enables or disables drawing the mouse pointer on all
+// outputs.  DXGI only reports the pointer as visible on the
+// output it is on.
+//
+bool ScreenCaptureMultiDX11::SetCursorCapture(bool enable)
+{
+    for (auto &output : m_outputs)
+        output->capture.SetCursorCapture(enable);
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Body of the thread that captures one output.  Each time it
+// is asked to, waits for the output's screen to change until
+// the deadline it was given, until the session stops.  The
+// frame is composited by WaitForFrame(), not here, since the
+// caller may be using the frame buffer while we wait.
+//
+void ScreenCaptureMultiDX11::OutputThread(Output *output)
+{
+    for (;;)
+    {
+        WaitForSingleObject(output->startEvent, INFINITE);
+        if (m_stopping)
+            break;
+
+        ScreenCaptureResult result = ScreenCaptureResult_NoChange;
+        for (;;)
+        {
+            const DWORD left = GetRemainingMs(output->deadline);
+            result = output->capture.WaitForFrame(min(left, static_cast<DWORD>(StopCheckMs)));
+            if (result != ScreenCaptureResult_NoChange || m_stopping ||
+                GetRemainingMs(output->deadline) == 0)
+            {
+                break;
+            }
+        }
+
+        output->failed   = (result == ScreenCaptureResult_Error);
+        output->captured = (result == ScreenCaptureResult_Frame ||
+                            result == ScreenCaptureResult_ModeChanged) &&
+                           output->capture.GetFrameWidth() > 0;
+        output->modeChanged = output->captured && (result == ScreenCaptureResult_ModeChanged);
+
+        SetEvent(output->doneEvent);
+    }
+}
+
+//
+// Works out the size of the virtual desktop and where each
+// output goes in the frame buffer, from the outputs' current
+// positions on the desktop.  What the frame buffer held for
+// an output that kept its size is moved to the output's new
+// area; any other output is copied in full the next time it
+// is composited.
+//
+void ScreenCaptureMultiDX11::UpdateLayout()
+{
+    // The virtual desktop is the bounding box of all outputs,
+    // which may start at negative coordinates.
+    int left = INT_MAX, top = INT_MAX, right = INT_MIN, bottom = INT_MIN;
+    for (const auto &output : m_outputs)
+    {
+        const ScreenCaptureRect &r = output->desktopRect;
+        left   = min(left,   r.left);
+        top    = min(top,    r.top);
+        right  = max(right,  r.right);
+        bottom = max(bottom, r.bottom);
+    }
+
+    std::vector<uint8_t> oldFrameBuffer;
+    oldFrameBuffer.swap(m_frameBuffer);
+    const ptrdiff_t oldStride = static_cast<ptrdiff_t>(m_width) * 4;
+
+    m_desktopLeft = left;
+    m_desktopTop  = top;
+    m_width  = static_cast<unsigned>(right - left);
+    m_height = static_cast<unsigned>(bottom - top);
+    m_frameBuffer.assign(static_cast<size_t>(m_width) * m_height * 4, 0);
+    const ptrdiff_t stride = static_cast<ptrdiff_t>(m_width) * 4;
+
+    for (auto &output : m_outputs)
+    {
+        const ScreenCaptureRect old = output->rect;
+        ScreenCaptureRect &r = output->rect;
+        r = output->desktopRect;
+        r.left   -= left;
+        r.right  -= left;
+        r.top    -= top;
+        r.bottom -= top;
+
+        const int width  = r.right - r.left;
+        const int height = r.bottom - r.top;
+        if (output->composited && width == old.right - old.left && height == old.bottom - old.top)
+        {
+            PixelOps::CopyImage(
+                m_frameBuffer.data() + r.top * stride + r.left * 4, stride,
+                oldFrameBuffer.data() + old.top * oldStride + old.left * 4, oldStride,
+                static_cast<size_t>(width) * 4, height);
+        }
+        else
+        {
+            output->composited = false;
+        }
+    }
+}
+
+//
+// Copies the parts of an output's frame that changed into its
+// area of the virtual desktop frame buffer.  Outputs don't
+// overlap, so each output only touches its own area.
+//
+void ScreenCaptureMultiDX11::CompositeOutput(Output &output)
+{
+    const ScreenCaptureDX11 &cap = output.capture;
+    output.dirtyRects.clear();
+
+    // A rotated output's frame doesn't match its area, so only
+    // copy as much as fits.
+    const int width  = min(static_cast<int>(cap.GetFrameWidth()),
+                                output.rect.right - output.rect.left);
+    const int height = min(static_cast<int>(cap.GetFrameHeight()),
+                                output.rect.bottom - output.rect.top);
+
+    // The first frame is copied in full, since the frame buffer
+    // doesn't hold anything from this output yet.
+    std::vector<ScreenCaptureRect> whole;
+    if (!output.composited)
+    {
+        ScreenCaptureRect r;
+        r.right  = width;
+        r.bottom = height;
+        whole.push_back(r);
+    }
+    const auto &rects = output.composited ? cap.GetFrameDirtyRects() : whole;
+
+    const ptrdiff_t stride = static_cast<ptrdiff_t>(m_width) * 4;
+    for (const auto &rect : rects)
+    {
+        const int left   = max(rect.left, 0);
+        const int top    = max(rect.top, 0);
+        const int right  = min(rect.right, width);
+        const int bottom = min(rect.bottom, height);
+        if (left >= right || top >= bottom)
+            continue;
+
+        uint8_t *dst = m_frameBuffer.data() +
+            (output.rect.top + top) * stride + (output.rect.left + left) * 4;
+        PixelOps::CopyImage(dst, stride,
+            cap.GetFrameBufferPixelPtr(top, left), cap.GetFrameStride(),
+            static_cast<size_t>(right - left) * 4, bottom - top);
+
+        ScreenCaptureRect dirty;
+        dirty.left   = output.rect.left + left;
+        dirty.top    = output.rect.top + top;
+        dirty.right  = output.rect.left + right;
+        dirty.bottom = output.rect.top + bottom;
+        output.dirtyRects.push_back(dirty);
+    }
+
+    output.composited = true;
+}
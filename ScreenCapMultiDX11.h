@@ -0,0 +1,216 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapMultiDX11.h
+// Header file for C++ class to capture all of the screens of a
+// PC at once, using DirectX 11 output duplication on each one.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "ScreenCapDX11.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+//
+// This class manages a screen capture session covering every
+// output of every adapter.  Each output gets its own Direct3D
+// device and output duplication, and is captured on its own
+// worker thread, so the outputs are captured in parallel and
+// outputs on different adapters work.  The captured images are
+// composited into one 32-bit BGRA frame covering the virtual
+// desktop, and are also available separately.
+//
+// Areas of the virtual desktop that no output covers are
+// black.  Rotated outputs are copied unrotated.
+//
+class ScreenCaptureMultiDX11 : public ScreenCaptureBackend
+{
+public:
+    ScreenCaptureMultiDX11()  { }
+    ~ScreenCaptureMultiDX11() { Shutdown(); }
+
+    ScreenCaptureMode GetMode() const override { return ScreenCaptureMode_DX11All; }
+
+    //
+    // Begins a screen capture session on every output attached
+    // to the desktop.  Outputs that can't be duplicated are
+    // skipped.  Returns true if at least one output was started.
+    //
+    bool Startup() override;
+
+    //
+    // Stops the screen capture session and releases any
+    // allocated resources.
+    //
+    void Shutdown() override;
+
+    //
+    // Attempts to capture the next frame from all of the
+    // outputs.  The outputs that changed are copied into the
+    // virtual desktop frame buffer.  Returns true if any output
+    // changed, or false if none did or there was an error.
+    //
+    bool CaptureFrame() override;
+
+    //
+    // Waits up to 'timeoutMs' milliseconds (or INFINITE) on
+    // every output at once for its screen to change, then
+    // copies the outputs that changed into the frame buffer.
+    // The call returns as soon as any output has captured a
+    // frame, along with whatever the other outputs have
+    // captured by then, so a static screen doesn't hold back a
+    // busy one.  Outputs still waiting keep waiting on their
+    // threads, without polling, and what they capture is
+    // delivered by a later call.  Returns
+    // ScreenCaptureResult_Error only if every output failed.
+    //
+    // Each output recovers from a lost duplication on its own
+    // (see ScreenCaptureDX11::WaitForFrame()).  When one of
+    // them comes back with a different size or orientation,
+    // the virtual desktop is laid out again from the outputs'
+    // new positions, the whole frame is reported as dirty, and
+    // ScreenCaptureResult_ModeChanged is returned.  Outputs
+    // that are attached or detached later aren't picked up.
+    //
+    ScreenCaptureResult WaitForFrame(unsigned timeoutMs) override;
+
+    //
+    // Hands out the virtual desktop frame buffer again, after a
+    // WaitForFrame() that found no change.  Returns false if
+    // nothing was captured yet.
+    //
+    bool RestoreLastFrame() override;
+
+    //
+    // These apply the settings of the same names to all of
+    // the outputs.  See ScreenCaptureDX11.
+    //
+    bool SetPipelinedReadback(bool enable) override;
+    bool SetIncrementalCapture(bool enable) override;
+    bool SetCursorCapture(bool enable) override;
+
+    // Retrieve the dimensions and format of the captured
+    // frame image.
+    unsigned GetFrameWidth()  const override { return m_frameWidth; }
+    unsigned GetFrameHeight() const override { return m_frameHeight; }
+    unsigned GetFrameDepth()  const override { return m_frameWidth ? 32 : 0; }
+    unsigned GetFrameStride() const override { return m_frameWidth ? m_width * 4 : 0; }
+
+    // Returns the present time of the most recent change to
+    // any output in the last captured frame, in
+    // QueryPerformanceCounter() ticks.
+    int64_t GetFrameTime() const override { return m_frameTime; }
+
+    //
+    // Returns a pointer to the frame buffer pixels of the
+    // captured virtual desktop image.
+    //
+    size_t GetFrameBufferSize() const override { return m_frameBuffer.size(); }
+    const uint8_t *GetFrameBuffer() const override { return m_frameBuffer.data(); }
+
+    //
+    // Returns the list of rectangles of the frame buffer that
+    // changed in the most recently captured frame.
+    //
+    const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const override { return m_frameDirtyRects; }
+
+    //
+    // Returns the position of the virtual desktop's top left
+    // corner in desktop coordinates.  Frame buffer coordinates
+    // are relative to this.
+    //
+    int GetDesktopLeft() const { return m_desktopLeft; }
+    int GetDesktopTop()  const { return m_desktopTop;  }
+
+    //
+    // Access to the individual outputs.  GetOutputRect() is the
+    // area of the frame buffer that the output covers, and
+    // GetOutput() gives the output's own capture object, whose
+    // frame buffer holds that output's most recent frame.  The
+    // output objects must not be used during CaptureFrame() or
+    // WaitForFrame(), nor while IsOutputWaiting() says that the
+    // output's thread is still waiting for its screen.
+    //
+    unsigned GetOutputCount() const override { return static_cast<unsigned>(m_outputs.size()); }
+    ScreenCaptureRect GetOutputRect(unsigned index) const override { return m_outputs[index]->rect; }
+    const ScreenCaptureDX11 &GetOutput(unsigned index) const { return m_outputs[index]->capture; }
+    bool IsOutputWaiting(unsigned index) const { return m_outputs[index]->busy; }
+
+private:
+    // One duplicated output and the thread that captures it.
+    struct Output
+    {
+        ScreenCaptureDX11              capture;
+        ScreenCaptureRect              rect;             // Area of the frame buffer.
+        std::thread                    thread;
+        HANDLE                         startEvent = nullptr;  // Set to request a capture.
+        HANDLE                         doneEvent = nullptr;   // Set when the capture is done.
+        int64_t                        deadline = 0;          // When the capture gives up.
+
+        // Set by the thread before it sets doneEvent.
+        bool                           captured = false;      // The last capture got a frame.
+        bool                           failed = false;        // The last capture failed.
+        bool                           modeChanged = false;   // It got a frame in a new mode.
+
+        // Only used by the caller's thread.
+        bool                           busy = false;          // The thread is capturing.
+        bool                           finished = false;      // Done with in this WaitForFrame().
+        bool                           composited = false;    // A whole frame has been copied.
+        ScreenCaptureRect              desktopRect;      // Where the output was, as last seen.
+        std::vector<ScreenCaptureRect> dirtyRects;       // In frame buffer coordinates.
+    };
+
+    std::vector<std::unique_ptr<Output>> m_outputs;
+    std::atomic<bool>                    m_stopping { false };
+
+    // The virtual desktop frame buffer.  m_frameWidth and
+    // m_frameHeight are zero when the last capture got nothing.
+    std::vector<uint8_t>                 m_frameBuffer;
+    std::vector<ScreenCaptureRect>       m_frameDirtyRects;
+    unsigned                             m_width = 0;
+    unsigned                             m_height = 0;
+    unsigned                             m_frameWidth = 0;
+    unsigned                             m_frameHeight = 0;
+    int                                  m_desktopLeft = 0;
+    int                                  m_desktopTop = 0;
+    int64_t                              m_frameTime = 0;
+
+    void OutputThread(Output *output);
+    void UpdateLayout();
+    void CompositeOutput(Output &output);
+};
@@ -0,0 +1,67 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapTrace.cpp
+// Definition and registration of the TraceLogging provider
+// used by SCREENCAP_TRACE().
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ScreenCapTrace.h"
+
+#ifdef SCREENCAP_ENABLE_TRACING
+
+#pragma comment(lib, "Advapi32.lib")
+
+// The GUID is the one ETW derives from the name "ScreenCap", so
+// tools can find the provider by name.
+TRACELOGGING_DEFINE_PROVIDER(
+    g_screenCapTraceProvider,
+    "ScreenCap",
+    (0x73e436bb, 0xf74d, 0x5012, 0xce, 0x13, 0x4c, 0x5e, 0x8e, 0xa1, 0xc3, 0xe0));
+
+//
+// Registers the provider before main() runs and unregisters it
+// when the program exits, so that events can be written from
+// any thread without the rest of the code having to set
+// anything up.
+//
+static struct TraceRegistration
+{
+    TraceRegistration()  { TraceLoggingRegister(g_screenCapTraceProvider); }
+    ~TraceRegistration() { TraceLoggingUnregister(g_screenCapTraceProvider); }
+} traceRegistration;
+
+#endif
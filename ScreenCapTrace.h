@@ -0,0 +1,87 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapTrace.h
+// Optional TraceLogging (ETW) events for profiling the screen
+// capture and video encoding hot paths.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+
+//
+// The capture and encoder code reports what happens on its hot
+// paths -- frames acquired, timeouts, failures with their
+// HRESULTs, bytes copied, queue depths and write latencies --
+// through SCREENCAP_TRACE(), which takes an event name and
+// TraceLogging field macros:
+//
+//     SCREENCAP_TRACE("AcquireFailed",
+//         TraceLoggingLevel(WINEVENT_LEVEL_WARNING),
+//         TraceLoggingHResult(hr, "HResult"));
+//
+// Event levels must be constants.  Failures are logged at the
+// warning level or above where the code can tell; events that
+// carry an HRESULT show whether it failed either way.
+//
+// The events are only compiled in when SCREENCAP_ENABLE_TRACING
+// is defined (nmake TRACE=1).  Otherwise SCREENCAP_TRACE()
+// expands to nothing and its arguments are never evaluated, so
+// they mustn't have side effects.
+//
+// The provider is named "ScreenCap" and its GUID is derived from
+// that name, so it can be recorded without knowing the GUID, for
+// example with "xperf -start sc -on *ScreenCap -f sc.etl" and
+// "xperf -stop sc", and viewed in Windows Performance Analyzer.
+// Whenever no trace session has the provider enabled, each
+// event costs one test of a flag.
+//
+#ifdef SCREENCAP_ENABLE_TRACING
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winmeta.h>
+#include <TraceLoggingProvider.h>
+
+TRACELOGGING_DECLARE_PROVIDER(g_screenCapTraceProvider);
+
+#define SCREENCAP_TRACE(eventName, ...) \
+    TraceLoggingWrite(g_screenCapTraceProvider, eventName, __VA_ARGS__)
+
+#else
+
+#define SCREENCAP_TRACE(eventName, ...) ((void)0)
+
+#endif
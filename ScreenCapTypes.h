@@ -0,0 +1,93 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapTypes.h
+// Small data types shared by the ScreenCapture, ScreenCaptureGDI and
+// ScreenCaptureDX11 classes.  Kept separate so the capture headers
+// can share them without pulling in windows.h.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2019,2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include <stdint.h>
+
+//
+// A rectangle within a captured frame, in pixels.  'right' and
+// 'bottom' are exclusive, the same as a Windows RECT.
+//
+struct ScreenCaptureRect
+{
+    int left   = 0;
+    int top    = 0;
+    int right  = 0;
+    int bottom = 0;
+};
+
+//
+// Pixel formats that captured frames can be delivered in.
+//
+enum ScreenCaptureFormat
+{
+    ScreenCaptureFormat_BGRA32 = 0,  // 32 bits per pixel, blue in the low byte.
+    ScreenCaptureFormat_NV12   = 1   // 8-bit Y plane followed by a half-size
+                                     // interleaved UV plane, with the same stride.
+};
+
+//
+// Outcome of waiting for a frame.
+//
+enum ScreenCaptureResult
+{
+    ScreenCaptureResult_Frame       = 0,  // A new frame was captured.
+    ScreenCaptureResult_NoChange    = 1,  // Nothing changed before the timeout.
+    ScreenCaptureResult_Error       = 2,  // Capture failed.
+    ScreenCaptureResult_ModeChanged = 3   // A new frame was captured, but the
+                                          // output changed size or orientation
+                                          // since the last one; see
+                                          // GetFrameWidth() and GetFrameHeight().
+};
+
+//
+// How long each stage of the last capture took, in
+// QueryPerformanceCounter() ticks, for profiling.  Stages that
+// a capture engine doesn't have are left at zero.
+//
+struct ScreenCaptureTimings
+{
+    int64_t acquire = 0;   // Waiting for and acquiring the screen image.
+    int64_t gpuCopy = 0;   // Queuing the GPU copy, scaling and conversion.
+    int64_t map = 0;       // Mapping the copy for reading, which waits for the GPU.
+    int64_t copy = 0;      // Copying the pixels into the frame buffer.
+};
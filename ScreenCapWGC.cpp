@@ -0,0 +1,541 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapWGC.cpp
+// C++ class to capture screen images on a Windows computer using
+// Windows.Graphics.Capture.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ScreenCapWGC.h"
+#include "PixelOps.h"
+#include <roapi.h>
+#include <windows.graphics.capture.interop.h>
+#include <windows.graphics.directx.direct3d11.interop.h>
+#include <wrl/event.h>
+#include <wrl/wrappers/corewrappers.h>
+
+#pragma comment(lib, "runtimeobject.lib")
+#pragma comment(lib, "d3d11.lib")
+
+using namespace ABI::Windows::Graphics::Capture;
+using namespace ABI::Windows::Graphics::DirectX;
+using namespace ABI::Windows::Graphics::DirectX::Direct3D11;
+using ABI::Windows::Foundation::IClosable;
+using ABI::Windows::Foundation::ITypedEventHandler;
+using ABI::Windows::Foundation::TimeSpan;
+using ABI::Windows::Graphics::SizeInt32;
+using Microsoft::WRL::Wrappers::HStringReference;
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+//
+// Looks up the activation factory, or statics, of a Windows
+// Runtime class by name.  Returns true if successful.
+//
+template <class T, size_t N>
+static bool GetActivationFactory(const wchar_t (&className)[N], T **factory)
+{
+    return SUCCEEDED(RoGetActivationFactory(HStringReference(className).Get(),
+                        __uuidof(T), reinterpret_cast<void **>(factory)));
+}
+
+//
+// Closes a Windows Runtime object that holds on to resources,
+// such as a frame, which goes back to the frame pool.
+//
+static void CloseObject(IUnknown *object)
+{
+    CComPtr<IClosable> closable;
+    if (object && SUCCEEDED(object->QueryInterface(__uuidof(IClosable), reinterpret_cast<void **>(&closable))))
+        closable->Close();
+}
+
+//
+// Converts a time in 100ns units on the QueryPerformanceCounter()
+// clock, as Windows.Graphics.Capture reports, to QPC ticks.
+// Split in two so that the multiplication can't overflow.
+//
+static int64_t ToQpcTicks(int64_t duration)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return (duration / 10000000) * freq.QuadPart + (duration % 10000000) * freq.QuadPart / 10000000;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Returns true if this version of Windows supports
+// Windows.Graphics.Capture.
+//
+bool ScreenCaptureWGC::IsSupported()
+{
+    const HRESULT hr = RoInitialize(RO_INIT_MULTITHREADED);
+
+    CComPtr<IGraphicsCaptureSessionStatics> statics;
+    boolean supported = false;
+    if (!GetActivationFactory(RuntimeClass_Windows_Graphics_Capture_GraphicsCaptureSession, &statics) ||
+        FAILED(statics->IsSupported(&supported)))
+    {
+        supported = false;
+    }
+    statics.Release();
+
+    if (SUCCEEDED(hr))
+        RoUninitialize();
+    return supported != false;
+}
+
+//
+// Begins a capture session on the primary screen.  Returns true
+// if successful.
+//
+bool ScreenCaptureWGC::Startup()
+{
+    Shutdown();
+
+    // A thread that already uses COM in a single-threaded
+    // apartment can still use the Windows Runtime.
+    const HRESULT hr = RoInitialize(RO_INIT_MULTITHREADED);
+    if (FAILED(hr) && hr != RPC_E_CHANGED_MODE)
+        return false;
+    m_roInitialized = SUCCEEDED(hr);
+
+    if (!IsSupported())
+    {
+        Shutdown();
+        return false;
+    }
+
+    D3D_FEATURE_LEVEL level;
+    CComPtr<IDXGIDevice> dxgiDevice;
+    CComPtr<IInspectable> inspectable;
+    if (FAILED(D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_HARDWARE, nullptr, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+                nullptr, 0, D3D11_SDK_VERSION, &m_device, &level, &m_deviceContext)) ||
+        FAILED(m_device.QueryInterface(&dxgiDevice)) ||
+        FAILED(CreateDirect3D11DeviceFromDXGIDevice(dxgiDevice, &inspectable)) ||
+        FAILED(inspectable.QueryInterface(&m_winrtDevice)))
+    {
+        Shutdown();
+        return false;
+    }
+
+    m_frameEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!m_frameEvent || !StartMonitorCapture())
+    {
+        Shutdown();
+        return false;
+    }
+    return true;
+}
+
+//
+// Stops the capture session and releases any allocated
+// resources.
+//
+void ScreenCaptureWGC::Shutdown()
+{
+    StopSession();
+
+    m_stagingTexture.Release();
+    m_stagingWidth = m_stagingHeight = 0;
+    m_winrtDevice.Release();
+    m_deviceContext.Release();
+    m_device.Release();
+
+    if (m_frameEvent)
+        CloseHandle(m_frameEvent);
+    m_frameEvent = nullptr;
+
+    m_frameBuffer.clear();
+    m_frameDirtyRects.clear();
+    m_frameWidth = m_frameHeight = 0;
+    m_frameTime = 0;
+    m_regionSet = false;
+    m_windowCapture = false;
+
+    if (m_roInitialized)
+        RoUninitialize();
+    m_roInitialized = false;
+}
+
+//
+// Copies the newest frame from the frame pool into the frame
+// buffer.  Returns false if there is no new frame.
+//
+bool ScreenCaptureWGC::CaptureFrame()
+{
+    if (!m_framePool)
+        return false;
+
+    // Take the newest frame.  Older ones are closed right away
+    // so they don't add latency.
+    CComPtr<IDirect3D11CaptureFrame> frame;
+    for (;;)
+    {
+        CComPtr<IDirect3D11CaptureFrame> next;
+        if (FAILED(m_framePool->TryGetNextFrame(&next)) || !next)
+            break;
+        CloseObject(frame);
+        frame = next;
+    }
+    if (!frame)
+        return false;
+
+    const bool ok = CopyFrame(frame);
+    CloseObject(frame);
+    return ok;
+}
+
+//
+// Waits up to 'timeoutMs' milliseconds for a frame to arrive,
+// then captures it.  The time left is worked out from
+// QueryPerformanceCounter(), since GetTickCount64() only moves
+// every 10 to 16 milliseconds.
+//
+ScreenCaptureResult ScreenCaptureWGC::WaitForFrame(unsigned timeoutMs)
+{
+    if (!m_framePool)
+        return ScreenCaptureResult_Error;
+
+    LARGE_INTEGER freq, now, deadline;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    deadline.QuadPart = now.QuadPart + freq.QuadPart * timeoutMs / 1000;
+    for (;;)
+    {
+        if (CaptureFrame())
+            return ScreenCaptureResult_Frame;
+
+        DWORD wait = INFINITE;
+        if (timeoutMs != INFINITE)
+        {
+            QueryPerformanceCounter(&now);
+            if (now.QuadPart >= deadline.QuadPart)
+                return ScreenCaptureResult_NoChange;
+            wait = static_cast<DWORD>(((deadline.QuadPart - now.QuadPart) * 1000 +
+                       freq.QuadPart - 1) / freq.QuadPart);
+        }
+        if (WaitForSingleObject(m_frameEvent, wait) != WAIT_OBJECT_0)
+            return ScreenCaptureResult_NoChange;
+    }
+}
+
+//
+// Restricts capture to a region of the screen.  Returns false if
+// the region doesn't overlap the screen.
+//
+bool ScreenCaptureWGC::SetCaptureRegion(const ScreenCaptureRect &region)
+{
+    if (!m_winrtDevice)
+        return false;
+    if (m_windowCapture && !StartMonitorCapture())
+        return false;
+
+    ScreenCaptureRect r;
+    r.left   = max(region.left,   m_screen.left);
+    r.top    = max(region.top,    m_screen.top);
+    r.right  = min(region.right,  m_screen.right);
+    r.bottom = min(region.bottom, m_screen.bottom);
+    if (r.right <= r.left || r.bottom <= r.top)
+        return false;
+
+    m_region = r;
+    m_regionSet = true;
+    return true;
+}
+
+//
+// Goes back to capturing the whole screen.
+//
+void ScreenCaptureWGC::ClearCaptureRegion()
+{
+    m_regionSet = false;
+    if (m_windowCapture)
+        StartMonitorCapture();
+}
+
+//
+// Captures a window's own contents instead of the screen.
+// Returns false if the window can't be captured.
+//
+bool ScreenCaptureWGC::SetCaptureWindow(void *hwnd)
+{
+    HWND window = static_cast<HWND>(hwnd);
+    if (!m_winrtDevice || !IsWindow(window))
+        return false;
+
+    CComPtr<IGraphicsCaptureItemInterop> interop;
+    CComPtr<IGraphicsCaptureItem> item;
+    if (!GetActivationFactory(RuntimeClass_Windows_Graphics_Capture_GraphicsCaptureItem, &interop) ||
+        FAILED(interop->CreateForWindow(window, IID_PPV_ARGS(&item))))
+    {
+        return false;
+    }
+
+    if (!StartSession(item))
+    {
+        StartMonitorCapture();
+        return false;
+    }
+
+    m_windowCapture = true;
+    m_regionSet = false;
+    return true;
+}
+
+//
+// Includes or leaves out the mouse pointer.  The setting is
+// also applied to sessions started later.
+//
+bool ScreenCaptureWGC::SetCursorCapture(bool enable)
+{
+    m_cursorCapture = enable;
+    if (!m_session)
+        return true;
+
+    // Older versions of Windows always draw the pointer.
+    CComPtr<IGraphicsCaptureSession2> session2;
+    if (FAILED(m_session.QueryInterface(&session2)))
+        return enable;
+    return SUCCEEDED(session2->put_IsCursorCaptureEnabled(enable));
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Starts capturing the primary screen.  Returns true if
+// successful.
+//
+bool ScreenCaptureWGC::StartMonitorCapture()
+{
+    HMONITOR monitor = MonitorFromPoint(POINT { 0, 0 }, MONITOR_DEFAULTTOPRIMARY);
+    MONITORINFO info = {};
+    info.cbSize = sizeof(info);
+    if (!GetMonitorInfo(monitor, &info))
+        return false;
+
+    CComPtr<IGraphicsCaptureItemInterop> interop;
+    CComPtr<IGraphicsCaptureItem> item;
+    if (!GetActivationFactory(RuntimeClass_Windows_Graphics_Capture_GraphicsCaptureItem, &interop) ||
+        FAILED(interop->CreateForMonitor(monitor, IID_PPV_ARGS(&item))) ||
+        !StartSession(item))
+    {
+        return false;
+    }
+
+    m_screen.left   = info.rcMonitor.left;
+    m_screen.top    = info.rcMonitor.top;
+    m_screen.right  = info.rcMonitor.right;
+    m_screen.bottom = info.rcMonitor.bottom;
+    m_windowCapture = false;
+    return true;
+}
+
+//
+// Creates a frame pool for a capture item and starts a capture
+// session on it, replacing any previous session.  Returns true
+// if successful.
+//
+bool ScreenCaptureWGC::StartSession(IGraphicsCaptureItem *item)
+{
+    StopSession();
+
+    SizeInt32 size = {};
+    CComPtr<IDirect3D11CaptureFramePoolStatics2> poolStatics;
+    if (FAILED(item->get_Size(&size)) ||
+        !GetActivationFactory(RuntimeClass_Windows_Graphics_Capture_Direct3D11CaptureFramePool, &poolStatics) ||
+        FAILED(poolStatics->CreateFreeThreaded(m_winrtDevice, DirectXPixelFormat_B8G8R8A8UIntNormalized,
+                NumPoolBuffers, size, &m_framePool)))
+    {
+        StopSession();
+        return false;
+    }
+
+    // A free-threaded pool raises FrameArrived on a thread pool
+    // thread.  The handler only wakes up WaitForFrame(); frames
+    // are copied on the thread that captures.
+    HANDLE frameEvent = m_frameEvent;
+    auto handler = Microsoft::WRL::Callback<ITypedEventHandler<Direct3D11CaptureFramePool *, IInspectable *>>(
+        [frameEvent](IDirect3D11CaptureFramePool *, IInspectable *) -> HRESULT
+        {
+            SetEvent(frameEvent);
+            return S_OK;
+        });
+    if (!handler ||
+        FAILED(m_framePool->add_FrameArrived(handler.Get(), &m_frameArrivedToken)) ||
+        FAILED(m_framePool->CreateCaptureSession(item, &m_session)))
+    {
+        StopSession();
+        return false;
+    }
+
+    // Leave the mouse pointer out unless it was asked for, the
+    // same as the other capture modes.  Older versions of
+    // Windows always include it.
+    CComPtr<IGraphicsCaptureSession2> session2;
+    if (SUCCEEDED(m_session.QueryInterface(&session2)))
+        session2->put_IsCursorCaptureEnabled(m_cursorCapture);
+
+    ResetEvent(m_frameEvent);
+    if (FAILED(m_session->StartCapture()))
+    {
+        StopSession();
+        return false;
+    }
+
+    m_item = item;
+    m_poolSize = size;
+    return true;
+}
+
+//
+// Stops the capture session and releases the frame pool.
+//
+void ScreenCaptureWGC::StopSession()
+{
+    if (m_framePool && m_frameArrivedToken.value)
+        m_framePool->remove_FrameArrived(m_frameArrivedToken);
+    m_frameArrivedToken = {};
+
+    CloseObject(m_session);
+    CloseObject(m_framePool);
+    m_session.Release();
+    m_framePool.Release();
+    m_item.Release();
+    m_poolSize = {};
+}
+
+//
+// Copies a frame, or the capture region of it, into the frame
+// buffer.  Returns true if successful.
+//
+bool ScreenCaptureWGC::CopyFrame(IDirect3D11CaptureFrame *frame)
+{
+    SizeInt32 contentSize = {};
+    TimeSpan time = {};
+    CComPtr<IDirect3DSurface> surface;
+    CComPtr<::Windows::Graphics::DirectX::Direct3D11::IDirect3DDxgiInterfaceAccess> access;
+    CComPtr<ID3D11Texture2D> texture;
+    if (FAILED(frame->get_ContentSize(&contentSize)) ||
+        FAILED(frame->get_SystemRelativeTime(&time)) ||
+        FAILED(frame->get_Surface(&surface)) ||
+        FAILED(surface.QueryInterface(&access)) ||
+        FAILED(access->GetInterface(IID_PPV_ARGS(&texture))))
+    {
+        return false;
+    }
+
+    // The pool's buffers keep the size they were made with, so
+    // when a captured window is resized they are remade to fit,
+    // and until then the frame is clipped to them.
+    if (contentSize.Width != m_poolSize.Width || contentSize.Height != m_poolSize.Height)
+    {
+        if (SUCCEEDED(m_framePool->Recreate(m_winrtDevice, DirectXPixelFormat_B8G8R8A8UIntNormalized,
+                        NumPoolBuffers, contentSize)))
+        {
+            m_poolSize = contentSize;
+        }
+    }
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+    int left = 0;
+    int top = 0;
+    int right  = min(static_cast<int>(contentSize.Width),  static_cast<int>(desc.Width));
+    int bottom = min(static_cast<int>(contentSize.Height), static_cast<int>(desc.Height));
+    if (m_regionSet && !m_windowCapture)
+    {
+        left   = max(left,   m_region.left   - m_screen.left);
+        top    = max(top,    m_region.top    - m_screen.top);
+        right  = min(right,  m_region.right  - m_screen.left);
+        bottom = min(bottom, m_region.bottom - m_screen.top);
+    }
+    if (right <= left || bottom <= top)
+        return false;
+
+    const UINT width  = static_cast<UINT>(right - left);
+    const UINT height = static_cast<UINT>(bottom - top);
+    if (!m_stagingTexture || m_stagingWidth != width || m_stagingHeight != height)
+    {
+        D3D11_TEXTURE2D_DESC stagingDesc = {};
+        stagingDesc.Width = width;
+        stagingDesc.Height = height;
+        stagingDesc.MipLevels = 1;
+        stagingDesc.ArraySize = 1;
+        stagingDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+        stagingDesc.SampleDesc.Count = 1;
+        stagingDesc.Usage = D3D11_USAGE_STAGING;
+        stagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+
+        m_stagingTexture.Release();
+        m_stagingWidth = m_stagingHeight = 0;
+        if (FAILED(m_device->CreateTexture2D(&stagingDesc, nullptr, &m_stagingTexture)))
+            return false;
+        m_stagingWidth = width;
+        m_stagingHeight = height;
+    }
+
+    D3D11_BOX box = { static_cast<UINT>(left), static_cast<UINT>(top), 0,
+                      static_cast<UINT>(right), static_cast<UINT>(bottom), 1 };
+    m_deviceContext->CopySubresourceRegion(m_stagingTexture, 0, 0, 0, 0, texture, 0, &box);
+
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    if (FAILED(m_deviceContext->Map(m_stagingTexture, 0, D3D11_MAP_READ, 0, &mapped)))
+        return false;
+
+    const size_t rowBytes = static_cast<size_t>(width) * 4;
+    m_frameBuffer.resize(rowBytes * height);
+    PixelOps::CopyImage(m_frameBuffer.data(), rowBytes,
+        static_cast<const uint8_t *>(mapped.pData), mapped.RowPitch, rowBytes, height);
+    m_deviceContext->Unmap(m_stagingTexture, 0);
+
+    m_frameWidth = width;
+    m_frameHeight = height;
+    m_frameTime = ToQpcTicks(time.Duration);
+
+    ScreenCaptureRect all;
+    all.right  = static_cast<int>(width);
+    all.bottom = static_cast<int>(height);
+    m_frameDirtyRects.assign(1, all);
+    return true;
+}
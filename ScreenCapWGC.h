@@ -0,0 +1,189 @@
+//--------------------------------------------------------------------
+//
+// ScreenCapWGC.h
+// Header file of C++ class to capture screen images on a Windows
+// computer using Windows.Graphics.Capture.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <atlbase.h>
+#include <d3d11.h>
+#include <windows.graphics.capture.h>
+#include <vector>
+#include <cstdint>
+#include "ScreenCapBackend.h"
+
+//
+// This class manages a screen capture session using the
+// Windows.Graphics.Capture API of Windows 10 version 1903 and
+// later, through its ABI interfaces.  Frames are delivered by
+// the compositor into a free-threaded frame pool, so unlike
+// DXGI output duplication it keeps working during exclusive
+// full-screen and display mode changes, and protected content
+// is blacked out rather than failing the capture.
+//
+// It can also capture a single window's own contents, even
+// while other windows cover it, which costs no more than
+// capturing the screen it's on.
+//
+class ScreenCaptureWGC : public ScreenCaptureBackend
+{
+public:
+    ScreenCaptureWGC()  { }
+    ~ScreenCaptureWGC() { Shutdown(); }
+
+    ScreenCaptureMode GetMode() const override { return ScreenCaptureMode_WGC; }
+
+    //
+    // Returns true if Windows.Graphics.Capture is available.
+    //
+    static bool IsSupported();
+
+    //
+    // Begins a capture session on the primary screen.  Returns
+    // true if successful.
+    //
+    bool Startup() override;
+
+    //
+    // Stops the capture session and releases any allocated
+    // resources.
+    //
+    void Shutdown() override;
+
+    //
+    // Copies the newest frame from the frame pool into the
+    // frame buffer.  Returns false if no new frame has arrived
+    // since the last call, or if there was an error.
+    //
+    bool CaptureFrame() override;
+
+    //
+    // Waits up to 'timeoutMs' milliseconds (or INFINITE) for a
+    // frame to arrive, then captures it.  The thread sleeps
+    // until the frame pool signals a new frame.
+    //
+    ScreenCaptureResult WaitForFrame(unsigned timeoutMs) override;
+
+    //
+    // Restricts capture to a region of the screen, given in
+    // desktop coordinates.  Frames are still captured whole and
+    // only the region is copied out.  Switches back to the
+    // screen if a window was being captured.
+    //
+    bool SetCaptureRegion(const ScreenCaptureRect &region) override;
+    void ClearCaptureRegion() override;
+
+    //
+    // Captures a window's own contents instead of the screen.
+    // The frame buffer follows the window's size.  Returns false
+    // if the window can't be captured.
+    //
+    bool SetCaptureWindow(void *hwnd) override;
+
+    //
+    // Has Windows draw the mouse pointer into the frames, or
+    // leave it out.  Returns false if this version of Windows
+    // can't leave it out, or can't put it in.
+    //
+    bool SetCursorCapture(bool enable) override;
+
+    ID3D11Device *GetD3DDevice() const override { return m_device; }
+
+    // Retrieve the dimensions and format of the captured
+    // frame image.
+    unsigned GetFrameWidth()  const override { return m_frameWidth;  }
+    unsigned GetFrameHeight() const override { return m_frameHeight; }
+    unsigned GetFrameDepth()  const override { return m_frameWidth ? 32 : 0; }
+    unsigned GetFrameStride() const override { return m_frameWidth * 4; }
+
+    // Returns when the compositor produced the frame, in
+    // QueryPerformanceCounter() ticks.
+    int64_t GetFrameTime() const override { return m_frameTime; }
+
+    size_t GetFrameBufferSize() const override { return m_frameBuffer.size(); }
+    const uint8_t *GetFrameBuffer() const override { return m_frameBuffer.data(); }
+
+    //
+    // Windows.Graphics.Capture doesn't say what changed, so this
+    // is always the whole frame.
+    //
+    const std::vector<ScreenCaptureRect> &GetFrameDirtyRects() const override { return m_frameDirtyRects; }
+
+private:
+    // Number of buffers in the frame pool.
+    static const int NumPoolBuffers = 2;
+
+    CComPtr<ID3D11Device>        m_device;
+    CComPtr<ID3D11DeviceContext> m_deviceContext;
+    CComPtr<ABI::Windows::Graphics::DirectX::Direct3D11::IDirect3DDevice> m_winrtDevice;
+    CComPtr<ABI::Windows::Graphics::Capture::IGraphicsCaptureItem>        m_item;
+    CComPtr<ABI::Windows::Graphics::Capture::IDirect3D11CaptureFramePool> m_framePool;
+    CComPtr<ABI::Windows::Graphics::Capture::IGraphicsCaptureSession>     m_session;
+    EventRegistrationToken       m_frameArrivedToken = {};
+    HANDLE                       m_frameEvent = nullptr;    // Set when a frame arrives.
+    bool                         m_roInitialized = false;
+
+    // Size the frame pool's buffers were created with.
+    ABI::Windows::Graphics::SizeInt32 m_poolSize = {};
+
+    // Position of the captured screen on the desktop, and the
+    // region of it to copy out, in desktop coordinates.
+    ScreenCaptureRect            m_screen;
+    ScreenCaptureRect            m_region;
+    bool                         m_regionSet = false;
+    bool                         m_windowCapture = false;
+    bool                         m_cursorCapture = false;
+
+    // Staging texture the frame is read back through.
+    CComPtr<ID3D11Texture2D>     m_stagingTexture;
+    UINT                         m_stagingWidth = 0;
+    UINT                         m_stagingHeight = 0;
+
+    std::vector<uint8_t>         m_frameBuffer;
+    std::vector<ScreenCaptureRect> m_frameDirtyRects;
+    unsigned                     m_frameWidth = 0;
+    unsigned                     m_frameHeight = 0;
+    int64_t                      m_frameTime = 0;
+
+    bool StartMonitorCapture();
+    bool StartSession(ABI::Windows::Graphics::Capture::IGraphicsCaptureItem *item);
+    void StopSession();
+    bool CopyFrame(ABI::Windows::Graphics::Capture::IDirect3D11CaptureFrame *frame);
+};
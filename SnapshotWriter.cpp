@@ -0,0 +1,566 @@
+//--------------------------------------------------------------------
+//
+// SnapshotWriter.cpp
+// C++ implementation of a class that writes captured frames to image
+// files on a pool of worker threads.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "SnapshotWriter.h"
+#include "PixelOps.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Unbuffered writes must be a multiple of the disk's sector
+// size, from a buffer aligned the same way.  4096 covers both
+// 512-byte and 4K sector disks.
+static const size_t SectorAlign = 4096;
+
+static size_t AlignToSector(size_t bytes)
+{
+    return (bytes + SectorAlign - 1) & ~(SectorAlign - 1);
+}
+
+// Stores a 32-bit value in big-endian byte order, as QOI wants.
+static uint8_t *PutBigEndian32(uint8_t *p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+    return p + 4;
+}
+
+//
+// Returns the most bytes a QOI file of the given size can take:
+// every pixel stored as a 4-byte QOI_OP_RGB, plus the 14-byte
+// header and the 8-byte end marker.
+//
+static size_t GetMaxQOISize(unsigned width, unsigned height)
+{
+    return 14 + static_cast<size_t>(width) * height * 4 + 8;
+}
+
+//
+// Encodes packed 24-bit BGR or 32-bit BGRA pixels into a 3
+// channel QOI image, as described at https://qoiformat.org.
+// Returns the size of the file in bytes.
+//
+static size_t EncodeQOI(uint8_t *out, const uint8_t *pixels, unsigned stride,
+    unsigned width, unsigned height, unsigned bitsPerPixel, bool bottomUp)
+{
+    uint8_t *p = out;
+    *p++ = 'q';
+    *p++ = 'o';
+    *p++ = 'i';
+    *p++ = 'f';
+    p = PutBigEndian32(p, width);
+    p = PutBigEndian32(p, height);
+    *p++ = 3;   // RGB; the alpha of captured pixels means nothing.
+    *p++ = 0;   // sRGB.
+
+    const unsigned pixelBytes = bitsPerPixel / 8;
+    const size_t lastPixel = static_cast<size_t>(width) * height - 1;
+
+    // Pixels are compared packed as 0x00RRGGBB.  The index
+    // starts out holding a value no pixel can match, since it
+    // stands for transparent black.
+    uint32_t index[64];
+    for (auto &entry : index)
+        entry = 0xffffffff;
+    uint32_t prev = 0;
+    unsigned run = 0;
+    size_t count = 0;
+    for (unsigned y = 0; y < height; y++)
+    {
+        const uint8_t *src = pixels + static_cast<size_t>(stride) * (bottomUp ? height - 1 - y : y);
+        for (unsigned x = 0; x < width; x++, src += pixelBytes, count++)
+        {
+            const uint8_t b = src[0], g = src[1], r = src[2];
+            const uint32_t px = (static_cast<uint32_t>(r) << 16) | (static_cast<uint32_t>(g) << 8) | b;
+            if (px == prev)
+            {
+                run++;
+                if (run == 62 || count == lastPixel)
+                {
+                    *p++ = static_cast<uint8_t>(0xc0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0)
+            {
+                *p++ = static_cast<uint8_t>(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            // The alpha is always 255, which adds 255 * 11 to
+            // the hash.
+            const unsigned hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (index[hash] == px)
+            {
+                *p++ = static_cast<uint8_t>(hash);
+            }
+            else
+            {
+                index[hash] = px;
+
+                // Differences wrap around, as the format requires.
+                const int8_t dr = static_cast<int8_t>(r - static_cast<uint8_t>(prev >> 16));
+                const int8_t dg = static_cast<int8_t>(g - static_cast<uint8_t>(prev >> 8));
+                const int8_t db = static_cast<int8_t>(b - static_cast<uint8_t>(prev));
+                const int dr_dg = dr - dg;
+                const int db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    *p++ = static_cast<uint8_t>(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                }
+                else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7)
+                {
+                    *p++ = static_cast<uint8_t>(0x80 | (dg + 32));
+                    *p++ = static_cast<uint8_t>(((dr_dg + 8) << 4) | (db_dg + 8));
+                }
+                else
+                {
+                    *p++ = 0xfe;
+                    *p++ = r;
+                    *p++ = g;
+                    *p++ = b;
+                }
+            }
+            prev = px;
+        }
+    }
+
+    static const uint8_t endMarker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    memcpy(p, endMarker, sizeof(endMarker));
+    p += sizeof(endMarker);
+    return static_cast<size_t>(p - out);
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Starts the worker threads.  Returns true if successful.
+//
+bool SnapshotWriter::Startup(unsigned threads, unsigned maxQueued)
+{
+    Shutdown();
+
+    if (threads == 0)
+        threads = max(std::thread::hardware_concurrency(), 1u);
+    if (maxQueued == 0)
+        maxQueued = 1;
+
+    m_queuedSemaphore = CreateSemaphore(nullptr, 0, MAXLONG, nullptr);
+    m_freeSemaphore   = CreateSemaphore(nullptr, static_cast<LONG>(maxQueued), static_cast<LONG>(maxQueued), nullptr);
+    m_idleEvent       = CreateEvent(nullptr, TRUE, TRUE, nullptr);
+    if (!m_queuedSemaphore || !m_freeSemaphore || !m_idleEvent)
+    {
+        Shutdown();
+        return false;
+    }
+
+    m_stopping = false;
+    m_written = 0;
+    m_failed = 0;
+    m_busy = 0;
+    m_maxQueued = maxQueued;
+    m_running = true;
+    for (unsigned i = 0; i < threads; i++)
+        m_workers.emplace_back(&SnapshotWriter::WorkerThread, this);
+    return true;
+}
+
+//
+// Writes the frames still queued and stops the worker threads.
+//
+void SnapshotWriter::Shutdown()
+{
+    if (m_running)
+    {
+        Flush();
+
+        // Each worker takes one wake-up with nothing queued as
+        // the signal to quit.
+        m_stopping = true;
+        ReleaseSemaphore(m_queuedSemaphore, static_cast<LONG>(m_workers.size()), nullptr);
+        for (auto &worker : m_workers)
+            worker.join();
+        m_workers.clear();
+        m_running = false;
+    }
+
+    if (m_queuedSemaphore)
+        CloseHandle(m_queuedSemaphore);
+    if (m_freeSemaphore)
+        CloseHandle(m_freeSemaphore);
+    if (m_idleEvent)
+        CloseHandle(m_idleEvent);
+    m_queuedSemaphore = nullptr;
+    m_freeSemaphore = nullptr;
+    m_idleEvent = nullptr;
+}
+
+//
+// Copies a frame and queues it for a worker to write.  Returns
+// true if it was queued.
+//
+bool SnapshotWriter::Write(const std::wstring &filename, SnapshotFormat format,
+    unsigned width, unsigned height, unsigned stride,
+    unsigned bitsPerPixel, const void *pBits, bool bottomUp)
+{
+    if (!m_running || filename.empty() || width < 1 || height < 1 ||
+        (bitsPerPixel != 24 && bitsPerPixel != 32) ||
+        stride < width * (bitsPerPixel / 8) || pBits == nullptr)
+    {
+        return false;
+    }
+
+    Job job;
+    job.filename = filename;
+    job.format = format;
+    job.width = width;
+    job.height = height;
+    job.bitsPerPixel = bitsPerPixel;
+    job.bottomUp = bottomUp;
+    const size_t rowBytes = static_cast<size_t>(width) * (bitsPerPixel / 8);
+    job.stride = static_cast<unsigned>(rowBytes);
+    job.pixels.resize(rowBytes * height);
+    PixelOps::CopyImage(job.pixels.data(), rowBytes, static_cast<const uint8_t *>(pBits), stride, rowBytes, height);
+    return QueueJob(job);
+}
+
+//
+// Queues a pool buffer for a worker to write, without copying
+// it.  Returns true if it was queued.
+//
+bool SnapshotWriter::Write(const std::wstring &filename, SnapshotFormat format, const FrameHandle &frame)
+{
+    const FrameInfo &info = frame.GetInfo();
+    if (!m_running || filename.empty() || !frame || info.width < 1 || info.height < 1 ||
+        info.depth != 32 || info.stride < info.width * 4 ||
+        static_cast<size_t>(info.stride) * info.height > frame.GetSize())
+    {
+        return false;
+    }
+
+    Job job;
+    job.filename = filename;
+    job.format = format;
+    job.width = info.width;
+    job.height = info.height;
+    job.bitsPerPixel = 32;
+    job.bottomUp = info.bottomUp;
+    job.stride = info.stride;
+    job.frame = frame;
+    return QueueJob(job);
+}
+
+//
+// Waits until every frame queued so far has been written.
+//
+void SnapshotWriter::Flush()
+{
+    if (m_running)
+        WaitForSingleObject(m_idleEvent, INFINITE);
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Hands a job to the workers.  Returns true if it was queued.
+//
+bool SnapshotWriter::QueueJob(Job &job)
+{
+    // Wait for room in the queue if the workers are behind.
+    WaitForSingleObject(m_freeSemaphore, INFINITE);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(std::move(job));
+        if (m_busy++ == 0)
+            ResetEvent(m_idleEvent);
+    }
+    ReleaseSemaphore(m_queuedSemaphore, 1, nullptr);
+    return true;
+}
+
+//
+// Body of each worker thread.  A worker encodes a frame into one
+// of its two buffers while the file for the frame before it is
+// still being written from the other.
+//
+void SnapshotWriter::WorkerThread()
+{
+    FileBuffer buffers[2];
+    unsigned current = 0;
+    PendingWrite pending;
+    bool hasPending = false;
+
+    for (;;)
+    {
+        // With a write in progress, only take a frame that is
+        // already waiting; otherwise finish the write first.
+        Job job;
+        if (!TakeJob(job, hasPending ? 0 : INFINITE))
+        {
+            if (hasPending)
+            {
+                if (EndWrite(pending))
+                    m_written++;
+                else
+                    m_failed++;
+                JobDone();
+                hasPending = false;
+                continue;
+            }
+            if (m_stopping)
+                break;
+            continue;
+        }
+
+        FileBuffer &buffer = buffers[current];
+        const bool encoded = Encode(job, buffer);
+        job.frame.Reset();  // Let the capture have its buffer back.
+
+        if (hasPending)
+        {
+            if (EndWrite(pending))
+                m_written++;
+            else
+                m_failed++;
+            JobDone();
+            hasPending = false;
+        }
+
+        if (encoded && BeginWrite(job.filename, buffer, pending))
+        {
+            hasPending = true;
+            current ^= 1;
+        }
+        else
+        {
+            m_failed++;
+            JobDone();
+        }
+    }
+
+    Free(buffers[0]);
+    Free(buffers[1]);
+}
+
+//
+// Takes the next frame from the queue, waiting up to 'timeout'
+// milliseconds for one.  Returns false if there is none.
+//
+bool SnapshotWriter::TakeJob(Job &job, DWORD timeout)
+{
+    if (WaitForSingleObject(m_queuedSemaphore, timeout) != WAIT_OBJECT_0)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.empty())
+            return false;   // Woken up to quit.
+        job = std::move(m_queue.front());
+        m_queue.pop_front();
+    }
+    ReleaseSemaphore(m_freeSemaphore, 1, nullptr);
+    return true;
+}
+
+//
+// Counts a frame as finished, one way or the other.
+//
+void SnapshotWriter::JobDone()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_busy == 0)
+        SetEvent(m_idleEvent);
+}
+
+//
+// Encodes a frame into the complete contents of its file.
+// Returns true if successful.
+//
+bool SnapshotWriter::Encode(const Job &job, FileBuffer &buffer)
+{
+    if (job.format == SnapshotFormat_QOI)
+    {
+        if (!Reserve(buffer, GetMaxQOISize(job.width, job.height)))
+            return false;
+        buffer.size = EncodeQOI(buffer.data, job.GetPixels(), job.stride, job.width, job.height,
+                        job.bitsPerPixel, job.bottomUp);
+        return true;
+    }
+
+    // 24-bit BMP, bottom-up with each scanline padded to a
+    // multiple of 4 bytes.
+    unsigned outStride = job.width * 3;
+    while (outStride % 4)
+        outStride++;
+
+    BITMAPINFOHEADER stInfoHdr = {0};
+    stInfoHdr.biSize = sizeof(stInfoHdr);
+    stInfoHdr.biBitCount = 24;
+    stInfoHdr.biWidth = job.width;
+    stInfoHdr.biHeight = job.height;
+    stInfoHdr.biPlanes = 1;
+    stInfoHdr.biSizeImage = outStride * job.height;
+
+    BITMAPFILEHEADER stFileHdr;
+    memset(&stFileHdr, 0, sizeof(stFileHdr));
+    stFileHdr.bfType = (WORD)'B' + 256 * (WORD)'M';
+    stFileHdr.bfSize = sizeof(BITMAPFILEHEADER) + stInfoHdr.biSize + stInfoHdr.biSizeImage;
+    stFileHdr.bfOffBits = sizeof(BITMAPFILEHEADER) + stInfoHdr.biSize;
+
+    if (!Reserve(buffer, stFileHdr.bfSize))
+        return false;
+    memcpy(buffer.data, &stFileHdr, sizeof(stFileHdr));
+    memcpy(buffer.data + sizeof(stFileHdr), &stInfoHdr, sizeof(stInfoHdr));
+
+    // Start from the bottom scanline, wherever it is in memory.
+    uint8_t *pDst = buffer.data + stFileHdr.bfOffBits;
+    const ptrdiff_t rowBytes = static_cast<ptrdiff_t>(job.stride);
+    const uint8_t *pSrc = job.GetPixels();
+    ptrdiff_t srcStride = rowBytes;
+    if (!job.bottomUp)
+    {
+        pSrc += rowBytes * (job.height - 1);
+        srcStride = -rowBytes;
+    }
+    if (outStride != job.width * 3)
+        memset(pDst, 0, stInfoHdr.biSizeImage);
+    if (job.bitsPerPixel == 32)
+        PixelOps::BGRAToRGB24(pDst, outStride, pSrc, srcStride, job.width, job.height);
+    else
+        PixelOps::CopyImage(pDst, outStride, pSrc, srcStride, job.width * 3, job.height);
+
+    buffer.size = stFileHdr.bfSize;
+    return true;
+}
+
+//
+// Creates a file and starts writing the buffer to it, bypassing
+// the file cache.  Returns true if the write was started.
+//
+bool SnapshotWriter::BeginWrite(const std::wstring &filename, const FileBuffer &buffer, PendingWrite &pending)
+{
+    const size_t alignedSize = AlignToSector(buffer.size);
+    if (alignedSize > MAXDWORD)
+        return false;
+
+    pending.file = CreateFileW(filename.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, nullptr);
+    if (pending.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    pending.filename = filename;
+    pending.size = buffer.size;
+    pending.overlapped = {};
+
+    // The write covers whole sectors, so it runs past the end of
+    // the data; EndWrite() cuts the file back to size.
+    if (!WriteFile(pending.file, buffer.data, static_cast<DWORD>(alignedSize), nullptr, &pending.overlapped) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        CloseHandle(pending.file);
+        pending.file = INVALID_HANDLE_VALUE;
+        DeleteFileW(filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+//
+// Waits for a write started by BeginWrite() and closes the
+// file.  Returns true if the file was written completely.
+//
+bool SnapshotWriter::EndWrite(PendingWrite &pending)
+{
+    DWORD written = 0;
+    bool ok = GetOverlappedResult(pending.file, &pending.overlapped, &written, TRUE) &&
+              written == AlignToSector(pending.size);
+
+    if (ok)
+    {
+        FILE_END_OF_FILE_INFO eof;
+        eof.EndOfFile.QuadPart = static_cast<LONGLONG>(pending.size);
+        ok = SetFileInformationByHandle(pending.file, FileEndOfFileInfo, &eof, sizeof(eof)) != FALSE;
+    }
+
+    CloseHandle(pending.file);
+    pending.file = INVALID_HANDLE_VALUE;
+    if (!ok)
+        DeleteFileW(pending.filename.c_str());
+    return ok;
+}
+
+//
+// Makes sure the buffer can hold 'bytes' bytes, rounded up to
+// whole sectors.  Returns true if successful.
+//
+bool SnapshotWriter::Reserve(FileBuffer &buffer, size_t bytes)
+{
+    bytes = AlignToSector(bytes);
+    if (buffer.capacity >= bytes)
+        return true;
+
+    // VirtualAlloc() memory is page aligned, which is sector
+    // aligned too.
+    Free(buffer);
+    buffer.data = static_cast<uint8_t *>(VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!buffer.data)
+        return false;
+    buffer.capacity = bytes;
+    return true;
+}
+
+void SnapshotWriter::Free(FileBuffer &buffer)
+{
+    if (buffer.data)
+        VirtualFree(buffer.data, 0, MEM_RELEASE);
+    buffer.data = nullptr;
+    buffer.capacity = 0;
+    buffer.size = 0;
+}
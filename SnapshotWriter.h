@@ -0,0 +1,193 @@
+//--------------------------------------------------------------------
+//
+// SnapshotWriter.h
+// C++ declarations for a class that writes captured frames to image
+// files on a pool of worker threads.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FramePool.h"
+
+//
+// Image file formats the snapshot writer can produce.
+//
+enum SnapshotFormat
+{
+    SnapshotFormat_BMP,     // 24-bit uncompressed .BMP.
+    SnapshotFormat_QOI      // Lossless, compressed .QOI ("Quite OK Image").
+};
+
+//
+// This class writes frames to image files without holding up
+// the thread that captures them.  Write() only copies the
+// pixels; the frame is encoded and written to disk by one of a
+// pool of worker threads, so a burst of snapshots is spread
+// over all of the CPU cores.
+//
+// Each file is encoded in full into a sector-aligned buffer and
+// written with one unbuffered, overlapped WriteFile(), so that
+// the data doesn't pass through the file cache.  While the
+// write is in progress the worker encodes its next frame.
+//
+class SnapshotWriter
+{
+public:
+    SnapshotWriter() { }
+    ~SnapshotWriter() { Shutdown(); }
+
+    //
+    // Starts the worker threads.  'threads' defaults to the
+    // number of CPU cores.  Write() waits once 'maxQueued'
+    // frames are waiting to be encoded, so that memory use stays
+    // bounded when the disk can't keep up.  Returns true if
+    // successful.
+    //
+    bool Startup(unsigned threads = 0, unsigned maxQueued = 16);
+
+    //
+    // Writes all of the frames still queued and stops the
+    // worker threads.
+    //
+    void Shutdown();
+
+    bool IsRunning() const { return m_running; }
+
+    //
+    // Queues a 24-bit BGR or 32-bit BGRA image to be written to
+    // a file.  The pixels are copied, so the caller can reuse
+    // its buffer right away.  'bottomUp' tells whether the first
+    // scanline in memory is the bottom one, as for GDI captures.
+    // Returns true if the frame was queued; whether the file was
+    // written can be checked with GetFailedCount().
+    //
+    bool Write(const std::wstring &filename, SnapshotFormat format,
+        unsigned width, unsigned height, unsigned stride,
+        unsigned bitsPerPixel, const void *pBits, bool bottomUp = false);
+
+    //
+    // Queues a 32-bit frame from a capture's FramePool to be
+    // written to a file, as described by its FrameInfo.  The
+    // pixels aren't copied; the handle is held until the file
+    // has been encoded.
+    //
+    bool Write(const std::wstring &filename, SnapshotFormat format, const FrameHandle &frame);
+
+    //
+    // Waits until every frame queued so far has been written.
+    //
+    void Flush();
+
+    //
+    // Returns the most frames the writer holds at once, queued
+    // or being encoded, which is how many pool buffers it may
+    // keep from the capture.
+    //
+    unsigned GetMaxFramesHeld() const { return m_maxQueued + static_cast<unsigned>(m_workers.size()); }
+
+    uint64_t GetWrittenCount() const { return m_written; }
+    uint64_t GetFailedCount() const  { return m_failed; }
+
+private:
+    // A frame waiting to be written.
+    struct Job
+    {
+        std::wstring         filename;
+        SnapshotFormat       format = SnapshotFormat_BMP;
+        unsigned             width = 0;
+        unsigned             height = 0;
+        unsigned             bitsPerPixel = 0;
+        bool                 bottomUp = false;
+        unsigned             stride = 0;   // Bytes between scanlines.
+        std::vector<uint8_t> pixels;       // Packed, without padding,
+        FrameHandle          frame;        // or held in a pool buffer.
+
+        const uint8_t *GetPixels() const { return frame ? frame.GetData() : pixels.data(); }
+    };
+
+    // A buffer aligned for unbuffered writes.
+    struct FileBuffer
+    {
+        uint8_t *data = nullptr;
+        size_t   capacity = 0;
+        size_t   size = 0;      // Bytes of file data in the buffer.
+    };
+
+    // A write that has been issued but may not be done yet.
+    struct PendingWrite
+    {
+        HANDLE       file = INVALID_HANDLE_VALUE;
+        OVERLAPPED   overlapped = {};
+        std::wstring filename;
+        size_t       size = 0;
+    };
+
+    bool                 m_running = false;
+    unsigned             m_maxQueued = 0;
+    std::vector<std::thread> m_workers;
+
+    // Jobs waiting for a worker, under m_mutex.  m_queuedSemaphore
+    // counts them, and m_freeSemaphore counts the room left.
+    std::mutex           m_mutex;
+    std::deque<Job>      m_queue;
+    unsigned             m_busy = 0;            // Jobs queued or not yet written.
+    HANDLE               m_queuedSemaphore = nullptr;
+    HANDLE               m_freeSemaphore = nullptr;
+    HANDLE               m_idleEvent = nullptr; // Set while nothing is queued or busy.
+
+    std::atomic<bool>    m_stopping { false };
+    std::atomic<uint64_t> m_written { 0 };
+    std::atomic<uint64_t> m_failed { 0 };
+
+    void WorkerThread();
+    bool TakeJob(Job &job, DWORD timeout);
+    void JobDone();
+    bool QueueJob(Job &job);
+    static bool Encode(const Job &job, FileBuffer &buffer);
+    static bool BeginWrite(const std::wstring &filename, const FileBuffer &buffer, PendingWrite &pending);
+    static bool EndWrite(PendingWrite &pending);
+    static bool Reserve(FileBuffer &buffer, size_t bytes);
+    static void Free(FileBuffer &buffer);
+};
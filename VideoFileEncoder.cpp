@@ -41,12 +41,18 @@
 //--------------------------------------------------------------------
 
 #include "VideoFileEncoder.h"
+#include "ScreenCapTrace.h"
+#include <d3d10.h>
+#include <mftransform.h>
+#include <codecapi.h>
+#include <mutex>
 
 // Auto-link to the MMF libaries.
 #pragma comment(lib, "ole32")
 #pragma comment(lib, "mfuuid")
 #pragma comment(lib, "mfreadwrite")
 #pragma comment(lib, "mfplat")
+#pragma comment(lib, "mf")
 
 template <class T> void SafeRelease(T **ppT)
 {
@@ -57,6 +63,173 @@ template <class T> void SafeRelease(T **ppT)
     }
 }
 
+//----------------------------------------------------------
+// Local helpers
+//----------------------------------------------------------
+
+// Key of the attribute that carries the size of an asynchronous
+// write from BeginWrite() to EndWrite().
+static const GUID WriteSizeKey =
+    { 0x6c1f4d2a, 0x93b7, 0x4e0b, { 0xa5, 0x1c, 0x2d, 0x8e, 0x47, 0x30, 0xb9, 0x6f } };
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+//
+// A write-only byte stream that hands everything written to it
+// straight to a VideoEncoderOutput, so the encoded video never
+// piles up in memory.  It can't seek or read, which the
+// fragmented MP4 sink doesn't need.
+//
+class CallbackByteStream : public IMFByteStream
+{
+public:
+    explicit CallbackByteStream(VideoEncoderOutput *output) : m_output(output) { }
+
+    // IUnknown
+    STDMETHODIMP QueryInterface(REFIID riid, void **ppv) override
+    {
+        if (!ppv)
+            return E_POINTER;
+        if (riid == __uuidof(IUnknown) || riid == __uuidof(IMFByteStream))
+        {
+            *ppv = static_cast<IMFByteStream *>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = nullptr;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef() override { return InterlockedIncrement(&m_refCount); }
+    STDMETHODIMP_(ULONG) Release() override
+    {
+        const ULONG count = InterlockedDecrement(&m_refCount);
+        if (count == 0)
+            delete this;
+        return count;
+    }
+
+    // IMFByteStream
+    STDMETHODIMP GetCapabilities(DWORD *pdwCapabilities) override
+    {
+        *pdwCapabilities = MFBYTESTREAM_IS_WRITABLE;
+        return S_OK;
+    }
+    STDMETHODIMP GetLength(QWORD *pqwLength) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *pqwLength = m_position;
+        return S_OK;
+    }
+    STDMETHODIMP SetLength(QWORD) override { return E_NOTIMPL; }
+    STDMETHODIMP GetCurrentPosition(QWORD *pqwPosition) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *pqwPosition = m_position;
+        return S_OK;
+    }
+    STDMETHODIMP SetCurrentPosition(QWORD qwPosition) override
+    {
+        // We can only "seek" to where we already are.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return (qwPosition == m_position) ? S_OK : E_NOTIMPL;
+    }
+    STDMETHODIMP IsEndOfStream(BOOL *pfEndOfStream) override
+    {
+        *pfEndOfStream = TRUE;
+        return S_OK;
+    }
+    STDMETHODIMP Read(BYTE *, ULONG, ULONG *) override { return E_NOTIMPL; }
+    STDMETHODIMP BeginRead(BYTE *, ULONG, IMFAsyncCallback *, IUnknown *) override { return E_NOTIMPL; }
+    STDMETHODIMP EndRead(IMFAsyncResult *, ULONG *) override { return E_NOTIMPL; }
+    STDMETHODIMP Write(const BYTE *pb, ULONG cb, ULONG *pcbWritten) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *pcbWritten = 0;
+        if (m_closed || !m_output->Write(pb, cb))
+            return E_FAIL;
+        m_position += cb;
+        *pcbWritten = cb;
+        return S_OK;
+    }
+    STDMETHODIMP BeginWrite(const BYTE *pb, ULONG cb,
+        IMFAsyncCallback *pCallback, IUnknown *punkState) override
+    {
+        // The write is done right away, and the result that tells
+        // the caller so carries its size along to EndWrite().
+        ULONG written = 0;
+        HRESULT hrWrite = Write(pb, cb, &written);
+
+        IMFAttributes *pSize = nullptr;
+        IMFAsyncResult *pResult = nullptr;
+        HRESULT hr = MFCreateAttributes(&pSize, 1);
+        if (SUCCEEDED(hr))
+            hr = pSize->SetUINT32(WriteSizeKey, written);
+        if (SUCCEEDED(hr))
+            hr = MFCreateAsyncResult(pSize, pCallback, punkState, &pResult);
+        if (SUCCEEDED(hr))
+        {
+            pResult->SetStatus(hrWrite);
+            hr = MFInvokeCallback(pResult);
+        }
+        SafeRelease(&pResult);
+        SafeRelease(&pSize);
+        return hr;
+    }
+    STDMETHODIMP EndWrite(IMFAsyncResult *pResult, ULONG *pcbWritten) override
+    {
+        *pcbWritten = 0;
+        IUnknown *pObject = nullptr;
+        IMFAttributes *pSize = nullptr;
+        HRESULT hr = pResult->GetStatus();
+        if (SUCCEEDED(hr))
+            hr = pResult->GetObject(&pObject);
+        if (SUCCEEDED(hr))
+            hr = pObject->QueryInterface(IID_PPV_ARGS(&pSize));
+        UINT32 written = 0;
+        if (SUCCEEDED(hr))
+            hr = pSize->GetUINT32(WriteSizeKey, &written);
+        if (SUCCEEDED(hr))
+            *pcbWritten = written;
+        SafeRelease(&pSize);
+        SafeRelease(&pObject);
+        return hr;
+    }
+    STDMETHODIMP Seek(MFBYTESTREAM_SEEK_ORIGIN origin, LONGLONG offset,
+        DWORD, QWORD *pqwCurrentPosition) override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const LONGLONG target = (origin == msoBegin) ?
+            offset : static_cast<LONGLONG>(m_position) + offset;
+        if (target != static_cast<LONGLONG>(m_position))
+            return E_NOTIMPL;
+        if (pqwCurrentPosition)
+            *pqwCurrentPosition = m_position;
+        return S_OK;
+    }
+    STDMETHODIMP Flush() override { return S_OK; }
+    STDMETHODIMP Close() override
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        return S_OK;
+    }
+
+private:
+    ~CallbackByteStream() { }
+
+    volatile ULONG      m_refCount = 1;
+    VideoEncoderOutput *m_output;
+    std::mutex          m_mutex;
+    QWORD               m_position = 0;
+    bool                m_closed = false;
+};
+
 //----------------------------------------------------------
 // Private members
 //----------------------------------------------------------
@@ -75,7 +248,71 @@ bool VideoFileEncoder::SetFrameFormat(
     m_fps = fps;
     m_frameDuration = 10 * 1000 * 1000 / m_fps;
     m_bitRate = static_cast<uint32_t>(width * height * 2.5);
-    m_pixels.resize(width * height * sizeof(uint32_t));
+
+    return true;
+}
+
+//
+// Returns the size in bytes of one input frame.
+//
+DWORD VideoFileEncoder::GetFrameBytes() const
+{
+    if (m_inputFormat == MFVideoFormat_NV12)
+        return m_width * m_height * 3 / 2;
+    return sizeof(uint32_t) * m_width * m_height;
+}
+
+//
+// Sets up the sink writer for Start(), writing either to the
+// named file, or as fragmented MP4 to the given byte stream.
+// Returns true if successful.
+//
+bool VideoFileEncoder::StartWriter(
+    const wchar_t *filename,
+    IMFByteStream *pByteStream,
+    uint32_t width,
+    uint32_t height,
+    uint32_t fps,
+    const VideoEncoderConfig &config
+    )
+{
+    if (m_pSinkWriter)
+        Stop();
+
+    // H.264 has one chroma sample per 2x2 block of pixels, so
+    // the encoder rejects odd sizes.  Whether a large frame
+    // size is supported is up to the encoder, which tells us
+    // when the sink writer is set up.
+    if (m_encodingFormat == MFVideoFormat_H264 && ((width | height) & 1))
+        return false;
+
+    // Only MP4 files can be fragmented.
+    if (pByteStream && m_encodingFormat != MFVideoFormat_H264)
+        return false;
+
+    if (!SetFrameFormat(width, height, fps))
+        return false;
+    m_config = config;
+    if (config.bitRate)
+        m_bitRate = config.bitRate;
+
+    // NV12 has one UV sample per 2x2 block of pixels.
+    if (m_inputFormat == MFVideoFormat_NV12 && ((width | height) & 1))
+        return false;
+
+    m_pSinkWriter = nullptr;
+    m_stream = 0;
+    HRESULT hr = InitializeSinkWriter(&m_pSinkWriter, reinterpret_cast<DWORD *>(&m_stream),
+                    filename, pByteStream);
+    SCREENCAP_TRACE("EncoderStarted",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingHResult(hr, "HResult"),
+        TraceLoggingUInt32(width, "Width"),
+        TraceLoggingUInt32(height, "Height"),
+        TraceLoggingUInt32(fps, "Fps"),
+        TraceLoggingBool(m_hardwareEncoder, "Hardware"));
+    if (!SUCCEEDED(hr))
+        return false;
 
     return true;
 }
@@ -83,7 +320,8 @@ bool VideoFileEncoder::SetFrameFormat(
 HRESULT VideoFileEncoder::InitializeSinkWriter(
     IMFSinkWriter **ppWriter,
     DWORD *pStreamIndex,
-    const wchar_t *filename
+    const wchar_t *filename,
+    IMFByteStream *pByteStream
     )
 {
     // This code was adapted from the example in Microsoft's documentation.
@@ -96,7 +334,21 @@ HRESULT VideoFileEncoder::InitializeSinkWriter(
     IMFMediaType    *pMediaTypeIn = nullptr;   
     DWORD           streamIndex = 0;
 
-    HRESULT hr = MFCreateSinkWriterFromURL(filename, nullptr, nullptr, &pSinkWriter);
+    IMFAttributes   *pAttributes = nullptr;
+    IMFAttributes   *pParams = nullptr;
+    IMFMediaSink    *pMediaSink = nullptr;
+
+    // Let the sink writer pick a hardware encoder if there is
+    // one, unless we were told not to.  When we share a Direct3D
+    // device, the sink writer uses it too.
+    const BOOL hardware = (m_config.hardware != VideoEncoderHardware_Off);
+    HRESULT hr = MFCreateAttributes(&pAttributes, 3);
+    if (SUCCEEDED(hr) && m_pDeviceManager)
+        hr = pAttributes->SetUnknown(MF_SINK_WRITER_D3D_MANAGER, m_pDeviceManager);
+    if (SUCCEEDED(hr))
+        hr = pAttributes->SetUINT32(MF_READWRITE_ENABLE_HARDWARE_TRANSFORMS, hardware);
+    if (SUCCEEDED(hr) && m_config.lowLatency)
+        hr = pAttributes->SetUINT32(MF_LOW_LATENCY, TRUE);
 
     // Set the output media type.
     if (SUCCEEDED(hr))
@@ -115,8 +367,24 @@ HRESULT VideoFileEncoder::InitializeSinkWriter(
         hr = MFSetAttributeRatio(pMediaTypeOut, MF_MT_FRAME_RATE, m_fps, 1);
     if (SUCCEEDED(hr))
         hr = MFSetAttributeRatio(pMediaTypeOut, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
-    if (SUCCEEDED(hr))
-        hr = pSinkWriter->AddStream(pMediaTypeOut, &streamIndex);   
+
+    // A fragmented MP4 sink is created with its one stream
+    // already in place.  A sink writer for a file works out the
+    // kind of file from the file name.
+    if (pByteStream)
+    {
+        if (SUCCEEDED(hr))
+            hr = MFCreateFMPEG4MediaSink(pByteStream, pMediaTypeOut, nullptr, &pMediaSink);
+        if (SUCCEEDED(hr))
+            hr = MFCreateSinkWriterFromMediaSink(pMediaSink, pAttributes, &pSinkWriter);
+    }
+    else
+    {
+        if (SUCCEEDED(hr))
+            hr = MFCreateSinkWriterFromURL(filename, nullptr, pAttributes, &pSinkWriter);
+        if (SUCCEEDED(hr))
+            hr = pSinkWriter->AddStream(pMediaTypeOut, &streamIndex);   
+    }
 
     // Set the input media type.
     if (SUCCEEDED(hr))
@@ -127,6 +395,16 @@ HRESULT VideoFileEncoder::InitializeSinkWriter(
         hr = pMediaTypeIn->SetGUID(MF_MT_SUBTYPE, m_inputFormat);
     if (SUCCEEDED(hr))
         hr = pMediaTypeIn->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+    if (SUCCEEDED(hr))
+    {
+        // Without this, Media Foundation assumes RGB frames are
+        // bottom-up.  A positive stride says they are top-down,
+        // which is how frames arrive from capture, so they don't
+        // need to be flipped.
+        const UINT32 stride = (m_inputFormat == MFVideoFormat_NV12) ?
+            m_width : sizeof(uint32_t) * m_width;
+        hr = pMediaTypeIn->SetUINT32(MF_MT_DEFAULT_STRIDE, stride);
+    }
     if (SUCCEEDED(hr))
         hr = MFSetAttributeSize(pMediaTypeIn, MF_MT_FRAME_SIZE, m_width, m_height);
     if (SUCCEEDED(hr))
@@ -134,7 +412,17 @@ HRESULT VideoFileEncoder::InitializeSinkWriter(
     if (SUCCEEDED(hr))
         hr = MFSetAttributeRatio(pMediaTypeIn, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);   
     if (SUCCEEDED(hr))
-        hr = pSinkWriter->SetInputMediaType(streamIndex, pMediaTypeIn, nullptr);   
+        hr = CreateEncodingParameters(&pParams);
+    if (SUCCEEDED(hr))
+        hr = pSinkWriter->SetInputMediaType(streamIndex, pMediaTypeIn, pParams);   
+
+    // The encoder has been chosen now.
+    if (SUCCEEDED(hr))
+    {
+        m_hardwareEncoder = UsesHardwareEncoder(pSinkWriter, streamIndex);
+        if (m_config.hardware == VideoEncoderHardware_Required && !m_hardwareEncoder)
+            hr = MF_E_TOPO_CODEC_NOT_FOUND;
+    }
 
     if (SUCCEEDED(hr))
         hr = pSinkWriter->BeginWriting();
@@ -147,63 +435,221 @@ HRESULT VideoFileEncoder::InitializeSinkWriter(
     }
 
     SafeRelease(&pSinkWriter);
+    SafeRelease(&pMediaSink);
     SafeRelease(&pMediaTypeOut);
     SafeRelease(&pMediaTypeIn);
+    SafeRelease(&pAttributes);
+    SafeRelease(&pParams);
     return hr;
 }
 
-HRESULT VideoFileEncoder::WriteFrame(
-    IMFSinkWriter *pWriter, 
-    DWORD streamIndex, 
-    const LONGLONG& timestamp
-    )
+//
+// Creates the attributes that pass the encoder settings from
+// m_config to the encoder, keyed by their ICodecAPI properties.
+//
+HRESULT VideoFileEncoder::CreateEncodingParameters(IMFAttributes **ppParams) const
 {
-    IMFSample *pSample = nullptr;
-    IMFMediaBuffer *pBuffer = nullptr;
+    IMFAttributes *pParams = nullptr;
+    HRESULT hr = MFCreateAttributes(&pParams, 8);
 
-    const LONG cbWidth = sizeof(uint32_t) * m_width;
-    const DWORD cbBuffer = cbWidth * m_height;
+    if (SUCCEEDED(hr) && m_config.rateControl != VideoEncoderRateControl_Default)
+    {
+        UINT32 mode = eAVEncCommonRateControlMode_CBR;
+        if (m_config.rateControl == VideoEncoderRateControl_VBR)
+            mode = eAVEncCommonRateControlMode_UnconstrainedVBR;
+        else if (m_config.rateControl == VideoEncoderRateControl_Quality)
+            mode = eAVEncCommonRateControlMode_Quality;
+        hr = pParams->SetUINT32(CODECAPI_AVEncCommonRateControlMode, mode);
+    }
+    if (SUCCEEDED(hr) && m_config.rateControl != VideoEncoderRateControl_Quality)
+        hr = pParams->SetUINT32(CODECAPI_AVEncCommonMeanBitRate, m_bitRate);
+    if (SUCCEEDED(hr) && m_config.quality)
+        hr = pParams->SetUINT32(CODECAPI_AVEncCommonQuality, min(m_config.quality, 100u));
+    if (SUCCEEDED(hr) && m_config.lowLatency)
+        hr = pParams->SetUINT32(CODECAPI_AVLowLatencyMode, TRUE);
+    if (SUCCEEDED(hr) && m_config.gopSize)
+        hr = pParams->SetUINT32(CODECAPI_AVEncMPVGOPSize, m_config.gopSize);
+    if (SUCCEEDED(hr) && m_config.bFrames >= 0)
+        hr = pParams->SetUINT32(CODECAPI_AVEncMPVDefaultBPictureCount, m_config.bFrames);
+    if (SUCCEEDED(hr) && m_config.threads)
+        hr = pParams->SetUINT32(CODECAPI_AVEncNumWorkerThreads, m_config.threads);
 
-    BYTE *pData = nullptr;
+    if (FAILED(hr))
+    {
+        SafeRelease(&pParams);
+        return hr;
+    }
 
-    HRESULT hr = MFCreateMemoryBuffer(cbBuffer, &pBuffer);
+    *ppParams = pParams;
+    return S_OK;
+}
 
-    if (SUCCEEDED(hr))
-        hr = pBuffer->Lock(&pData, nullptr, nullptr);
+//
+// Returns true if the encoder the sink writer chose for the
+// stream is a hardware encoder.  Hardware MFTs are required to
+// carry MFT_ENUM_HARDWARE_URL_Attribute.
+//
+bool VideoFileEncoder::UsesHardwareEncoder(IMFSinkWriter *pWriter, DWORD streamIndex) const
+{
+    IMFSinkWriterEx *pWriterEx = nullptr;
+    if (FAILED(pWriter->QueryInterface(__uuidof(IMFSinkWriterEx),
+                    reinterpret_cast<void **>(&pWriterEx))))
+        return false;
 
-    if (SUCCEEDED(hr))
+    bool hardware = false;
+    for (DWORD i = 0; ; i++)
     {
-        hr = MFCopyImage(
-                pData,            // Dest buffer
-                cbWidth,          // Dest stride
-                m_pixels.data(),  // Src buffer
-                cbWidth,          // Src stride
-                cbWidth,          // Image width in bytes (not pixels!)
-                m_height          // Image height in pixels
-            );
+        GUID category = GUID_NULL;
+        IMFTransform *pTransform = nullptr;
+        if (FAILED(pWriterEx->GetTransformForStream(streamIndex, i, &category, &pTransform)))
+            break;
+
+        IMFAttributes *pAttributes = nullptr;
+        UINT32 length = 0;
+        if (category == MFT_CATEGORY_VIDEO_ENCODER &&
+            SUCCEEDED(pTransform->GetAttributes(&pAttributes)) &&
+            SUCCEEDED(pAttributes->GetStringLength(MFT_ENUM_HARDWARE_URL_Attribute, &length)))
+        {
+            hardware = true;
+        }
+        SafeRelease(&pAttributes);
+        SafeRelease(&pTransform);
     }
 
-    if (pBuffer)
-        pBuffer->Unlock();
+    SafeRelease(&pWriterEx);
+    return hardware;
+}
 
-    if (SUCCEEDED(hr))
-        hr = pBuffer->SetCurrentLength(cbBuffer);
+//
+// Gets a sample with a system memory buffer big enough for one
+// frame, reusing one from the pool if the sink writer is done
+// with it.  The caller receives a reference to both the sample
+// and its buffer.
+//
+HRESULT VideoFileEncoder::GetPooledSample(
+    IMFSample **ppSample,
+    IMFMediaBuffer **ppBuffer
+    )
+{
+    *ppSample = nullptr;
+    *ppBuffer = nullptr;
+
+    // A sample that only the pool holds a reference to is free.
+    for (auto *pSample : m_samplePool)
+    {
+        pSample->AddRef();
+        if (pSample->Release() == 1)
+        {
+            *ppSample = pSample;
+            (*ppSample)->AddRef();
+            return pSample->GetBufferByIndex(0, ppBuffer);
+        }
+    }
+
+    // They are all still in use, so add another one.
+    const DWORD cbBuffer = GetFrameBytes();
+    IMFSample *pSample = nullptr;
+    IMFMediaBuffer *pBuffer = nullptr;
+
+    HRESULT hr = MFCreateMemoryBuffer(cbBuffer, &pBuffer);
     if (SUCCEEDED(hr))
         hr = MFCreateSample(&pSample);
     if (SUCCEEDED(hr))
         hr = pSample->AddBuffer(pBuffer);
+
     if (SUCCEEDED(hr))
-        hr = pSample->SetSampleTime(timestamp);
-    if (SUCCEEDED(hr))
-        hr = pSample->SetSampleDuration(m_frameDuration);
-    if (SUCCEEDED(hr))
-        hr = pWriter->WriteSample(streamIndex, pSample);
+    {
+        m_samplePool.push_back(pSample);
+        pSample->AddRef();
+        *ppSample = pSample;
+        *ppBuffer = pBuffer;
+        return S_OK;
+    }
 
     SafeRelease(&pSample);
     SafeRelease(&pBuffer);
     return hr;
 }
 
+//
+// Releases the pool of samples.
+//
+void VideoFileEncoder::ReleaseSamplePool()
+{
+    for (auto *pSample : m_samplePool)
+        pSample->Release();
+    m_samplePool.clear();
+}
+
+//
+// Sends a sample holding one frame to the sink writer.  In
+// variable frame rate mode, the sample is held instead, and the
+// previously held one is sent with its duration running up to
+// this one.
+//
+HRESULT VideoFileEncoder::WriteFrame(
+    IMFSinkWriter *pWriter,
+    DWORD streamIndex,
+    IMFSample *pSample,
+    const LONGLONG& timestamp
+    )
+{
+    const int64_t writeStart = GetQpc();
+    HRESULT hr = S_OK;
+    if (m_variableFrameRate)
+    {
+        if (m_pHeldSample && timestamp <= m_heldTime)
+            return E_INVALIDARG;
+
+        hr = WriteHeldFrame(timestamp);
+        if (SUCCEEDED(hr))
+            hr = pSample->SetSampleTime(timestamp);
+        if (SUCCEEDED(hr))
+        {
+            m_pHeldSample = pSample;
+            m_pHeldSample->AddRef();
+            m_heldTime = timestamp;
+            m_heldEnd  = timestamp + m_frameDuration;
+        }
+    }
+    else
+    {
+        hr = pSample->SetSampleTime(timestamp);
+        if (SUCCEEDED(hr))
+            hr = pSample->SetSampleDuration(m_frameDuration);
+        if (SUCCEEDED(hr))
+            hr = pWriter->WriteSample(streamIndex, pSample);
+    }
+    m_timings.write = GetQpc() - writeStart;
+
+    // In variable frame rate mode the sample written is the one
+    // held from the frame before.
+    SCREENCAP_TRACE("EncoderWriteSample",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingHResult(hr, "HResult"),
+        TraceLoggingInt64(timestamp, "Timestamp"),
+        TraceLoggingInt64(m_timings.write, "WriteTicks"),
+        TraceLoggingBool(m_variableFrameRate, "Held"));
+    return hr;
+}
+
+//
+// Sends the sample held in variable frame rate mode, if any,
+// to the sink writer, lasting until 'endTime'.
+//
+HRESULT VideoFileEncoder::WriteHeldFrame(const LONGLONG& endTime)
+{
+    if (!m_pHeldSample)
+        return S_OK;
+
+    HRESULT hr = m_pHeldSample->SetSampleDuration(endTime - m_heldTime);
+    if (SUCCEEDED(hr))
+        hr = m_pSinkWriter->WriteSample(m_stream, m_pHeldSample);
+
+    SafeRelease(&m_pHeldSample);
+    return hr;
+}
+
 //----------------------------------------------------------
 // Public members
 //----------------------------------------------------------
@@ -211,13 +657,19 @@ HRESULT VideoFileEncoder::WriteFrame(
 VideoFileEncoder::VideoFileEncoder(bool doMFStartup, bool doCoInitialize) :
     m_doMFStartup(doMFStartup), m_doCoInitialize(doCoInitialize)
 {
-    CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
-    MFStartup(MF_VERSION);
+    // Only start what the flags ask for, so an application
+    // that keeps COM and Media Foundation running doesn't pay
+    // for starting them again with every encoder.
+    if (m_doCoInitialize)
+        CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+    if (m_doMFStartup)
+        MFStartup(MF_VERSION);
 }
 
 VideoFileEncoder::~VideoFileEncoder()
 {
     Stop();
+    SafeRelease(&m_pDeviceManager);
     if (m_doMFStartup)
         MFShutdown();
     if (m_doCoInitialize)
@@ -233,29 +685,199 @@ bool VideoFileEncoder::SetEncodingFormat(GUID fmt)
     return true;
 }
 
+//
+// Specify the format of the frames passed to the encoder.
+//
+bool VideoFileEncoder::SetInputFormat(GUID fmt)
+{
+    if (m_pSinkWriter)
+        return false; // Too late, already started!
+
+    if (fmt != MFVideoFormat_RGB32 && fmt != MFVideoFormat_NV12)
+        return false;
+
+    m_inputFormat = fmt;
+    return true;
+}
+
+//
+// Specify a Direct3D 11 device to share with Media Foundation.
+//
+bool VideoFileEncoder::SetD3DDevice(ID3D11Device *pDevice)
+{
+    if (m_pSinkWriter)
+        return false; // Too late, already started!
+
+    SafeRelease(&m_pDeviceManager);
+    m_deviceResetToken = 0;
+    if (!pDevice)
+        return true;
+
+    // Media Foundation may use the device from its own threads.
+    ID3D10Multithread *pMultithread = nullptr;
+    if (SUCCEEDED(pDevice->QueryInterface(__uuidof(ID3D10Multithread),
+                    reinterpret_cast<void **>(&pMultithread))))
+    {
+        pMultithread->SetMultithreadProtected(TRUE);
+        SafeRelease(&pMultithread);
+    }
+
+    HRESULT hr = MFCreateDXGIDeviceManager(&m_deviceResetToken, &m_pDeviceManager);
+    if (SUCCEEDED(hr))
+        hr = m_pDeviceManager->ResetDevice(pDevice, m_deviceResetToken);
+    if (FAILED(hr))
+    {
+        SafeRelease(&m_pDeviceManager);
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Enables or disables variable frame rate mode.
+//
+bool VideoFileEncoder::SetVariableFrameRate(bool enable)
+{
+    if (m_pSinkWriter)
+        return false; // Too late, already started!
+
+    m_variableFrameRate = enable;
+    return true;
+}
+
 //
 // Start encoding video frames to the specified file in the
 // specified frame format.
 //
-bool VideoFileEncoder::Start(const wchar_t *filename, uint32_t width, uint32_t height, uint32_t fps)
+bool VideoFileEncoder::Start(
+    const wchar_t *filename,
+    uint32_t width,
+    uint32_t height,
+    uint32_t fps,
+    const VideoEncoderConfig &config
+    )
 {
+    if (!config.fragmented)
+        return StartWriter(filename, nullptr, width, height, fps, config);
+
+    // The fragmented MP4 sink writes to a byte stream, so open
+    // the file as one.
     if (m_pSinkWriter)
         Stop();
+    IMFByteStream *pByteStream = nullptr;
+    if (FAILED(MFCreateFile(MF_ACCESSMODE_WRITE, MF_OPENMODE_DELETE_IF_EXIST,
+            MF_FILEFLAGS_NONE, filename, &pByteStream)))
+        return false;
 
-    // TODO: mp4/h264 format must have even width and height
-    // parameters AND must be no larger than 1920x1080.
-    // Need to check these!
+    const bool ok = StartWriter(nullptr, pByteStream, width, height, fps, config);
+    SafeRelease(&pByteStream);
+    return ok;
+}
 
-    if (!SetFrameFormat(width, height, fps))
+//
+// Start encoding video frames as fragmented MP4 to the given
+// byte stream.
+//
+bool VideoFileEncoder::Start(
+    IMFByteStream *pByteStream,
+    uint32_t width,
+    uint32_t height,
+    uint32_t fps,
+    const VideoEncoderConfig &config
+    )
+{
+    if (!pByteStream)
         return false;
 
-    m_pSinkWriter = nullptr;
-    m_stream = 0;
-    HRESULT hr = InitializeSinkWriter(&m_pSinkWriter, reinterpret_cast<DWORD *>(&m_stream), filename);
-    if (!SUCCEEDED(hr))
+    return StartWriter(nullptr, pByteStream, width, height, fps, config);
+}
+
+//
+// Start encoding video frames as fragmented MP4, handing the
+// encoded data to 'output' as it is written.
+//
+bool VideoFileEncoder::Start(
+    VideoEncoderOutput *output,
+    uint32_t width,
+    uint32_t height,
+    uint32_t fps,
+    const VideoEncoderConfig &config
+    )
+{
+    if (!output)
         return false;
 
-    return true;
+    IMFByteStream *pByteStream = new CallbackByteStream(output);
+    const bool ok = StartWriter(nullptr, pByteStream, width, height, fps, config);
+    SafeRelease(&pByteStream);
+    return ok;
+}
+
+//
+// Works out the largest even frame size with the shape of the
+// given image that fits within the given maximum.
+//
+void VideoFileEncoder::FitFrameSize(
+    uint32_t width,
+    uint32_t height,
+    uint32_t maxWidth,
+    uint32_t maxHeight,
+    uint32_t &fitWidth,
+    uint32_t &fitHeight
+    )
+{
+    fitWidth  = width;
+    fitHeight = height;
+    if (fitWidth > maxWidth)
+    {
+        fitHeight = static_cast<uint32_t>(static_cast<uint64_t>(fitHeight) * maxWidth / fitWidth);
+        fitWidth  = maxWidth;
+    }
+    if (fitHeight > maxHeight)
+    {
+        fitWidth  = static_cast<uint32_t>(static_cast<uint64_t>(fitWidth) * maxHeight / fitHeight);
+        fitHeight = maxHeight;
+    }
+
+    fitWidth  = max(fitWidth & ~1u, 2u);
+    fitHeight = max(fitHeight & ~1u, 2u);
+}
+
+//
+// Lists the hardware encoders for the selected encoding format.
+//
+bool VideoFileEncoder::GetHardwareEncoderNames(std::vector<std::wstring> &names) const
+{
+    names.clear();
+
+    MFT_REGISTER_TYPE_INFO outputType = { MFMediaType_Video, m_encodingFormat };
+    IMFActivate **ppActivate = nullptr;
+    UINT32 count = 0;
+    HRESULT hr = MFTEnumEx(MFT_CATEGORY_VIDEO_ENCODER,
+                    MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+                    nullptr, &outputType, &ppActivate, &count);
+    if (FAILED(hr))
+        return false;
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        wchar_t *name = nullptr;
+        UINT32 length = 0;
+        if (SUCCEEDED(ppActivate[i]->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute, &name, &length)))
+        {
+            names.push_back(name);
+            CoTaskMemFree(name);
+        }
+        else
+        {
+            names.push_back(L"Unknown hardware encoder");
+        }
+        ppActivate[i]->Release();
+    }
+    CoTaskMemFree(ppActivate);
+
+    return !names.empty();
 }
 
 //
@@ -266,8 +888,22 @@ bool VideoFileEncoder::Stop()
     if (!m_pSinkWriter)
         return false;
 
-    HRESULT hr = m_pSinkWriter->Finalize();
+    if (m_pOpenBuffer)
+        m_pOpenBuffer->Unlock();
+    SafeRelease(&m_pOpenBuffer);
+    SafeRelease(&m_pOpenSample);
+
+    // The last frame lasts as long as it was last known to be
+    // on the screen.
+    HRESULT hr = WriteHeldFrame(m_heldEnd);
+    HRESULT hrFinalize = m_pSinkWriter->Finalize();
+    if (SUCCEEDED(hr))
+        hr = hrFinalize;
+    SCREENCAP_TRACE("EncoderStopped",
+        TraceLoggingLevel(WINEVENT_LEVEL_INFO),
+        TraceLoggingHResult(hr, "HResult"));
     SafeRelease(&m_pSinkWriter);
+    ReleaseSamplePool();
 
     return SUCCEEDED(hr);
 }
@@ -276,7 +912,8 @@ bool VideoFileEncoder::Stop()
 // Adds the next frame to the video stream.
 // The data pointed to by 'pixels' must be in the format
 // specified to the Start() member.  Pixels are assumed
-// to be 32 bits each (BGRA or BGRX).
+// to be 32 bits each (BGRA or BGRX), unless NV12 input
+// was selected.
 //
 // If flipY is true, the scanlines in 'pixels' are in
 // bottom-to-top order rather than top-to-bottom order.
@@ -285,29 +922,222 @@ bool VideoFileEncoder::Stop()
 //
 bool VideoFileEncoder::AddFrame(const void *pixels, bool flipY, uint64_t timestamp)
 {
-    if (!pixels || m_pixels.empty())
+    const uint32_t stride = (m_inputFormat == MFVideoFormat_NV12) ?
+        m_width : sizeof(uint32_t) * m_width;
+    return AddFrame(pixels, stride, flipY, timestamp);
+}
+
+//
+// Adds the next frame to the video stream, where the scanlines
+// in 'pixels' are 'stride' bytes apart.  Returns true if
+// successful.
+//
+bool VideoFileEncoder::AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp)
+{
+    const bool nv12 = (m_inputFormat == MFVideoFormat_NV12);
+    const LONG cbWidth = nv12 ? m_width : sizeof(uint32_t) * m_width;
+    const DWORD cbBuffer = GetFrameBytes();
+
+    if (!pixels || !m_pSinkWriter || stride < static_cast<uint32_t>(cbWidth))
         return false;
+    if (nv12 && flipY)
+        return false; // Not supported for planar frames.
 
-    memcpy(m_pixels.data(), pixels, m_width * m_height * sizeof(uint32_t));
+    IMFSample *pSample = nullptr;
+    IMFMediaBuffer *pBuffer = nullptr;
+    BYTE *pData = nullptr;
+
+    const int64_t copyStart = GetQpc();
+    HRESULT hr = GetPooledSample(&pSample, &pBuffer);
+    if (SUCCEEDED(hr))
+        hr = pBuffer->Lock(&pData, nullptr, nullptr);
 
-    if (flipY)
+    if (SUCCEEDED(hr))
     {
-        unsigned stride = m_width * sizeof(uint32_t);
-        std::vector<uint8_t> scanline(stride);
-        uint8_t *scanline1 = m_pixels.data();
-        uint8_t *scanline2 = m_pixels.data() + (m_height - 1) * stride;
-        for (unsigned y = 0; y < m_height / 2; y++)
+        // Flipping is done by copying from the last scanline
+        // up, with a negative source stride, so each frame is
+        // only copied once.
+        const BYTE *pSrc = static_cast<const BYTE *>(pixels);
+        LONG srcStride = static_cast<LONG>(stride);
+        if (flipY)
         {
-            memcpy(scanline.data(), scanline1, stride);
-            memcpy(scanline1, scanline2, stride);
-            memcpy(scanline2, scanline.data(), stride);
-    
-            scanline1 += stride;
-            scanline2 -= stride;
+            pSrc += static_cast<size_t>(m_height - 1) * stride;
+            srcStride = -srcStride;
         }
+
+        hr = MFCopyImage(
+                pData,            // Dest buffer
+                cbWidth,          // Dest stride
+                pSrc,             // Src buffer
+                srcStride,        // Src stride
+                cbWidth,          // Image width in bytes (not pixels!)
+                m_height          // Image height in pixels
+            );
+
+        // The UV plane has half as many scanlines, each holding
+        // interleaved U and V for every other pixel.
+        if (SUCCEEDED(hr) && nv12)
+        {
+            hr = MFCopyImage(
+                    pData + cbWidth * m_height,
+                    cbWidth,
+                    pSrc + static_cast<size_t>(stride) * m_height,
+                    srcStride,
+                    cbWidth,
+                    m_height / 2
+                );
+        }
+        pBuffer->Unlock();
+    }
+    m_timings = VideoEncoderTimings();
+    m_timings.copy = GetQpc() - copyStart;
+
+    if (SUCCEEDED(hr))
+        hr = pBuffer->SetCurrentLength(cbBuffer);
+    if (SUCCEEDED(hr))
+        hr = WriteFrame(m_pSinkWriter, m_stream, pSample, timestamp);
+
+    SCREENCAP_TRACE("EncoderAddFrame",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingHResult(hr, "HResult"),
+        TraceLoggingUInt32(cbBuffer, "BytesCopied"),
+        TraceLoggingBool(flipY, "Flipped"),
+        TraceLoggingInt64(m_timings.copy, "CopyTicks"));
+
+    SafeRelease(&pSample);
+    SafeRelease(&pBuffer);
+    return SUCCEEDED(hr);
+}
+
+//
+// Returns a pointer to the buffer that the next frame's pixels
+// should be written to, or nullptr on failure.  The frame is
+// sent to the encoder by EndFrame().
+//
+uint8_t *VideoFileEncoder::BeginFrame()
+{
+    if (!m_pSinkWriter)
+        return nullptr;
+
+    // Throw away a frame that was begun but never ended.
+    if (m_pOpenBuffer)
+        m_pOpenBuffer->Unlock();
+    SafeRelease(&m_pOpenBuffer);
+    SafeRelease(&m_pOpenSample);
+
+    BYTE *pData = nullptr;
+    HRESULT hr = GetPooledSample(&m_pOpenSample, &m_pOpenBuffer);
+    if (SUCCEEDED(hr))
+        hr = m_pOpenBuffer->Lock(&pData, nullptr, nullptr);
+    if (FAILED(hr))
+    {
+        SafeRelease(&m_pOpenBuffer);
+        SafeRelease(&m_pOpenSample);
+        return nullptr;
     }
 
-    HRESULT hr = WriteFrame(m_pSinkWriter, m_stream, timestamp);
+    return pData;
+}
+
+//
+// Sends the frame begun by BeginFrame() to the encoder.
+// Returns true if successful.
+//
+bool VideoFileEncoder::EndFrame(uint64_t timestamp)
+{
+    if (!m_pOpenSample || !m_pOpenBuffer)
+        return false;
+
+    m_pOpenBuffer->Unlock();
+    m_timings = VideoEncoderTimings();
+
+    const DWORD cbBuffer = GetFrameBytes();
+    HRESULT hr = m_pOpenBuffer->SetCurrentLength(cbBuffer);
+    if (SUCCEEDED(hr))
+        hr = WriteFrame(m_pSinkWriter, m_stream, m_pOpenSample, timestamp);
+
+    SCREENCAP_TRACE("EncoderEndFrame",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingHResult(hr, "HResult"));
+
+    SafeRelease(&m_pOpenBuffer);
+    SafeRelease(&m_pOpenSample);
+    return SUCCEEDED(hr);
+}
+
+//
+// Adds the next frame to the video stream from a GPU texture.
+// Returns true if successful.
+//
+bool VideoFileEncoder::AddFrameTexture(ID3D11Texture2D *texture, uint64_t timestamp)
+{
+    if (!texture || !m_pSinkWriter || !m_pDeviceManager)
+        return false;
+
+    D3D11_TEXTURE2D_DESC desc;
+    texture->GetDesc(&desc);
+    if (desc.Width != m_width || desc.Height != m_height)
+        return false;
+
+    IMFSample *pSample = nullptr;
+    IMFMediaBuffer *pBuffer = nullptr;
+    IMF2DBuffer *p2DBuffer = nullptr;
+    DWORD cbBuffer = 0;
+
+    // Wrap the texture in a media buffer; no pixels are copied.
+    m_timings = VideoEncoderTimings();
+    HRESULT hr = MFCreateDXGISurfaceBuffer(__uuidof(ID3D11Texture2D),
+                    texture, 0, FALSE, &pBuffer);
+    if (SUCCEEDED(hr))
+        hr = pBuffer->QueryInterface(__uuidof(IMF2DBuffer), reinterpret_cast<void **>(&p2DBuffer));
+    if (SUCCEEDED(hr))
+        hr = p2DBuffer->GetContiguousLength(&cbBuffer);
+    if (SUCCEEDED(hr))
+        hr = pBuffer->SetCurrentLength(cbBuffer);
+    if (SUCCEEDED(hr))
+        hr = MFCreateSample(&pSample);
+    if (SUCCEEDED(hr))
+        hr = pSample->AddBuffer(pBuffer);
+    if (SUCCEEDED(hr))
+        hr = WriteFrame(m_pSinkWriter, m_stream, pSample, timestamp);
+
+    SCREENCAP_TRACE("EncoderAddFrameTexture",
+        TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+        TraceLoggingHResult(hr, "HResult"));
+
+    SafeRelease(&pSample);
+    SafeRelease(&p2DBuffer);
+    SafeRelease(&pBuffer);
     return SUCCEEDED(hr);
 }
 
+//
+// Extends the frame held in variable frame rate mode so it
+// lasts at least until 'timestamp'.  Returns true if successful.
+//
+bool VideoFileEncoder::RepeatFrame(uint64_t timestamp)
+{
+    if (!m_pSinkWriter || !m_pHeldSample)
+        return false;
+
+    const LONGLONG end = static_cast<LONGLONG>(timestamp) + m_frameDuration;
+    if (end > m_heldEnd)
+        m_heldEnd = end;
+    return true;
+}
+
+//
+// Makes the frame held in variable frame rate mode end at
+// 'timestamp'.  Returns true if successful.
+//
+bool VideoFileEncoder::EndHeldFrameAt(uint64_t timestamp)
+{
+    if (!m_pSinkWriter || !m_pHeldSample)
+        return false;
+
+    const LONGLONG end = static_cast<LONGLONG>(timestamp);
+    if (end <= m_heldTime)
+        return false;
+    m_heldEnd = end;
+    return true;
+}
@@ -40,15 +40,81 @@
 // DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
 //--------------------------------------------------------------------
 
+#pragma once
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <mfapi.h>
 #include <mfidl.h>
 #include <mfreadwrite.h>
 #include <mferror.h>
+#include <d3d11.h>
 #include <cstdint>
+#include <string>
 #include <vector>
 
+//
+// Whether a hardware encoder (such as NVENC, Quick Sync or AMF)
+// may be used.
+//
+enum VideoEncoderHardware
+{
+    VideoEncoderHardware_Auto     = 0,  // Use one if there is one.
+    VideoEncoderHardware_Off      = 1,  // Always use the software encoder.
+    VideoEncoderHardware_Required = 2   // Fail to start without one.
+};
+
+//
+// How the encoder spends bits.
+//
+enum VideoEncoderRateControl
+{
+    VideoEncoderRateControl_Default = 0,  // Whatever the encoder does by default.
+    VideoEncoderRateControl_CBR     = 1,  // Constant bit rate.
+    VideoEncoderRateControl_VBR     = 2,  // Variable bit rate, averaging bitRate.
+    VideoEncoderRateControl_Quality = 3   // Constant quality; bitRate is ignored.
+};
+
+//
+// Encoder settings passed to VideoFileEncoder::Start().  Zero
+// (or -1 for bFrames) leaves a setting at the encoder's own
+// default.  Settings the encoder doesn't support are ignored.
+//
+struct VideoEncoderConfig
+{
+    VideoEncoderHardware    hardware = VideoEncoderHardware_Auto;
+    VideoEncoderRateControl rateControl = VideoEncoderRateControl_Default;
+    uint32_t bitRate = 0;       // Bits per second; 0 is width*height*2.5.
+    uint32_t quality = 0;       // 1 to 100, for VideoEncoderRateControl_Quality.
+    bool     lowLatency = false;// Don't buffer frames inside the encoder.
+    uint32_t gopSize = 0;       // Frames from one key frame to the next.
+    int      bFrames = -1;      // B frames between reference frames.
+    uint32_t threads = 0;       // Worker threads of a software encoder.
+    bool     fragmented = false;// Write fragmented MP4 (H.264 only).
+};
+
+//
+// How long the stages of adding the last frame took, in
+// QueryPerformanceCounter() ticks, for profiling.
+//
+struct VideoEncoderTimings
+{
+    int64_t copy = 0;       // Copying, flipping or converting the pixels into a sample.
+    int64_t write = 0;      // IMFSinkWriter::WriteSample(), which may encode the frame.
+};
+
+//
+// Receives the encoded file in pieces, in order, as the encoder
+// writes it, for streaming to a socket or a ring buffer.  Write()
+// is called from Media Foundation's threads, and nothing is kept
+// after it returns.  Returning false makes encoding fail.
+//
+class VideoEncoderOutput
+{
+public:
+    virtual ~VideoEncoderOutput() { }
+    virtual bool Write(const uint8_t *data, size_t size) = 0;
+};
+
 class VideoFileEncoder
 {
 public:
@@ -79,15 +145,122 @@ public:
     //
     bool SetEncodingFormat(GUID fmt);
 
+    //
+    // Specify the format of the frames passed to AddFrame() and
+    // friends.  Either MFVideoFormat_RGB32 (the default), or
+    // MFVideoFormat_NV12, which is what video encoders use
+    // internally, so it saves the encoder a conversion.  Frames
+    // in NV12 format must have even dimensions and can't be
+    // flipped.  Must be called before Start().
+    //
+    bool SetInputFormat(GUID fmt);
+
+    //
+    // Specify a Direct3D 11 device whose textures will be passed
+    // to AddFrameTexture().  The device is shared with Media
+    // Foundation, which also allows a hardware encoder to be
+    // used.  Must be called before Start().  Pass nullptr to go
+    // back to encoding from system memory only.
+    //
+    bool SetD3DDevice(ID3D11Device *pDevice);
+
+    //
+    // Enables or disables variable frame rate mode.  Normally
+    // every frame lasts GetFrameDuration().  In variable frame
+    // rate mode, each frame lasts until the timestamp of the
+    // frame after it, so frames can be passed in at irregular
+    // intervals, and a screen that doesn't change costs nothing
+    // to encode.  The frame rate given to Start() is then only
+    // a hint for the encoder.  Frames are held back until the
+    // next one arrives, and timestamps must always increase.
+    // Must be called before Start().
+    //
+    bool SetVariableFrameRate(bool enable);
+
     //
     // Start encoding video frames to the specified file in the
-    // specified frame format.
+    // specified frame format, with the given encoder settings.
+    //
+    // Hardware encoders are looked up with MFTEnumEx().  Media
+    // Foundation picks the hardware encoder itself; when a
+    // device was given to SetD3DDevice(), it is the one on that
+    // device's graphics adapter, so that is how a particular
+    // vendor's encoder is chosen.
+    //
+    // Normally the index of an MP4 file is only written by
+    // Stop(), so the file can't be played until then, and
+    // nothing of it survives a crash.  With config.fragmented
+    // set, a fragmented MP4 file is written instead: a short
+    // header, then a fragment with its own index at each key
+    // frame, so config.gopSize sets how much can be lost, and
+    // Stop() has almost nothing left to write.
+    //
+    // H.264 frames must have even dimensions, so Start() fails
+    // for odd ones.  The largest size depends on the encoder;
+    // older ones stop at 1920x1080.  FitFrameSize() works out a
+    // size that avoids both problems.
     //
     bool Start(
             const wchar_t *filename,
             uint32_t width,
             uint32_t height,
-            uint32_t fps);
+            uint32_t fps,
+            const VideoEncoderConfig &config = VideoEncoderConfig());
+
+    //
+    // Same as above, except the video is written to a Media
+    // Foundation byte stream or to a VideoEncoderOutput instead
+    // of a file.  These always write fragmented MP4, which only
+    // writes forward, so the byte stream doesn't have to be
+    // seekable.  The encoding format must be H.264.  The output
+    // must stay alive until Stop() returns.
+    //
+    bool Start(
+            IMFByteStream *pByteStream,
+            uint32_t width,
+            uint32_t height,
+            uint32_t fps,
+            const VideoEncoderConfig &config = VideoEncoderConfig());
+    bool Start(
+            VideoEncoderOutput *output,
+            uint32_t width,
+            uint32_t height,
+            uint32_t fps,
+            const VideoEncoderConfig &config = VideoEncoderConfig());
+
+    //
+    // Works out the largest frame size with the shape of a
+    // 'width' x 'height' image that fits within 'maxWidth' x
+    // 'maxHeight', rounded down to even numbers.  Images that
+    // already fit only lose an odd last column or row.  Pass
+    // the result to ScreenCapture::SetOutputSize() to have the
+    // captured frames scaled to it.
+    //
+    static void FitFrameSize(
+            uint32_t width,
+            uint32_t height,
+            uint32_t maxWidth,
+            uint32_t maxHeight,
+            uint32_t &fitWidth,
+            uint32_t &fitHeight);
+
+    //
+    // Lists the friendly names of the hardware encoders that can
+    // encode to the selected encoding format.  Returns true if
+    // there are any.
+    //
+    bool GetHardwareEncoderNames(std::vector<std::wstring> &names) const;
+
+    //
+    // Returns true if the encoder that Start() set up is a
+    // hardware encoder.
+    //
+    bool IsHardwareEncoder() const { return m_hardwareEncoder; }
+
+    //
+    // Returns true between a successful Start() and Stop().
+    //
+    bool IsStarted() const { return m_pSinkWriter != nullptr; }
 
     //
     // Finish encoding video frames to the output file.
@@ -99,7 +272,8 @@ public:
     // Adds the next frame to the video stream.
     // The data pointed to by 'pixels' must be in the format
     // specified to the Start() member.  Pixels are assumed
-    // to be 32 bits each (BGRA or BGRX).
+    // to be 32 bits each (BGRA or BGRX), unless NV12 input
+    // was selected with SetInputFormat().
     //
     // If flipY is true, the scanlines in 'pixels' are in
     // bottom-to-top order rather than top-to-bottom order.
@@ -108,11 +282,72 @@ public:
     //
     bool AddFrame(const void *pixels, bool flipY, uint64_t timestamp);
 
+    //
+    // Same as above, except the scanlines in 'pixels' are
+    // 'stride' bytes apart instead of width*4 bytes apart.
+    // This accepts frame buffers with padded scanlines, such
+    // as the ones captured by ScreenCapture, without the
+    // caller having to repack them first.  For NV12 frames,
+    // the UV plane starts stride*height bytes after 'pixels'
+    // and has the same stride.
+    //
+    bool AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp);
+
+    //
+    // Alternative to AddFrame() for callers that can produce
+    // the frame's pixels themselves.  BeginFrame() returns a
+    // pointer to the buffer that will be sent to the encoder,
+    // which has room for GetHeight() scanlines of GetWidth()*4
+    // bytes each, in top-to-bottom order (for NV12, GetHeight()
+    // scanlines of GetWidth() bytes followed by the UV plane
+    // with GetHeight()/2 scanlines).  EndFrame() sends the
+    // buffer to the encoder.  BeginFrame() returns nullptr on
+    // failure; EndFrame() returns true if successful.
+    //
+    uint8_t *BeginFrame();
+    bool EndFrame(uint64_t timestamp);
+
+    //
+    // Adds the next frame to the video stream from a GPU texture,
+    // without the pixels ever being copied to system memory.  The
+    // texture must belong to the device given to SetD3DDevice(),
+    // be 32 bits per pixel (BGRA or BGRX), and match the size
+    // given to Start().  The encoder keeps a reference to the
+    // texture until it is done with it.
+    //
+    // Returns true if successful.
+    //
+    bool AddFrameTexture(ID3D11Texture2D *texture, uint64_t timestamp);
+
+    //
+    // In variable frame rate mode, tells the encoder that the
+    // previous frame is still on the screen at 'timestamp', so
+    // it lasts at least until then, even if no other frame
+    // follows before Stop().  Nothing is encoded.  Returns false
+    // if there is no previous frame, or if variable frame rate
+    // mode is off; then the frame must be added again instead.
+    //
+    bool RepeatFrame(uint64_t timestamp);
+
+    //
+    // In variable frame rate mode, makes the previous frame end
+    // exactly at 'timestamp' instead of lasting at least until
+    // then, such as where a recording is cut.  Returns false if
+    // there is no previous frame, if variable frame rate mode
+    // is off, or if 'timestamp' isn't after the frame's start.
+    //
+    bool EndHeldFrameAt(uint64_t timestamp);
+
     uint32_t GetWidth()             const { return m_width; }
     uint32_t GetHeight()            const { return m_height; }
     uint32_t GetFrameDuration()     const { return m_frameDuration; }
     uint32_t GetBitRate()           const { return m_bitRate; }
-    const uint8_t *GetFrameBuffer() const { return m_pixels.data(); }
+
+    //
+    // Returns how long the stages of the last AddFrame(),
+    // EndFrame() or AddFrameTexture() took.
+    //
+    const VideoEncoderTimings &GetFrameTimings() const { return m_timings; }
 
 private:
     uint32_t m_width = 0;
@@ -120,18 +355,51 @@ private:
     uint32_t m_fps = 0;
     uint32_t m_frameDuration = 0;
     uint32_t m_bitRate = 0;
+    VideoEncoderConfig m_config;
+    bool     m_hardwareEncoder = false;
     GUID     m_encodingFormat = MFVideoFormat_H264;
     GUID     m_inputFormat = MFVideoFormat_RGB32;
-    std::vector<uint8_t> m_pixels;
     IMFSinkWriter *m_pSinkWriter = nullptr;
+
+    // In variable frame rate mode, the most recent frame is
+    // held until the next one tells us its duration.  It lasts
+    // until at least m_heldEnd.
+    bool       m_variableFrameRate = false;
+    IMFSample *m_pHeldSample = nullptr;
+    LONGLONG   m_heldTime = 0;
+    LONGLONG   m_heldEnd = 0;
+
+    // How long the stages of the last frame took.
+    VideoEncoderTimings m_timings;
+
+    // Samples with system memory buffers that are reused from
+    // frame to frame, once the sink writer is done with them.
+    std::vector<IMFSample *> m_samplePool;
+
+    // The sample and locked buffer between BeginFrame() and EndFrame().
+    IMFSample      *m_pOpenSample = nullptr;
+    IMFMediaBuffer *m_pOpenBuffer = nullptr;
+
+    IMFDXGIDeviceManager *m_pDeviceManager = nullptr;
+    UINT     m_deviceResetToken = 0;
     uint32_t m_stream = 0;
     bool     m_doMFStartup = false;
     bool     m_doCoInitialize = false;
 
     bool SetFrameFormat(uint32_t width, uint32_t height, uint32_t fps);
+    DWORD GetFrameBytes() const;
+    bool StartWriter(const wchar_t *filename, IMFByteStream *pByteStream,
+        uint32_t width, uint32_t height, uint32_t fps,
+        const VideoEncoderConfig &config);
     HRESULT InitializeSinkWriter(IMFSinkWriter **ppWriter,
-        DWORD *pStreamIndex, const wchar_t *filename);
-    HRESULT WriteFrame(IMFSinkWriter *pWriter, DWORD streamIndex, 
-        const LONGLONG& timestamp);
+        DWORD *pStreamIndex, const wchar_t *filename,
+        IMFByteStream *pByteStream);
+    HRESULT CreateEncodingParameters(IMFAttributes **ppParams) const;
+    bool UsesHardwareEncoder(IMFSinkWriter *pWriter, DWORD streamIndex) const;
+    HRESULT GetPooledSample(IMFSample **ppSample, IMFMediaBuffer **ppBuffer);
+    void ReleaseSamplePool();
+    HRESULT WriteFrame(IMFSinkWriter *pWriter, DWORD streamIndex,
+        IMFSample *pSample, const LONGLONG& timestamp);
+    HRESULT WriteHeldFrame(const LONGLONG& endTime);
 };
 
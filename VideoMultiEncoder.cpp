@@ -0,0 +1,490 @@
+//--------------------------------------------------------------------
+//
+// VideoMultiEncoder.cpp
+// C++ class that encodes one series of frames to several
+// outputs at once, each on its own thread.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "VideoMultiEncoder.h"
+#include "PixelOps.h"
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+// Raises 'maxValue' to 'value' if it is larger.
+template <class T> static void UpdateMax(std::atomic<T> &maxValue, T value)
+{
+    T prev = maxValue.load();
+    while (value > prev && !maxValue.compare_exchange_weak(prev, value))
+        ;
+}
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Adds an output to be started by Start().
+//
+int VideoMultiEncoder::AddOutput(const VideoMultiOutputConfig &config)
+{
+    if (m_running)
+        return -1;
+
+    std::unique_ptr<Output> output(new Output);
+    output->config = config;
+    m_outputs.push_back(std::move(output));
+    return static_cast<int>(m_outputs.size() - 1);
+}
+
+//
+// Removes all of the outputs.
+//
+void VideoMultiEncoder::ClearOutputs()
+{
+    if (!m_running)
+        m_outputs.clear();
+}
+
+//
+// Starts every output's encoder and thread.  Returns true if
+// successful.
+//
+bool VideoMultiEncoder::Start(uint32_t width, uint32_t height, uint32_t fps)
+{
+    if (m_running)
+        Stop();
+
+    if (m_outputs.empty() || width < 1 || height < 1 || fps < 1)
+        return false;
+
+    m_width = width;
+    m_height = height;
+    m_fps = fps;
+    m_hasFrame = false;
+    m_done = false;
+
+    // Outputs of the same size share one scaled frame.
+    m_sizes.clear();
+    for (auto &output : m_outputs)
+    {
+        const uint32_t w = output->config.width  ? output->config.width  : width;
+        const uint32_t h = output->config.height ? output->config.height : height;
+        size_t index = 0;
+        while (index < m_sizes.size() && (m_sizes[index]->width != w || m_sizes[index]->height != h))
+            index++;
+        if (index == m_sizes.size())
+        {
+            std::unique_ptr<FrameSize> size(new FrameSize);
+            size->width  = w;
+            size->height = h;
+            m_sizes.push_back(std::move(size));
+        }
+        output->size = index;
+    }
+
+    // Each output may hold every one of its frames, and one
+    // more is needed to make the next frame in.
+    for (size_t i = 0; i < m_sizes.size(); i++)
+    {
+        unsigned count = 1;
+        for (auto &output : m_outputs)
+        {
+            if (output->size == i)
+                count += output->config.queueLength + 1;
+        }
+        m_sizes[i]->pool.SetMaxBuffers(count);
+    }
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_qpcFrequency = freq.QuadPart;
+
+    for (auto &output : m_outputs)
+    {
+        if (!StartOutput(*output))
+        {
+            // Files that were started are of no use.
+            for (auto &started : m_outputs)
+            {
+                const bool hadEncoder = started->encoder != nullptr;
+                ReleaseOutput(*started);
+                if (hadEncoder && !started->config.output)
+                    DeleteFileW(started->config.filename.c_str());
+            }
+            m_sizes.clear();
+            return false;
+        }
+    }
+
+    for (auto &output : m_outputs)
+        output->thread = std::thread(&VideoMultiEncoder::OutputThread, this, output.get());
+    m_running = true;
+    return true;
+}
+
+//
+// Makes a frame of each output size from the caller's pixels
+// and queues it to every output.  Returns false if any output
+// couldn't take it.
+//
+bool VideoMultiEncoder::AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp)
+{
+    if (!m_running || !pixels)
+        return false;
+
+    const uint8_t *src = static_cast<const uint8_t *>(pixels);
+    ptrdiff_t srcStride = stride;
+    if (flipY)
+    {
+        src += srcStride * static_cast<ptrdiff_t>(m_height - 1);
+        srcStride = -srcStride;
+    }
+
+    for (auto &size : m_sizes)
+        MakeFrame(*size, src, srcStride);
+    return QueueFrames(timestamp);
+}
+
+//
+// Same as above, for a frame in a pooled buffer, which is
+// queued as it is to the outputs of the same size.
+//
+bool VideoMultiEncoder::AddFrame(const FrameHandle &frame, uint64_t timestamp)
+{
+    if (!m_running || !frame)
+        return false;
+
+    const FrameInfo &info = frame.GetInfo();
+    if (info.width != m_width || info.height != m_height || info.format != ScreenCaptureFormat_BGRA32)
+        return false;
+
+    const uint8_t *src = frame.GetData();
+    ptrdiff_t srcStride = info.stride;
+    if (info.bottomUp)
+    {
+        src += srcStride * static_cast<ptrdiff_t>(m_height - 1);
+        srcStride = -srcStride;
+    }
+
+    for (auto &size : m_sizes)
+    {
+        if (size->width == m_width && size->height == m_height && !info.bottomUp)
+            size->frame = frame;
+        else
+            MakeFrame(*size, src, srcStride);
+    }
+    return QueueFrames(timestamp);
+}
+
+//
+// Queues a repeat of the previous frame to every output.
+//
+bool VideoMultiEncoder::RepeatFrame(uint64_t timestamp)
+{
+    if (!m_running || !m_hasFrame)
+        return false;
+
+    for (auto &output : m_outputs)
+        QueueItem(*output, FrameHandle(), timestamp);
+    return true;
+}
+
+//
+// Lets the output threads drain their queues, then finishes
+// every output.  Returns true if every output was written
+// successfully.
+//
+bool VideoMultiEncoder::Stop()
+{
+    if (!m_running)
+        return false;
+
+    m_done = true;
+    for (auto &output : m_outputs)
+    {
+        SetEvent(output->queuedEvent);
+        if (output->thread.joinable())
+            output->thread.join();
+    }
+
+    bool ok = true;
+    for (auto &output : m_outputs)
+    {
+        if (!output->encoder->Stop() || output->encodeErrors)
+            ok = false;
+        ReleaseOutput(*output);
+    }
+
+    m_sizes.clear();
+    m_running = false;
+    return ok;
+}
+
+//
+// Returns the most frame buffers the outputs may hold.
+//
+unsigned VideoMultiEncoder::GetMaxFramesHeld() const
+{
+    unsigned count = 0;
+    for (auto &output : m_outputs)
+        count += output->config.queueLength + 1;
+    return count;
+}
+
+//
+// Retrieves statistics about one output.
+//
+bool VideoMultiEncoder::GetOutputStats(size_t index, VideoMultiOutputStats &stats) const
+{
+    if (index >= m_outputs.size())
+        return false;
+
+    const Output &output = *m_outputs[index];
+    auto toMs = [this](int64_t ticks) { return ticks * 1000.0 / m_qpcFrequency; };
+    stats = VideoMultiOutputStats();
+    stats.framesEncoded = output.framesEncoded;
+    stats.framesDropped = output.framesDropped;
+    stats.encodeErrors  = output.encodeErrors;
+    stats.queueDepth    = static_cast<unsigned>(output.fullQueue.GetDepth());
+    if (stats.framesEncoded)
+        stats.avgEncodeMs = toMs(output.encodeTicks) / stats.framesEncoded;
+    stats.maxEncodeMs = toMs(output.maxEncodeTicks);
+    return true;
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Copies or scales the input frame into a pooled buffer of the
+// given size, top-down with unpadded scanlines.  Leaves
+// 'size.frame' empty and returns false if the pool has no
+// buffer to give.
+//
+bool VideoMultiEncoder::MakeFrame(FrameSize &size, const uint8_t *pixels, ptrdiff_t stride)
+{
+    const uint32_t rowBytes = size.width * 4;
+    size.frame = size.pool.Allocate(static_cast<size_t>(rowBytes) * size.height);
+    if (!size.frame)
+        return false;
+
+    if (size.width == m_width && size.height == m_height)
+        PixelOps::CopyImage(size.frame.GetData(), rowBytes, pixels, stride, rowBytes, size.height);
+    else
+        PixelOps::ScaleImage(size.frame.GetData(), rowBytes, size.width, size.height,
+            pixels, stride, m_width, m_height, size.scale);
+
+    FrameInfo info;
+    info.width  = size.width;
+    info.height = size.height;
+    info.stride = rowBytes;
+    info.depth  = 32;
+    size.frame.SetInfo(info);
+    return true;
+}
+
+//
+// Queues the frames just made to the outputs of their sizes,
+// then lets go of them, so only the queues hold them.  Returns
+// false if any output rejected its frame or had none.
+//
+bool VideoMultiEncoder::QueueFrames(uint64_t timestamp)
+{
+    bool ok = true;
+    for (auto &output : m_outputs)
+    {
+        const FrameHandle &frame = m_sizes[output->size]->frame;
+        if (!frame)
+        {
+            output->encodeErrors++;
+            ok = false;
+            continue;
+        }
+        if (!QueueItem(*output, frame, timestamp))
+            ok = false;
+    }
+
+    for (auto &size : m_sizes)
+        size->frame.Reset();
+    m_hasFrame = true;
+    return ok;
+}
+
+//
+// Queues a frame, or a repeat if 'frame' is empty, to one
+// output, waiting for room unless the output drops frames.
+// Returns false if the frame was dropped.
+//
+bool VideoMultiEncoder::QueueItem(Output &output, const FrameHandle &frame, uint64_t timestamp)
+{
+    uint32_t index = 0;
+    while (!output.freeQueue.Pop(index))
+    {
+        if (output.config.dropFrames)
+        {
+            // A dropped repeat costs nothing; the next one
+            // covers it.
+            if (frame)
+                output.framesDropped++;
+            return !frame;
+        }
+        WaitForSingleObject(output.freedEvent, 100);
+    }
+
+    Item &item = output.items[index];
+    item.frame = frame;
+    item.timestamp = timestamp;
+    output.fullQueue.Push(index);
+    SetEvent(output.queuedEvent);
+    return true;
+}
+
+//
+// Body of an output's thread.  Encodes queued frames until
+// Stop() is called and the queue is empty.
+//
+void VideoMultiEncoder::OutputThread(Output *output)
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    for (;;)
+    {
+        uint32_t index = 0;
+        if (!output->fullQueue.Pop(index))
+        {
+            if (m_done)
+                break;
+            WaitForSingleObject(output->queuedEvent, 100);
+            continue;
+        }
+
+        Item &item = output->items[index];
+        if (item.frame)
+        {
+            const int64_t startQpc = GetQpc();
+            const FrameInfo &info = item.frame.GetInfo();
+            if (output->encoder->AddFrame(item.frame.GetData(), info.stride, false, item.timestamp))
+                output->framesEncoded++;
+            else
+                output->encodeErrors++;
+
+            const int64_t encodeTicks = GetQpc() - startQpc;
+            output->encodeTicks += encodeTicks;
+            UpdateMax(output->maxEncodeTicks, encodeTicks);
+        }
+        else
+        {
+            output->encoder->RepeatFrame(item.timestamp);
+        }
+
+        item.frame.Reset();
+        output->freeQueue.Push(index);
+        SetEvent(output->freedEvent);
+    }
+
+    CoUninitialize();
+}
+
+//
+// Creates and starts an output's encoder, and sets up its
+// queues.  Returns true if successful.
+//
+bool VideoMultiEncoder::StartOutput(Output &output)
+{
+    const VideoMultiOutputConfig &config = output.config;
+    if (config.queueLength < 1 || (!config.output && config.filename.empty()))
+        return false;
+
+    // MFStartup() counts its callers, so each encoder can start
+    // and shut down Media Foundation on its own.
+    const FrameSize &size = *m_sizes[output.size];
+    output.encoder.reset(new VideoFileEncoder(true, false));
+    if (!output.encoder->SetEncodingFormat(config.encodingFormat) ||
+        !output.encoder->SetVariableFrameRate(true))
+    {
+        return false;
+    }
+    const bool started = config.output ?
+        output.encoder->Start(config.output, size.width, size.height, m_fps, config.encoder) :
+        output.encoder->Start(config.filename.c_str(), size.width, size.height, m_fps, config.encoder);
+    if (!started)
+        return false;
+
+    // One frame for each queue entry, plus the one being
+    // encoded.
+    output.items.assign(config.queueLength + 1, Item());
+    output.fullQueue.Reset(output.items.size());
+    output.freeQueue.Reset(output.items.size());
+    for (uint32_t i = 0; i < output.items.size(); i++)
+        output.freeQueue.Push(i);
+
+    output.queuedEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    output.freedEvent  = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!output.queuedEvent || !output.freedEvent)
+        return false;
+
+    output.framesEncoded = output.framesDropped = output.encodeErrors = 0;
+    output.encodeTicks = output.maxEncodeTicks = 0;
+    return true;
+}
+
+//
+// Releases an output's encoder, frames and events.
+//
+void VideoMultiEncoder::ReleaseOutput(Output &output)
+{
+    output.encoder.reset();
+    output.items.clear();
+    output.fullQueue.Reset(0);
+    output.freeQueue.Reset(0);
+    if (output.queuedEvent)
+        CloseHandle(output.queuedEvent);
+    if (output.freedEvent)
+        CloseHandle(output.freedEvent);
+    output.queuedEvent = output.freedEvent = nullptr;
+}
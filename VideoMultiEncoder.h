@@ -0,0 +1,232 @@
+//--------------------------------------------------------------------
+//
+// VideoMultiEncoder.h
+// Header file of C++ class that encodes one series of frames to
+// several outputs at once, each on its own thread.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "VideoFileEncoder.h"
+#include "FramePool.h"
+#include "FrameQueue.h"
+#include "PixelOps.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Settings of one output of a VideoMultiEncoder.  The output is
+// a file, unless 'output' is given, in which case fragmented MP4
+// is streamed to it as with VideoFileEncoder::Start().
+//
+struct VideoMultiOutputConfig
+{
+    std::wstring filename;
+    VideoEncoderOutput *output = nullptr;   // Must outlive Stop().
+    GUID     encodingFormat = MFVideoFormat_H264;
+    uint32_t width = 0;                     // Frame size of this output;
+    uint32_t height = 0;                    // zero for the size of the input.
+    VideoEncoderConfig encoder;             // Passed on to VideoFileEncoder::Start().
+    unsigned queueLength = 4;               // Frames that may wait for this output's encoder.
+    bool     dropFrames = false;            // Drop frames when the queue is full, rather than wait.
+};
+
+//
+// Statistics of one output.  Latencies are in milliseconds.
+//
+struct VideoMultiOutputStats
+{
+    uint64_t framesEncoded = 0;     // Frames sent to the encoder.
+    uint64_t framesDropped = 0;     // Frames dropped because the queue was full.
+    uint64_t encodeErrors  = 0;     // Frames the encoder rejected.
+    unsigned queueDepth    = 0;     // Frames currently waiting to be encoded.
+    double   avgEncodeMs   = 0.0;   // Time to encode a frame.
+    double   maxEncodeMs   = 0.0;
+};
+
+//
+// This class encodes the same frames to several outputs at
+// once, such as a high quality archive file and a small,
+// low bit rate preview stream, each with its own size,
+// encoding format and encoder settings.
+//
+// Each frame is scaled once for each distinct output size, on
+// the thread that adds it, into a buffer from a FramePool;
+// outputs of the same size share the buffer rather than each
+// getting a copy.  Outputs the size of the input share the
+// caller's FrameHandle when given one, so those cost no copy
+// at all here.  Every output then has its own queue and its
+// own thread that hands the frames to its VideoFileEncoder, so
+// a slow encoder only holds up its own output.
+//
+// All outputs run in variable frame rate mode, the same as
+// VideoSegmenter.  Frames are 32-bit BGRA (or BGRX).
+//
+class VideoMultiEncoder
+{
+public:
+    VideoMultiEncoder() { }
+    ~VideoMultiEncoder() { Stop(); }
+
+    //
+    // Adds an output, to be started by Start().  Returns the
+    // index of the output, or -1 if already started.
+    //
+    int AddOutput(const VideoMultiOutputConfig &config);
+
+    //
+    // Removes all of the outputs.  Only allowed while stopped.
+    //
+    void ClearOutputs();
+
+    size_t GetOutputCount() const { return m_outputs.size(); }
+
+    //
+    // Starts the encoders of all of the outputs for input
+    // frames of the given size and nominal frame rate, and
+    // their threads.  Returns false, with nothing started, if
+    // any of them fails to start.
+    //
+    bool Start(uint32_t width, uint32_t height, uint32_t fps);
+
+    //
+    // Adds the next frame to every output.  The scanlines of
+    // 'pixels' are 'stride' bytes apart, from the bottom up if
+    // 'flipY' is set; flipping is done along with the copy or
+    // the scaling, once for all outputs.  Timestamps are in 100ns
+    // units and must always increase.  Returns false if any of
+    // the outputs couldn't take the frame.
+    //
+    bool AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp);
+
+    //
+    // Same as above, but for a frame in a FramePool buffer,
+    // such as the one from ScreenCapture::GetFrameHandle().  The
+    // outputs that don't need it scaled hold on to the buffer
+    // until they have encoded it, so the capture must be
+    // allowed enough buffers (see GetMaxFramesHeld()).
+    //
+    bool AddFrame(const FrameHandle &frame, uint64_t timestamp);
+
+    //
+    // Tells every output that the previous frame is still on
+    // the screen at 'timestamp'.  Nothing is encoded.
+    //
+    bool RepeatFrame(uint64_t timestamp);
+
+    //
+    // Encodes whatever is still queued, finishes every output
+    // and stops their threads.  Returns true if every output
+    // was written successfully.
+    //
+    bool Stop();
+
+    bool IsRunning() const { return m_running; }
+
+    //
+    // Returns the most frame buffers that the outputs may hold
+    // at once, so a capture handing its buffers to AddFrame()
+    // can be given one more than that.
+    //
+    unsigned GetMaxFramesHeld() const;
+
+    //
+    // Retrieves statistics about one output.  May be called
+    // while running.  Returns false if there is no such output.
+    //
+    bool GetOutputStats(size_t index, VideoMultiOutputStats &stats) const;
+
+private:
+    // A queued frame, or a repeat of the previous one if
+    // 'frame' is empty.
+    struct Item
+    {
+        FrameHandle frame;
+        uint64_t    timestamp = 0;
+    };
+
+    // An output and its encoder thread.  'size' is the index
+    // of its entry in m_sizes.
+    struct Output
+    {
+        VideoMultiOutputConfig            config;
+        std::unique_ptr<VideoFileEncoder> encoder;
+        size_t                            size = 0;
+        std::vector<Item>                 items;
+        FrameQueue                        freeQueue;
+        FrameQueue                        fullQueue;
+        HANDLE                            queuedEvent = nullptr;
+        HANDLE                            freedEvent = nullptr;
+        std::thread                       thread;
+        std::atomic<uint64_t>             framesEncoded { 0 };
+        std::atomic<uint64_t>             framesDropped { 0 };
+        std::atomic<uint64_t>             encodeErrors { 0 };
+        std::atomic<int64_t>              encodeTicks { 0 };
+        std::atomic<int64_t>              maxEncodeTicks { 0 };
+    };
+
+    // One of the distinct output sizes, the frame of that size
+    // made from the input frame being added, and the buffers
+    // such frames are made in.
+    struct FrameSize
+    {
+        uint32_t    width = 0;
+        uint32_t    height = 0;
+        FrameHandle frame;
+        FramePool   pool;
+        PixelOpsScaleBuffers scale;   // For scaling the input frames.
+    };
+
+    std::vector<std::unique_ptr<Output>>    m_outputs;
+    std::vector<std::unique_ptr<FrameSize>> m_sizes;
+    uint32_t               m_width = 0;     // Size of the input frames.
+    uint32_t               m_height = 0;
+    uint32_t               m_fps = 0;
+    bool                   m_running = false;
+    bool                   m_hasFrame = false;
+    std::atomic<bool>      m_done { false };
+    int64_t                m_qpcFrequency = 1;
+
+    bool MakeFrame(FrameSize &size, const uint8_t *pixels, ptrdiff_t stride);
+    bool QueueItem(Output &output, const FrameHandle &frame, uint64_t timestamp);
+    bool QueueFrames(uint64_t timestamp);
+    void OutputThread(Output *output);
+    bool StartOutput(Output &output);
+    void ReleaseOutput(Output &output);
+};
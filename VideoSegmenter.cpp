@@ -0,0 +1,308 @@
+//--------------------------------------------------------------------
+//
+// VideoSegmenter.cpp
+// C++ implementation of class that records video as a series of
+// segment files, switching files without dropping frames.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "VideoSegmenter.h"
+
+//--------------------------------------------------------------------
+// Public members
+//--------------------------------------------------------------------
+
+//
+// Starts recording, with the first file started right away and
+// the second one on the worker thread.  Returns true if
+// successful.
+//
+bool VideoSegmenter::Start(const VideoSegmenterConfig &config, uint32_t width, uint32_t height, uint32_t fps)
+{
+    if (m_running)
+        Stop();
+
+    if (config.segmentDuration == 0)
+        return false;
+
+    m_config = config;
+    m_width = width;
+    m_height = height;
+    m_fps = fps;
+    m_lastTimestamp = 0;
+    m_hasFrame = false;
+    m_cutLate = false;
+    m_finished.clear();
+    m_nextNumber = 1;
+    m_stopping = false;
+    m_failed = false;
+    m_lateCuts = 0;
+
+    if (!StartSegment(m_current, 0))
+        return false;
+
+    m_wakeEvent = CreateEvent(nullptr, FALSE, TRUE, nullptr);
+    if (!m_wakeEvent)
+    {
+        m_current.encoder.reset();
+        DeleteFileW(m_current.info.filename.c_str());
+        return false;
+    }
+
+    m_running = true;
+    m_worker = std::thread(&VideoSegmenter::WorkerThread, this);
+    return true;
+}
+
+//
+// Adds the next frame, switching to the pre-started encoder
+// first if the current segment is long enough.  Returns true
+// if successful.
+//
+bool VideoSegmenter::AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp)
+{
+    if (!m_running || !m_current.encoder)
+        return false;
+
+    if (!m_hasFrame)
+    {
+        m_current.info.start = timestamp;
+    }
+    else if (timestamp >= m_current.info.start + m_config.segmentDuration)
+    {
+        Segment next;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            next = std::move(m_next);
+        }
+
+        if (next.encoder)
+        {
+            // The last frame of this segment lasts until the
+            // first frame of the next one, and no longer.
+            m_current.encoder->EndHeldFrameAt(timestamp - m_current.info.start);
+            m_current.info.duration = timestamp - m_current.info.start;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_retired.push_back(std::move(m_current));
+            }
+            m_current = std::move(next);
+            m_current.info.start = timestamp;
+            m_cutLate = false;
+        }
+        else if (!m_cutLate)
+        {
+            // Count the cut once, however many frames it waits.
+            m_cutLate = true;
+            m_lateCuts++;
+        }
+
+        // Either finish the old file and start the one after
+        // the new one, or try again to start the next one.
+        SetEvent(m_wakeEvent);
+    }
+
+    m_hasFrame = true;
+    m_lastTimestamp = timestamp;
+    return m_current.encoder->AddFrame(pixels, stride, flipY, timestamp - m_current.info.start);
+}
+
+//
+// Extends the previous frame to 'timestamp'.
+//
+bool VideoSegmenter::RepeatFrame(uint64_t timestamp)
+{
+    if (!m_running || !m_hasFrame || timestamp < m_current.info.start)
+        return false;
+
+    m_lastTimestamp = timestamp;
+    return m_current.encoder->RepeatFrame(timestamp - m_current.info.start);
+}
+
+//
+// Finishes the current file and stops the worker thread, which
+// finishes any retired files and throws away the encoder it
+// started ahead of time.  Returns true if every segment was
+// written successfully.
+//
+bool VideoSegmenter::Stop()
+{
+    if (!m_running)
+        return false;
+
+    if (m_hasFrame)
+    {
+        m_current.info.duration = m_lastTimestamp - m_current.info.start;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_retired.push_back(std::move(m_current));
+    }
+    else
+    {
+        // Nothing was recorded, so the file isn't worth keeping.
+        m_current.encoder.reset();
+        DeleteFileW(m_current.info.filename.c_str());
+    }
+    m_current = Segment();
+
+    m_stopping = true;
+    SetEvent(m_wakeEvent);
+    if (m_worker.joinable())
+        m_worker.join();
+
+    CloseHandle(m_wakeEvent);
+    m_wakeEvent = nullptr;
+    m_running = false;
+    return !m_failed;
+}
+
+//
+// Retrieves the list of finished segments, oldest first.
+//
+void VideoSegmenter::GetSegments(std::vector<VideoSegmentInfo> &segments) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    segments.assign(m_finished.begin(), m_finished.end());
+}
+
+//--------------------------------------------------------------------
+// Private members
+//--------------------------------------------------------------------
+
+//
+// Body of the worker thread.  Each time it is woken, it finishes
+// the retired segments and makes sure the next encoder is ready.
+//
+void VideoSegmenter::WorkerThread()
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    for (;;)
+    {
+        WaitForSingleObject(m_wakeEvent, INFINITE);
+
+        std::vector<Segment> retired;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            retired.swap(m_retired);
+        }
+        for (auto &segment : retired)
+            FinishSegment(segment);
+
+        if (m_stopping)
+            break;
+
+        unsigned number = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_next.encoder)
+                continue;
+            number = m_nextNumber;
+        }
+
+        // Starting an encoder sets up the sink writer and the
+        // encoder itself, which is the slow part of switching
+        // files, so it is done here well before it is needed.
+        Segment next;
+        if (StartSegment(next, number))
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_next = std::move(next);
+            m_nextNumber++;
+        }
+    }
+
+    // The encoder started ahead of time was never used.
+    Segment unused;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        unused = std::move(m_next);
+    }
+    if (unused.encoder)
+    {
+        unused.encoder.reset();
+        DeleteFileW(unused.info.filename.c_str());
+    }
+
+    CoUninitialize();
+}
+
+//
+// Creates and starts the encoder for segment file 'number'.
+// Returns true if successful.
+//
+bool VideoSegmenter::StartSegment(Segment &segment, unsigned number)
+{
+    wchar_t digits[16];
+    swprintf_s(digits, L"%06u", number);
+    segment.info = VideoSegmentInfo();
+    segment.info.number = number;
+    segment.info.filename = m_config.filePrefix + digits + m_config.extension;
+
+    // MFStartup() counts its callers, so each encoder can start
+    // and shut down Media Foundation on its own.
+    segment.encoder.reset(new VideoFileEncoder(true, false));
+    if (!segment.encoder->SetEncodingFormat(m_config.encodingFormat) ||
+        !segment.encoder->SetInputFormat(m_config.inputFormat) ||
+        !segment.encoder->SetVariableFrameRate(true) ||
+        !segment.encoder->Start(segment.info.filename.c_str(), m_width, m_height, m_fps, m_config.encoder))
+    {
+        segment.encoder.reset();
+        return false;
+    }
+
+    return true;
+}
+
+//
+// Finishes writing a segment file and adds it to the list of
+// finished segments, deleting the oldest ones beyond
+// m_config.maxSegments.
+//
+void VideoSegmenter::FinishSegment(Segment &segment)
+{
+    segment.info.ok = segment.encoder && segment.encoder->Stop();
+    segment.encoder.reset();
+    if (!segment.info.ok)
+        m_failed = true;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_finished.push_back(segment.info);
+    while (m_config.maxSegments && m_finished.size() > m_config.maxSegments)
+    {
+        DeleteFileW(m_finished.front().filename.c_str());
+        m_finished.pop_front();
+    }
+}
@@ -0,0 +1,183 @@
+//--------------------------------------------------------------------
+//
+// VideoSegmenter.h
+// Header file of C++ class that records video as a series of
+// segment files, switching files without dropping frames.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#pragma once
+#include "VideoFileEncoder.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Settings of a segmented recording.
+//
+struct VideoSegmenterConfig
+{
+    std::wstring filePrefix = L"segment_";  // Files are named <prefix><number><extension>.
+    std::wstring extension = L".mp4";
+    uint64_t segmentDuration = 60ull * 10000000; // In 100ns units.
+    unsigned maxSegments = 0;               // Older segment files are deleted; 0 keeps all.
+    GUID     encodingFormat = MFVideoFormat_H264;
+    GUID     inputFormat = MFVideoFormat_RGB32;
+    VideoEncoderConfig encoder;             // Passed on to VideoFileEncoder::Start().
+};
+
+//
+// Describes one finished segment file.  'start' is the time of
+// its first frame on the caller's timeline; the timestamps
+// inside the file start from zero.
+//
+struct VideoSegmentInfo
+{
+    std::wstring filename;
+    unsigned     number = 0;
+    uint64_t     start = 0;     // In 100ns units.
+    uint64_t     duration = 0;  // In 100ns units.
+    bool         ok = false;    // True if the file was written successfully.
+};
+
+//
+// This class records frames into a series of video files of
+// about the same length, such as for keeping the last few
+// minutes of a screen recording.  Each file has an encoder of
+// its own in variable frame rate mode.
+//
+// While one file is being written, the encoder for the next one
+// is started ahead of time on a worker thread, and the finished
+// file is completed on that thread too, so switching files
+// costs AddFrame() nothing.  A new file begins with the first
+// frame at or after the cut time, which the fresh encoder
+// always makes a key frame, so every segment plays on its own.
+// The previous segment's last frame lasts right up to that
+// frame, so no time is lost between segments.  If the next
+// encoder isn't ready in time, the current segment simply runs
+// longer.
+//
+class VideoSegmenter
+{
+public:
+    VideoSegmenter() { }
+    ~VideoSegmenter() { Stop(); }
+
+    //
+    // Starts recording frames of the given size and nominal
+    // frame rate.  The first file is started right away.
+    // Returns true if successful.
+    //
+    bool Start(const VideoSegmenterConfig &config, uint32_t width, uint32_t height, uint32_t fps);
+
+    //
+    // Adds the next frame, moving on to the next file first if
+    // the current one is long enough.  Timestamps are in 100ns
+    // units and must always increase, the same as for
+    // VideoFileEncoder::AddFrame() in variable frame rate mode.
+    // Returns true if successful.
+    //
+    bool AddFrame(const void *pixels, uint32_t stride, bool flipY, uint64_t timestamp);
+
+    //
+    // Tells the encoder that the previous frame is still on the
+    // screen at 'timestamp'.  Files only change on a new frame.
+    //
+    bool RepeatFrame(uint64_t timestamp);
+
+    //
+    // Finishes the current file and stops the worker thread.
+    // Returns true if every segment was written successfully.
+    //
+    bool Stop();
+
+    bool IsRunning() const { return m_running; }
+
+    //
+    // Retrieves the list of finished segments whose files still
+    // exist, oldest first.  May be called while recording.
+    //
+    void GetSegments(std::vector<VideoSegmentInfo> &segments) const;
+
+    //
+    // Returns how many times a segment ran past its cut time
+    // because the next encoder wasn't ready yet.
+    //
+    uint64_t GetLateCuts() const { return m_lateCuts; }
+
+private:
+    // An encoder and the file it writes to.
+    struct Segment
+    {
+        std::unique_ptr<VideoFileEncoder> encoder;
+        VideoSegmentInfo                  info;
+    };
+
+    VideoSegmenterConfig m_config;
+    uint32_t             m_width = 0;
+    uint32_t             m_height = 0;
+    uint32_t             m_fps = 0;
+    bool                 m_running = false;
+
+    // Only touched by the thread that adds frames.
+    Segment              m_current;
+    uint64_t             m_lastTimestamp = 0;
+    bool                 m_hasFrame = false;   // True once m_current has a frame.
+    bool                 m_cutLate = false;    // The next encoder missed the cut.
+
+    // Handed between that thread and the worker thread under
+    // m_mutex.  m_next is the pre-started encoder for the next
+    // file, and m_retired holds the files waiting to be finished.
+    mutable std::mutex   m_mutex;
+    Segment              m_next;
+    std::vector<Segment> m_retired;
+    std::deque<VideoSegmentInfo> m_finished;
+    unsigned             m_nextNumber = 0;
+
+    std::thread          m_worker;
+    HANDLE               m_wakeEvent = nullptr;
+    std::atomic<bool>    m_stopping { false };
+    std::atomic<bool>    m_failed { false };
+    std::atomic<uint64_t> m_lateCuts { 0 };
+
+    void WorkerThread();
+    bool StartSegment(Segment &segment, unsigned number);
+    void FinishSegment(Segment &segment);
+};
@@ -0,0 +1,643 @@
+//--------------------------------------------------------------------
+//
+// capbench.cpp
+// Benchmark of capturing the screen and encoding the frames,
+// timing each stage and reporting its latency distribution.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "ScreenCap.h"
+#include "VideoFileEncoder.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//
+// What is on the screen while a benchmark runs.
+//
+enum BenchScenario
+{
+    BenchScenario_Static,       // The desktop as it is, usually idle.
+    BenchScenario_Window,       // A 640x480 window animating every frame.
+    BenchScenario_FullScreen,   // The whole primary screen animating.
+    BenchScenario_Count
+};
+
+static const char *const scenarioNames[BenchScenario_Count] = { "STATIC", "WINDOW", "FULLSCREEN" };
+
+//
+// Stages of a frame that are timed.
+//
+enum BenchStage
+{
+    BenchStage_Capture,         // All of WaitForFrame().
+    BenchStage_Acquire,         // ScreenCaptureTimings::acquire.
+    BenchStage_GpuCopy,         // ScreenCaptureTimings::gpuCopy.
+    BenchStage_Map,             // ScreenCaptureTimings::map.
+    BenchStage_Copy,            // ScreenCaptureTimings::copy.
+    BenchStage_EncodeCopy,      // VideoEncoderTimings::copy, including any flip.
+    BenchStage_EncodeWrite,     // VideoEncoderTimings::write.
+    BenchStage_Frame,           // Capture and encode together.
+    BenchStage_Count
+};
+
+static const char *const stageNames[BenchStage_Count] =
+{
+    "capture", "acquire", "gpucopy", "map", "copy", "encodecopy", "encodewrite", "frame"
+};
+
+// Histogram buckets are powers of two microseconds, from under
+// 1us up to everything over about a second.
+static const unsigned HistogramBuckets = 21;
+
+unsigned framesPerRun = 300;
+unsigned framesPerSecond = 60;
+unsigned maxFrameWidth = 1920;
+unsigned maxFrameHeight = 1080;
+int64_t  qpcFrequency = 1;
+
+//--------------------------------------------------------------------
+// Local helpers
+//--------------------------------------------------------------------
+
+// Returns the current value of the performance counter.
+static int64_t GetQpc()
+{
+    LARGE_INTEGER qpc;
+    QueryPerformanceCounter(&qpc);
+    return qpc.QuadPart;
+}
+
+// Converts performance counter ticks to microseconds.
+static double TicksToUs(int64_t ticks)
+{
+    return ticks * 1000000.0 / qpcFrequency;
+}
+
+// Returns the CPU time used by the process so far, in 100ns units.
+static uint64_t GetProcessCpuTime()
+{
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+        return 0;
+    ULARGE_INTEGER k, u;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return k.QuadPart + u.QuadPart;
+}
+
+//
+// The times recorded for one stage, in QPC ticks.
+//
+struct StageSamples
+{
+    std::vector<int64_t> ticks;
+
+    void Add(int64_t t) { ticks.push_back(t); }
+
+    //
+    // Works out the median, 99th percentile, maximum and mean in
+    // microseconds, and counts the samples in each histogram
+    // bucket.  Leaves everything at zero if there are no samples.
+    //
+    void Summarize(double &p50, double &p99, double &maxUs, double &meanUs,
+        unsigned (&histogram)[HistogramBuckets]) const
+    {
+        p50 = p99 = maxUs = meanUs = 0.0;
+        for (auto &count : histogram)
+            count = 0;
+        if (ticks.empty())
+            return;
+
+        std::vector<int64_t> sorted(ticks);
+        std::sort(sorted.begin(), sorted.end());
+        const size_t n = sorted.size();
+        p50 = TicksToUs(sorted[(n - 1) / 2]);
+        p99 = TicksToUs(sorted[(n - 1) * 99 / 100]);
+        maxUs = TicksToUs(sorted[n - 1]);
+
+        int64_t total = 0;
+        for (int64_t t : sorted)
+        {
+            total += t;
+            unsigned bucket = 0;
+            for (double us = TicksToUs(t); us >= 1.0 && bucket < HistogramBuckets - 1; us /= 2.0)
+                bucket++;
+            histogram[bucket]++;
+        }
+        meanUs = TicksToUs(total) / n;
+    }
+};
+
+//
+// The results of one benchmark run.
+//
+struct BenchResult
+{
+    std::string  mode;
+    std::string  scenario;
+    unsigned     width = 0;         // Size of the captured frames.
+    unsigned     height = 0;
+    unsigned     polls = 0;         // Calls to WaitForFrame().
+    unsigned     frames = 0;        // Calls that captured a frame.
+    double       seconds = 0.0;
+    double       cpuPercent = 0.0;  // Of all of the CPU cores.
+    double       megabytesPerSecond = 0.0; // Frame data captured.
+    bool         encoded = false;
+    StageSamples stages[BenchStage_Count];
+};
+
+//
+// A window that draws a scrolling noisy gradient on every
+// screen refresh, from a thread of its own, so the screen
+// changes as much as it would playing a video.
+//
+class AnimationWindow
+{
+public:
+    AnimationWindow() { }
+    ~AnimationWindow() { Stop(); }
+
+    //
+    // Shows the window over the given area of the screen and
+    // starts animating it.  Returns true if successful.
+    //
+    bool Start(const RECT &area)
+    {
+        Stop();
+        m_stop = false;
+        m_ready = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        if (!m_ready)
+            return false;
+        m_created = false;
+        m_thread = std::thread(&AnimationWindow::Run, this, area);
+        WaitForSingleObject(m_ready, INFINITE);
+        CloseHandle(m_ready);
+        m_ready = nullptr;
+        if (!m_created)
+        {
+            Stop();
+            return false;
+        }
+
+        // Give the compositor time to show it.
+        Sleep(250);
+        return true;
+    }
+
+    //
+    // Closes the window.
+    //
+    void Stop()
+    {
+        m_stop = true;
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+private:
+    // How far the pattern repeats, in pixels.
+    static const int PatternPeriod = 256;
+
+    std::thread       m_thread;
+    std::atomic<bool> m_stop { false };
+    HANDLE            m_ready = nullptr;
+    bool              m_created = false;
+
+    void Run(RECT area)
+    {
+        const int width  = area.right - area.left;
+        const int height = area.bottom - area.top;
+
+        WNDCLASSW wc = {};
+        wc.lpfnWndProc = DefWindowProcW;
+        wc.hInstance = GetModuleHandleW(nullptr);
+        wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+        wc.lpszClassName = L"CapBenchAnimation";
+        RegisterClassW(&wc);
+        HWND hwnd = CreateWindowExW(WS_EX_TOPMOST | WS_EX_TOOLWINDOW | WS_EX_NOACTIVATE,
+                        wc.lpszClassName, L"capbench", WS_POPUP | WS_VISIBLE,
+                        area.left, area.top, width, height,
+                        nullptr, nullptr, wc.hInstance, nullptr);
+        m_created = (hwnd != nullptr);
+        SetEvent(m_ready);
+        if (!hwnd)
+            return;
+
+        // A pattern one period wider than the window, which is
+        // drawn at a different offset each frame.  The noise
+        // keeps the encoder from having an easy time of it.
+        const int patternWidth = width + PatternPeriod;
+        std::vector<uint32_t> pattern(static_cast<size_t>(patternWidth) * height);
+        uint32_t seed = 0x12345678;
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < patternWidth; x++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                const uint32_t phase = static_cast<uint32_t>(x % PatternPeriod);
+                const uint32_t noise = seed & 0x1f1f1f;
+                pattern[static_cast<size_t>(y) * patternWidth + x] =
+                    ((phase << 16) | (static_cast<uint32_t>(y & 0xff) << 8) | (255 - phase)) ^ noise;
+            }
+        }
+
+        BITMAPINFOHEADER hdr = {};
+        hdr.biSize = sizeof(hdr);
+        hdr.biWidth = patternWidth;
+        hdr.biHeight = -height;
+        hdr.biPlanes = 1;
+        hdr.biBitCount = 32;
+
+        HDC hdc = GetDC(hwnd);
+        for (int offset = 0; !m_stop; offset = (offset + 4) % PatternPeriod)
+        {
+            MSG msg;
+            while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE))
+                DispatchMessageW(&msg);
+
+            StretchDIBits(hdc, 0, 0, width, height, offset, 0, width, height,
+                pattern.data(), reinterpret_cast<BITMAPINFO *>(&hdr), DIB_RGB_COLORS, SRCCOPY);
+            GdiFlush();
+
+            // Draw once per screen refresh.
+            if (FAILED(DwmFlush()))
+                Sleep(15);
+        }
+        ReleaseDC(hwnd, hdc);
+        DestroyWindow(hwnd);
+    }
+};
+
+//
+// Runs one benchmark: captures 'framesPerRun' times with the
+// given capture mode, scaled to 'width' x 'height' unless they
+// are zero, and encodes the frames if 'encode' is true.
+// Returns false if the mode or size isn't supported.
+//
+static bool RunBenchmark(ScreenCaptureMode mode, BenchScenario scenario,
+    unsigned width, unsigned height, bool encode, BenchResult &result)
+{
+    result = BenchResult();
+    result.mode = GetScreenCaptureModeName(mode);
+    result.scenario = scenarioNames[scenario];
+    result.encoded = encode;
+
+    ScreenCapture cap;
+    if (!cap.Startup(mode))
+        return false;
+
+    // Have the capture scale the frames if asked to, or if the
+    // encoder couldn't take them as they are.
+    const ScreenCaptureResult first = cap.WaitForFrame(1000);
+    if (first != ScreenCaptureResult_Frame && first != ScreenCaptureResult_ModeChanged)
+        return false;
+    if (!width)
+    {
+        uint32_t w = 0, h = 0;
+        VideoFileEncoder::FitFrameSize(cap.GetFrameWidth(), cap.GetFrameHeight(),
+            maxFrameWidth, maxFrameHeight, w, h);
+        if (w != cap.GetFrameWidth() || h != cap.GetFrameHeight())
+        {
+            width  = w;
+            height = h;
+        }
+    }
+    if (width && !cap.SetOutputSize(width, height))
+        return false;
+
+    VideoFileEncoder encoder(true, true);
+    if (encode && (!encoder.SetEncodingFormat(MFVideoFormat_H264) ||
+        !encoder.SetVariableFrameRate(true)))
+    {
+        return false;
+    }
+
+    const unsigned timeoutMs = 1000 / framesPerSecond;
+    const int64_t startQpc = GetQpc();
+    const uint64_t startCpu = GetProcessCpuTime();
+    int64_t firstFrameTime = 0;
+    uint64_t lastTimestamp = 0;
+    uint64_t bytes = 0;
+    for (unsigned ipoll = 0; ipoll < framesPerRun; ipoll++)
+    {
+        const int64_t captureStart = GetQpc();
+        const ScreenCaptureResult status = cap.WaitForFrame(timeoutMs);
+        const int64_t captureEnd = GetQpc();
+        result.polls++;
+        if (status == ScreenCaptureResult_Error)
+            return false;
+        if (status == ScreenCaptureResult_NoChange)
+            continue;
+
+        const ScreenCaptureTimings timings = cap.GetFrameTimings();
+        result.stages[BenchStage_Capture].Add(captureEnd - captureStart);
+        result.stages[BenchStage_Acquire].Add(timings.acquire);
+        result.stages[BenchStage_GpuCopy].Add(timings.gpuCopy);
+        result.stages[BenchStage_Map].Add(timings.map);
+        result.stages[BenchStage_Copy].Add(timings.copy);
+        result.width  = cap.GetFrameWidth();
+        result.height = cap.GetFrameHeight();
+        bytes += cap.GetFrameBufferSize();
+
+        if (encode)
+        {
+            if (!result.frames)
+            {
+                firstFrameTime = cap.GetFrameTime();
+                if (!encoder.Start(L"capbench.mp4", result.width, result.height, framesPerSecond))
+                    return false;
+            }
+            if (result.width != encoder.GetWidth() || result.height != encoder.GetHeight())
+                return false;
+
+            // Timestamps must keep going up, even if two frames
+            // were presented at the same time.
+            uint64_t timestamp = static_cast<uint64_t>(
+                (cap.GetFrameTime() - firstFrameTime) * 10000000 / qpcFrequency);
+            if (result.frames && timestamp <= lastTimestamp)
+                timestamp = lastTimestamp + 1;
+            lastTimestamp = timestamp;
+
+            if (!encoder.AddFrame(cap.GetFrameBuffer(), cap.GetFrameStride(),
+                    cap.IsFrameBottomUp(), timestamp))
+            {
+                return false;
+            }
+            const VideoEncoderTimings &encodeTimings = encoder.GetFrameTimings();
+            result.stages[BenchStage_EncodeCopy].Add(encodeTimings.copy);
+            result.stages[BenchStage_EncodeWrite].Add(encodeTimings.write);
+        }
+        result.stages[BenchStage_Frame].Add(GetQpc() - captureStart);
+        result.frames++;
+    }
+    const int64_t elapsed = GetQpc() - startQpc;
+    const uint64_t cpu = GetProcessCpuTime() - startCpu;
+    if (encode && result.frames && !encoder.Stop())
+        return false;
+
+    result.seconds = static_cast<double>(elapsed) / qpcFrequency;
+    if (result.seconds > 0.0)
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        result.cpuPercent = cpu / 10000000.0 / result.seconds / si.dwNumberOfProcessors * 100.0;
+        result.megabytesPerSecond = bytes / 1048576.0 / result.seconds;
+    }
+    return true;
+}
+
+//
+// Writes the results as CSV, one line for each stage of each
+// run.  Returns true if successful.
+//
+static bool WriteCsv(const char *filename, const std::vector<BenchResult> &results)
+{
+    FILE *fp = nullptr;
+    if (fopen_s(&fp, filename, "w") != 0 || !fp)
+        return false;
+
+    fprintf(fp, "mode,scenario,width,height,polls,frames,seconds,fps,cpu_percent,mb_per_sec,"
+                "stage,samples,p50_us,p99_us,max_us,mean_us\n");
+    for (const auto &r : results)
+    {
+        for (unsigned stage = 0; stage < BenchStage_Count; stage++)
+        {
+            double p50, p99, maxUs, meanUs;
+            unsigned histogram[HistogramBuckets];
+            r.stages[stage].Summarize(p50, p99, maxUs, meanUs, histogram);
+            fprintf(fp, "%s,%s,%u,%u,%u,%u,%.3f,%.2f,%.1f,%.1f,%s,%zu,%.1f,%.1f,%.1f,%.1f\n",
+                r.mode.c_str(), r.scenario.c_str(), r.width, r.height, r.polls, r.frames,
+                r.seconds, r.seconds > 0.0 ? r.frames / r.seconds : 0.0,
+                r.cpuPercent, r.megabytesPerSecond, stageNames[stage],
+                r.stages[stage].ticks.size(), p50, p99, maxUs, meanUs);
+        }
+    }
+
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+//
+// Writes the results as JSON, with a histogram for each stage.
+// Returns true if successful.
+//
+static bool WriteJson(const char *filename, const std::vector<BenchResult> &results)
+{
+    FILE *fp = nullptr;
+    if (fopen_s(&fp, filename, "w") != 0 || !fp)
+        return false;
+
+    fprintf(fp, "{\n  \"histogramBuckets\": \"counts of samples under 1us, 2us, 4us and so on\",\n");
+    fprintf(fp, "  \"runs\": [");
+    for (size_t irun = 0; irun < results.size(); irun++)
+    {
+        const auto &r = results[irun];
+        fprintf(fp, "%s\n    {\n", irun ? "," : "");
+        fprintf(fp, "      \"mode\": \"%s\", \"scenario\": \"%s\", \"width\": %u, \"height\": %u,\n",
+            r.mode.c_str(), r.scenario.c_str(), r.width, r.height);
+        fprintf(fp, "      \"polls\": %u, \"frames\": %u, \"seconds\": %.3f, \"fps\": %.2f,\n",
+            r.polls, r.frames, r.seconds, r.seconds > 0.0 ? r.frames / r.seconds : 0.0);
+        fprintf(fp, "      \"cpuPercent\": %.1f, \"mbPerSec\": %.1f, \"encoded\": %s,\n",
+            r.cpuPercent, r.megabytesPerSecond, r.encoded ? "true" : "false");
+        fprintf(fp, "      \"stages\": {");
+        for (unsigned stage = 0; stage < BenchStage_Count; stage++)
+        {
+            double p50, p99, maxUs, meanUs;
+            unsigned histogram[HistogramBuckets];
+            r.stages[stage].Summarize(p50, p99, maxUs, meanUs, histogram);
+            fprintf(fp, "%s\n        \"%s\": { \"samples\": %zu, \"p50Us\": %.1f, \"p99Us\": %.1f, "
+                        "\"maxUs\": %.1f, \"meanUs\": %.1f, \"histogram\": [",
+                stage ? "," : "", stageNames[stage], r.stages[stage].ticks.size(),
+                p50, p99, maxUs, meanUs);
+            for (unsigned bucket = 0; bucket < HistogramBuckets; bucket++)
+                fprintf(fp, "%s%u", bucket ? ", " : "", histogram[bucket]);
+            fprintf(fp, "] }");
+        }
+        fprintf(fp, "\n      }\n    }");
+    }
+    fprintf(fp, "\n  ]\n}\n");
+
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    qpcFrequency = freq.QuadPart;
+
+    // Parse the command line.  Each kind of keyword adds to its
+    // list; an empty list means all of that kind.
+    std::vector<ScreenCaptureMode> modes;
+    std::vector<BenchScenario> scenarios;
+    std::vector<std::pair<unsigned, unsigned>> sizes;
+    bool json = false;
+    bool encode = true;
+    for (int iarg = 1; iarg < argc; iarg++)
+    {
+        const char *arg = argv[iarg];
+        if (_stricmp(arg, "GDI") == 0)
+            modes.push_back(ScreenCaptureMode_GDI);
+        else if (_stricmp(arg, "DX11") == 0)
+            modes.push_back(ScreenCaptureMode_DX11);
+        else if (_stricmp(arg, "DX11ALL") == 0)
+            modes.push_back(ScreenCaptureMode_DX11All);
+        else if (_stricmp(arg, "WGC") == 0)
+            modes.push_back(ScreenCaptureMode_WGC);
+        else if (_stricmp(arg, "STATIC") == 0)
+            scenarios.push_back(BenchScenario_Static);
+        else if (_stricmp(arg, "WINDOW") == 0)
+            scenarios.push_back(BenchScenario_Window);
+        else if (_stricmp(arg, "FULLSCREEN") == 0)
+            scenarios.push_back(BenchScenario_FullScreen);
+        else if (_stricmp(arg, "NATIVE") == 0)
+            sizes.push_back(std::make_pair(0u, 0u));
+        else if (_stricmp(arg, "720P") == 0)
+            sizes.push_back(std::make_pair(1280u, 720u));
+        else if (_stricmp(arg, "1080P") == 0)
+            sizes.push_back(std::make_pair(1920u, 1080u));
+        else if (_strnicmp(arg, "FRAMES=", 7) == 0 && atoi(arg + 7) > 0)
+            framesPerRun = static_cast<unsigned>(atoi(arg + 7));
+        else if (_stricmp(arg, "JSON") == 0)
+            json = true;
+        else if (_stricmp(arg, "NOENCODE") == 0)
+            encode = false;
+        else
+        {
+            printf(
+                "Usage:\n"
+                "    capbench [modes] [scenarios] [sizes] [FRAMES=n] [JSON] [NOENCODE]\n"
+                "Modes are GDI, DX11, DX11ALL and WGC; the default is GDI, DX11\n"
+                "and WGC.  Scenarios are STATIC (the desktop as it is), WINDOW (an\n"
+                "animated window) and FULLSCREEN (an animated screen); the default\n"
+                "is all three.  Sizes are NATIVE (scaled down to fit 1920x1080 if\n"
+                "need be), 720P and 1080P; the default is NATIVE and 720P.  Each run\n"
+                "waits for %u frames, which FRAMES=n changes.  The results are\n"
+                "written to capbench.csv, or to capbench.json with the keyword JSON.\n"
+                "The keyword NOENCODE skips encoding the frames.\n", framesPerRun);
+            return -1;
+        }
+    }
+    if (modes.empty())
+        modes = { ScreenCaptureMode_GDI, ScreenCaptureMode_DX11, ScreenCaptureMode_WGC };
+    if (scenarios.empty())
+        scenarios = { BenchScenario_Static, BenchScenario_Window, BenchScenario_FullScreen };
+    if (sizes.empty())
+        sizes = { std::make_pair(0u, 0u), std::make_pair(1280u, 720u) };
+
+    ::SetProcessDPIAware();
+    const int screenWidth  = GetSystemMetrics(SM_CXSCREEN);
+    const int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+
+    std::vector<BenchResult> results;
+    bool failed = false;
+    for (const BenchScenario scenario : scenarios)
+    {
+        // The animation runs for all of the runs of a scenario.
+        AnimationWindow animation;
+        if (scenario != BenchScenario_Static)
+        {
+            RECT area = { 0, 0, screenWidth, screenHeight };
+            if (scenario == BenchScenario_Window)
+            {
+                area.left = max(0, (screenWidth - 640) / 2);
+                area.top  = max(0, (screenHeight - 480) / 2);
+                area.right  = min(screenWidth, area.left + 640);
+                area.bottom = min(screenHeight, area.top + 480);
+            }
+            if (!animation.Start(area))
+            {
+                printf("Failed creating the animation window!\n");
+                return -1;
+            }
+        }
+
+        for (const ScreenCaptureMode mode : modes)
+        {
+            for (const auto &size : sizes)
+            {
+                BenchResult result;
+                if (!RunBenchmark(mode, scenario, size.first, size.second, encode, result))
+                {
+                    printf("%-6s %-10s %ux%u: failed or not supported.\n",
+                        GetScreenCaptureModeName(mode), scenarioNames[scenario],
+                        size.first, size.second);
+                    failed = true;
+                    continue;
+                }
+
+                double p50, p99, maxUs, meanUs;
+                unsigned histogram[HistogramBuckets];
+                result.stages[BenchStage_Frame].Summarize(p50, p99, maxUs, meanUs, histogram);
+                printf("%-6s %-10s %ux%u: %u frames, %.1f fps, p50 %.2f ms, p99 %.2f ms, "
+                       "max %.2f ms, CPU %.1f%%, %.1f MB/s\n",
+                    result.mode.c_str(), result.scenario.c_str(), result.width, result.height,
+                    result.frames, result.frames / result.seconds, p50 / 1000.0, p99 / 1000.0,
+                    maxUs / 1000.0, result.cpuPercent, result.megabytesPerSecond);
+                results.push_back(std::move(result));
+            }
+        }
+    }
+
+    const char *filename = json ? "capbench.json" : "capbench.csv";
+    if (!(json ? WriteJson(filename, results) : WriteCsv(filename, results)))
+    {
+        printf("Failed writing %s!\n", filename);
+        return -1;
+    }
+    printf("Results written to %s.\n", filename);
+
+    if (failed)
+        printf("Some runs failed.\n");
+    printf("OK\n");
+    return 0;
+}
@@ -41,6 +41,11 @@
 
 #include "ScreenCap.h"
 #include "VideoFileEncoder.h"
+#include "CapturePipeline.h"
+#include "CaptureScheduler.h"
+#include "VideoSegmenter.h"
+#include "InstantRecorder.h"
+#include "ReplayBuffer.h"
 #include <vector>
 #if 0 // TODO
 #define WIN32_LEAN_AND_MEAN
@@ -52,6 +57,216 @@
 
 const wchar_t *outputFilename = L"test.mp4";
 unsigned framesPerSecond = 30;
+unsigned maxFrameWidth = 1920;
+unsigned maxFrameHeight = 1080;
+VideoEncoderConfig encoderConfig;
+
+//
+// Called when the capture reports that the screen changed
+// mode.  A video can't change size in the middle of a file,
+// so if the frames no longer match it, the following frames
+// are scaled back to the video's size.  Returns true if the
+// frame just captured can still be encoded.
+//
+static bool FitModeChange(ScreenCapture &cap, uint32_t width, uint32_t height)
+{
+    if (cap.GetFrameWidth() == width && cap.GetFrameHeight() == height)
+        return true;
+
+    printf("Screen changed to %ux%u; scaling frames to %ux%u.\n",
+        cap.GetFrameWidth(), cap.GetFrameHeight(), width, height);
+    if (!cap.SetOutputSize(width, height))
+        printf("Frames can't be scaled in this capture mode.\n");
+    return false;
+}
+
+//
+// Captures and encodes up to 100 frames using the threaded
+// capture pipeline, then shows the pipeline's statistics.
+// Returns the program's exit code.
+//
+static int RunPipeline(ScreenCapture &cap, VideoFileEncoder &encoder)
+{
+    CapturePipeline pipeline(cap, encoder);
+    if (!pipeline.Start(outputFilename, framesPerSecond, 4,
+            CapturePipelineDrop_Oldest, encoderConfig))
+    {
+        printf("Failed starting pipeline!\n");
+        return -1;
+    }
+
+    // Run until 100 frames were captured, or give up after
+    // ten seconds.
+    uint64_t startTick = GetTickCount64();
+    CapturePipelineStats stats;
+    do
+    {
+        Sleep(10);
+        pipeline.GetStats(stats);
+    } while (stats.framesCaptured < 100 && GetTickCount64() - startTick < 10000);
+
+    float seconds = static_cast<float>(GetTickCount64() - startTick) / 1000.0f;
+
+    bool ok = pipeline.Stop();
+    pipeline.GetStats(stats);
+    cap.Shutdown();
+    if (!ok)
+    {
+        printf("Failed writing video file!\n");
+        return -1;
+    }
+
+    // Show statistics.
+    printf("Frames:  %llu captured, %llu encoded, %llu dropped, %llu failed\n",
+        stats.framesCaptured, stats.framesEncoded, stats.framesDropped,
+        stats.encodeErrors);
+    printf("Queue:   max depth %u\n", stats.maxQueueDepth);
+    printf("Capture: avg %.2f ms, max %.2f ms\n", stats.avgCaptureMs, stats.maxCaptureMs);
+    printf("Queued:  avg %.2f ms, max %.2f ms\n", stats.avgQueueMs, stats.maxQueueMs);
+    printf("Encode:  avg %.2f ms, max %.2f ms\n", stats.avgEncodeMs, stats.maxEncodeMs);
+    printf("First:   %.2f ms to the first encoded frame\n", stats.firstFrameMs);
+    printf("Time:    %.2f seconds\n", seconds);
+    if (seconds > 0.0f)
+        printf("FPS:     %.2f\n", stats.framesEncoded / seconds);
+
+    printf("OK\n");
+    return 0;
+}
+
+//
+// Prepares an InstantRecorder, then makes two three second
+// recordings with it, showing how long each took to get its
+// first frame encoded.  The second encoder is started while
+// nothing is being recorded, as it would be between hotkey
+// presses.  Returns the program's exit code.
+//
+static int RunInstantRecorder(ScreenCaptureMode mode)
+{
+    CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED);
+
+    int result = 0;
+    {
+        InstantRecorder recorder;
+        if (!recorder.Prepare(mode, framesPerSecond, encoderConfig, maxFrameWidth, maxFrameHeight))
+        {
+            printf("Failed preparing recorder!\n");
+            CoUninitialize();
+            return -1;
+        }
+        printf("Prepared in %.2f ms.\n", recorder.GetPrepareMs());
+
+        static const wchar_t *filenames[] = { L"test.mp4", L"test_2.mp4" };
+        for (const wchar_t *filename : filenames)
+        {
+            Sleep(500);
+            if (!recorder.StartRecording(filename))
+            {
+                printf("Failed starting recording!\n");
+                result = -1;
+                break;
+            }
+            Sleep(3000);
+            const bool ok = recorder.StopRecording();
+
+            CapturePipelineStats stats;
+            recorder.GetStats(stats);
+            printf("%ls: %llu frames encoded, %.2f ms to the first encoded frame%s\n",
+                filename, stats.framesEncoded, recorder.GetTimeToFirstFrameMs(),
+                ok ? "" : " (failed)");
+            if (!ok)
+                result = -1;
+        }
+    }
+
+    CoUninitialize();
+    if (result == 0)
+        printf("OK\n");
+    return result;
+}
+
+//
+// Captures up to 100 frames into segment files of one second
+// each, keeping only the last two, then lists the segments.
+// Returns the program's exit code.
+//
+static int RunSegmenter(ScreenCapture &cap)
+{
+    CaptureScheduler scheduler(cap);
+    if (!scheduler.Start(framesPerSecond))
+    {
+        printf("Failed starting capture scheduler!\n");
+        return -1;
+    }
+
+    VideoSegmenterConfig config;
+    config.filePrefix = L"test_segment_";
+    config.segmentDuration = 10000000;
+    config.maxSegments = 2;
+    config.encoder = encoderConfig;
+    if (cap.GetFrameFormat() == ScreenCaptureFormat_NV12)
+        config.inputFormat = MFVideoFormat_NV12;
+
+    VideoSegmenter segmenter;
+    size_t numFrames = 0;
+    uint32_t width = 0, height = 0;
+    for (int iframe = 0; iframe < 100; iframe++)
+    {
+        uint64_t timestamp = 0;
+        ScreenCaptureResult result = scheduler.WaitForTick(timestamp);
+        if (result == ScreenCaptureResult_NoChange && numFrames)
+        {
+            segmenter.RepeatFrame(timestamp);
+            continue;
+        }
+        if (result == ScreenCaptureResult_ModeChanged && numFrames &&
+            !FitModeChange(cap, width, height))
+        {
+            continue;
+        }
+        if (result != ScreenCaptureResult_Frame && result != ScreenCaptureResult_ModeChanged)
+            continue;
+
+        if (!numFrames)
+        {
+            width  = cap.GetFrameWidth();
+            height = cap.GetFrameHeight();
+            if (!segmenter.Start(config, width, height, framesPerSecond))
+            {
+                printf("Failed starting segmenter!\n");
+                return -1;
+            }
+        }
+        if (!segmenter.AddFrame(cap.GetFrameBuffer(), cap.GetFrameStride(),
+                cap.IsFrameBottomUp(), timestamp))
+        {
+            printf("Failed encoding frame!\n");
+            return -1;
+        }
+        numFrames++;
+    }
+
+    cap.Shutdown();
+    bool ok = segmenter.Stop();
+
+    std::vector<VideoSegmentInfo> segments;
+    segmenter.GetSegments(segments);
+    for (const auto &segment : segments)
+    {
+        printf("Segment: %ls, start %.2f s, length %.2f s%s\n",
+            segment.filename.c_str(), segment.start / 10000000.0,
+            segment.duration / 10000000.0, segment.ok ? "" : " (failed)");
+    }
+    printf("Frames:  %zu\n", numFrames);
+    printf("Late:    %llu cuts\n", segmenter.GetLateCuts());
+    if (!ok)
+    {
+        printf("Failed writing video file!\n");
+        return -1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -59,8 +274,23 @@ int main(int argc, char **argv)
     {
         printf(
             "Usage:\n"
-            "    capenctest GDI    - Test capture using Windows GDI.\n"
-            "    capenctest DX11   - Test capture using DirectX 11.\n"
+            "    capenctest GDI       - Test capture using Windows GDI.\n"
+            "    capenctest DX11      - Test capture using DirectX 11.\n"
+            "    capenctest DX11ALL   - Test capture of all screens using DirectX 11.\n"
+            "    capenctest WGC       - Test capture using Windows.Graphics.Capture.\n"
+            "    capenctest AUTO      - Test capture using the first of WGC, DX11\n"
+            "                           and GDI that works well enough.\n"
+            "    capenctest DX11 GPU  - Test capture using DirectX 11, passing\n"
+            "                           GPU textures straight to the encoder.\n"
+            "Add the keyword PIPELINE after GDI or DX11 to capture and encode\n"
+            "on separate threads.  Add the keyword NV12 after DX11 to convert\n"
+            "frames to NV12 on the GPU before they are read back.  Add the\n"
+            "keyword HW to require a hardware encoder in low latency mode.\n"
+            "Add the keyword FRAG to write a fragmented MP4 file.  Add the\n"
+            "keyword SEGMENT to record one second segment files.  Add the\n"
+            "keyword INSTANT to time starting recordings with InstantRecorder.\n"
+            "Add the keyword REPLAY to keep the last two seconds in memory and\n"
+            "write them to the file at the end.\n"
             );
         return -1;
     }
@@ -77,18 +307,121 @@ int main(int argc, char **argv)
         printf("Selected DX11 capture mode.\n");
         mode = ScreenCaptureMode_DX11;
     }
+    else if (_stricmp(argv[1], "DX11ALL") == 0)
+    {
+        printf("Selected DX11 capture of all screens.\n");
+        mode = ScreenCaptureMode_DX11All;
+    }
+    else if (_stricmp(argv[1], "WGC") == 0)
+    {
+        printf("Selected Windows.Graphics.Capture mode.\n");
+        mode = ScreenCaptureMode_WGC;
+    }
+    else if (_stricmp(argv[1], "AUTO") == 0)
+    {
+        printf("Selected automatic choice of capture mode.\n");
+        mode = ScreenCaptureMode_Auto;
+    }
     if (mode == ScreenCaptureMode_Invalid)
     {
         printf("Unrecognized capture mode '%s'\n", argv[1]);
         return -1;
     }
 
+    // Parse options.
+    bool gpuFrames = false;
+    bool pipeline = false;
+    bool nv12 = false;
+    bool segment = false;
+    bool instant = false;
+    bool replay = false;
+    for (int iarg = 2; iarg < argc; iarg++)
+    {
+        if (_stricmp(argv[iarg], "GPU") == 0 && mode == ScreenCaptureMode_DX11)
+        {
+            printf("Selected GPU texture frames.\n");
+            gpuFrames = true;
+        }
+        else if (_stricmp(argv[iarg], "NV12") == 0 && mode == ScreenCaptureMode_DX11)
+        {
+            printf("Selected NV12 frames.\n");
+            nv12 = true;
+        }
+        else if (_stricmp(argv[iarg], "HW") == 0)
+        {
+            printf("Selected low latency hardware encoder.\n");
+            encoderConfig.hardware = VideoEncoderHardware_Required;
+            encoderConfig.lowLatency = true;
+            encoderConfig.rateControl = VideoEncoderRateControl_CBR;
+            encoderConfig.bFrames = 0;
+        }
+        else if (_stricmp(argv[iarg], "FRAG") == 0)
+        {
+            printf("Selected fragmented MP4.\n");
+            encoderConfig.fragmented = true;
+        }
+        else if (_stricmp(argv[iarg], "SEGMENT") == 0)
+        {
+            printf("Selected segmented recording.\n");
+            segment = true;
+        }
+        else if (_stricmp(argv[iarg], "PIPELINE") == 0)
+        {
+            printf("Selected threaded pipeline.\n");
+            pipeline = true;
+        }
+        else if (_stricmp(argv[iarg], "INSTANT") == 0)
+        {
+            printf("Selected instant recording.\n");
+            instant = true;
+        }
+        else if (_stricmp(argv[iarg], "REPLAY") == 0)
+        {
+            printf("Selected instant replay buffer.\n");
+            replay = true;
+            encoderConfig.fragmented = true;
+        }
+        else
+        {
+            printf("Unrecognized option '%s'\n", argv[iarg]);
+            return -1;
+        }
+    }
+
+    if (instant)
+        return RunInstantRecorder(mode);
+
     ScreenCapture cap;
     if (!cap.Startup(mode))
     {
         printf("Startup failed!\n");
         return -1;
     }
+    if (mode == ScreenCaptureMode_Auto)
+        printf("Using %s capture mode.\n", GetScreenCaptureModeName(cap.GetCaptureMode()));
+    if (nv12 && !cap.SetOutputFormat(ScreenCaptureFormat_NV12))
+    {
+        printf("NV12 frames are not supported on this system!\n");
+        return -1;
+    }
+
+    // H.264 needs even frame sizes, and older encoders stop at
+    // 1920x1080, so look at the first frame and have any larger
+    // or odd-sized frames scaled to fit.
+    const ScreenCaptureResult firstResult = cap.WaitForFrame(1000);
+    if (firstResult == ScreenCaptureResult_Frame || firstResult == ScreenCaptureResult_ModeChanged)
+    {
+        uint32_t width = 0, height = 0;
+        VideoFileEncoder::FitFrameSize(cap.GetFrameWidth(), cap.GetFrameHeight(),
+            maxFrameWidth, maxFrameHeight, width, height);
+        if (width != cap.GetFrameWidth() || height != cap.GetFrameHeight())
+        {
+            printf("Scaling frames from %ux%u to %ux%u.\n",
+                cap.GetFrameWidth(), cap.GetFrameHeight(), width, height);
+            if (!cap.SetOutputSize(width, height))
+                printf("Frames can't be scaled in this capture mode.\n");
+        }
+    }
 
     VideoFileEncoder encoder(true, true);
     if (!encoder.SetEncodingFormat(MFVideoFormat_H264))
@@ -96,19 +429,131 @@ int main(int argc, char **argv)
         printf("Failed initializing encoder!\n");
         return -1;
     }
+    if (nv12 && !encoder.SetInputFormat(MFVideoFormat_NV12))
+    {
+        printf("Failed initializing encoder!\n");
+        return -1;
+    }
+    if (gpuFrames && !encoder.SetD3DDevice(cap.GetD3DDevice()))
+    {
+        printf("Failed sharing Direct3D device with encoder!\n");
+        return -1;
+    }
+
+    std::vector<std::wstring> encoderNames;
+    encoder.GetHardwareEncoderNames(encoderNames);
+    for (const auto &name : encoderNames)
+        printf("Hardware encoder: %ls\n", name.c_str());
+
+    if (gpuFrames && (pipeline || nv12 || segment))
+    {
+        printf("The GPU option can't be combined with PIPELINE, NV12 or SEGMENT.\n");
+        return -1;
+    }
+    if (replay && (pipeline || segment))
+    {
+        printf("The REPLAY option can't be combined with PIPELINE or SEGMENT.\n");
+        return -1;
+    }
+    // GDI mode has to compare each frame with the one before
+    // to find out that the screen didn't change, so unchanged
+    // frames are repeated instead of encoded again, as in the
+    // other modes.  This starts over with a full frame.
+    if (cap.GetCaptureMode() == ScreenCaptureMode_GDI)
+        cap.SetIncrementalCapture(true);
+
+    if (pipeline)
+        return RunPipeline(cap, encoder);
+    if (segment)
+        return RunSegmenter(cap);
+
+    // Each frame lasts until the next one, so the timestamps
+    // can follow the real, uneven intervals between frames.
+    if (!encoder.SetVariableFrameRate(true))
+    {
+        printf("Failed initializing encoder!\n");
+        return -1;
+    }
+
+    // Frames from system memory are paced by the scheduler.
+    CaptureScheduler scheduler(cap);
+    if (!gpuFrames && !scheduler.Start(framesPerSecond))
+    {
+        printf("Failed starting capture scheduler!\n");
+        return -1;
+    }
+
+    // With REPLAY, only the last two seconds are kept, in
+    // memory, until the file is written at the end.  A key
+    // frame every second lets the buffer drop a second at a
+    // time.
+    ReplayBuffer replayBuffer;
+    if (replay)
+    {
+        encoderConfig.gopSize = framesPerSecond;
+        replayBuffer.SetLimits(2ull * 10000000, 0);
+    }
+
+    LARGE_INTEGER qpcFrequency;
+    QueryPerformanceFrequency(&qpcFrequency);
+    int64_t firstFrameTime = 0;
 
     size_t numFrames = 0;
+    size_t numRepeats = 0;
     uint64_t startTick = GetTickCount64();
-    int64_t timestamp = 0;
 
     for (int iframe = 0; iframe < 100; iframe++)
     {
         // Capture a screen image.
-        if (!cap.CaptureFrame() || cap.GetFrameWidth() < 1)
+        CComPtr<ID3D11Texture2D> texture;
+        unsigned width = 0, height = 0;
+        uint64_t timestamp = 0;
+        if (gpuFrames)
         {
-            // No image was captured.
-            // Keep trying.
-            continue;
+            if (!cap.CaptureFrameTexture(texture))
+            {
+                // No image was captured.
+                // Keep trying.
+                continue;
+            }
+
+            D3D11_TEXTURE2D_DESC desc;
+            texture->GetDesc(&desc);
+            width  = desc.Width;
+            height = desc.Height;
+
+            // Time stamps count from when the first frame was
+            // presented.
+            if (!numFrames)
+                firstFrameTime = cap.GetFrameTime();
+            timestamp = static_cast<uint64_t>(
+                (cap.GetFrameTime() - firstFrameTime) * 10000000 / qpcFrequency.QuadPart);
+        }
+        else
+        {
+            ScreenCaptureResult result = scheduler.WaitForTick(timestamp);
+            if (result == ScreenCaptureResult_NoChange && numFrames)
+            {
+                // Nothing changed, so the last frame just lasts
+                // longer.  It isn't encoded again.
+                encoder.RepeatFrame(timestamp);
+                numRepeats++;
+                continue;
+            }
+            if (result == ScreenCaptureResult_ModeChanged && numFrames &&
+                !FitModeChange(cap, encoder.GetWidth(), encoder.GetHeight()))
+            {
+                continue;
+            }
+            if (result != ScreenCaptureResult_Frame && result != ScreenCaptureResult_ModeChanged)
+            {
+                // No image was captured.
+                // Keep trying.
+                continue;
+            }
+
+            width  = cap.GetFrameWidth();
+            height = cap.GetFrameHeight();
         }
 
         // When we get the first frame, initialize the
@@ -116,26 +561,30 @@ int main(int argc, char **argv)
         if (!numFrames)
         {
             printf("Start encoder, width=%u, height=%u, stride=%u, fps=%u\n",
-                cap.GetFrameWidth(), cap.GetFrameHeight(),
-                cap.GetFrameStride(), framesPerSecond);
-            if (!encoder.Start(outputFilename,
-                cap.GetFrameWidth(), cap.GetFrameHeight(),
-                framesPerSecond))
+                width, height, cap.GetFrameStride(), framesPerSecond);
+            const bool started = replay ?
+                encoder.Start(&replayBuffer, width, height, framesPerSecond, encoderConfig) :
+                encoder.Start(outputFilename, width, height, framesPerSecond, encoderConfig);
+            if (!started)
             {
                 printf("Failed starting encoder!\n");
                 return -1;
             }
+            printf("Using %s encoder.\n", encoder.IsHardwareEncoder() ? "hardware" : "software");
         }
 
         // Send the captured frame image to the encoder.
-        if (!encoder.AddFrame(cap.GetFrameBuffer(), true, timestamp))
+        bool ok = gpuFrames ?
+            encoder.AddFrameTexture(texture, timestamp) :
+            encoder.AddFrame(cap.GetFrameBuffer(), cap.GetFrameStride(),
+                             cap.IsFrameBottomUp(), timestamp);
+        if (!ok)
         {
             printf("Failed encoding frame!\n");
             return -1;
         }
 
         numFrames++;
-        timestamp += encoder.GetFrameDuration();
     }
 
     float seconds = static_cast<float>(GetTickCount64() - startTick) / 1000.0f;
@@ -146,9 +595,21 @@ int main(int argc, char **argv)
         printf("Failed writing video file!\n");
         return -1;
     }
+    if (replay)
+    {
+        printf("Replay:  %.2f seconds, %zu bytes, %zu fragments\n",
+            replayBuffer.GetBufferedDuration() / 10000000.0,
+            replayBuffer.GetBufferedBytes(), replayBuffer.GetFragmentCount());
+        if (!replayBuffer.SaveToFile(outputFilename))
+        {
+            printf("Failed writing video file!\n");
+            return -1;
+        }
+    }
 
     // Show statistics.
     printf("Frames:  %zu\n", numFrames);
+    printf("Repeats: %zu\n", numRepeats);
     printf("Time:    %.2f seconds\n", seconds);
     if (seconds > 0.0f)
         printf("FPS:     %.2f\n", numFrames / seconds);
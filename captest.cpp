@@ -41,6 +41,9 @@
 //--------------------------------------------------------------------
 
 #include "ScreenCap.h"
+#include "PixelOps.h"
+#include "FrameLog.h"
+#include "SnapshotWriter.h"
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <atlbase.h>
@@ -48,94 +51,25 @@
 #include <d3d11.h>
 #include <vector>
 
-//
-// Writes a 24-bit BGR or 32-bit BGRA image from memory to a
-// Microsoft .BMP file on disk.  Returns true if successful.
-//
-static bool BmpWrite(const char *szPath, unsigned width, unsigned height,
-    unsigned stride, unsigned bitsPerPixel, const void *pBits)
-{
-    // Check for bogus arguments.
-    if (szPath == nullptr || szPath[0] == '\0' || width < 1 || height < 1 ||
-        stride < width * 3 || (bitsPerPixel != 24 && bitsPerPixel != 32) ||
-        pBits == nullptr)
-    {
-        return false;
-    }
-
-    // Open the output file.
-    FILE *fp = nullptr;
-    if (fopen_s(&fp, szPath, "wb") || fp == nullptr)
-    {
-        // Failed opening output file!
-        return false;
-    }
-
-    unsigned outStride = width * bitsPerPixel / 8;
-    while (outStride % 4)
-        outStride++;
-
-    // Build BITMAPINFOHEADER to write to file.
-    BITMAPINFOHEADER stInfoHdr = {0};
-    stInfoHdr.biSize = sizeof(stInfoHdr);
-    stInfoHdr.biBitCount = static_cast<WORD>(bitsPerPixel);
-    stInfoHdr.biWidth = width;
-    stInfoHdr.biHeight = height;
-    stInfoHdr.biPlanes = 1;
-    stInfoHdr.biSizeImage = outStride * height;
-
-    // Build BITMAPFILEHEADER structure.
-    BITMAPFILEHEADER stFileHdr;
-    memset(&stFileHdr, 0, sizeof(stFileHdr));
-    stFileHdr.bfType = (WORD)'B' + 256 * (WORD)'M';
-    stFileHdr.bfSize = sizeof(BITMAPFILEHEADER) + stInfoHdr.biSize + stInfoHdr.biSizeImage;
-    stFileHdr.bfOffBits = sizeof(BITMAPFILEHEADER) + stInfoHdr.biSize;
-
-    // Write the BITMAPFILEHEADER to the output file.
-    if (fwrite(&stFileHdr, sizeof(stFileHdr), 1, fp) != 1)
-    {
-        // Write to output file failed!
-        fclose(fp);
-        _unlink(szPath);
-        return false;
-    }
-
-    // Write the BITMAPINFOHEADER to the output file.
-    if (fwrite(&stInfoHdr, stInfoHdr.biSize, 1, fp) != 1)
-    {
-        // Write to output file failed!
-        fclose(fp);
-        _unlink(szPath);
-        return false;
-    }
-
-    // Write the bitmap bits one scanline at a time.
-    const unsigned char *scanline = static_cast<const unsigned char *>(pBits) + stride * (height - 1);
-    for (unsigned y = 0; y < height; y++)
-    {
-        if (fwrite(scanline, outStride, 1, fp) != 1)
-        {
-            // Write to output file failed!
-            fclose(fp);
-            _unlink(szPath);
-            return false;
-        }
-
-        scanline -= stride;
-    }
-
-    fclose(fp);
-    return true;
-}
-
 int main(int argc, char **argv)
 {
     if (argc < 2)
     {
         printf(
             "Usage:\n"
-            "    captest GDI    - Test capture using Windows GDI.\n"
-            "    captest DX11   - Test capture using DirectX 11.\n"
+            "    captest GDI     - Test capture using Windows GDI.\n"
+            "    captest DX11    - Test capture using DirectX 11.\n"
+            "    captest DX11ALL - Test capture of all screens using DirectX 11.\n"
+            "    captest WGC     - Test capture using Windows.Graphics.Capture.\n"
+            "    captest AUTO    - Test capture using the first of WGC, DX11\n"
+            "                      and GDI that works well enough.\n"
+            "Add the keyword WINDOW after GDI, DX11, WGC or AUTO to capture\n"
+            "only the window that is in the foreground at startup.\n"
+            "Add the keyword LOG to record the frames losslessly into\n"
+            "frames.framelog instead of writing .BMP files, then read\n"
+            "the last frame back to check it.  Add the keyword QOI to\n"
+            "write .QOI files instead of .BMP files.  Add the keyword\n"
+            "CURSOR to include the mouse pointer.\n"
             );
         return -1;
     }
@@ -152,18 +86,97 @@ int main(int argc, char **argv)
         printf("Selected DX11 capture mode.\n");
         mode = ScreenCaptureMode_DX11;
     }
+    else if (_stricmp(argv[1], "DX11ALL") == 0)
+    {
+        printf("Selected DX11 capture of all screens.\n");
+        mode = ScreenCaptureMode_DX11All;
+    }
+    else if (_stricmp(argv[1], "WGC") == 0)
+    {
+        printf("Selected Windows.Graphics.Capture mode.\n");
+        mode = ScreenCaptureMode_WGC;
+    }
+    else if (_stricmp(argv[1], "AUTO") == 0)
+    {
+        printf("Selected automatic choice of capture mode.\n");
+        mode = ScreenCaptureMode_Auto;
+    }
     if (mode == ScreenCaptureMode_Invalid)
     {
         printf("Unrecognized capture mode '%s'\n", argv[1]);
         return -1;
     }
 
+    bool window = false;
+    bool log = false;
+    bool cursor = false;
+    SnapshotFormat snapshotFormat = SnapshotFormat_BMP;
+    for (int iarg = 2; iarg < argc; iarg++)
+    {
+        if (_stricmp(argv[iarg], "WINDOW") == 0 && mode != ScreenCaptureMode_DX11All)
+        {
+            printf("Capturing the foreground window only.\n");
+            window = true;
+        }
+        else if (_stricmp(argv[iarg], "LOG") == 0)
+        {
+            printf("Recording frames to a frame log.\n");
+            log = true;
+        }
+        else if (_stricmp(argv[iarg], "QOI") == 0)
+        {
+            printf("Writing .QOI files.\n");
+            snapshotFormat = SnapshotFormat_QOI;
+        }
+        else if (_stricmp(argv[iarg], "CURSOR") == 0)
+        {
+            printf("Including the mouse pointer.\n");
+            cursor = true;
+        }
+        else
+        {
+            printf("Unrecognized option '%s'\n", argv[iarg]);
+            return -1;
+        }
+    }
+
     ScreenCapture cap;
     if (!cap.Startup(mode))
     {
         printf("Startup failed!\n");
         return -1;
     }
+    if (mode == ScreenCaptureMode_Auto)
+        printf("Using %s capture mode.\n", GetScreenCaptureModeName(cap.GetCaptureMode()));
+
+    if (window && !cap.SetCaptureWindow(GetForegroundWindow()))
+    {
+        printf("Failed to select the foreground window for capture!\n");
+        return -1;
+    }
+    if (cursor && !cap.SetCursorCapture(true))
+    {
+        printf("The mouse pointer can't be captured in this mode!\n");
+        return -1;
+    }
+
+    // Files are written on worker threads, so the capture loop
+    // isn't held up by the disk.
+    SnapshotWriter snapshots;
+    if (!log && !snapshots.Startup())
+    {
+        printf("Failed starting snapshot writer!\n");
+        return -1;
+    }
+
+    // The writer holds on to the capture's buffers until it has
+    // encoded them, plus the one being captured into.
+    if (snapshots.IsRunning())
+        cap.SetMaxFrameBuffers(snapshots.GetMaxFramesHeld() + 1);
+
+    FrameLogWriter logWriter;
+    std::vector<uint8_t> lastFrame;
+    uint64_t lastTime = 0;
 
     size_t numFrames = 0;
     uint64_t startTick = GetTickCount64();
@@ -187,17 +200,52 @@ int main(int argc, char **argv)
 
         numFrames++;
 
-        // Write the screen image to a BMP file.
-        char filename[256] = {0};
-        snprintf(filename, sizeof(filename), "frame%d.bmp", iframe);
+        if (log)
+        {
+            // The log holds 32-bit frames of one size, packed
+            // without any padding at the end of the scanlines.
+            if (!logWriter.IsOpen() &&
+                (cap.GetFrameDepth() != 32 ||
+                 !logWriter.Create(L"frames.framelog", cap.GetFrameWidth(), cap.GetFrameHeight(),
+                    ScreenCaptureFormat_BGRA32)))
+            {
+                printf("Failed creating frame log!\n");
+                return -1;
+            }
+
+            lastTime = static_cast<uint64_t>(cap.GetFrameTime());
+            if (!logWriter.AddFrame(cap.GetFrameBuffer(), cap.GetFrameStride(), lastTime,
+                    &cap.GetFrameDirtyRects()))
+            {
+                printf("Failed adding frame %d to frame log!\n", iframe);
+                return -1;
+            }
+
+            const size_t rowBytes = static_cast<size_t>(cap.GetFrameWidth()) * 4;
+            lastFrame.resize(rowBytes * cap.GetFrameHeight());
+            PixelOps::CopyImage(lastFrame.data(), rowBytes, cap.GetFrameBuffer(), cap.GetFrameStride(),
+                rowBytes, cap.GetFrameHeight());
+            continue;
+        }
+
+        // Queue the screen image to be written to a file.
+        const wchar_t *extension = snapshotFormat == SnapshotFormat_QOI ? L"qoi" : L"bmp";
+        wchar_t filename[256] = {0};
+        swprintf_s(filename, L"frame%d.%s", iframe, extension);
 
-        printf("Writing %s, %u x %u x %u\n", filename,
+        printf("Writing %ls, %u x %u x %u\n", filename,
             cap.GetFrameWidth(), cap.GetFrameHeight(), cap.GetFrameDepth());
 
-        if (!BmpWrite(filename, cap.GetFrameWidth(), cap.GetFrameHeight(),
-                      cap.GetFrameStride(), cap.GetFrameDepth(), cap.GetFrameBuffer()))
+        // Hand over the capture's own buffer if it has one, so
+        // the frame isn't copied.
+        const FrameHandle frame = cap.GetFrameHandle();
+        const bool queued = frame ?
+            snapshots.Write(filename, snapshotFormat, frame) :
+            snapshots.Write(filename, snapshotFormat, cap.GetFrameWidth(), cap.GetFrameHeight(),
+                cap.GetFrameStride(), cap.GetFrameDepth(), cap.GetFrameBuffer(), cap.IsFrameBottomUp());
+        if (!queued)
         {
-            printf("Failed writing image to BMP file!\n");
+            printf("Failed queuing image to be written!\n");
             return -1;
         }
     }
@@ -206,6 +254,52 @@ int main(int argc, char **argv)
 
     cap.Shutdown();
 
+    if (snapshots.IsRunning())
+    {
+        // Time how long the files take to finish after capture.
+        uint64_t flushTick = GetTickCount64();
+        snapshots.Shutdown();
+        printf("Flush:   %.2f seconds\n", static_cast<float>(GetTickCount64() - flushTick) / 1000.0f);
+        if (snapshots.GetFailedCount())
+        {
+            printf("Failed writing %llu image files!\n",
+                static_cast<unsigned long long>(snapshots.GetFailedCount()));
+            return -1;
+        }
+    }
+
+    if (log && logWriter.IsOpen())
+    {
+        const unsigned logFrames = logWriter.GetFrameCount();
+        const uint64_t storedBytes = logWriter.GetStoredBytes();
+        const uint64_t rawBytes = logWriter.GetRawBytes();
+        if (!logWriter.Close())
+        {
+            printf("Failed closing frame log!\n");
+            return -1;
+        }
+        printf("Log:     %u frames, %llu bytes from %llu (%.1f%%)\n", logFrames,
+            static_cast<unsigned long long>(storedBytes), static_cast<unsigned long long>(rawBytes),
+            rawBytes ? 100.0 * storedBytes / rawBytes : 0.0);
+
+        // Read the last frame back, which means decoding it from
+        // the key frame before it, and check it didn't change.
+        FrameLogReader logReader;
+        std::vector<uint8_t> pixels;
+        uint64_t timestamp = 0;
+        if (!logReader.Open(L"frames.framelog") || logReader.GetFrameCount() != logFrames ||
+            !logReader.ReadFrame(logFrames - 1, pixels, timestamp))
+        {
+            printf("Failed reading frame log!\n");
+            return -1;
+        }
+        if (pixels != lastFrame || timestamp != lastTime)
+        {
+            printf("Last frame read from the frame log doesn't match!\n");
+            return -1;
+        }
+    }
+
     // Show statistics.
     printf("Frames:  %zu\n", numFrames);
     printf("Time:    %.2f seconds\n", seconds);
@@ -4,12 +4,119 @@
 // Attempts to encode a video of vertical blue bars
 // moving horizontally across the screen.
 //
+// Usage:
+//    encodetest          - Write test.mp4 the usual way.
+//    encodetest FRAG     - Write test.mp4 as fragmented MP4.
+//    encodetest STREAM   - Stream fragmented MP4 through a
+//                          VideoEncoderOutput to stream.mp4.
+//    encodetest MULTI    - Write test.mp4 and a half size, low
+//                          bit rate preview.mp4 at the same
+//                          time with VideoMultiEncoder.
+//
 
 #include "VideoFileEncoder.h"
+#include "VideoMultiEncoder.h"
 #include <stdio.h>
+#include <string.h>
+
+//
+// Writes the streamed video to a file, the same way it could
+// be sent over a socket.
+//
+class FileOutput : public VideoEncoderOutput
+{
+public:
+    explicit FileOutput(FILE *fp) : m_fp(fp) { }
+    bool Write(const uint8_t *data, size_t size) override
+    {
+        return fwrite(data, 1, size, m_fp) == size;
+    }
+
+private:
+    FILE *m_fp;
+};
+
+//
+// Fills a 640x480 frame with blue vertical bars that move
+// horizontally based on the frame number.
+//
+static void DrawBars(std::vector<uint8_t> &frameBuffer, DWORD frameNumber)
+{
+    const size_t numPixels = frameBuffer.size() / sizeof(uint32_t);
+    for (size_t j = 0; j < numPixels; ++j)
+    {
+        frameBuffer[j * sizeof(uint32_t)] = ((frameNumber + j) & 0x7F) + 0x80;
+    }
+}
 
-int main()
+//
+// Encodes the bars to "test.mp4" and, at the same time, to a
+// half size, low bit rate "preview.mp4".
+//
+static int RunMultiEncoder()
 {
+    VideoMultiEncoder multi;
+    VideoMultiOutputConfig archive;
+    archive.filename = L"test.mp4";
+    multi.AddOutput(archive);
+
+    VideoMultiOutputConfig preview;
+    preview.filename = L"preview.mp4";
+    preview.width = 320;
+    preview.height = 240;
+    preview.encoder.bitRate = 250000;
+    preview.dropFrames = true;
+    multi.AddOutput(preview);
+
+    if (!multi.Start(640, 480, 30))
+    {
+        printf("multi.Start failed!\n");
+        return -1;
+    }
+
+    const uint64_t frameDuration = 10000000 / 30;
+    std::vector<uint8_t> frameBuffer(640 * 480 * sizeof(uint32_t));
+    for (DWORD i = 0; i < 500; ++i)
+    {
+        DrawBars(frameBuffer, i);
+        if (!multi.AddFrame(frameBuffer.data(), 640 * 4, false, i * frameDuration))
+        {
+            printf("multi.AddFrame failed!\n");
+            break;
+        }
+    }
+    multi.RepeatFrame(500 * frameDuration);
+
+    for (size_t i = 0; i < multi.GetOutputCount(); i++)
+    {
+        VideoMultiOutputStats stats;
+        multi.GetOutputStats(i, stats);
+        printf("Output %zu: %llu frames encoded, %llu dropped, %.2f ms average encode.\n",
+            i, stats.framesEncoded, stats.framesDropped, stats.avgEncodeMs);
+    }
+
+    if (!multi.Stop())
+    {
+        printf("multi.Stop failed!\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && _stricmp(argv[1], "MULTI") == 0)
+    {
+        CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        const int result = RunMultiEncoder();
+        CoUninitialize();
+        return result;
+    }
+
+    const bool stream = (argc > 1 && _stricmp(argv[1], "STREAM") == 0);
+    VideoEncoderConfig config;
+    config.fragmented = (argc > 1 && _stricmp(argv[1], "FRAG") == 0);
+
     VideoFileEncoder enc(true, true);
     if (!enc.SetEncodingFormat(MFVideoFormat_H264))
     {
@@ -17,7 +124,15 @@ int main()
         CoUninitialize();
         return -1;
     }
-    if (!enc.Start(L"test.mp4", 640, 480, 30))
+
+    FILE *fp = nullptr;
+    if (stream && fopen_s(&fp, "stream.mp4", "wb") != 0)
+    {
+        printf("Can't create stream.mp4!\n");
+        return -1;
+    }
+    FileOutput output(fp);
+    if (stream ? !enc.Start(&output, 640, 480, 30) : !enc.Start(L"test.mp4", 640, 480, 30, config))
     {
         printf("enc.Start failed!\n");
         CoUninitialize();
@@ -29,14 +144,7 @@ int main()
     std::vector<uint8_t> frameBuffer(enc.GetWidth() * enc.GetHeight() * sizeof(uint32_t));
     for (DWORD i = 0; i < 500; ++i)
     {
-        // Fill the frame with blue vertical bars
-        // that move horizontally based on the
-        // frame number.
-        size_t numPixels = enc.GetWidth() * enc.GetHeight();
-        for (size_t j = 0; j < numPixels; ++j)
-        {
-            frameBuffer[j * sizeof(uint32_t)] = ((i + j) & 0x7F) + 0x80;
-        }
+        DrawBars(frameBuffer, i);
 
         if (!enc.AddFrame(frameBuffer.data(), false, timestamp))
         {
@@ -47,6 +155,8 @@ int main()
     }
 
     enc.Stop();
+    if (fp)
+        fclose(fp);
 
     return 0;
 }
@@ -0,0 +1,231 @@
+//--------------------------------------------------------------------
+//
+// pixeltest.cpp
+// Simple program to test the PixelOps module.  Checks that each
+// SIMD level produces the same output as the scalar kernels, then
+// times each kernel at each level on a 1920x1080 image.
+//
+//--------------------------------------------------------------------
+// (C) Copyright 2024 by Ammon R. Campbell.
+//
+// I wrote this code for use in my own educational and experimental
+// programs, but you may also freely use it in yours as long as you
+// abide by the following terms and conditions:
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following
+//     disclaimer in the documentation and/or other materials
+//     provided with the distribution.
+//   * The name(s) of the author(s) and contributors (if any) may not
+//     be used to endorse or promote products derived from this
+//     software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+// INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+// OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+// USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+// DAMAGE.  IN OTHER WORDS, USE AT YOUR OWN RISK, NOT OURS.  
+//--------------------------------------------------------------------
+
+#include "PixelOps.h"
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+enum Kernel
+{
+    Kernel_Copy = 0,
+    Kernel_FlipCopy,
+    Kernel_ReverseRows,
+    Kernel_RGB24,
+    Kernel_SetAlpha,
+    Kernel_NV12,
+    Kernel_Scale,
+    Kernel_Xor,
+    Kernel_HashTiles,
+    Kernel_Count
+};
+
+static const char *s_kernelNames[Kernel_Count] =
+{
+    "CopyImage", "CopyImage (flip)", "ReverseRows", "BGRAToRGB24", "SetAlpha", "BGRAToNV12", "ScaleImage (2/3)",
+    "XorImage", "HashTiles (32)"
+};
+
+// Scratch space kept between runs, as the capture code keeps
+// it between frames, so the timings don't include allocating it.
+static std::vector<uint32_t> s_hashLanes;
+static PixelOpsScaleBuffers  s_scaleBuffers;
+
+//
+// Runs one kernel on a 'width' x 'height' BGRA source image
+// with scanlines 'stride' bytes apart, producing 'out'.  The
+// in-place kernels start from a copy of the source unless
+// 'out' already holds one, so the copy isn't timed.
+//
+static void RunKernel(Kernel kernel, const std::vector<uint8_t> &src,
+    unsigned width, unsigned height, unsigned stride, std::vector<uint8_t> &out)
+{
+    const ptrdiff_t rowBytes = width * 4;
+    const uint8_t *last = src.data() + static_cast<size_t>(stride) * (height - 1);
+    switch (kernel)
+    {
+        case Kernel_Copy:
+            out.resize(rowBytes * height);
+            PixelOps::CopyImage(out.data(), rowBytes, src.data(), stride, rowBytes, height);
+            break;
+        case Kernel_FlipCopy:
+            out.resize(rowBytes * height);
+            PixelOps::CopyImage(out.data(), rowBytes, last, -static_cast<ptrdiff_t>(stride), rowBytes, height);
+            break;
+        case Kernel_ReverseRows:
+            if (out.size() != src.size())
+                out = src;
+            PixelOps::ReverseRows(out.data(), stride, rowBytes, height);
+            break;
+        case Kernel_RGB24:
+            out.resize(static_cast<size_t>(width) * 3 * height);
+            PixelOps::BGRAToRGB24(out.data(), width * 3, src.data(), stride, width, height);
+            break;
+        case Kernel_SetAlpha:
+            if (out.size() != src.size())
+                out = src;
+            PixelOps::SetAlpha(out.data(), stride, width, height);
+            break;
+        case Kernel_NV12:
+            out.resize(static_cast<size_t>(width) * height * 3 / 2);
+            PixelOps::BGRAToNV12(out.data(), width, out.data() + static_cast<size_t>(width) * height,
+                width, src.data(), stride, width & ~1u, height & ~1u);
+            break;
+        case Kernel_Scale:
+        {
+            const unsigned dstWidth  = width * 2 / 3;
+            const unsigned dstHeight = height * 2 / 3;
+            out.resize(static_cast<size_t>(dstWidth) * 4 * dstHeight);
+            PixelOps::ScaleImage(out.data(), dstWidth * 4, dstWidth, dstHeight,
+                src.data(), stride, width, height, s_scaleBuffers);
+            break;
+        }
+        case Kernel_Xor:
+            out.resize(rowBytes * height);
+            PixelOps::XorImage(out.data(), rowBytes, src.data(), stride,
+                last, -static_cast<ptrdiff_t>(stride), rowBytes, height);
+            break;
+        case Kernel_HashTiles:
+        {
+            const unsigned tiles = ((width + 31) / 32) * ((height + 31) / 32);
+            out.resize(static_cast<size_t>(tiles) * sizeof(uint64_t));
+            PixelOps::HashTiles(src.data(), stride, width, height, 32,
+                reinterpret_cast<uint64_t *>(out.data()), s_hashLanes);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//
+// Compares each SIMD level against the scalar kernels over a
+// range of image widths, to exercise the leftover pixels at
+// the end of each scanline.  Returns the number of mismatches.
+//
+static int CheckKernels()
+{
+    int failures = 0;
+    const PixelOpsLevel maxLevel = PixelOps::GetSupportedLevel();
+    for (unsigned width = 2; width <= 80; width += 2)
+    {
+        const unsigned height = 6;
+        const unsigned stride = width * 4 + 12;
+        std::vector<uint8_t> src(static_cast<size_t>(stride) * height);
+        for (auto &b : src)
+            b = static_cast<uint8_t>(rand());
+
+        for (int k = 0; k < Kernel_Count; k++)
+        {
+            std::vector<uint8_t> expected;
+            PixelOps::SetLevel(PixelOpsLevel_Scalar);
+            RunKernel(static_cast<Kernel>(k), src, width, height, stride, expected);
+            for (int level = PixelOpsLevel_Scalar + 1; level <= maxLevel; level++)
+            {
+                std::vector<uint8_t> actual;
+                PixelOps::SetLevel(static_cast<PixelOpsLevel>(level));
+                RunKernel(static_cast<Kernel>(k), src, width, height, stride, actual);
+                if (actual != expected)
+                {
+                    printf("Mismatch: %s at %s, width=%u\n", s_kernelNames[k],
+                        PixelOps::GetLevelName(static_cast<PixelOpsLevel>(level)), width);
+                    failures++;
+                }
+            }
+        }
+    }
+
+    PixelOps::SetLevel(maxLevel);
+    return failures;
+}
+
+int main()
+{
+    printf("Supported level: %s\n", PixelOps::GetLevelName(PixelOps::GetSupportedLevel()));
+
+    const int failures = CheckKernels();
+    if (failures)
+    {
+        printf("%d mismatches!\n", failures);
+        return -1;
+    }
+    printf("All levels match the scalar kernels.\n");
+
+    // Time each kernel on a full HD frame with padded scanlines,
+    // like the ones captured by ScreenCapture.
+    const unsigned width = 1920, height = 1080, stride = 1920 * 4 + 64;
+    const int iterations = 100;
+    std::vector<uint8_t> src(static_cast<size_t>(stride) * height);
+    for (auto &b : src)
+        b = static_cast<uint8_t>(rand());
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for (int k = 0; k < Kernel_Count; k++)
+    {
+        printf("%s:\n", s_kernelNames[k]);
+        double scalarMs = 0;
+        for (int level = PixelOpsLevel_Scalar; level <= PixelOps::GetSupportedLevel(); level++)
+        {
+            PixelOps::SetLevel(static_cast<PixelOpsLevel>(level));
+            std::vector<uint8_t> out;
+            RunKernel(static_cast<Kernel>(k), src, width, height, stride, out);
+
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            for (int i = 0; i < iterations; i++)
+                RunKernel(static_cast<Kernel>(k), src, width, height, stride, out);
+            QueryPerformanceCounter(&end);
+
+            const double ms = (end.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart / iterations;
+            if (level == PixelOpsLevel_Scalar)
+                scalarMs = ms;
+            printf("    %-8s %7.3f ms per frame  (%.2fx scalar)\n",
+                PixelOps::GetLevelName(static_cast<PixelOpsLevel>(level)), ms, scalarMs / ms);
+        }
+    }
+
+    printf("OK\n");
+    return 0;
+}